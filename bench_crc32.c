@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "nvram_crc32.h"
+
+#define BUF_SIZE (16 * 1024 * 1024)
+#define ITERATIONS 16
+/* Sizes representative for headers, sections and flash dumps */
+static const size_t sizes[] = {20, 1020, 64 * 1024, BUF_SIZE};
+
+/* Keeps results alive to prevent the calculation from being optimized away */
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile uint32_t sink;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	uint8_t* buf = malloc(BUF_SIZE);
+	if (buf == NULL) {
+		fprintf(stderr, "failed allocating buffer\n");
+		return 1;
+	}
+	srand(1);
+	for (size_t i = 0; i < BUF_SIZE; ++i)
+		buf[i] = (uint8_t) rand();
+
+	const uint32_t reference = nvram_crc32(0, buf, BUF_SIZE);
+	int r = 0;
+	printf("%-10s %10s %10s\n", "impl", "size", "GB/s");
+	for (const struct nvram_crc32_impl* impl = nvram_crc32_impls(); impl->name != NULL; impl++) {
+		if (!impl->supported()) {
+			printf("%-10s unsupported\n", impl->name);
+			continue;
+		}
+		if (impl->update(0, buf, BUF_SIZE) != reference) {
+			fprintf(stderr, "%s: crc mismatch\n", impl->name);
+			r = 1;
+			continue;
+		}
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+			const size_t rounds = (size_t) BUF_SIZE * ITERATIONS / sizes[s];
+			uint32_t crc = 0;
+			const double start = now();
+			for (size_t i = 0; i < rounds; ++i)
+				crc = impl->update(crc, buf, sizes[s]);
+			const double elapsed = now() - start;
+			sink = crc;
+			printf("%-10s %10zu %10.2f\n", impl->name, sizes[s],
+					(double) rounds * (double) sizes[s] / elapsed / 1e9);
+		}
+	}
+
+	free(buf);
+	return r;
+}
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "nvram_arena.h"
+#include "nvram_format.h"
+#include "nvram_interface.h"
+#include "nvram_stats.h"
+#include "nvram_table.h"
+
+/* Entries per section and size of their values, about 32 MiB per section */
+#define ENTRIES 8192
+#define VALUE_SIZE 4096
+/* Window of streamed loads */
+#define WINDOW "65536"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void make_key(char* key, size_t size, int i)
+{
+	snprintf(key, size, "key%06d", i);
+}
+
+/* Strings, so legacy can store them too */
+static void make_value(uint8_t* value, int i)
+{
+	memset(value, 'a' + i % 26, VALUE_SIZE - 1);
+	value[VALUE_SIZE - 1] = '\0';
+}
+
+/* Commit twice, so A/B formats have both sections written */
+static int write_sections(struct nvram_format* format, struct nvram_interface* interface, const char* path_a, const char* path_b)
+{
+	struct nvram_arena arena;
+	memset(&arena, 0, sizeof(arena));
+	struct nvram_table table;
+	memset(&table, 0, sizeof(table));
+	struct nvram* nvram = NULL;
+	uint8_t* value = malloc(VALUE_SIZE);
+	int r = value == NULL ? -ENOMEM : 0;
+	if (!r)
+		r = format->init(&nvram, interface, &table, path_a, path_b, &arena);
+	for (int i = 0; i < ENTRIES && !r; ++i) {
+		char key[16];
+		make_key(key, sizeof(key), i);
+		make_value(value, i);
+		r = nvram_table_append(&table, (const uint8_t*) key, strlen(key) + 1, value, VALUE_SIZE);
+	}
+	for (int i = 0; i < 2 && !r; ++i)
+		r = format->commit(nvram, &table);
+
+	if (nvram)
+		format->close(&nvram);
+	nvram_table_destroy(&table);
+	nvram_arena_release(&arena);
+	nvram_stats_discard();
+	free(value);
+	return r;
+}
+
+/* Load as nvram --list does, or find the last key as --get does if lookup */
+static int load(struct nvram_format* format, struct nvram_interface* interface, const char* path_a, const char* path_b, int lookup)
+{
+	struct nvram_arena arena;
+	memset(&arena, 0, sizeof(arena));
+	struct nvram_table table;
+	memset(&table, 0, sizeof(table));
+	struct nvram* nvram = NULL;
+	int r = format->init(&nvram, interface, lookup ? NULL : &table, path_a, path_b, &arena);
+	if (!r && lookup) {
+		char key[16];
+		make_key(key, sizeof(key), ENTRIES - 1);
+		struct libnvram_entry entry;
+		r = format->lookup(nvram, (const uint8_t*) key, strlen(key) + 1, &entry);
+		if (!r && entry.value_len != VALUE_SIZE)
+			r = -EINVAL;
+	}
+	else if (!r && table.live != ENTRIES) {
+		r = -EINVAL;
+	}
+
+	if (nvram)
+		format->close(&nvram);
+	nvram_table_destroy(&table);
+	nvram_arena_release(&arena);
+	return r;
+}
+
+/*
+ * Load in a child process, so its peak RSS only covers the load. Returns
+ * peak RSS in KiB or -1 for failure.
+ */
+static long run_load(struct nvram_format* format, struct nvram_interface* interface, const char* path_a, const char* path_b, int lookup,
+					const char* window, double* elapsed)
+{
+	const double start = now();
+	const pid_t pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0) {
+		setenv("NVRAM_STREAM_WINDOW", window, 1);
+		_exit(load(format, interface, path_a, path_b, lookup) ? 1 : 0);
+	}
+	int status = 0;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -1;
+	*elapsed = now() - start;
+	return usage.ru_maxrss;
+}
+
+int main(void)
+{
+	struct nvram_interface* interface = nvram_get_interface("file");
+	if (interface == NULL) {
+		printf("file interface not compiled in\n");
+		return 0;
+	}
+	char dir[] = "/tmp/bench_load.XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "failed creating directory: %s\n", strerror(errno));
+		return 1;
+	}
+	char path_a[sizeof(dir) + 16];
+	char path_b[sizeof(dir) + 16];
+	snprintf(path_a, sizeof(path_a), "%s/a", dir);
+	snprintf(path_b, sizeof(path_b), "%s/b", dir);
+
+	static const struct {
+		const char* format;
+		int ab;
+		int lookup;
+	} cases[] = {
+		{"v2", 1, 0},
+		{"v2", 1, 1},
+		{"legacy", 0, 0},
+	};
+	static const char* windows[] = {"0", WINDOW};
+	int r = 0;
+	printf("%-8s %-8s %10s %10s %14s\n", "format", "op", "window", "ms", "peak RSS KiB");
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+		struct nvram_format* format = nvram_get_format(cases[c].format);
+		if (format == NULL) {
+			printf("%-8s not compiled in\n", cases[c].format);
+			continue;
+		}
+		const char* b = cases[c].ab ? path_b : NULL;
+		unlink(path_a);
+		unlink(path_b);
+		/* Written by a child too, keeping the data out of later children */
+		const pid_t pid = fork();
+		if (pid == 0)
+			_exit(write_sections(format, interface, path_a, b) ? 1 : 0);
+		int status = 0;
+		if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "%s: failed writing sections\n", cases[c].format);
+			r = 1;
+			continue;
+		}
+		for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); ++w) {
+			double elapsed = 0;
+			const long rss = run_load(format, interface, path_a, b, cases[c].lookup, windows[w], &elapsed);
+			if (rss < 0) {
+				fprintf(stderr, "%s: load with window %s failed\n", cases[c].format, windows[w]);
+				r = 1;
+				continue;
+			}
+			printf("%-8s %-8s %10s %10.1f %14ld\n", cases[c].format, cases[c].lookup ? "lookup" : "load", windows[w], elapsed * 1e3, rss);
+		}
+	}
+
+	unlink(path_a);
+	unlink(path_b);
+	rmdir(dir);
+	return r;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "libnvram/libnvram.h"
+#include "nvram_scan.h"
+
+#define BUF_SIZE (64 * 1024 * 1024)
+#define ITERATIONS 4
+/* Sections are placed every SPACING bytes */
+#define SPACING (1024 * 1024)
+/* Alignments representative for exhaustive scans, words and sectors */
+static const size_t aligns[] = {1, 4, 512};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* Random data with zero filled areas, as in flash and disk dumps */
+static void fill(uint8_t* buf)
+{
+	srand(1);
+	for (size_t i = 0; i < BUF_SIZE; ++i)
+		buf[i] = (uint8_t) rand();
+	for (size_t i = 0; i < BUF_SIZE; i += 4 * SPACING)
+		memset(buf + i, 0, SPACING);
+}
+
+static int place_sections(uint8_t* buf)
+{
+	struct libnvram_list* list = NULL;
+	uint8_t key[] = "key";
+	uint8_t value[] = "value";
+	const struct libnvram_entry entry = {.key = key, .key_len = sizeof(key), .value = value, .value_len = sizeof(value)};
+	if (libnvram_list_set(&list, &entry))
+		return -1;
+	int placed = 0;
+	for (size_t i = SPACING / 2; i < BUF_SIZE; i += SPACING) {
+		struct libnvram_header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.user = (uint32_t) placed;
+		hdr.type = LIBNVRAM_TYPE_LIST;
+		if (libnvram_serialize(list, buf + i, libnvram_serialize_size(list, LIBNVRAM_TYPE_LIST), &hdr) == 0)
+			break;
+		placed++;
+	}
+	destroy_libnvram_list(&list);
+	return placed;
+}
+
+static int count_candidate(void* ctx, size_t offset, enum nvram_scan_type type)
+{
+	(void) offset;
+	(void) type;
+	(*(size_t*) ctx)++;
+	return 0;
+}
+
+int main(void)
+{
+	uint8_t* buf = malloc(BUF_SIZE);
+	if (buf == NULL) {
+		fprintf(stderr, "failed allocating buffer\n");
+		return 1;
+	}
+	fill(buf);
+	const int placed = place_sections(buf);
+
+	int r = 0;
+	struct nvram_scan_sections sections;
+	memset(&sections, 0, sizeof(sections));
+	if (nvram_scan(buf, BUF_SIZE, 0, BUF_SIZE, 1, &sections) || sections.len != (size_t) placed) {
+		fprintf(stderr, "found %zu of %d sections\n", sections.len, placed);
+		r = 1;
+	}
+	nvram_scan_destroy(&sections);
+
+	/* Candidates found by the first implementation, which the others must match */
+	size_t reference[sizeof(aligns) / sizeof(aligns[0])] = {0};
+	int have_reference = 0;
+	printf("%-10s %10s %12s %10s\n", "impl", "align", "candidates", "GB/s");
+	for (const struct nvram_scan_impl* impl = nvram_scan_impls(); impl->name != NULL; impl++) {
+		if (!impl->supported()) {
+			printf("%-10s unsupported\n", impl->name);
+			continue;
+		}
+		for (size_t a = 0; a < sizeof(aligns) / sizeof(aligns[0]); ++a) {
+			size_t candidates = 0;
+			const double start = now();
+			for (size_t i = 0; i < ITERATIONS; ++i) {
+				candidates = 0;
+				impl->scan(buf, BUF_SIZE, 0, BUF_SIZE, aligns[a], count_candidate, &candidates);
+			}
+			const double elapsed = now() - start;
+			if (!have_reference) {
+				reference[a] = candidates;
+			}
+			else if (candidates != reference[a]) {
+				fprintf(stderr, "%s: %zu candidates, expected %zu\n", impl->name, candidates, reference[a]);
+				r = 1;
+			}
+			printf("%-10s %10zu %12zu %10.2f\n", impl->name, aligns[a], candidates,
+					(double) BUF_SIZE * ITERATIONS / elapsed / 1e9);
+		}
+		have_reference = 1;
+	}
+
+	free(buf);
+	return r;
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "nvram_crc32.h"
+#include "nvram_table.h"
+#include "libnvram/libnvram.h"
+
+#define ENTRIES 10000
+#define LOOKUPS 10000
+#define ROUNDS 20
+#define KEY_SIZE 32
+#define VALUE_SIZE 32
+
+/* Keeps results alive to prevent the calculation from being optimized away */
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile uint64_t sink;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, const char* store, double elapsed, size_t ops)
+{
+	printf("%-10s %-6s %12.0f ops/s\n", name, store, (double) ops / elapsed);
+}
+
+static void make_entry(size_t i, char* key, char* value)
+{
+	snprintf(key, KEY_SIZE, "SYS_bench_key_%zu", i);
+	snprintf(value, VALUE_SIZE, "value_%zu", i * 7);
+}
+
+int main(void)
+{
+	struct libnvram_list* list = NULL;
+	struct nvram_table table;
+	memset(&table, 0, sizeof(table));
+	char key[KEY_SIZE];
+	char value[VALUE_SIZE];
+	struct libnvram_entry entry;
+	uint64_t acc = 0;
+	int r = 1;
+
+	double start = now();
+	for (size_t i = 0; i < ENTRIES; ++i) {
+		make_entry(i, key, value);
+		entry.key = (uint8_t*) key;
+		entry.key_len = strlen(key) + 1;
+		entry.value = (uint8_t*) value;
+		entry.value_len = strlen(value) + 1;
+		if (libnvram_list_set(&list, &entry))
+			goto exit;
+	}
+	report("insert", "list", now() - start, ENTRIES);
+
+	start = now();
+	for (size_t i = 0; i < ENTRIES; ++i) {
+		make_entry(i, key, value);
+		if (nvram_table_set(&table, (uint8_t*) key, strlen(key) + 1, (uint8_t*) value, strlen(value) + 1) < 0)
+			goto exit;
+	}
+	report("insert", "table", now() - start, ENTRIES);
+
+	start = now();
+	for (int round = 0; round < ROUNDS; ++round) {
+		for (struct libnvram_list* it = libnvram_list_begin(list); it != libnvram_list_end(list); it = libnvram_list_next(it)) {
+			const struct libnvram_entry* e = libnvram_list_deref(it);
+			acc += e->key[0] + e->value[e->value_len - 1] + e->key_len;
+		}
+	}
+	report("list", "list", now() - start, (size_t) ENTRIES * ROUNDS);
+
+	start = now();
+	for (int round = 0; round < ROUNDS; ++round) {
+		for (size_t row = 0; row < table.rows; ++row) {
+			if (!nvram_table_live(&table, row))
+				continue;
+			nvram_table_entry(&table, row, &entry);
+			acc += entry.key[0] + entry.value[entry.value_len - 1] + entry.key_len;
+		}
+	}
+	report("list", "table", now() - start, (size_t) ENTRIES * ROUNDS);
+
+	srand(1);
+	start = now();
+	for (size_t i = 0; i < LOOKUPS; ++i) {
+		make_entry((size_t) rand() % ENTRIES, key, value);
+		acc += libnvram_list_get(list, (uint8_t*) key, strlen(key) + 1) != NULL;
+	}
+	report("lookup", "list", now() - start, LOOKUPS);
+
+	srand(1);
+	start = now();
+	for (size_t i = 0; i < LOOKUPS; ++i) {
+		make_entry((size_t) rand() % ENTRIES, key, value);
+		acc += nvram_table_find(&table, (uint8_t*) key, strlen(key) + 1) != NVRAM_TABLE_NPOS;
+	}
+	report("lookup", "table", now() - start, LOOKUPS);
+
+	start = now();
+	for (int round = 0; round < ROUNDS; ++round) {
+		const uint32_t size = libnvram_serialize_size(list, LIBNVRAM_TYPE_LIST);
+		uint8_t* buf = malloc(size);
+		struct libnvram_header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.type = LIBNVRAM_TYPE_LIST;
+		acc += buf ? libnvram_serialize(list, buf, size, &hdr) : 0;
+		free(buf);
+	}
+	report("serialize", "list", now() - start, (size_t) ENTRIES * ROUNDS);
+
+	/* Entries and their crc as the v2 format writes them, the header is constant cost */
+	start = now();
+	for (int round = 0; round < ROUNDS; ++round) {
+		const uint64_t size = nvram_table_serialize_size(&table);
+		uint8_t* buf = malloc(size);
+		if (buf) {
+			nvram_table_serialize(&table, buf);
+			acc += nvram_crc32(0, buf, size);
+		}
+		free(buf);
+	}
+	report("serialize", "table", now() - start, (size_t) ENTRIES * ROUNDS);
+
+	sink = acc;
+	r = 0;
+exit:
+	destroy_libnvram_list(&list);
+	nvram_table_destroy(&table);
+	return r;
+}
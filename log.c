@@ -2,6 +2,8 @@
 #include <stdarg.h>
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
 static int NVDBG = 0;
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static int NVQUIET = 0;
 
 void enable_debug(void)
 {
@@ -18,3 +20,18 @@ void print_debug(const char* fmt, ...)
 	}
 
 }
+
+void quiet_errors(int quiet)
+{
+	NVQUIET = quiet;
+}
+
+void print_error(const char* fmt, ...)
+{
+	if (NVQUIET && !NVDBG)
+		return;
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(NVQUIET ? stdout : stderr, fmt, args);
+	va_end(args);
+}
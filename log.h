@@ -7,9 +7,12 @@
 		print_debug("dbg: " fmt, ##__VA_ARGS__);
 
 #define pr_err(fmt, ...) \
-		fprintf(stderr, "error: " fmt, ##__VA_ARGS__);
+		print_error("error: " fmt, ##__VA_ARGS__);
 
 void enable_debug(void);
 void print_debug(const char* fmt, ...);
+/* Errors are printed as debug while quiet, for attempts that are retried */
+void quiet_errors(int quiet);
+void print_error(const char* fmt, ...);
 
 #endif // LOG_H_
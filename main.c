@@ -3,14 +3,22 @@
 #include <string.h>
 #include <errno.h>
 #include <stddef.h>
+#include <time.h>
 #include <sys/file.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <libgen.h>
 #include "log.h"
 #include "nvram_format.h"
 #include "nvram_interface.h"
+#include "nvram_index.h"
+#include "nvram_serve.h"
+#include "nvram_value.h"
+#include "nvram_stats.h"
+#include "nvram_snapshot.h"
 #include "libnvram/libnvram.h"
 
 #define xstr(a) str(a)
@@ -18,10 +26,24 @@
 
 #define NVRAM_ENV_INTERFACE "NVRAM_INTERFACE"
 #define NVRAM_ENV_FORMAT "NVRAM_FORMAT"
-#define NVRAM_LOCKFILE "/run/lock/nvram.lock"
+#define NVRAM_SYSTEM_LOCKFILE "/run/lock/nvram-system.lock"
+#define NVRAM_USER_LOCKFILE "/run/lock/nvram-user.lock"
+#define NVRAM_VOLATILE_LOCKFILE "/run/lock/nvram-volatile.lock"
+#define NVRAM_SYSTEM_STANDBY_LOCKFILE "/run/lock/nvram-system-standby.lock"
+#define NVRAM_USER_STANDBY_LOCKFILE "/run/lock/nvram-user-standby.lock"
 #define NVRAM_ENV_DEBUG "NVRAM_DEBUG"
 #define NVRAM_ENV_SYSTEM_UNLOCK "NVRAM_SYSTEM_UNLOCK"
 #define NVRAM_SYSTEM_UNLOCK_MAGIC "16440"
+#define NVRAM_ENV_STANDBY_ERASE "NVRAM_STANDBY_ERASE"
+#define NVRAM_ENV_LOCKLESS_READ "NVRAM_LOCKLESS_READ"
+/* Lockless reads interfered with by commits this often take the lock */
+#define LOCKLESS_ATTEMPTS 3
+#define NVRAM_ENV_SOCKET "NVRAM_SOCKET"
+#define NVRAM_ENV_FLUSH_DELAY_MS "NVRAM_FLUSH_DELAY_MS"
+#define NVRAM_ENV_STATS_FILE "NVRAM_STATS_FILE"
+#define NVRAM_ENV_SNAPSHOT "NVRAM_SNAPSHOT"
+#define NVRAM_ENV_VOLATILE_FILE "NVRAM_VOLATILE_FILE"
+#define NVRAM_ENV_VOLATILE_PREFIX "NVRAM_VOLATILE_PREFIX"
 
 static const char* get_env_str(const char* env, const char* def)
 {
@@ -42,6 +64,13 @@ static long get_env_long(const char* env)
 	return 0;
 }
 
+static long get_env_long_def(const char* env, long def)
+{
+	if (getenv(env))
+		return get_env_long(env);
+	return def;
+}
+
 static int system_unlocked(void)
 {
 	const char* unlock_str = getenv(NVRAM_ENV_SYSTEM_UNLOCK);
@@ -68,6 +97,27 @@ static int starts_with_sysprefix(const char* str)
 	return 0;
 }
 
+static const char* volatile_file(void)
+{
+	return get_env_str(NVRAM_ENV_VOLATILE_FILE, xstr(NVRAM_VOLATILE_FILE));
+}
+
+static const char* volatile_prefix(void)
+{
+	return get_env_str(NVRAM_ENV_VOLATILE_PREFIX, xstr(NVRAM_VOLATILE_PREFIX));
+}
+
+/* Returns 1 if keys with the volatile prefix are kept in the volatile section */
+static int volatile_enabled(void)
+{
+	return strlen(volatile_prefix()) > 0 && strlen(volatile_file()) > 0;
+}
+
+static int is_volatile_key(const char* key)
+{
+	return volatile_enabled() && !strncmp(key, volatile_prefix(), strlen(volatile_prefix()));
+}
+
 static int acquire_lockfile(const char *path)
 {
     const int allowed_retries = 10;
@@ -108,6 +158,25 @@ static int acquire_lockfile(const char *path)
     return fd;
 }
 
+/* Lock path without waiting, -EWOULDBLOCK if another process holds it */
+static int try_lockfile(const char* path)
+{
+	int fd = open(path, O_CREAT | O_WRONLY, S_IWUSR | S_IRUSR);
+	if (fd < 0)
+		return -errno;
+	if (flock(fd, LOCK_EX | LOCK_NB)) {
+		const int r = -errno;
+		close(fd);
+		return r;
+	}
+	pr_dbg("%s: locked\n", path);
+	return fd;
+}
+
+/*
+ * The lockfile is left in place. Unlinking it would let a process waiting on
+ * the old inode and one creating a new file both acquire the lock.
+ */
 static int release_lockfile(const char* path, int fdlock)
 {
 	int r = 0;
@@ -118,11 +187,6 @@ static int release_lockfile(const char* path, int fdlock)
 			pr_err("failed closing lockfile: %s [%d]: %s", path, r, strerror(r));
 			return -r;
 		}
-		if (unlink(path)) {
-			r = errno;
-			pr_err("failed removing lockfile: %s [%d]: %s", path, r, strerror(r));
-			return -r;
-		}
 	}
 
 	pr_dbg("%s: unlocked\n", path);
@@ -144,6 +208,7 @@ static void print_usage()
 	printf("system_b:   %s\n", nvram_get_interface_section(interface_name, SYSTEM_B));
 	printf("user_a:     %s\n", nvram_get_interface_section(interface_name, USER_A));
 	printf("user_b:     %s\n", nvram_get_interface_section(interface_name, USER_B));
+	printf("volatile:   %s, keys prefixed \"%s\"\n", xstr(NVRAM_VOLATILE_FILE), xstr(NVRAM_VOLATILE_PREFIX));
 	printf("\n");
 
 	printf("Usage:   nvram [OPTION] COMMAND [COMMAND]\n");
@@ -152,21 +217,70 @@ static void print_usage()
 	printf("\n");
 
 	printf("Options:\n");
-	printf("  --sys             ignore user section\n");
-	printf("  --user            ignore sys section\n");
+	printf("  --sys             ignore user and volatile sections\n");
+	printf("  --user            ignore sys and volatile sections\n");
 	printf("  -i, --interface   select interface\n");
 	printf("  -f, --format      select format\n");
 	printf("  --user_a          set user_a section\n");
 	printf("  --user_b          set user_b section\n");
 	printf("  --sys_a           set sys_a section\n");
 	printf("  --sys_b           set sys_b section\n");
+	printf("  --serve           serve requests of other invocations, see below\n");
+	printf("  --stats           print commit and erase counters per section\n");
+	printf("  --stats-openmetrics  print counters in OpenMetrics text format\n");
 	printf("\n");
 
 	printf("Commands:\n");
 	printf("  --set KEY VALUE  Write attribute with KEY and VALUE\n");
 	printf("  --get KEY        Read attribute with KEY\n");
+	printf("  --set-u32 KEY VALUE, --set-u64 KEY VALUE, --set-bool KEY VALUE\n");
+	printf("                   Write attribute as fixed-width little endian value,\n");
+	printf("                   VALUE is decimal, 0x prefixed hex, or true/false for bool\n");
+	printf("  --get-u32 KEY, --get-u64 KEY, --get-bool KEY\n");
+	printf("                   Read attribute as decimal number or true/false\n");
+	printf("  --exists KEY     Return 0 if attribute with KEY exists, else ENOENT\n");
+	printf("  --cas KEY EXPECTED VALUE\n");
+	printf("                   Write attribute if its value is EXPECTED, else ECANCELED\n");
+	printf("  --cas-absent KEY VALUE\n");
+	printf("                   Write attribute if it doesn't exist, else ECANCELED\n");
+	printf("  --incr KEY [DELTA], --decr KEY [DELTA]\n");
+	printf("                   Add DELTA, default 1, to or subtract it from number KEY\n");
+	printf("                   and print the result, missing KEY counts from 0\n");
 	printf("  --del KEY        Delete attribute with KEY\n");
 	printf("  --list           Lists attributes\n");
+	printf("  --list-prefix PREFIX  Lists attributes with KEY starting with PREFIX\n");
+	printf("  --range FROM TO  Lists attributes with FROM <= KEY < TO\n");
+	printf("  --sync           Commit changes deferred by server\n");
+	printf("\n");
+
+	printf("Locks:\n");
+	printf("  System, user and volatile sections are locked separately, by\n");
+	printf("  %s, %s and\n", NVRAM_SYSTEM_LOCKFILE, NVRAM_USER_LOCKFILE);
+	printf("  %s. Only the sections an invocation reads\n", NVRAM_VOLATILE_LOCKFILE);
+	printf("  or writes are locked, e.g. --sys doesn't wait for a user commit.\n");
+	printf("\n");
+
+	printf("Server:\n");
+	printf("  With --serve, nvram keeps the locks and the attributes in memory and\n");
+	printf("  handles invocations connecting on socket %s\n", xstr(NVRAM_SERVE_SOCKET));
+	printf("  (environment %s). Changes are committed %d ms after the first\n", NVRAM_ENV_SOCKET, NVRAM_FLUSH_DELAY_MS);
+	printf("  one (environment %s), on --sync and when terminated.\n", NVRAM_ENV_FLUSH_DELAY_MS);
+	printf("\n");
+
+	printf("Snapshot:\n");
+	printf("  Commits publish attributes to %s (environment %s,\n", xstr(NVRAM_SNAPSHOT), NVRAM_ENV_SNAPSHOT);
+	printf("  empty disables), --get and --exists read it without lock or server.\n");
+	printf("\n");
+
+	printf("Lockless reads:\n");
+	printf("  Reads of v2 sections take no lock and are retried under lock if a\n");
+	printf("  commit changed the sections while read (environment %s=0\n", NVRAM_ENV_LOCKLESS_READ);
+	printf("  disables).\n");
+	printf("\n");
+
+	printf("Stats:\n");
+	printf("  Commits are counted per section in %s\n", xstr(NVRAM_STATS_FILE));
+	printf("  (environment %s, empty disables).\n", NVRAM_ENV_STATS_FILE);
 	printf("\n");
 
 	printf("Return values:\n");
@@ -181,18 +295,9 @@ enum print_options {
 	PRINT_KEY_AND_VALUE = PRINT_KEY | PRINT_VALUE,
 };
 
-static void print_arr_u8(uint8_t* data, uint32_t size)
+static void print_bool(uint64_t val)
 {
-	/* Print as string if null-terminated, else as hex */
-	const int is_string = data[size - 1] == '\0';
-	if (is_string) {
-		printf("%s", data);
-	}
-	else {
-		printf("0x");
-		for (uint32_t i = 0; i < size; ++i)
-			printf("%02" PRIx8 "", data[i]);
-	}
+	printf("%s", val ? "true" : "false");
 }
 
 static int print_entry(const struct libnvram_entry* entry, enum print_options opts)
@@ -203,72 +308,120 @@ static int print_entry(const struct libnvram_entry* entry, enum print_options op
 		return -EINVAL;
 
 	if ((opts & PRINT_KEY) == PRINT_KEY)
-		print_arr_u8(entry->key, entry->key_len);
+		nvram_value_print(entry->key, entry->key_len);
 	if ((opts & PRINT_KEY_AND_VALUE) == PRINT_KEY_AND_VALUE)
 		printf("=");
 	if ((opts & PRINT_VALUE) == PRINT_VALUE)
-		print_arr_u8(entry->value, entry->value_len);
+		nvram_value_print(entry->value, entry->value_len);
 	printf("\n");
 	return 0;
 }
 
+static const char* type_name(enum nvram_value_type type)
+{
+	switch (type) {
+	case NVRAM_VALUE_BOOL:
+		return "bool";
+	case NVRAM_VALUE_U32:
+		return "u32";
+	case NVRAM_VALUE_U64:
+		return "u64";
+	case NVRAM_VALUE_STRING:
+		return "string";
+	case NVRAM_VALUE_BINARY:
+		break;
+	}
+	return "binary";
+}
+
 // return 0 for OK or negative errno for error
-static int print_list_entry(const char* list_name, const struct libnvram_list* list, const char* key)
+static int print_value(const struct libnvram_entry* entry, const char* key, enum nvram_value_type type)
 {
-	pr_dbg("getting key from %s: %s\n", list_name, key);
-	struct libnvram_entry *entry = libnvram_list_get(list, (uint8_t*) key, strlen(key) + 1);
-	if (!entry)
-		return -ENOENT;
-	return print_entry(entry, PRINT_VALUE);
+	if (type == NVRAM_VALUE_STRING)
+		return print_entry(entry, PRINT_VALUE);
+
+	uint64_t val = 0;
+	int r = nvram_value_get(type, entry->value, entry->value_len, &val);
+	if (r) {
+		pr_err("value of %s not of type %s\n", key, type_name(type));
+		return r;
+	}
+	if (type == NVRAM_VALUE_BOOL)
+		print_bool(val);
+	else
+		printf("%" PRIu64 "", val);
+	printf("\n");
+	return 0;
 }
 
-static void print_list(const char* list_name, const struct libnvram_list* list)
+static void print_table(const char* table_name, const struct nvram_table* table)
 {
-	pr_dbg("listing %s\n", list_name);
-	for (struct libnvram_list *cur = (struct libnvram_list*) list; cur; cur = cur->next)
-		print_entry(cur->entry, PRINT_KEY_AND_VALUE);
+	struct libnvram_entry entry;
+
+	pr_dbg("listing %s\n", table_name);
+	for (size_t row = 0; row < table->rows; ++row) {
+		if (!nvram_table_live(table, row))
+			continue;
+		nvram_table_entry(table, row, &entry);
+		print_entry(&entry, PRINT_KEY_AND_VALUE);
+	}
 }
 
-// return 0 for equal
-static int keycmp(const uint8_t* key1, uint32_t key1_len, const uint8_t* key2, uint32_t key2_len)
+static void print_index_range(const struct nvram_table* table, const struct nvram_index* index, size_t begin, size_t end)
 {
-	if (key1_len == key2_len)
-		return memcmp(key1, key2, key1_len);
-	return 1;
+	struct libnvram_entry entry;
+	for (size_t i = begin; i < end; ++i) {
+		nvram_table_entry(table, index->keys[i].row, &entry);
+		print_entry(&entry, PRINT_KEY_AND_VALUE);
+	}
 }
 
-// return 0 if already exists, 1 if added, negate errno for error
-static int add_list_entry(const char* list_name, struct libnvram_list** list, const char* key, const char* value)
+static void print_prefix(const char* table_name, const struct nvram_table* table, const struct nvram_index* index, const char* prefix)
 {
-	const size_t key_len = strlen(key) + 1;
-	const size_t value_len = strlen(value) + 1;
+	const uint32_t prefix_len = strlen(prefix);
+
+	pr_dbg("listing %s with prefix: %s\n", table_name, prefix);
+	const size_t begin = nvram_index_lower_bound(index, (uint8_t*) prefix, prefix_len);
+	size_t end = begin;
+	while (end < index->len && nvram_index_has_prefix(index, end, (uint8_t*) prefix, prefix_len))
+		end++;
+	print_index_range(table, index, begin, end);
+}
 
-	pr_dbg("setting: %s: %s=%s\n", list_name, key, value);
-	struct libnvram_entry *entry = libnvram_list_get(*list, (uint8_t*) key, key_len);
-	if (entry && !keycmp(entry->value, entry->value_len, (uint8_t*) value, value_len))
-		return 0;
-	struct libnvram_entry new;
-	new.key = (uint8_t*) key;
-	new.key_len = key_len;
-	new.value = (uint8_t*) value;
-	new.value_len = value_len;
+static void print_range(const char* table_name, const struct nvram_table* table, const struct nvram_index* index, const char* from, const char* to)
+{
+	pr_dbg("listing %s in range: [%s, %s)\n", table_name, from, to);
+	const size_t begin = nvram_index_lower_bound(index, (uint8_t*) from, strlen(from) + 1);
+	const size_t end = nvram_index_lower_bound(index, (uint8_t*) to, strlen(to) + 1);
+	print_index_range(table, index, begin, end);
+}
 
-	int r = libnvram_list_set(list, &new);
-	if (r) {
-		pr_err("failed setting to %s list [%d]: %s\n", list_name, -r, strerror(-r));
-		return r;
+// return 0 if already exists, 1 if added, negate errno for error
+static int add_table_entry(const char* table_name, struct nvram_table* table, const char* key, const char* value, enum nvram_value_type type)
+{
+	pr_dbg("setting: %s: %s=%s (%s)\n", table_name, key, value, type_name(type));
+	uint8_t typed[NVRAM_VALUE_MAX_SIZE];
+	const uint8_t* data = (const uint8_t*) value;
+	uint32_t len = strlen(value) + 1;
+	if (type != NVRAM_VALUE_STRING) {
+		/* Parsed by validate_set() */
+		uint64_t val = 0;
+		if (nvram_value_parse(type, value, &val))
+			return -EINVAL;
+		len = nvram_value_encode(type, val, typed);
+		data = typed;
 	}
-
-	return 1;
+	int r = nvram_table_set(table, (uint8_t*) key, strlen(key) + 1, data, len);
+	if (r < 0)
+		pr_err("failed setting to %s table [%d]: %s\n", table_name, -r, strerror(-r));
+	return r;
 }
 
 // return 0 if not found, 1 if removed
-static int remove_list_entry(const char* list_name, struct libnvram_list** list, const char* key)
+static int remove_table_entry(const char* table_name, struct nvram_table* table, const char* key)
 {
-	const size_t key_len = strlen(key) + 1;
-
-	pr_dbg("deleting %s: %s\n", list_name, key);
-	return libnvram_list_remove(list, (uint8_t*) key, key_len) == 1;
+	pr_dbg("deleting %s: %s\n", table_name, key);
+	return nvram_table_remove(table, (uint8_t*) key, strlen(key) + 1);
 }
 
 enum op {
@@ -277,41 +430,236 @@ enum op {
 	OP_SET = 1 << 1,
 	OP_GET = 1 << 2,
 	OP_DEL = 1 << 3,
+	OP_LIST_PREFIX = 1 << 4,
+	OP_RANGE = 1 << 5,
+	OP_EXISTS = 1 << 6,
+	OP_CAS = 1 << 7,
+	OP_INCR = 1 << 8,
+	OP_DECR = 1 << 9,
 };
 
+/* Operations served by the sorted key index */
+static const int index_ops = OP_LIST_PREFIX | OP_RANGE;
+/* Operations served by format lookup, if only these are requested */
+static const int lookup_ops = OP_GET | OP_EXISTS;
+static const int write_ops = OP_SET | OP_DEL | OP_CAS | OP_INCR | OP_DECR;
+
 enum mode {
 	MODE_NONE = 0,
 	MODE_USER_READ = 1 << 0,
 	MODE_USER_WRITE = 1 << 1,
 	MODE_SYSTEM_READ = 1 << 2,
 	MODE_SYSTEM_WRITE = 1 << 3,
+	MODE_VOLATILE_READ = 1 << 4,
+	MODE_VOLATILE_WRITE = 1 << 5,
+};
+
+struct store {
+	struct nvram_table table;
+	/* Only built when an operation needs it, see index_ops */
+	struct nvram_index index;
+	/* Set when table is left empty and keys are looked up in nvram, see lookup_ops */
+	struct nvram_format* lookup_format;
+	struct nvram* lookup_nvram;
+	/* Set when an operation changed table, cleared once committed */
+	int written;
 };
 
+/* returns 0 if found, -ENOENT if not, other negative errno for error */
+static int store_get(const struct store* store, const char* key, struct libnvram_entry* entry)
+{
+	const uint32_t key_len = strlen(key) + 1;
+	if (store->lookup_format)
+		return store->lookup_format->lookup(store->lookup_nvram, (const uint8_t*) key, key_len, entry);
+
+	const size_t row = nvram_table_find(&store->table, (const uint8_t*) key, key_len);
+	if (row == NVRAM_TABLE_NPOS)
+		return -ENOENT;
+	nvram_table_entry(&store->table, row, entry);
+	return 0;
+}
+
+struct opts;
+
 struct operation {
 	/* commandline arguments */
 	enum op op;
 	char* key;
 	char* value;
+	/* type of value for set and get */
+	enum nvram_value_type type;
+	/* value compare-and-set requires, NULL if key must be absent */
+	char* expected;
+	/* value incr and decr print once committed, longest is UINT64_MAX */
+	char result[21];
 	/* filled in when created */
-	int (*validate)(const struct operation* operation, enum mode mode);
-	int (*execute)(const struct operation* operation, enum mode mode,
-			struct libnvram_list** list_system, struct libnvram_list** list_user, int* write_performed);
+	int (*validate)(const struct operation* operation, const struct opts* opts);
+	int (*execute)(struct operation* operation, enum mode mode,
+			struct store* system, struct store* user, struct store* vol, int* write_performed);
 	struct operation* next;
 };
 
 struct opts {
 	enum mode mode;
 	struct operation* operations;
+	char* interface_override;
+	char* format_override;
+	char* user_a_override;
+	char* user_b_override;
+	char* system_a_override;
+	char* system_b_override;
+	/* Of the invocation, which for a server is the client */
+	int system_unlocked;
+	int serve;
+	int sync;
+	int stats;
+	enum nvram_stats_output stats_output;
 };
 
-static int validate_set(const struct operation* operation, enum mode mode)
+/*
+ * Lockfile per section set, so a commit of one doesn't block the others.
+ * Acquired in this order, so invocations needing several can't deadlock.
+ */
+static const struct section_lock {
+	const char* path;
+	enum mode mode;
+	/* Held by a standby erase of the section, NULL if it has none */
+	const char* standby;
+} section_locks[] = {
+	{NVRAM_SYSTEM_LOCKFILE, MODE_SYSTEM_READ | MODE_SYSTEM_WRITE, NVRAM_SYSTEM_STANDBY_LOCKFILE},
+	{NVRAM_USER_LOCKFILE, MODE_USER_READ | MODE_USER_WRITE, NVRAM_USER_STANDBY_LOCKFILE},
+	{NVRAM_VOLATILE_LOCKFILE, MODE_VOLATILE_READ | MODE_VOLATILE_WRITE, NULL},
+};
+#define SECTION_LOCKS (sizeof(section_locks) / sizeof(*section_locks))
+
+/* Release locks held in fds, in reverse order. Returns first error. */
+static int release_locks(int* fds)
+{
+	int r = 0;
+	for (size_t i = SECTION_LOCKS; i-- > 0;) {
+		if (fds[i] < 0)
+			continue;
+		const int ret = release_lockfile(section_locks[i].path, fds[i]);
+		fds[i] = -1;
+		if (r == 0)
+			r = ret;
+	}
+	return r;
+}
+
+/*
+ * Acquire lockfiles of section sets mode reads or writes, fds of others are
+ * set to -1. Nothing is held on failure.
+ */
+static int acquire_locks(enum mode mode, int* fds)
+{
+	for (size_t i = 0; i < SECTION_LOCKS; ++i)
+		fds[i] = -1;
+	for (size_t i = 0; i < SECTION_LOCKS; ++i) {
+		if ((mode & section_locks[i].mode) == 0)
+			continue;
+		const int fd = acquire_lockfile(section_locks[i].path);
+		if (fd < 0) {
+			release_locks(fds);
+			return fd;
+		}
+		fds[i] = fd;
+	}
+	return 0;
+}
+
+/*
+ * Wait for standby erases of sections mode writes to finish. An erase runs
+ * without the section lock, so readers don't wait for it, but the next commit
+ * writes the section being erased.
+ */
+static int wait_standby(enum mode mode)
+{
+	const enum mode writes = MODE_SYSTEM_WRITE | MODE_USER_WRITE | MODE_VOLATILE_WRITE;
+	for (size_t i = 0; i < SECTION_LOCKS; ++i) {
+		if (section_locks[i].standby == NULL || (mode & section_locks[i].mode & writes) == 0)
+			continue;
+		const char* path = section_locks[i].standby;
+		int fd = open(path, O_CREAT | O_WRONLY | O_CLOEXEC, S_IWUSR | S_IRUSR);
+		if (fd < 0) {
+			const int r = -errno;
+			pr_err("failed opening lockfile: %s [%d]: %s\n", path, -r, strerror(-r));
+			return r;
+		}
+		if (flock(fd, LOCK_EX)) {
+			const int r = -errno;
+			pr_err("failed locking lockfile: %s [%d]: %s\n", path, -r, strerror(-r));
+			close(fd);
+			return r;
+		}
+		close(fd);
+	}
+	return 0;
+}
+
+/* Returns store written by operations on key, NULL if mode allows none */
+static struct store* write_store(const char* key, enum mode mode, struct store* system, struct store* user,
+		struct store* vol, const char** table_name)
+{
+	if (is_volatile_key(key)) {
+		*table_name = "volatile";
+		return (mode & MODE_VOLATILE_WRITE) == MODE_VOLATILE_WRITE ? vol : NULL;
+	}
+	if ((mode & MODE_SYSTEM_WRITE) == MODE_SYSTEM_WRITE) {
+		*table_name = "system";
+		return system;
+	}
+	if ((mode & MODE_USER_WRITE) == MODE_USER_WRITE) {
+		*table_name = "user";
+		return user;
+	}
+	return NULL;
+}
+
+/*
+ * Get mode of sections write operations write, they read nothing else. Other
+ * sections are then neither locked nor loaded.
+ */
+static enum mode written_mode(const struct opts* opts)
+{
+	enum mode mode = MODE_NONE;
+	for (const struct operation* it = opts->operations; it != NULL; it = it->next) {
+		if (is_volatile_key(it->key))
+			mode |= MODE_VOLATILE_READ | MODE_VOLATILE_WRITE;
+		else if ((opts->mode & MODE_SYSTEM_WRITE) == MODE_SYSTEM_WRITE)
+			mode |= MODE_SYSTEM_READ | MODE_SYSTEM_WRITE;
+		else if ((opts->mode & MODE_USER_WRITE) == MODE_USER_WRITE)
+			mode |= MODE_USER_READ | MODE_USER_WRITE;
+	}
+	return mode & opts->mode;
+}
+
+/* Volatile keys are written regardless of system lock and prefix */
+static int validate_volatile(const struct operation* operation, const struct opts* opts)
+{
+	if ((opts->mode & MODE_VOLATILE_WRITE) != MODE_VOLATILE_WRITE) {
+		pr_err("volatile attribute %s can't be written with --sys or --user\n", operation->key);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int validate_set(const struct operation* operation, const struct opts* opts)
 {
+	const enum mode mode = opts->mode;
+	uint64_t val = 0;
+	if (operation->type != NVRAM_VALUE_STRING && nvram_value_parse(operation->type, operation->value, &val)) {
+		pr_err("invalid %s value: %s\n", type_name(operation->type), operation->value);
+		return -EINVAL;
+	}
+	if (is_volatile_key(operation->key))
+		return validate_volatile(operation, opts);
 	if ((mode & MODE_SYSTEM_WRITE) == MODE_SYSTEM_WRITE) {
 		if (sysprefix_enforced() && !starts_with_sysprefix(operation->key)) {
 			pr_err("required prefix \"%s\" missing in system attribute\n", xstr(NVRAM_SYSTEM_PREFIX));
 			return -EINVAL;
 		}
-		if (!system_unlocked()) {
+		if (!opts->system_unlocked) {
 			pr_err("system write locked\n")
 			return -EACCES;
 		}
@@ -325,82 +673,232 @@ static int validate_set(const struct operation* operation, enum mode mode)
 	return 0;
 }
 
-static int validate_del(const struct operation* operation, enum mode mode)
+static int validate_del(const struct operation* operation, const struct opts* opts)
 {
-	(void) operation;
-
-	if (((mode & MODE_SYSTEM_WRITE) == MODE_SYSTEM_WRITE) && !system_unlocked()) {
+	if (is_volatile_key(operation->key))
+		return validate_volatile(operation, opts);
+	if (((opts->mode & MODE_SYSTEM_WRITE) == MODE_SYSTEM_WRITE) && !opts->system_unlocked) {
 		pr_err("system write locked\n")
 		return -EACCES;
 	}
 	return 0;
 }
 
-static int exec_list(const struct operation* operation, enum mode mode,
-		struct libnvram_list** list_system, struct libnvram_list** list_user, int* write_performed)
+static int exec_list(struct operation* operation, enum mode mode,
+		struct store* system, struct store* user, struct store* vol, int* write_performed)
 {
 	(void) write_performed;
 	(void) operation;
 
 	if ((mode & MODE_SYSTEM_READ) == MODE_SYSTEM_READ)
-		print_list("system", *list_system);
+		print_table("system", &system->table);
+	if ((mode & MODE_USER_READ) == MODE_USER_READ)
+		print_table("user", &user->table);
+	if ((mode & MODE_VOLATILE_READ) == MODE_VOLATILE_READ)
+		print_table("volatile", &vol->table);
+	return 0;
+}
+
+static int exec_list_prefix(struct operation* operation, enum mode mode,
+		struct store* system, struct store* user, struct store* vol, int* write_performed)
+{
+	(void) write_performed;
+
+	if ((mode & MODE_SYSTEM_READ) == MODE_SYSTEM_READ)
+		print_prefix("system", &system->table, &system->index, operation->key);
+	if ((mode & MODE_USER_READ) == MODE_USER_READ)
+		print_prefix("user", &user->table, &user->index, operation->key);
+	if ((mode & MODE_VOLATILE_READ) == MODE_VOLATILE_READ)
+		print_prefix("volatile", &vol->table, &vol->index, operation->key);
+	return 0;
+}
+
+static int exec_range(struct operation* operation, enum mode mode,
+		struct store* system, struct store* user, struct store* vol, int* write_performed)
+{
+	(void) write_performed;
+
+	if ((mode & MODE_SYSTEM_READ) == MODE_SYSTEM_READ)
+		print_range("system", &system->table, &system->index, operation->key, operation->value);
 	if ((mode & MODE_USER_READ) == MODE_USER_READ)
-		print_list("user", *list_user);
+		print_range("user", &user->table, &user->index, operation->key, operation->value);
+	if ((mode & MODE_VOLATILE_READ) == MODE_VOLATILE_READ)
+		print_range("volatile", &vol->table, &vol->index, operation->key, operation->value);
 	return 0;
 }
 
-static int exec_set(const struct operation* operation, enum mode mode,
-		struct libnvram_list** list_system, struct libnvram_list** list_user, int* write_performed)
+static int exec_set(struct operation* operation, enum mode mode,
+		struct store* system, struct store* user, struct store* vol, int* write_performed)
 {
-	int r = -EINVAL;
-	if ((mode & MODE_SYSTEM_WRITE) == MODE_SYSTEM_WRITE)
-		r = add_list_entry("system", list_system, operation->key, operation->value);
-	else if ((mode & MODE_USER_WRITE) == MODE_USER_WRITE)
-		r = add_list_entry("user", list_user, operation->key, operation->value);
+	const char* table_name = NULL;
+	struct store* store = write_store(operation->key, mode, system, user, vol, &table_name);
+	if (!store)
+		return -EINVAL;
+	int r = add_table_entry(table_name, &store->table, operation->key, operation->value, operation->type);
 	if (r < 0)
 		return r;
 	if (r == 1) {
 		pr_dbg("written\n");
+		store->written = 1;
 		*write_performed = 1;
 	}
 	return 0;
 }
 
-static int exec_get(const struct operation* operation, enum mode mode,
-		struct libnvram_list** list_system, struct libnvram_list** list_user, int* write_performed)
+/*
+ * Set value if key in the written section has the expected value, or is
+ * absent if none is expected. Values are compared as strings.
+ *
+ * return 0 for success, -ECANCELED if not as expected, other negative errno for error
+ */
+static int exec_cas(struct operation* operation, enum mode mode,
+		struct store* system, struct store* user, struct store* vol, int* write_performed)
 {
-	(void) write_performed;
+	const char* table_name = NULL;
+	const struct store* store = write_store(operation->key, mode, system, user, vol, &table_name);
+	if (!store)
+		return -EINVAL;
+
+	const size_t row = nvram_table_find(&store->table, (uint8_t*) operation->key, strlen(operation->key) + 1);
+	int match = 0;
+	if (operation->expected == NULL) {
+		match = row == NVRAM_TABLE_NPOS;
+	}
+	else if (row != NVRAM_TABLE_NPOS) {
+		struct libnvram_entry entry;
+		nvram_table_entry(&store->table, row, &entry);
+		const uint32_t expected_len = strlen(operation->expected) + 1;
+		match = entry.value_len == expected_len && !memcmp(entry.value, operation->expected, expected_len);
+	}
+	if (!match) {
+		pr_dbg("%s: not as expected\n", operation->key);
+		return -ECANCELED;
+	}
+	return exec_set(operation, mode, system, user, vol, write_performed);
+}
+
+/*
+ * Add value, 1 if none, to the number of key in the written section, or
+ * subtract it for decr, and print the result. Strings stay decimal strings and
+ * typed values keep their type. A missing key counts from 0 and is created as
+ * a string.
+ */
+static int exec_incr(struct operation* operation, enum mode mode,
+		struct store* system, struct store* user, struct store* vol, int* write_performed)
+{
+	const char* table_name = NULL;
+	struct store* store = write_store(operation->key, mode, system, user, vol, &table_name);
+	if (!store)
+		return -EINVAL;
+
+	uint64_t delta = 1;
+	if (operation->value != NULL && nvram_value_parse(NVRAM_VALUE_U64, operation->value, &delta))
+		return -EINVAL;
+
+	enum nvram_value_type type = NVRAM_VALUE_STRING;
+	uint64_t max = UINT64_MAX;
+	uint64_t val = 0;
+	const size_t row = nvram_table_find(&store->table, (uint8_t*) operation->key, strlen(operation->key) + 1);
+	if (row != NVRAM_TABLE_NPOS) {
+		struct libnvram_entry entry;
+		nvram_table_entry(&store->table, row, &entry);
+		type = nvram_value_type(entry.value, entry.value_len);
+		int r = -EINVAL;
+		if (type == NVRAM_VALUE_STRING || type == NVRAM_VALUE_U32 || type == NVRAM_VALUE_U64)
+			r = nvram_value_get(type == NVRAM_VALUE_STRING ? NVRAM_VALUE_U64 : type, entry.value, entry.value_len, &val);
+		if (r) {
+			pr_err("value of %s not a number\n", operation->key);
+			return r;
+		}
+		if (type == NVRAM_VALUE_U32)
+			max = UINT32_MAX;
+	}
+
+	const int decr = operation->op == OP_DECR;
+	if (decr ? val < delta : max - val < delta) {
+		pr_err("%s out of range of %s\n", operation->key, type_name(type == NVRAM_VALUE_STRING ? NVRAM_VALUE_U64 : type));
+		return -ERANGE;
+	}
+	val = decr ? val - delta : val + delta;
 
+	snprintf(operation->result, sizeof(operation->result), "%" PRIu64, val);
+	int r = add_table_entry(table_name, &store->table, operation->key, operation->result, type);
+	if (r < 0)
+		return r;
+	if (r == 1) {
+		store->written = 1;
+		*write_performed = 1;
+	}
+	return 0;
+}
+
+// return 0 if found, -ENOENT if not, other negative errno for error
+static int find_entry(const char* key, enum mode mode, const struct store* system, const struct store* user,
+		const struct store* vol, struct libnvram_entry* entry)
+{
 	int r = -ENOENT;
+	/* Volatile keys are only kept in the volatile section */
+	if (is_volatile_key(key)) {
+		if ((mode & MODE_VOLATILE_READ) == MODE_VOLATILE_READ) {
+			pr_dbg("getting key from volatile: %s\n", key);
+			r = store_get(vol, key, entry);
+		}
+		if (r == -ENOENT)
+			pr_dbg("key not found: %s\n", key);
+		return r;
+	}
 	/* Prefer retrieving from system if allowed */
-	if ((mode & MODE_SYSTEM_READ) == MODE_SYSTEM_READ)
-		r = print_list_entry("system", *list_system, operation->key);
+	if ((mode & MODE_SYSTEM_READ) == MODE_SYSTEM_READ) {
+		pr_dbg("getting key from system: %s\n", key);
+		r = store_get(system, key, entry);
+	}
 	/* Retrieve from user if not already found and allowed */
-	if (r != 0 && (mode & MODE_USER_READ) == MODE_USER_READ)
-		r = print_list_entry("user", *list_user, operation->key);
-	if (r != 0)
-		pr_dbg("key not found: %s\n", operation->key);
+	if (r == -ENOENT && (mode & MODE_USER_READ) == MODE_USER_READ) {
+		pr_dbg("getting key from user: %s\n", key);
+		r = store_get(user, key, entry);
+	}
+	if (r == -ENOENT)
+		pr_dbg("key not found: %s\n", key);
 	return r;
 }
 
-static int exec_del(const struct operation* operation, enum mode mode,
-		struct libnvram_list** list_system, struct libnvram_list** list_user, int* write_performed)
+static int exec_get(struct operation* operation, enum mode mode,
+		struct store* system, struct store* user, struct store* vol, int* write_performed)
 {
-	int r = -EINVAL;
-	if ((mode & MODE_SYSTEM_WRITE) == MODE_SYSTEM_WRITE)
-		r = remove_list_entry("system", list_system, operation->key);
-	else if ((mode & MODE_USER_WRITE) == MODE_USER_WRITE)
-		r = remove_list_entry("user", list_user, operation->key);
-	if (r == 1) {
+	(void) write_performed;
+
+	struct libnvram_entry entry;
+	int r = find_entry(operation->key, mode, system, user, vol, &entry);
+	if (r)
+		return r;
+	return print_value(&entry, operation->key, operation->type);
+}
+
+static int exec_exists(struct operation* operation, enum mode mode,
+		struct store* system, struct store* user, struct store* vol, int* write_performed)
+{
+	(void) write_performed;
+
+	struct libnvram_entry entry;
+	return find_entry(operation->key, mode, system, user, vol, &entry);
+}
+
+static int exec_del(struct operation* operation, enum mode mode,
+		struct store* system, struct store* user, struct store* vol, int* write_performed)
+{
+	const char* table_name = NULL;
+	struct store* store = write_store(operation->key, mode, system, user, vol, &table_name);
+	if (store && remove_table_entry(table_name, &store->table, operation->key) == 1) {
 		pr_dbg("deleted\n");
+		store->written = 1;
 		*write_performed = 1;
 	}
 	return 0;
 }
 
-static int add_operation(struct operation** list, enum op op, char* key, char* value)
+static int add_operation(struct operation** list, enum op op, char* key, char* value, enum nvram_value_type type, struct nvram_arena* arena)
 {
-	struct operation* operation = malloc(sizeof(struct operation));
+	struct operation* operation = nvram_arena_alloc(arena, sizeof(struct operation));
 	if (operation == NULL) {
 		pr_err("Failed allocating operation memory\n");
 		return -ENOMEM;
@@ -408,6 +906,9 @@ static int add_operation(struct operation** list, enum op op, char* key, char* v
 	operation->op = op;
 	operation->key = key;
 	operation->value = value;
+	operation->type = type;
+	operation->expected = NULL;
+	operation->result[0] = '\0';
 	switch (operation->op) {
 	case OP_LIST:
 		operation->validate = NULL;
@@ -425,6 +926,27 @@ static int add_operation(struct operation** list, enum op op, char* key, char* v
 		operation->validate = validate_del;
 		operation->execute = exec_del;
 		break;
+	case OP_LIST_PREFIX:
+		operation->validate = NULL;
+		operation->execute = exec_list_prefix;
+		break;
+	case OP_RANGE:
+		operation->validate = NULL;
+		operation->execute = exec_range;
+		break;
+	case OP_EXISTS:
+		operation->validate = NULL;
+		operation->execute = exec_exists;
+		break;
+	case OP_CAS:
+		operation->validate = validate_set;
+		operation->execute = exec_cas;
+		break;
+	case OP_INCR:
+	case OP_DECR:
+		operation->validate = validate_set;
+		operation->execute = exec_incr;
+		break;
 	case OP_NONE:
 		break;
 	}
@@ -441,19 +963,20 @@ static int add_operation(struct operation** list, enum op op, char* key, char* v
 	return 0;
 }
 
-static void destroy_operations(struct operation** list)
+static struct operation* last_operation(struct operation* list)
 {
-	if (list != NULL) {
-		struct operation* it = *list;
-		struct operation* next = NULL;
-		while (it != NULL) {
-			next = it->next;
-			free(it);
-			it = next;
+	while (list != NULL && list->next != NULL)
+		list = list->next;
+	return list;
+}
 
-		}
-		*list = NULL;
+static int has_operation(const struct opts* opts, int ops)
+{
+	for (struct operation* it = opts->operations; it != NULL; it = it->next) {
+		if ((it->op & ops) != 0)
+			return 1;
 	}
+	return 0;
 }
 
 static int validate_operations(const struct opts* opts)
@@ -465,201 +988,1027 @@ static int validate_operations(const struct opts* opts)
 				it->op, it->key, it->value);
 		found_op_types |= it->op;
 		if (it->validate != NULL) {
-			r = it->validate(it, opts->mode);
+			r = it->validate(it, opts);
 			if (r != 0)
 				return r;
 		}
 	}
 
-	const int read_ops = OP_GET | OP_LIST;
-	const int write_ops = OP_SET | OP_DEL;
+	const int list_ops = OP_LIST | OP_LIST_PREFIX | OP_RANGE;
+	const int read_ops = lookup_ops | list_ops;
 	if ((found_op_types & read_ops) != 0 && (found_op_types & write_ops) != 0) {
 		pr_err("can't mix read and write operations\n");
 		return -EINVAL;
 	}
-	if ((found_op_types & OP_LIST) == OP_LIST && (found_op_types & OP_GET) == OP_GET) {
-		pr_err("can't mix --get and --list operations\n");
+	if ((found_op_types & list_ops) != 0 && (found_op_types & lookup_ops) != 0) {
+		pr_err("can't mix --get or --exists and --list operations\n");
 		return -EINVAL;
 	}
 	return 0;
 }
 
-static int execute_operations(const struct opts* opts, struct nvram_format* format,
-								struct nvram* nvram_system, struct libnvram_list** list_system,
-								struct nvram* nvram_user, struct libnvram_list** list_user)
+static int execute_operations(const struct opts* opts, struct store* system, struct store* user, struct store* vol,
+		int* write_performed)
 {
-	int r = 0;
-	int write_performed = 0;
-
 	for (struct operation* it = opts->operations; it != NULL; it = it->next) {
 		if (it->execute == NULL) {
 			pr_err("operation should not be NULL\n");
 			return -EBADF;
 		}
-		r = it->execute(it, opts->mode, list_system, list_user, &write_performed);
+		int r = it->execute(it, opts->mode, system, user, vol, write_performed);
 		if (r != 0)
 			return r;
 	}
+	return 0;
+}
 
-	r = 0;
-	if (write_performed) {
-		pr_dbg("Commit changes\n");
-		if ((opts->mode & MODE_SYSTEM_WRITE) == MODE_SYSTEM_WRITE)
-			r = format->commit(nvram_system, *list_system);
-		else if ((opts->mode & MODE_USER_WRITE) == MODE_USER_WRITE)
-			r = format->commit(nvram_user, *list_user);
-		if (r)
-			pr_err("Failed committing changes [%d]: %s\n", -r, strerror(-r));
+/* Print results of operations, only once their changes are committed */
+static void print_results(const struct opts* opts)
+{
+	for (const struct operation* it = opts->operations; it != NULL; it = it->next) {
+		if (it->result[0] != '\0')
+			printf("%s\n", it->result);
 	}
-	return r;
 }
 
-/* Allow greater cognitive complexity due to argument parsing
- *
- * NOLINTNEXTLINE(readability-function-cognitive-complexity) */
-int main(int argc, char** argv)
+/* committed is set to the nvram written */
+static int commit_changes(struct nvram_format* format,
+								struct nvram* nvram_system, struct store* system,
+								struct nvram* nvram_user, struct store* user, struct nvram** committed)
 {
-	struct nvram *nvram_system = NULL;
-	struct libnvram_list *list_system = NULL;
-	struct nvram *nvram_user = NULL;
-	struct libnvram_list *list_user = NULL;
-	struct nvram_interface* interface = NULL;
-	struct nvram_format* format = NULL;
-	struct opts opts;
-	memset(&opts, 0, sizeof(opts));
-	opts.mode = MODE_USER_READ | MODE_USER_WRITE | MODE_SYSTEM_READ;
-	char* interface_override = NULL;
-	char* format_override = NULL;
-	char* user_a_override = NULL;
-	char* user_b_override = NULL;
-	char* system_a_override = NULL;
-	char* system_b_override = NULL;
-	int fd_lock = -1;
 	int r = 0;
-	int lock_ret = 0;
+	pr_dbg("Commit changes\n");
+	if (system->written) {
+		r = format->commit(nvram_system, &system->table);
+		*committed = nvram_system;
+	}
+	else if (user->written) {
+		r = format->commit(nvram_user, &user->table);
+		*committed = nvram_user;
+	}
+	if (r)
+		pr_err("Failed committing changes [%d]: %s\n", -r, strerror(-r));
+	return r;
+}
 
-	if (get_env_long(NVRAM_ENV_DEBUG))
-		enable_debug();
+/* Volatile section is on tmpfs, its directory doesn't survive a reboot */
+static int commit_volatile(struct nvram_format* format, struct nvram* nvram, struct store* vol)
+{
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%s", volatile_file());
+	if (mkdir(dirname(dir), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) && errno != EEXIST)
+		pr_dbg("failed creating volatile directory [%d]: %s\n", errno, strerror(errno));
 
-	for (int i = 1; i < argc; i++) {
-		if (!strcmp("--set", argv[i]) || !strcmp("set", argv[i])) {
-			if (i + 2 >= argc) {
-				fprintf(stderr, "Too few arguments for command set\n");
-				r = -EINVAL;
-				goto exit;
-			}
-			r = add_operation(&opts.operations, OP_SET, argv[i + 1], argv[i + 2]);
-			if (r != 0)
-				goto exit;
-			i += 2;
-		}
-		else if (!strcmp("--get", argv[i]) || !strcmp("get", argv[i])) {
-			if (++i >= argc) {
-				fprintf(stderr, "Too few arguments for command get\n");
-				r = -EINVAL;
-				goto exit;
-			}
-			r = add_operation(&opts.operations, OP_GET, argv[i], NULL);
-			if (r != 0)
-				goto exit;
-		}
-		else if (!strcmp("--list", argv[i]) || !strcmp("list", argv[i])) {
-			r = add_operation(&opts.operations, OP_LIST, NULL, NULL);
-			if (r != 0)
-				goto exit;
-		}
-		else if(!strcmp("--del", argv[i]) || !strcmp("delete", argv[i])) {
-			if (++i >= argc) {
-				fprintf(stderr, "Too few arguments for command delete\n");
-				r = -EINVAL;
-				goto exit;
-			}
-			r = add_operation(&opts.operations, OP_DEL, argv[i], NULL);
-			if (r != 0)
-				goto exit;
-		}
+	pr_dbg("Commit volatile changes\n");
+	const int r = format->commit(nvram, &vol->table);
+	if (r)
+		pr_err("Failed committing volatile changes [%d]: %s\n", -r, strerror(-r));
+	return r;
+}
+
+/* Build index of store if an operation needs it */
+static int build_index(const struct opts* opts, struct store* store, struct nvram_arena* arena)
+{
+	if (!has_operation(opts, index_ops))
+		return 0;
+	return nvram_index_build(&store->index, &store->table, arena);
+}
+
+static const char* stats_file(void)
+{
+	return get_env_str(NVRAM_ENV_STATS_FILE, xstr(NVRAM_STATS_FILE));
+}
+
+/* Stats are informational, failing to store them doesn't fail the commit */
+static void flush_stats(void)
+{
+	const char* path = stats_file();
+	if (strlen(path) == 0)
+		return;
+	const int r = nvram_stats_flush(path);
+	/* Directory of stats file not being provisioned disables them */
+	if (r == -ENOENT) {
+		pr_dbg("no stats written: %s\n", path);
+	}
+	else if (r) {
+		pr_err("failed writing stats: %s [%d]: %s\n", path, -r, strerror(-r));
+	}
+}
+
+static const char* snapshot_file(void)
+{
+	return get_env_str(NVRAM_ENV_SNAPSHOT, xstr(NVRAM_SNAPSHOT));
+}
+
+/* Called before writing nvram, readers must not be served data older than it */
+static void invalidate_snapshot(int sections)
+{
+	const char* path = snapshot_file();
+	if (sections == 0 || strlen(path) == 0)
+		return;
+	const int r = nvram_snapshot_invalidate(path, sections);
+	if (r)
+		pr_err("failed invalidating snapshot: %s [%d]: %s\n", path, -r, strerror(-r));
+}
+
+/*
+ * Snapshot is an optimization, readers fall back to nvram without it. A NULL
+ * store keeps its section as published.
+ */
+static void publish_snapshot(const struct nvram_snapshot_source* source, const struct store* system,
+		const struct store* user)
+{
+	const char* path = snapshot_file();
+	if (strlen(path) == 0)
+		return;
+	const int r = nvram_snapshot_publish(path, source, system ? &system->table : NULL,
+			user ? &user->table : NULL);
+	if (r)
+		pr_dbg("failed publishing snapshot: %s [%d]: %s\n", path, -r, strerror(-r));
+}
+
+/*
+ * Publish sections never published, such as system before the first commit
+ * with --sys, when their lock is free. Locks held in fds are not taken again,
+ * and none is waited for, so lock order doesn't matter.
+ */
+static void complete_snapshot(struct nvram_interface* interface, struct nvram_format* format,
+		const struct nvram_snapshot_source* source, const int* fds, struct nvram_arena* arena)
+{
+	const char* path = snapshot_file();
+	if (strlen(path) == 0)
+		return;
+	const struct {
+		int section;
+		/* Index in section_locks */
+		size_t lock;
+		const char* a;
+		const char* b;
+	} sections[] = {
+		{NVRAM_SNAPSHOT_SYSTEM, 0, source->system_a, source->system_b},
+		{NVRAM_SNAPSHOT_USER, 1, source->user_a, source->user_b},
+	};
+	const int published = nvram_snapshot_sections(path, source);
+	for (size_t i = 0; i < sizeof(sections) / sizeof(*sections); ++i) {
+		if ((published & sections[i].section) != 0 || fds[sections[i].lock] >= 0)
+			continue;
+		const char* lockfile = section_locks[sections[i].lock].path;
+		const int fd = try_lockfile(lockfile);
+		if (fd < 0) {
+			pr_dbg("not publishing %s to snapshot [%d]: %s\n", lockfile, -fd, strerror(-fd));
+			continue;
+		}
+		struct nvram* nvram = NULL;
+		struct store store;
+		memset(&store, 0, sizeof(store));
+		if (format->init(&nvram, interface, &store.table, sections[i].a, sections[i].b, arena) == 0) {
+			publish_snapshot(source, sections[i].section == NVRAM_SNAPSHOT_SYSTEM ? &store : NULL,
+					sections[i].section == NVRAM_SNAPSHOT_USER ? &store : NULL);
+		}
+		nvram_table_destroy(&store.table);
+		format->close(&nvram);
+		release_lockfile(lockfile, fd);
+	}
+}
+
+/*
+ * Run lookup operations against the snapshot, if there is a current one
+ *
+ * @returns
+ *   1 if done, with operations result in result
+ *   0 if snapshot can't be used
+ */
+static int run_snapshot(const struct opts* opts, const struct nvram_snapshot_source* source,
+		struct store* system, struct store* user, struct store* vol, struct nvram_arena* arena, int* result)
+{
+	const char* path = snapshot_file();
+	if (strlen(path) == 0)
+		return 0;
+
+	size_t keys_len = 0;
+	for (const struct operation* it = opts->operations; it != NULL; it = it->next) {
+		/* Snapshot holds only persistent sections */
+		if (is_volatile_key(it->key))
+			return 0;
+		keys_len++;
+	}
+	const char** keys = nvram_arena_alloc(arena, keys_len * sizeof(*keys));
+	if (!keys)
+		return 0;
+	keys_len = 0;
+	for (const struct operation* it = opts->operations; it != NULL; it = it->next)
+		keys[keys_len++] = it->key;
+
+	const int r = nvram_snapshot_lookup(path, source, keys, keys_len, &system->table, &user->table);
+	if (r) {
+		pr_dbg("not using snapshot: %s [%d]: %s\n", path, -r, strerror(-r));
+		return 0;
+	}
+	pr_dbg("looking up keys in snapshot\n");
+
+	int write_performed = 0;
+	*result = validate_operations(opts);
+	if (*result == 0)
+		*result = execute_operations(opts, system, user, vol, &write_performed);
+	return 1;
+}
+
+/*
+ * Initialize sections needed by opts->mode. With lookup, tables are left
+ * empty and keys are looked up in nvram.
+ */
+static int open_stores(const struct opts* opts, struct nvram_interface* interface, struct nvram_format* format,
+		const struct nvram_snapshot_source* source, int lookup, struct nvram** nvram_system, struct store* system,
+		struct nvram** nvram_user, struct store* user, struct nvram_format** vol_format, struct nvram** nvram_vol,
+		struct store* vol, struct nvram_arena* arena)
+{
+	int r = 0;
+	if ((opts->mode & (MODE_SYSTEM_WRITE | MODE_SYSTEM_READ)) != 0) {
+		pr_dbg("NVRAM_SYSTEM_A: %s\n", source->system_a);
+		pr_dbg("NVRAM_SYSTEM_B: %s\n", source->system_b);
+
+		r = format->init(nvram_system, interface, lookup ? NULL : &system->table, source->system_a, source->system_b, arena);
+		if (r)
+			return r;
+		if (lookup) {
+			system->lookup_format = format;
+			system->lookup_nvram = *nvram_system;
+		}
+		r = build_index(opts, system, arena);
+		if (r)
+			return r;
+	}
+
+	if ((opts->mode & (MODE_USER_WRITE | MODE_USER_READ)) != 0) {
+		pr_dbg("NVRAM_USER_A: %s\n", source->user_a);
+		pr_dbg("NVRAM_USER_B: %s\n", source->user_b);
+		r = format->init(nvram_user, interface, lookup ? NULL : &user->table, source->user_a, source->user_b, arena);
+		if (r)
+			return r;
+		if (lookup) {
+			user->lookup_format = format;
+			user->lookup_nvram = *nvram_user;
+		}
+		r = build_index(opts, user, arena);
+		if (r)
+			return r;
+	}
+
+	/* Volatile section is always v2 in a single file, regardless of interface and format */
+	if ((opts->mode & (MODE_VOLATILE_WRITE | MODE_VOLATILE_READ)) != 0) {
+		struct nvram_interface* vol_interface = nvram_get_interface("file");
+		*vol_format = nvram_get_format("v2");
+		if (vol_interface == NULL || *vol_format == NULL) {
+			pr_err("volatile section needs v2 format and file interface, unset %s\n", NVRAM_ENV_VOLATILE_PREFIX);
+			*vol_format = NULL;
+			return -EINVAL;
+		}
+		pr_dbg("NVRAM_VOLATILE: %s\n", volatile_file());
+		r = (*vol_format)->init(nvram_vol, vol_interface, &vol->table, volatile_file(), NULL, arena);
+		if (r)
+			return r;
+		r = build_index(opts, vol, arena);
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+/* Close sections and empty stores, memory is returned with the arena */
+static void close_stores(struct nvram_format* format, struct nvram** nvram_system, struct store* system,
+		struct nvram** nvram_user, struct store* user, struct nvram_format* vol_format, struct nvram** nvram_vol,
+		struct store* vol)
+{
+	nvram_table_destroy(&system->table);
+	nvram_table_destroy(&user->table);
+	nvram_table_destroy(&vol->table);
+	memset(system, 0, sizeof(*system));
+	memset(user, 0, sizeof(*user));
+	memset(vol, 0, sizeof(*vol));
+	if (format != NULL) {
+		format->close(nvram_system);
+		format->close(nvram_user);
+	}
+	if (vol_format != NULL)
+		vol_format->close(nvram_vol);
+}
+
+static int lockless_enabled(void)
+{
+	return get_env_long_def(NVRAM_ENV_LOCKLESS_READ, NVRAM_LOCKLESS_READ) != 0;
+}
+
+/* Returns 0 if data read without lock is a committed state, see nvram_format validate */
+static int validate_store(struct nvram_format* format, struct nvram* nvram)
+{
+	if (nvram == NULL)
+		return 0;
+	return format->validate ? format->validate(nvram) : -EAGAIN;
+}
+
+/*
+ * Run read operations without lock, for formats able to tell whether data
+ * read was changed by a concurrent commit. Tables are loaded and validated
+ * before operations print anything. Errors are left to the locked attempt
+ * to report, as are attempts interfered with LOCKLESS_ATTEMPTS times.
+ *
+ * @returns
+ *   1 if done, with operations result in result
+ *   0 if the lock is needed
+ */
+static int run_lockless(const struct opts* opts, struct nvram_interface* interface, struct nvram_format* format,
+		const struct nvram_snapshot_source* source, struct store* system, struct store* user, struct store* vol,
+		struct nvram_arena* arena, int* result)
+{
+	for (int attempt = 1; attempt <= LOCKLESS_ATTEMPTS; ++attempt) {
+		struct nvram* nvram_system = NULL;
+		struct nvram* nvram_user = NULL;
+		struct nvram* nvram_vol = NULL;
+		struct nvram_format* vol_format = NULL;
+		quiet_errors(1);
+		int r = open_stores(opts, interface, format, source, 0, &nvram_system, system, &nvram_user, user,
+				&vol_format, &nvram_vol, vol, arena);
+		if (!r)
+			r = validate_store(format, nvram_system);
+		if (!r)
+			r = validate_store(format, nvram_user);
+		if (!r)
+			r = validate_store(vol_format, nvram_vol);
+		quiet_errors(0);
+		if (!r) {
+			pr_dbg("read without lock\n");
+			int write_performed = 0;
+			*result = execute_operations(opts, system, user, vol, &write_performed);
+		}
+		close_stores(format, &nvram_system, system, &nvram_user, user, vol_format, &nvram_vol, vol);
+		if (!r)
+			return 1;
+		pr_dbg("read without lock, attempt %d failed [%d]: %s\n", attempt, -r, strerror(-r));
+		if (r != -EAGAIN)
+			break;
+	}
+	return 0;
+}
+
+static int standby_enabled(void)
+{
+	return get_env_long_def(NVRAM_ENV_STANDBY_ERASE, NVRAM_STANDBY_ERASE) != 0;
+}
+
+/*
+ * Erase the section written by the next commit in a child process, so the
+ * caller gets its result without waiting for the erase. The child holds only
+ * the standby lock of the section set in mode, taken before forking, so
+ * readers don't wait for the erase and writers wait in wait_standby(). A
+ * section read while it is erased has no valid header and is passed over.
+ */
+static void start_standby(struct nvram_format* format, struct nvram* nvram, int* fd_locks, enum mode mode)
+{
+	const char* path = NULL;
+	for (size_t i = 0; i < SECTION_LOCKS; ++i) {
+		if ((section_locks[i].mode & mode) != 0)
+			path = section_locks[i].standby;
+	}
+	if (path == NULL)
+		return;
+	/* Not contended, writers of the section wait for our section lock first */
+	int fd_standby = open(path, O_CREAT | O_WRONLY | O_CLOEXEC, S_IWUSR | S_IRUSR);
+	if (fd_standby < 0 || flock(fd_standby, LOCK_EX)) {
+		pr_err("failed locking lockfile: %s [%d]: %s\n", path, errno, strerror(errno));
+		if (fd_standby >= 0)
+			close(fd_standby);
+		return;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid = fork();
+	if (pid < 0) {
+		pr_err("failed starting standby erase [%d]: %s\n", errno, strerror(errno));
+		close(fd_standby);
+		return;
+	}
+	if (pid > 0) {
+		pr_dbg("standby erase started: %d\n", pid);
+		/* Lock stays with the child's descriptor */
+		close(fd_standby);
+		return;
+	}
+
+	for (size_t i = 0; i < SECTION_LOCKS; ++i) {
+		if (fd_locks[i] >= 0)
+			close(fd_locks[i]);
+	}
+
+	/* Callers reading our output must not wait for the child */
+	const int fd = open("/dev/null", O_RDWR);
+	if (fd >= 0) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+	const int r = format->standby(nvram);
+	flush_stats();
+	_exit(r ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+struct typed_command {
+	const char* name;
+	enum op op;
+	enum nvram_value_type type;
+};
+
+static const struct typed_command typed_commands[] = {
+	{"--set-u32", OP_SET, NVRAM_VALUE_U32},
+	{"--set-u64", OP_SET, NVRAM_VALUE_U64},
+	{"--set-bool", OP_SET, NVRAM_VALUE_BOOL},
+	{"--get-u32", OP_GET, NVRAM_VALUE_U32},
+	{"--get-u64", OP_GET, NVRAM_VALUE_U64},
+	{"--get-bool", OP_GET, NVRAM_VALUE_BOOL},
+};
+
+/* Returns NULL if not a typed command */
+static const struct typed_command* find_typed_command(const char* arg)
+{
+	for (size_t i = 0; i < sizeof(typed_commands) / sizeof(*typed_commands); ++i) {
+		if (!strcmp(typed_commands[i].name, arg))
+			return &typed_commands[i];
+	}
+	return NULL;
+}
+
+/* Parse arguments, without program name, into opts
+ *
+ * NOLINTNEXTLINE(readability-function-cognitive-complexity) */
+static int parse_args(int argc, char** argv, struct opts* opts, struct nvram_arena* arena)
+{
+	const struct typed_command* typed = NULL;
+	int r = 0;
+
+	for (int i = 0; i < argc; i++) {
+		if (!strcmp("--set", argv[i]) || !strcmp("set", argv[i])) {
+			if (i + 2 >= argc) {
+				fprintf(stderr, "Too few arguments for command set\n");
+				return -EINVAL;
+			}
+			r = add_operation(&opts->operations, OP_SET, argv[i + 1], argv[i + 2], NVRAM_VALUE_STRING, arena);
+			if (r != 0)
+				return r;
+			i += 2;
+		}
+		else if (!strcmp("--get", argv[i]) || !strcmp("get", argv[i])) {
+			if (++i >= argc) {
+				fprintf(stderr, "Too few arguments for command get\n");
+				return -EINVAL;
+			}
+			r = add_operation(&opts->operations, OP_GET, argv[i], NULL, NVRAM_VALUE_STRING, arena);
+			if (r != 0)
+				return r;
+		}
+		else if ((typed = find_typed_command(argv[i])) != NULL) {
+			const int values = typed->op == OP_SET ? 2 : 1;
+			if (i + values >= argc) {
+				fprintf(stderr, "Too few arguments for command %s\n", argv[i] + 2);
+				return -EINVAL;
+			}
+			r = add_operation(&opts->operations, typed->op, argv[i + 1], values == 2 ? argv[i + 2] : NULL, typed->type, arena);
+			if (r != 0)
+				return r;
+			i += values;
+		}
+		else if (!strcmp("--exists", argv[i])) {
+			if (++i >= argc) {
+				fprintf(stderr, "Too few arguments for command exists\n");
+				return -EINVAL;
+			}
+			r = add_operation(&opts->operations, OP_EXISTS, argv[i], NULL, NVRAM_VALUE_STRING, arena);
+			if (r != 0)
+				return r;
+		}
+		else if (!strcmp("--cas", argv[i])) {
+			if (i + 3 >= argc) {
+				fprintf(stderr, "Too few arguments for command cas\n");
+				return -EINVAL;
+			}
+			r = add_operation(&opts->operations, OP_CAS, argv[i + 1], argv[i + 3], NVRAM_VALUE_STRING, arena);
+			if (r != 0)
+				return r;
+			last_operation(opts->operations)->expected = argv[i + 2];
+			i += 3;
+		}
+		else if (!strcmp("--cas-absent", argv[i])) {
+			if (i + 2 >= argc) {
+				fprintf(stderr, "Too few arguments for command cas-absent\n");
+				return -EINVAL;
+			}
+			r = add_operation(&opts->operations, OP_CAS, argv[i + 1], argv[i + 2], NVRAM_VALUE_STRING, arena);
+			if (r != 0)
+				return r;
+			i += 2;
+		}
+		else if (!strcmp("--incr", argv[i]) || !strcmp("--decr", argv[i])) {
+			const enum op op = !strcmp("--incr", argv[i]) ? OP_INCR : OP_DECR;
+			if (i + 1 >= argc) {
+				fprintf(stderr, "Too few arguments for command %s\n", argv[i] + 2);
+				return -EINVAL;
+			}
+			/* Optional delta, anything else is the next command */
+			uint64_t delta = 0;
+			char* value = NULL;
+			if (i + 2 < argc && !nvram_value_parse(NVRAM_VALUE_U64, argv[i + 2], &delta))
+				value = argv[i + 2];
+			r = add_operation(&opts->operations, op, argv[i + 1], value, NVRAM_VALUE_STRING, arena);
+			if (r != 0)
+				return r;
+			i += value != NULL ? 2 : 1;
+		}
+		else if (!strcmp("--list", argv[i]) || !strcmp("list", argv[i])) {
+			r = add_operation(&opts->operations, OP_LIST, NULL, NULL, NVRAM_VALUE_STRING, arena);
+			if (r != 0)
+				return r;
+		}
+		else if (!strcmp("--list-prefix", argv[i])) {
+			if (++i >= argc) {
+				fprintf(stderr, "Too few arguments for command list-prefix\n");
+				return -EINVAL;
+			}
+			r = add_operation(&opts->operations, OP_LIST_PREFIX, argv[i], NULL, NVRAM_VALUE_STRING, arena);
+			if (r != 0)
+				return r;
+		}
+		else if (!strcmp("--range", argv[i])) {
+			if (i + 2 >= argc) {
+				fprintf(stderr, "Too few arguments for command range\n");
+				return -EINVAL;
+			}
+			r = add_operation(&opts->operations, OP_RANGE, argv[i + 1], argv[i + 2], NVRAM_VALUE_STRING, arena);
+			if (r != 0)
+				return r;
+			i += 2;
+		}
+		else if(!strcmp("--del", argv[i]) || !strcmp("delete", argv[i])) {
+			if (++i >= argc) {
+				fprintf(stderr, "Too few arguments for command delete\n");
+				return -EINVAL;
+			}
+			r = add_operation(&opts->operations, OP_DEL, argv[i], NULL, NVRAM_VALUE_STRING, arena);
+			if (r != 0)
+				return r;
+		}
+		else if (!strcmp("--sync", argv[i])) {
+			opts->sync = 1;
+		}
 		else if (!strcmp("--sys", argv[i])) {
-			opts.mode = MODE_SYSTEM_READ | MODE_SYSTEM_WRITE;
+			opts->mode = MODE_SYSTEM_READ | MODE_SYSTEM_WRITE;
 		}
 		else if (!strcmp("--user", argv[i])) {
-			opts.mode = MODE_USER_READ | MODE_USER_WRITE;
+			opts->mode = MODE_USER_READ | MODE_USER_WRITE;
+		}
+		else if (!strcmp("--serve", argv[i])) {
+			opts->serve = 1;
+		}
+		else if (!strcmp("--stats", argv[i])) {
+			opts->stats = 1;
+			opts->stats_output = NVRAM_STATS_TEXT;
+		}
+		else if (!strcmp("--stats-openmetrics", argv[i])) {
+			opts->stats = 1;
+			opts->stats_output = NVRAM_STATS_OPENMETRICS;
 		}
 		else if (!strcmp("-h", argv[i]) || !strcmp("--help", argv[i])) {
 			print_usage();
-			r = -EINVAL;
-			goto exit;
+			return -EINVAL;
 		}
 		else if (!strcmp("-f", argv[i]) || !strcmp("--format", argv[i])) {
 			if (++i >= argc) {
 				fprintf(stderr, "Too few arguments for -f, --format\n");
-				r = -EINVAL;
-				goto exit;
+				return -EINVAL;
 			}
-			format_override = argv[i];
+			opts->format_override = argv[i];
 		}
 		else if (!strcmp("-i", argv[i]) || !strcmp("--interface", argv[i])) {
 			if (++i >= argc) {
 				fprintf(stderr, "Too few arguments for -i, --interface\n");
-				r = -EINVAL;
-				goto exit;
+				return -EINVAL;
 			}
-			interface_override = argv[i];
+			opts->interface_override = argv[i];
 		}
 		else if (!strcmp("--user_a", argv[i])) {
 			if (++i >= argc) {
 				fprintf(stderr, "Too few arguments for --user_a\n");
-				r = -EINVAL;
-				goto exit;
+				return -EINVAL;
 			}
-			user_a_override = argv[i];
+			opts->user_a_override = argv[i];
 		}
 		else if (!strcmp("--user_b", argv[i])) {
 			if (++i >= argc) {
 				fprintf(stderr, "Too few arguments for --user_b\n");
-				r = -EINVAL;
-				goto exit;
+				return -EINVAL;
 			}
-			user_b_override = argv[i];
+			opts->user_b_override = argv[i];
 		}
 		else if (!strcmp("--sys_a", argv[i])) {
 			if (++i >= argc) {
 				fprintf(stderr, "Too few arguments for --sys_a\n");
-				r = -EINVAL;
-				goto exit;
+				return -EINVAL;
 			}
-			system_a_override = argv[i];
+			opts->system_a_override = argv[i];
 		}
 		else if (!strcmp("--sys_b", argv[i])) {
 			if (++i >= argc) {
 				fprintf(stderr, "Too few arguments for --sys_b\n");
-				r = -EINVAL;
-				goto exit;
+				return -EINVAL;
 			}
-			system_b_override = argv[i];
+			opts->system_b_override = argv[i];
 		}
 		else {
 			fprintf(stderr, "unknown argument: %s\n", argv[i]);
-			r = -EINVAL;
+			return -EINVAL;
+		}
+	}
+
+
+	if (opts->serve) {
+		if (opts->operations != NULL) {
+			fprintf(stderr, "--serve can't be combined with commands\n");
+			return -EINVAL;
+		}
+		return 0;
+	}
+	if (opts->stats) {
+		if (opts->operations != NULL || opts->sync) {
+			fprintf(stderr, "--stats can't be combined with commands\n");
+			return -EINVAL;
+		}
+		return 0;
+	}
+	if (opts->operations == NULL && !opts->sync)
+		return add_operation(&opts->operations, OP_LIST, NULL, NULL, NVRAM_VALUE_STRING, arena);
+	return 0;
+}
+
+/*
+ * Resident process started by --serve. Tables are loaded once and kept for
+ * all requests, changes are committed flush_delay_ms after the first one so
+ * a burst of writes ends up in a single commit.
+ */
+struct server {
+	struct nvram_format* format;
+	const struct nvram_snapshot_source* source;
+	struct nvram* nvram_system;
+	struct store* system;
+	struct nvram* nvram_user;
+	struct store* user;
+	/* Volatile section, format is NULL if disabled */
+	struct nvram_format* vol_format;
+	struct nvram* nvram_vol;
+	struct store* vol;
+	long flush_delay_ms;
+	int system_dirty;
+	int user_dirty;
+	int vol_dirty;
+	/* CLOCK_MONOTONIC time of next commit while dirty */
+	long long flush_at_ms;
+};
+
+static long long monotonic_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int flush_store(struct nvram_format* format, const char* name, struct nvram* nvram, struct store* store)
+{
+	pr_dbg("committing %s changes\n", name);
+	int r = format->commit(nvram, &store->table);
+	if (r) {
+		pr_err("failed committing %s changes [%d]: %s\n", name, -r, strerror(-r));
+		return r;
+	}
+
+	/* Table lives as long as the server, don't let it grow with every update */
+	r = nvram_table_compact(&store->table);
+	if (r)
+		pr_err("failed compacting %s table [%d]: %s\n", name, -r, strerror(-r));
+
+	if (format->standby && standby_enabled()) {
+		r = format->standby(nvram);
+		if (r)
+			pr_err("failed standby erase of %s [%d]: %s\n", name, -r, strerror(-r));
+	}
+	flush_stats();
+	return 0;
+}
+
+static int flush(struct server* server)
+{
+	/* Retry failed commits, but don't spin on them when writing through */
+	const long retry_min_ms = 100;
+	const int system_dirty = server->system_dirty;
+	const int user_dirty = server->user_dirty;
+	int r = 0;
+
+	if (server->system_dirty) {
+		r = flush_store(server->format, "system", server->nvram_system, server->system);
+		if (r == 0)
+			server->system_dirty = 0;
+	}
+	if (server->user_dirty) {
+		const int user_r = flush_store(server->format, "user", server->nvram_user, server->user);
+		if (user_r == 0)
+			server->user_dirty = 0;
+		else if (r == 0)
+			r = user_r;
+	}
+	if (server->vol_dirty) {
+		const int vol_r = commit_volatile(server->vol_format, server->nvram_vol, server->vol);
+		if (vol_r == 0)
+			server->vol_dirty = 0;
+		else if (r == 0)
+			r = vol_r;
+	}
+	/* Tables match nvram once committed, a section still dirty stays invalid */
+	const int system_published = system_dirty && !server->system_dirty;
+	const int user_published = user_dirty && !server->user_dirty;
+	if (system_published || user_published)
+		publish_snapshot(server->source, system_published ? server->system : NULL,
+				user_published ? server->user : NULL);
+	if (server->system_dirty || server->user_dirty || server->vol_dirty) {
+		const long retry_ms = server->flush_delay_ms > retry_min_ms ? server->flush_delay_ms : retry_min_ms;
+		server->flush_at_ms = monotonic_ms() + retry_ms;
+	}
+	return r;
+}
+
+static void mark_dirty(struct server* server)
+{
+	/* Window starts with the first change, later ones don't extend it */
+	if (!server->system_dirty && !server->user_dirty && !server->vol_dirty)
+		server->flush_at_ms = monotonic_ms() + server->flush_delay_ms;
+	/* Readers of the snapshot are sent to the server until the change is committed */
+	int sections = server->system->written && !server->system_dirty ? NVRAM_SNAPSHOT_SYSTEM : 0;
+	sections |= server->user->written && !server->user_dirty ? NVRAM_SNAPSHOT_USER : 0;
+	invalidate_snapshot(sections);
+	server->system_dirty |= server->system->written;
+	server->user_dirty |= server->user->written;
+	server->vol_dirty |= server->vol->written;
+	server->system->written = 0;
+	server->user->written = 0;
+	server->vol->written = 0;
+}
+
+static int serve_request(void* ctx, int argc, char** argv, int system_unlocked)
+{
+	struct server* server = ctx;
+	/* Memory for this request only */
+	struct nvram_arena arena;
+	memset(&arena, 0, sizeof(arena));
+	struct opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.mode = MODE_USER_READ | MODE_USER_WRITE | MODE_SYSTEM_READ;
+	if (server->vol_format)
+		opts.mode |= MODE_VOLATILE_READ | MODE_VOLATILE_WRITE;
+	opts.system_unlocked = system_unlocked;
+	int write_performed = 0;
+	struct store* stores[] = {server->system, server->user, server->vol};
+	const enum mode store_modes[] = {MODE_SYSTEM_WRITE, MODE_USER_WRITE, MODE_VOLATILE_WRITE};
+	struct nvram_table saved[sizeof(stores) / sizeof(*stores)];
+	int saved_stores[sizeof(stores) / sizeof(*stores)] = {0};
+
+	int r = parse_args(argc, argv, &opts, &arena);
+	if (r)
+		goto exit;
+	if (opts.serve || opts.interface_override || opts.format_override
+			|| opts.user_a_override || opts.user_b_override
+			|| opts.system_a_override || opts.system_b_override) {
+		pr_err("interface, format and sections are set by server\n");
+		r = -EINVAL;
+		goto exit;
+	}
+	r = validate_operations(&opts);
+	if (r)
+		goto exit;
+
+	/* Tables written by more than one operation are copied, to be restored if a later one fails */
+	int writes = 0;
+	for (const struct operation* it = opts.operations; it != NULL; it = it->next)
+		writes += (it->op & write_ops) != 0;
+	for (size_t i = 0; writes > 1 && i < sizeof(stores) / sizeof(*stores); ++i) {
+		if ((opts.mode & store_modes[i]) == 0)
+			continue;
+		r = nvram_table_copy(&saved[i], &stores[i]->table);
+		if (r)
+			goto exit;
+		saved_stores[i] = 1;
+	}
+
+	if ((opts.mode & (MODE_SYSTEM_WRITE | MODE_SYSTEM_READ)) != 0) {
+		r = build_index(&opts, server->system, &arena);
+		if (r)
+			goto exit;
+	}
+	if ((opts.mode & (MODE_USER_WRITE | MODE_USER_READ)) != 0) {
+		r = build_index(&opts, server->user, &arena);
+		if (r)
+			goto exit;
+	}
+	if ((opts.mode & (MODE_VOLATILE_WRITE | MODE_VOLATILE_READ)) != 0) {
+		r = build_index(&opts, server->vol, &arena);
+		if (r)
 			goto exit;
+	}
+
+	r = execute_operations(&opts, server->system, server->user, server->vol, &write_performed);
+	if (r) {
+		/* Nothing of a failing request is kept, as when running directly */
+		for (size_t i = 0; i < sizeof(stores) / sizeof(*stores); ++i) {
+			if (saved_stores[i]) {
+				nvram_table_destroy(&stores[i]->table);
+				stores[i]->table = saved[i];
+				saved_stores[i] = 0;
+			}
+			stores[i]->written = 0;
 		}
+		goto exit;
 	}
+	if (write_performed)
+		mark_dirty(server);
 
-	if (opts.operations == NULL) {
-		r = add_operation(&opts.operations, OP_LIST, NULL, NULL);
-		if (r != 0)
+	if (opts.sync || server->flush_delay_ms <= 0)
+		r = flush(server);
+	/* Deferred changes are kept by the server, written through ones must have been committed */
+	if (r == 0)
+		print_results(&opts);
+
+exit:
+	for (size_t i = 0; i < sizeof(stores) / sizeof(*stores); ++i) {
+		if (saved_stores[i])
+			nvram_table_destroy(&saved[i]);
+	}
+	/* Indexes reference request memory */
+	memset(&server->system->index, 0, sizeof(server->system->index));
+	memset(&server->user->index, 0, sizeof(server->user->index));
+	memset(&server->vol->index, 0, sizeof(server->vol->index));
+	pr_dbg("request arena: %zu allocations, %zu bytes, %zu chunks\n",
+			arena.allocations, arena.bytes, arena.chunk_allocations);
+	nvram_arena_release(&arena);
+	return r;
+}
+
+static long serve_next_timeout(void* ctx)
+{
+	const struct server* server = ctx;
+	if (!server->system_dirty && !server->user_dirty && !server->vol_dirty)
+		return -1;
+	const long long remaining = server->flush_at_ms - monotonic_ms();
+	return remaining > 0 ? (long) remaining : 0;
+}
+
+static void serve_timeout(void* ctx)
+{
+	flush(ctx);
+}
+
+static int run_server(const char* socket_path, struct nvram_format* format, const struct nvram_snapshot_source* source,
+		struct nvram* nvram_system, struct store* system, struct nvram* nvram_user, struct store* user,
+		struct nvram_format* vol_format, struct nvram* nvram_vol, struct store* vol)
+{
+	static const struct nvram_serve_ops ops = {
+		.request = serve_request,
+		.next_timeout = serve_next_timeout,
+		.timeout = serve_timeout,
+	};
+	struct server server;
+	memset(&server, 0, sizeof(server));
+	server.format = format;
+	server.source = source;
+	server.nvram_system = nvram_system;
+	server.system = system;
+	server.nvram_user = nvram_user;
+	server.user = user;
+	server.vol_format = vol_format;
+	server.nvram_vol = nvram_vol;
+	server.vol = vol;
+	server.flush_delay_ms = get_env_long_def(NVRAM_ENV_FLUSH_DELAY_MS, NVRAM_FLUSH_DELAY_MS);
+	pr_dbg("flush delay: %ld ms\n", server.flush_delay_ms);
+	/* Tables were just read, readers can use them until the first change */
+	publish_snapshot(source, system, user);
+
+	int r = nvram_serve_run(socket_path, &ops, &server);
+	/* Nothing deferred may be lost on shutdown */
+	const int flush_r = flush(&server);
+	return r ? r : flush_r;
+}
+
+/* NOLINTNEXTLINE(readability-function-cognitive-complexity) */
+int main(int argc, char** argv)
+{
+	struct nvram *nvram_system = NULL;
+	struct store system;
+	memset(&system, 0, sizeof(system));
+	struct nvram *nvram_user = NULL;
+	struct store user;
+	memset(&user, 0, sizeof(user));
+	struct nvram *nvram_vol = NULL;
+	struct store vol;
+	memset(&vol, 0, sizeof(vol));
+	struct nvram_interface* interface = NULL;
+	struct nvram_format* format = NULL;
+	struct nvram_format* vol_format = NULL;
+	/* Memory for this invocation, released in one go at exit */
+	struct nvram_arena arena;
+	memset(&arena, 0, sizeof(arena));
+	struct opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.mode = MODE_USER_READ | MODE_USER_WRITE | MODE_SYSTEM_READ | MODE_VOLATILE_READ | MODE_VOLATILE_WRITE;
+	int fd_locks[SECTION_LOCKS];
+	for (size_t i = 0; i < SECTION_LOCKS; ++i)
+		fd_locks[i] = -1;
+	int r = 0;
+	int lock_ret = 0;
+
+	if (get_env_long(NVRAM_ENV_DEBUG))
+		enable_debug();
+
+	r = parse_args(argc - 1, argv + 1, &opts, &arena);
+	if (r)
+		goto exit;
+	opts.system_unlocked = system_unlocked();
+	if (!volatile_enabled())
+		opts.mode &= ~(MODE_VOLATILE_READ | MODE_VOLATILE_WRITE);
+
+	/* Stats file is replaced as a whole, reading it needs neither lock nor server */
+	if (opts.stats) {
+		const char* path = stats_file();
+		if (strlen(path) == 0) {
+			pr_err("stats disabled, set %s\n", NVRAM_ENV_STATS_FILE);
+			r = -EINVAL;
 			goto exit;
+		}
+		r = nvram_stats_print(path, opts.stats_output);
+		goto exit;
 	}
 
 	const char* interface_selected = get_env_str(NVRAM_ENV_INTERFACE, xstr(NVRAM_INTERFACE_DEFAULT));
-	const char* interface_name = interface_override != NULL ? interface_override : interface_selected;
+	const char* interface_name = opts.interface_override != NULL ? opts.interface_override : interface_selected;
+	const char* format_selected = get_env_str(NVRAM_ENV_FORMAT, xstr(NVRAM_FORMAT_DEFAULT));
+	const char* format_name = opts.format_override != NULL ? opts.format_override : format_selected;
+	const struct nvram_snapshot_source source = {
+		.interface = interface_name,
+		.format = format_name,
+		.system_a = opts.system_a_override != NULL ? opts.system_a_override :
+						nvram_get_interface_section(interface_name, SYSTEM_A),
+		.system_b = opts.system_b_override != NULL ? opts.system_b_override :
+						nvram_get_interface_section(interface_name, SYSTEM_B),
+		.user_a = opts.user_a_override != NULL ? opts.user_a_override :
+						nvram_get_interface_section(interface_name, USER_A),
+		.user_b = opts.user_b_override != NULL ? opts.user_b_override :
+						nvram_get_interface_section(interface_name, USER_B),
+	};
+
+	/* Lookups skip both lock and server when the snapshot is current */
+	const int lookup_only = opts.operations != NULL && !opts.sync && !has_operation(&opts, ~lookup_ops);
+	if (!opts.serve && lookup_only && run_snapshot(&opts, &source, &system, &user, &vol, &arena, &r))
+		goto exit;
+
+	const char* socket_path = get_env_str(NVRAM_ENV_SOCKET, xstr(NVRAM_SERVE_SOCKET));
+	if (opts.serve) {
+		if (strlen(socket_path) == 0) {
+			pr_err("no socket for --serve, set %s\n", NVRAM_ENV_SOCKET);
+			r = -EINVAL;
+			goto exit;
+		}
+		/* Server handles both sections */
+		opts.mode |= MODE_USER_READ | MODE_USER_WRITE | MODE_SYSTEM_READ | MODE_SYSTEM_WRITE;
+	}
+	else if (strlen(socket_path) > 0) {
+		int result = 0;
+		r = nvram_serve_forward(socket_path, argc - 1, argv + 1, opts.system_unlocked, &result);
+		if (r == 0) {
+			r = result;
+			goto exit;
+		}
+		/*
+		 * Only run directly without a server, a running one holds every
+		 * section lock, so clients not allowed to connect would time out.
+		 */
+		if (r != -ENOENT && r != -ECONNREFUSED) {
+			pr_err("failed forwarding to server: %s [%d]: %s\n", socket_path, -r, strerror(-r));
+			goto exit;
+		}
+		pr_dbg("no server on %s, running directly [%d]: %s\n", socket_path, -r, strerror(-r));
+		r = 0;
+	}
+
 	interface = nvram_get_interface(interface_name);
 	if (interface == NULL) {
 		fprintf(stderr, "Unresolved interface: %s\n", interface_name);
 		r = -EINVAL;
 		goto exit;
 	}
-	const char* format_selected = get_env_str(NVRAM_ENV_FORMAT, xstr(NVRAM_FORMAT_DEFAULT));
-	const char* format_name = format_override != NULL ? format_override : format_selected;
 	format = nvram_get_format(format_name);
 	if (format == NULL) {
 		fprintf(stderr, "Unresolved format: %s\n", format_name);
@@ -673,63 +2022,92 @@ int main(int argc, char** argv)
 	pr_dbg("system_read: %s\n", (opts.mode & MODE_SYSTEM_READ) == MODE_SYSTEM_READ ? "yes" : "no");
 	pr_dbg("user_write: %s\n", (opts.mode & MODE_USER_WRITE) == MODE_USER_WRITE ? "yes" : "no");
 	pr_dbg("user_read: %s\n", (opts.mode & MODE_USER_READ) == MODE_USER_READ ? "yes" : "no");
+	pr_dbg("volatile_write: %s\n", (opts.mode & MODE_VOLATILE_WRITE) == MODE_VOLATILE_WRITE ? "yes" : "no");
+	pr_dbg("volatile_read: %s\n", (opts.mode & MODE_VOLATILE_READ) == MODE_VOLATILE_READ ? "yes" : "no");
 
 	r = validate_operations(&opts);
 	if (r)
 		goto exit;
 
-	fd_lock = acquire_lockfile(NVRAM_LOCKFILE);
-	if (fd_lock < 0)
+	/* Operations can't mix reads and writes, writing user doesn't wait for system */
+	if (!opts.serve && has_operation(&opts, write_ops)) {
+		opts.mode = written_mode(&opts);
+		pr_dbg("writing sections of mode: 0x%x\n", opts.mode);
+	}
+
+	const int read_only = opts.operations != NULL && !opts.sync && !has_operation(&opts, write_ops);
+	if (!opts.serve && read_only && format->validate != NULL && lockless_enabled()
+			&& run_lockless(&opts, interface, format, &source, &system, &user, &vol, &arena, &r))
 		goto exit;
 
-	if ((opts.mode & (MODE_SYSTEM_WRITE | MODE_SYSTEM_READ)) != 0) {
-		const char *nvram_system_a = system_a_override != NULL ? system_a_override :
-										nvram_get_interface_section(interface_name, SYSTEM_A);
-		const char *nvram_system_b = system_b_override != NULL ? system_b_override :
-										nvram_get_interface_section(interface_name, SYSTEM_B);
-		pr_dbg("NVRAM_SYSTEM_A: %s\n", nvram_system_a);
-		pr_dbg("NVRAM_SYSTEM_B: %s\n", nvram_system_b);
-
-		r = format->init(&nvram_system, interface, &list_system, nvram_system_a, nvram_system_b);
-		if (r) {
+	r = acquire_locks(opts.mode, fd_locks);
+	if (r)
+		goto exit;
+	if (opts.serve || has_operation(&opts, write_ops)) {
+		r = wait_standby(opts.mode);
+		if (r)
 			goto exit;
-		}
 	}
 
-	if ((opts.mode & (MODE_USER_WRITE | MODE_USER_READ)) != 0) {
-		const char *nvram_user_a = user_a_override != NULL ? user_a_override :
-									nvram_get_interface_section(interface_name, USER_A);
-		const char *nvram_user_b = user_b_override != NULL ? user_b_override :
-									nvram_get_interface_section(interface_name, USER_B);
-		pr_dbg("NVRAM_USER_A: %s\n", nvram_user_a);
-		pr_dbg("NVRAM_USER_B: %s\n", nvram_user_b);
-		r = format->init(&nvram_user, interface, &list_user, nvram_user_a, nvram_user_b);
-		if (r) {
-			goto exit;
-		}
+	/* Single keys are found without building tables when nothing else is requested */
+	const int lookup = !opts.serve && format->lookup != NULL && lookup_only;
+	if (lookup)
+		pr_dbg("looking up keys in place\n");
+
+	r = open_stores(&opts, interface, format, &source, lookup, &nvram_system, &system, &nvram_user, &user,
+			&vol_format, &nvram_vol, &vol, &arena);
+	if (r)
+		goto exit;
+
+	if (opts.serve) {
+		r = run_server(socket_path, format, &source, nvram_system, &system, nvram_user, &user,
+				vol_format, nvram_vol, &vol);
+		goto exit;
 	}
 
-	r = execute_operations(&opts, format, nvram_system, &list_system, nvram_user, &list_user);
+	int write_performed = 0;
+	r = execute_operations(&opts, &system, &user, &vol, &write_performed);
 	if (r)
 		goto exit;
 
+	if (write_performed) {
+		const int persistent = system.written || user.written;
+		struct nvram* committed = NULL;
+		if (vol.written)
+			r = commit_volatile(vol_format, nvram_vol, &vol);
+		if (r == 0 && persistent) {
+			invalidate_snapshot((system.written ? NVRAM_SNAPSHOT_SYSTEM : 0)
+					| (user.written ? NVRAM_SNAPSHOT_USER : 0));
+			r = commit_changes(format, nvram_system, &system, nvram_user, &user, &committed);
+		}
+		flush_stats();
+		if (r)
+			goto exit;
+		/* Sections read under their lock match nvram, others are kept as published */
+		if (persistent) {
+			publish_snapshot(&source, (opts.mode & MODE_SYSTEM_READ) == MODE_SYSTEM_READ ? &system : NULL,
+					(opts.mode & MODE_USER_READ) == MODE_USER_READ ? &user : NULL);
+			complete_snapshot(interface, format, &source, fd_locks, &arena);
+		}
+		if (persistent && format->standby && standby_enabled()) {
+			start_standby(format, committed, fd_locks, committed == nvram_system ?
+					MODE_SYSTEM_READ | MODE_SYSTEM_WRITE : MODE_USER_READ | MODE_USER_WRITE);
+		}
+	}
+	print_results(&opts);
+
 	r = 0;
 
 exit:
-	lock_ret = release_lockfile(NVRAM_LOCKFILE, fd_lock);
-	/* Return release_lockfile() error unless there already is an error,
+	lock_ret = release_locks(fd_locks);
+	/* Return release_locks() error unless there already is an error,
 	 * in that case return the original error. */
 	if (r == 0 && lock_ret != 0)
 		r = lock_ret;
 
-	destroy_operations(&opts.operations);
-	if (list_system)
-		destroy_libnvram_list(&list_system);
-	if (list_user)
-		destroy_libnvram_list(&list_user);
-	if (format != NULL) {
-		format->close(&nvram_system);
-		format->close(&nvram_user);
-	}
+	close_stores(format, &nvram_system, &system, &nvram_user, &user, vol_format, &nvram_vol, &vol);
+	pr_dbg("arena: %zu allocations, %zu bytes, %zu chunks\n",
+			arena.allocations, arena.bytes, arena.chunk_allocations);
+	nvram_arena_release(&arena);
 	return -r;
 }
@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "nvram_arena.h"
+
+#define CHUNK_SIZE 4096
+/* Larger allocations get a chunk of their own to not waste remaining space */
+#define DEDICATED_LIMIT (CHUNK_SIZE / 4)
+
+struct nvram_arena_chunk {
+	struct nvram_arena_chunk* next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+static struct nvram_arena_chunk* new_chunk(struct nvram_arena* arena, size_t size)
+{
+	struct nvram_arena_chunk* chunk = malloc(sizeof(struct nvram_arena_chunk) + size);
+	if (chunk == NULL)
+		return NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	arena->chunk_allocations++;
+	return chunk;
+}
+
+void* nvram_arena_alloc(struct nvram_arena* arena, size_t size)
+{
+	const size_t align = _Alignof(max_align_t);
+	if (size > SIZE_MAX - sizeof(struct nvram_arena_chunk) - align)
+		return NULL;
+	size = size == 0 ? align : (size + align - 1) & ~(align - 1);
+
+	struct nvram_arena_chunk* chunk = arena->chunks;
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		if (size > DEDICATED_LIMIT) {
+			chunk = new_chunk(arena, size);
+			if (chunk == NULL)
+				return NULL;
+			/* Keep current chunk first as it may still have space available */
+			if (arena->chunks != NULL) {
+				chunk->next = arena->chunks->next;
+				arena->chunks->next = chunk;
+			}
+			else {
+				chunk->next = NULL;
+				arena->chunks = chunk;
+			}
+		}
+		else {
+			chunk = new_chunk(arena, CHUNK_SIZE);
+			if (chunk == NULL)
+				return NULL;
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+		}
+	}
+
+	void* ptr = (uint8_t*) chunk->data + chunk->used;
+	chunk->used += size;
+	arena->allocations++;
+	arena->bytes += size;
+	return ptr;
+}
+
+void* nvram_arena_zalloc(struct nvram_arena* arena, size_t size)
+{
+	void* ptr = nvram_arena_alloc(arena, size);
+	if (ptr != NULL)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+void* nvram_arena_buf_get(struct nvram_arena_buf* buf, struct nvram_arena* arena, size_t size)
+{
+	if (buf->data != NULL && size <= buf->cap)
+		return buf->data;
+	/* Grow geometrically so repeated growth stays within twice the largest size */
+	size_t cap = buf->cap > SIZE_MAX / 2 ? size : buf->cap * 2;
+	if (cap < size)
+		cap = size;
+	void* data = nvram_arena_alloc(arena, cap);
+	if (data == NULL)
+		return NULL;
+	buf->data = data;
+	buf->cap = cap;
+	return data;
+}
+
+void nvram_arena_release(struct nvram_arena* arena)
+{
+	struct nvram_arena_chunk* it = arena->chunks;
+	while (it != NULL) {
+		struct nvram_arena_chunk* next = it->next;
+		free(it);
+		it = next;
+	}
+	arena->chunks = NULL;
+}
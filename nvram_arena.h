@@ -0,0 +1,61 @@
+#ifndef NVRAM_ARENA_H_
+#define NVRAM_ARENA_H_
+
+#include <stddef.h>
+
+struct nvram_arena_chunk;
+
+/*
+ * Bump allocator for data living until the end of an invocation.
+ *
+ * Allocations are carved from larger chunks and can't be freed individually,
+ * all memory is returned by nvram_arena_release(). A zeroed struct is an
+ * empty arena.
+ */
+struct nvram_arena {
+	struct nvram_arena_chunk* chunks;
+	/* Number of allocations served */
+	size_t allocations;
+	/* Number of chunks allocated from the system */
+	size_t chunk_allocations;
+	/* Bytes served, including alignment padding */
+	size_t bytes;
+};
+
+/*
+ * Allocate memory aligned for any type
+ *
+ * @returns
+ *   pointer to memory
+ *   NULL if out of memory
+ */
+void* nvram_arena_alloc(struct nvram_arena* arena, size_t size);
+
+/* As nvram_arena_alloc() with memory set to zero */
+void* nvram_arena_zalloc(struct nvram_arena* arena, size_t size);
+
+/*
+ * Buffer reused across calls, e.g. a write buffer in a long running process.
+ * Only replaced from the arena when a larger size is requested. A zeroed
+ * struct is an empty buffer.
+ */
+struct nvram_arena_buf {
+	void* data;
+	size_t cap;
+};
+
+/*
+ * Get buffer of at least size bytes. Content is not kept when replaced.
+ *
+ * @returns
+ *   pointer to memory
+ *   NULL if out of memory
+ */
+void* nvram_arena_buf_get(struct nvram_arena_buf* buf, struct nvram_arena* arena, size_t size);
+
+/*
+ * Free all memory allocated from arena. The arena can be reused afterwards.
+ */
+void nvram_arena_release(struct nvram_arena* arena);
+
+#endif // NVRAM_ARENA_H_
@@ -0,0 +1,260 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "log.h"
+#include "nvram_crc32.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NVRAM_CRC32_PCLMUL 1
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#define NVRAM_CRC32_ARMV8 1
+#endif
+
+#define CRC32_POLY 0xedb88320U
+#define SLICES 8
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static uint32_t crc32_table[SLICES][256];
+
+__attribute__((constructor))
+static void crc32_init_table(void)
+{
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; ++bit)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32_POLY : crc >> 1;
+		crc32_table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; ++i) {
+		for (int slice = 1; slice < SLICES; ++slice) {
+			const uint32_t prev = crc32_table[slice - 1][i];
+			crc32_table[slice][i] = (prev >> 8) ^ crc32_table[0][prev & 0xff];
+		}
+	}
+}
+
+static uint32_t le32(const uint8_t* buf)
+{
+	return (uint32_t) buf[3] << 24 | (uint32_t) buf[2] << 16 | (uint32_t) buf[1] << 8 | buf[0];
+}
+
+static int always_supported(void)
+{
+	return 1;
+}
+
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t* buf, size_t len)
+{
+	crc = ~crc;
+	while (len--)
+		crc = crc32_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t* buf, size_t len)
+{
+	crc = ~crc;
+	while (len >= SLICES) {
+		const uint32_t one = le32(buf) ^ crc;
+		const uint32_t two = le32(buf + 4);
+		crc = crc32_table[7][one & 0xff] ^ crc32_table[6][(one >> 8) & 0xff]
+			^ crc32_table[5][(one >> 16) & 0xff] ^ crc32_table[4][one >> 24]
+			^ crc32_table[3][two & 0xff] ^ crc32_table[2][(two >> 8) & 0xff]
+			^ crc32_table[1][(two >> 16) & 0xff] ^ crc32_table[0][two >> 24];
+		buf += SLICES;
+		len -= SLICES;
+	}
+	while (len--)
+		crc = crc32_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+#ifdef NVRAM_CRC32_PCLMUL
+static int pclmul_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+/*
+ * Folding with carry-less multiplication, from "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction", Intel 2009. Constants
+ * are the bit-reflected k1-k5 and Barrett reduction values for CRC32_POLY.
+ *
+ * Operates on the non-inverted crc register. len must be at least 64 and a
+ * multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold_pclmul(uint32_t crc, const uint8_t* buf, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+	__m128i x1 = _mm_loadu_si128((const __m128i*) (buf + 0x00));
+	__m128i x2 = _mm_loadu_si128((const __m128i*) (buf + 0x10));
+	__m128i x3 = _mm_loadu_si128((const __m128i*) (buf + 0x20));
+	__m128i x4 = _mm_loadu_si128((const __m128i*) (buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+	buf += 64;
+	len -= 64;
+
+	/* Fold 4 x 128 bits in parallel */
+	while (len >= 64) {
+		const __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		const __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		const __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		const __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*) (buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*) (buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*) (buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*) (buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Fold into 128 bits */
+	__m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Fold remaining 128 bit blocks */
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*) buf)), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	/* Fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (uint32_t) _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t* buf, size_t len)
+{
+	if (len >= 64) {
+		const size_t fold_len = len & ~(size_t) 15;
+		crc = ~crc32_fold_pclmul(~crc, buf, fold_len);
+		buf += fold_len;
+		len -= fold_len;
+	}
+	return crc32_slice8(crc, buf, len);
+}
+#endif
+
+#ifdef NVRAM_CRC32_ARMV8
+static int armv8_supported(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t* buf, size_t len)
+{
+	crc = ~crc;
+	while (len > 0 && ((uintptr_t) buf & 7) != 0) {
+		crc = __crc32b(crc, *buf++);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t val = 0;
+		memcpy(&val, buf, sizeof(val));
+		crc = __crc32d(crc, val);
+		buf += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = __crc32b(crc, *buf++);
+	return ~crc;
+}
+#endif
+
+/* Ordered by preference */
+static const struct nvram_crc32_impl impls[] = {
+#ifdef NVRAM_CRC32_PCLMUL
+	{.name = "pclmul", .supported = pclmul_supported, .update = crc32_pclmul},
+#endif
+#ifdef NVRAM_CRC32_ARMV8
+	{.name = "armv8", .supported = armv8_supported, .update = crc32_armv8},
+#endif
+	{.name = "slice8", .supported = always_supported, .update = crc32_slice8},
+	{.name = "bytewise", .supported = always_supported, .update = crc32_bytewise},
+	{.name = NULL},
+};
+
+const struct nvram_crc32_impl* nvram_crc32_impls(void)
+{
+	return impls;
+}
+
+static uint32_t crc32_resolve(uint32_t crc, const uint8_t* buf, size_t len);
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static uint32_t (*crc32_update)(uint32_t crc, const uint8_t* buf, size_t len) = crc32_resolve;
+
+static uint32_t crc32_resolve(uint32_t crc, const uint8_t* buf, size_t len)
+{
+	const struct nvram_crc32_impl* impl = &impls[0];
+	while (!impl->supported())
+		impl++;
+	pr_dbg("crc32: %s\n", impl->name);
+	__atomic_store_n(&crc32_update, impl->update, __ATOMIC_RELAXED);
+	return impl->update(crc, buf, len);
+}
+
+uint32_t nvram_crc32(uint32_t crc, const uint8_t* buf, size_t len)
+{
+	return __atomic_load_n(&crc32_update, __ATOMIC_RELAXED)(crc, buf, len);
+}
+
+/* Long enough to pass the wide paths of all implementations and their tails */
+#define PROBE_SIZE 1031
+
+int nvram_crc32_matches(uint32_t (*ref)(const uint8_t* data, uint32_t len))
+{
+	// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+	static uint32_t (*checked)(const uint8_t* data, uint32_t len);
+	// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+	static int matches;
+	if (__atomic_load_n(&checked, __ATOMIC_ACQUIRE) == ref)
+		return __atomic_load_n(&matches, __ATOMIC_RELAXED);
+	uint8_t probe[PROBE_SIZE];
+	for (size_t i = 0; i < sizeof(probe); i++)
+		probe[i] = (uint8_t) (i * 131 + 7);
+	const int r = nvram_crc32(0, probe, sizeof(probe)) == ref(probe, sizeof(probe)) && nvram_crc32(0, probe, 0) == ref(probe, 0);
+	if (!r)
+		pr_err("crc32: differs from reference, using it instead\n");
+	__atomic_store_n(&matches, r, __ATOMIC_RELAXED);
+	__atomic_store_n(&checked, ref, __ATOMIC_RELEASE);
+	return r;
+}
@@ -0,0 +1,45 @@
+#ifndef NVRAM_CRC32_H_
+#define NVRAM_CRC32_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * crc32 in zlib format (reflected polynomial 0xedb88320).
+ *
+ * The fastest implementation supported by the running cpu is selected on
+ * first usage.
+ *
+ * @params
+ *   crc: crc of previous data, 0 for first block
+ *   buf: data
+ *   len: size of data
+ *
+ * @returns
+ *   updated crc
+ */
+uint32_t nvram_crc32(uint32_t crc, const uint8_t* buf, size_t len);
+
+/*
+ * Check nvram_crc32 computes the same crcs as ref, e.g. libnvram_crc32, before
+ * comparing its crcs with ones written by ref. The last result is cached.
+ *
+ * @params
+ *   ref: crc function over whole buffer
+ *
+ * @returns
+ *   1 if crcs match, 0 if not
+ */
+int nvram_crc32_matches(uint32_t (*ref)(const uint8_t* data, uint32_t len));
+
+struct nvram_crc32_impl {
+	const char* name;
+	/* Returns 1 if usable on running cpu */
+	int (*supported)(void);
+	uint32_t (*update)(uint32_t crc, const uint8_t* buf, size_t len);
+};
+
+/* Returns compiled in implementations, terminated by entry with name NULL */
+const struct nvram_crc32_impl* nvram_crc32_impls(void);
+
+#endif // NVRAM_CRC32_H_
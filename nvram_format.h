@@ -3,41 +3,90 @@
 
 #include <stdint.h>
 #include "libnvram/libnvram.h"
+#include "nvram_arena.h"
 #include "nvram_interface.h"
+#include "nvram_table.h"
 
 struct nvram;
 
 struct nvram_format {
 	/*
-	 * Initialize nvram and get list of variables
+	 * Initialize nvram and get table of variables
 	 *
 	 * @params
 	 *   nvram: private data
-	 *   list: returned list
+	 *   table: table to populate, NULL if only lookup will be used
 	 *   section_a: String (i.e. path) for section A. The pointer must remain valid during program execution.
 	 *   section_b: String (i.e. path) for section B. The pointer must remain valid during program execution.
+	 *   arena: allocator for private data and buffers. Must outlive close.
 	 *
 	 * @returns
 	 *   0 for success
 	 *   negative errno for error
 	 */
-	int (*init)(struct nvram** nvram, struct nvram_interface* interface, struct libnvram_list** list, const char* section_a, const char* section_b);
+	int (*init)(struct nvram** nvram, struct nvram_interface* interface, struct nvram_table* table, const char* section_a, const char* section_b,
+				struct nvram_arena* arena);
 
 	/*
-	 * Commit list of variables to nvram
+	 * Commit table of variables to nvram
 	 *
 	 * @params
 	 *   nvram: private data
-	 *   list: list to commit
+	 *   table: table to commit
 	 *
 	 * @returns
 	 *   0 for success
 	 *   negative errno for error
 	 */
-	int (*commit)(struct nvram* nvram, const struct libnvram_list* list);
+	int (*commit)(struct nvram* nvram, const struct nvram_table* table);
 
 	/*
-	 * Close nvram after usage
+	 * Find key in nvram without a table, i.e. when init was given none.
+	 * Optional, NULL if not supported by format.
+	 *
+	 * @params
+	 *   nvram: private data
+	 *   key, key_len: key to find
+	 *   entry: set to reference nvram data, valid until close
+	 *
+	 * @returns
+	 *   0 for success
+	 *   -ENOENT if not found
+	 *   negative errno for other errors
+	 */
+	int (*lookup)(struct nvram* nvram, const uint8_t* key, uint32_t key_len, struct libnvram_entry* entry);
+
+	/*
+	 * Prepare the section written by the next commit, i.e. erase it ahead of
+	 * time. Called after a successful commit, a later commit writes the
+	 * prepared section. Optional, NULL if not supported by format.
+	 *
+	 * @params
+	 *   nvram: private data
+	 *
+	 * @returns
+	 *   0 for success
+	 *   negative errno for error
+	 */
+	int (*standby)(struct nvram* nvram);
+
+	/*
+	 * Check that data read by init, without holding the lock, is a committed
+	 * state and wasn't changed by a concurrent commit while read. Optional,
+	 * NULL if format is only read under lock.
+	 *
+	 * @params
+	 *   nvram: private data
+	 *
+	 * @returns
+	 *   0 if data read is a committed state
+	 *   -EAGAIN if a concurrent commit may have interfered, init again
+	 *   negative errno for other errors
+	 */
+	int (*validate)(struct nvram* nvram);
+
+	/*
+	 * Close nvram after usage. Memory is returned with the arena.
 	 *
 	 * @params
 	 *   nvram: private data
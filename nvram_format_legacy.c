@@ -6,11 +6,16 @@
 #include "log.h"
 #include "nvram_format.h"
 #include "nvram_interface.h"
+#include "nvram_stats.h"
+#include "nvram_stream.h"
 #include "libnvram/libnvram.h"
 
 struct nvram {
 	struct nvram_interface* interface;
 	struct nvram_priv* interface_priv;
+	struct nvram_arena* arena;
+	/* Reused by later commits */
+	struct nvram_arena_buf wbuf;
 };
 
 static void legacy_close(struct nvram** nvram)
@@ -19,7 +24,6 @@ static void legacy_close(struct nvram** nvram)
 		struct nvram *pnvram = *nvram;
 		if (pnvram->interface_priv)
 			pnvram->interface->destroy(&pnvram->interface_priv);
-		free(*nvram);
 		*nvram = NULL;
 	}
 }
@@ -36,19 +40,17 @@ static size_t find(const uint8_t* buf, size_t buf_size, uint8_t key)
 	return NPOS;
 }
 
-/* new entry must be freed by caller */
-static int append_null_terminator(struct libnvram_entry* new, const struct libnvram_entry* from)
+/* new entry is allocated from arena */
+static int append_null_terminator(struct libnvram_entry* new, const struct libnvram_entry* from, struct nvram_arena* arena)
 {
 	new->key_len = from->key_len + 1;
-	new->key = malloc(new->key_len);
+	new->key = nvram_arena_alloc(arena, new->key_len);
 	if (new->key == NULL)
 		return -ENOMEM;
 	new->value_len = from->value_len + 1;
-	new->value = malloc(new->value_len);
-	if (new->value == NULL) {
-		free(new->key);
+	new->value = nvram_arena_alloc(arena, new->value_len);
+	if (new->value == NULL)
 		return -ENOMEM;
-	}
 	memcpy(new->key, from->key, from->key_len);
 	new->key[from->key_len] = '\0';
 	memcpy(new->value, from->value, from->value_len);
@@ -89,7 +91,7 @@ static size_t find_entry(struct libnvram_entry* entry, uint8_t* buf, size_t buf_
 	return value_end < buf_size ? value_end + 1 : value_end;
 }
 
-static int populate_list(struct libnvram_list** list, uint8_t* buf, size_t buf_size)
+static int populate_table(struct nvram_table* table, uint8_t* buf, size_t buf_size, struct nvram_arena* arena)
 {
 	size_t pos = 0;
 	struct libnvram_entry entry;
@@ -103,12 +105,10 @@ static int populate_list(struct libnvram_list** list, uint8_t* buf, size_t buf_s
 			if (r == 0)
 				return -EINVAL;
 			struct libnvram_entry new;
-			if (append_null_terminator(&new, &entry) != 0)
+			if (append_null_terminator(&new, &entry, arena) != 0)
 				return -ENOMEM;
-			const int added = libnvram_list_set(list, &new);
-			free(new.key);
-			free(new.value);
-			if (added != 0)
+			const int added = nvram_table_set(table, new.key, new.key_len, new.value, new.value_len);
+			if (added < 0)
 				return -ENOMEM;
 			pos	+= r;
 		}
@@ -116,7 +116,74 @@ static int populate_list(struct libnvram_list** list, uint8_t* buf, size_t buf_s
 	return 0;
 }
 
-static int legacy_init(struct nvram** nvram, struct nvram_interface* interface, struct libnvram_list** list, const char* section_a, const char* section_b)
+/*
+ * Populate table reading lines in windows, which grow to the longest line.
+ * Entries are null terminated in entry_buf, which grows to the longest entry.
+ */
+static int stream_table(struct nvram_table* table, struct nvram_stream* stream)
+{
+	uint8_t* entry_buf = NULL;
+	size_t entry_cap = 0;
+	struct libnvram_entry entry;
+	int r = 0;
+	for (;;) {
+		r = nvram_stream_fill(stream, 1);
+		if (r == -ENODATA) {
+			r = 0;
+			break;
+		}
+		if (r)
+			break;
+		uint8_t* data = nvram_stream_data(stream);
+		/* Skip whitespace in beginning of line and skip empty lines */
+		if (data[0] == ' ' || data[0] == '\t' || data[0] == '\n') {
+			nvram_stream_consume(stream, 1);
+			continue;
+		}
+		/* Line including newline, or rest of data if unterminated */
+		size_t newline = NPOS;
+		while ((newline = find(nvram_stream_data(stream), nvram_stream_avail(stream), '\n')) == NPOS) {
+			r = nvram_stream_fill(stream, nvram_stream_avail(stream) + 1);
+			if (r)
+				break;
+		}
+		if (r && r != -ENODATA)
+			break;
+		data = nvram_stream_data(stream);
+		const size_t line_len = newline == NPOS ? nvram_stream_avail(stream) : newline + 1;
+		if (find_entry(&entry, data, line_len) == 0) {
+			r = -EINVAL;
+			break;
+		}
+		const size_t len = (size_t) entry.key_len + entry.value_len + 2;
+		if (len > entry_cap) {
+			uint8_t* buf = realloc(entry_buf, len);
+			if (buf == NULL) {
+				r = -ENOMEM;
+				break;
+			}
+			entry_buf = buf;
+			entry_cap = len;
+		}
+		uint8_t* key = entry_buf;
+		uint8_t* value = entry_buf + entry.key_len + 1;
+		memcpy(key, entry.key, entry.key_len);
+		key[entry.key_len] = '\0';
+		memcpy(value, entry.value, entry.value_len);
+		value[entry.value_len] = '\0';
+		const int added = nvram_table_set(table, key, entry.key_len + 1, value, entry.value_len + 1);
+		if (added < 0) {
+			r = -ENOMEM;
+			break;
+		}
+		nvram_stream_consume(stream, line_len);
+	}
+	free(entry_buf);
+	return r;
+}
+
+static int legacy_init(struct nvram** nvram, struct nvram_interface* interface, struct nvram_table* table, const char* section_a, const char* section_b,
+						struct nvram_arena* arena)
 {
 	if (!section_a || strlen(section_a) < 1)
 		return -EINVAL;
@@ -124,17 +191,17 @@ static int legacy_init(struct nvram** nvram, struct nvram_interface* interface,
 		pr_err("legacy interface supports single (A) section only\n");
 		return -EINVAL;
 	}
-	struct nvram *pnvram = (struct nvram*) malloc(sizeof(struct nvram));
+	struct nvram *pnvram = (struct nvram*) nvram_arena_zalloc(arena, sizeof(struct nvram));
 	if (!pnvram)
 		return -ENOMEM;
-	memset(pnvram, 0, sizeof(struct nvram));
 	pnvram->interface = interface;
+	pnvram->arena = arena;
 
 	int r = 0;
 	uint8_t *buf = NULL;
 	size_t buf_size = 0;
 
-	r = pnvram->interface->init(&pnvram->interface_priv, section_a);
+	r = pnvram->interface->init(&pnvram->interface_priv, section_a, arena);
 	if (r) {
 		pr_err("%s: failed initializing [%d]: %s\n", section_a, -r, strerror(-r));
 		goto exit;
@@ -144,8 +211,20 @@ static int legacy_init(struct nvram** nvram, struct nvram_interface* interface,
 		pr_err("%s: failed checking size [%d]: %s\n", section_a, -r, strerror(-r));
 		goto exit;
 	}
-	if (buf_size > 0) {
-		buf = malloc(buf_size);
+	const size_t window = pnvram->interface->read_at ? nvram_stream_window() : 0;
+	if (buf_size > 0 && window > 0) {
+		struct nvram_stream stream;
+		nvram_stream_init(&stream, pnvram->interface, pnvram->interface_priv, 0, buf_size, window);
+		r = stream_table(table, &stream);
+		pr_dbg("%s: streamed %zu b in windows of %zu b, %zu b at most\n", section_a, buf_size, window, stream.cap);
+		nvram_stream_destroy(&stream);
+		if (r) {
+			pr_err("%s: failed loading [%d]: %s\n", section_a, -r, strerror(-r));
+			goto exit;
+		}
+	}
+	else if (buf_size > 0) {
+		buf = nvram_arena_alloc(arena, buf_size);
 		if (buf == NULL) {
 			r = -ENOMEM;
 			pr_err("%s: failed allocating read buffer [%d]: %s\n", section_a, -r, strerror(-r));
@@ -156,7 +235,7 @@ static int legacy_init(struct nvram** nvram, struct nvram_interface* interface,
 			pr_err("%s: failed reading [%d]: %s\n", section_a, -r, strerror(-r));
 			goto exit;
 		}
-		r = populate_list(list, buf, buf_size);
+		r = populate_table(table, buf, buf_size, arena);
 		if (r) {
 			pr_err("%s: data corrupted [%d]: %s\n", section_a, -r, strerror(-r));
 			goto exit;
@@ -168,18 +247,20 @@ static int legacy_init(struct nvram** nvram, struct nvram_interface* interface,
 exit:
 	if (r)
 		legacy_close(&pnvram);
-	if (buf)
-		free(buf);
 	return r;
 }
 
-static int legacy_commit(struct nvram* nvram, const struct libnvram_list* list)
+static int legacy_commit(struct nvram* nvram, const struct nvram_table* table)
 {
 	const char* row_format = "%s=%s\n";
 	size_t buf_size = 0;
-	/* Calculate needed buffer for entries in list */
-	for (struct libnvram_list* it = libnvram_list_begin(list); it != libnvram_list_end(list); it = libnvram_list_next(it)) {
-		const struct libnvram_entry* entry = libnvram_list_deref(it);
+	struct libnvram_entry row;
+	const struct libnvram_entry* entry = &row;
+	/* Calculate needed buffer for entries in table */
+	for (size_t i = 0; i < table->rows; ++i) {
+		if (!nvram_table_live(table, i))
+			continue;
+		nvram_table_entry(table, i, &row);
 		if (find(entry->key, entry->key_len, '=') != NPOS) {
 			pr_err("legacy format: key contains invalid character \"=\"\n");
 			return -EINVAL;
@@ -192,6 +273,10 @@ static int legacy_commit(struct nvram* nvram, const struct libnvram_list* list)
 			pr_err("legacy format: value contains invalid character \"\\n\"\n");
 			return -EINVAL;
 		}
+		if (entry->value_len == 0 || entry->value[entry->value_len - 1] != '\0') {
+			pr_err("legacy format: value not a string\n");
+			return -EINVAL;
+		}
 		/* legacy format only supports strings and all entries should be null-terminated */
 		int r = snprintf(NULL, 0, row_format, entry->key, entry->value);
 		if (r < 0)
@@ -199,7 +284,7 @@ static int legacy_commit(struct nvram* nvram, const struct libnvram_list* list)
 		buf_size += r;
 	}
 	buf_size++; // include space for null-terminator
-	uint8_t* buf = malloc(buf_size);
+	uint8_t* buf = nvram_arena_buf_get(&nvram->wbuf, nvram->arena, buf_size);
 	if (buf == NULL) {
 		pr_err("%s: failed allocating write buffer [%d]: %s\n", nvram->interface->section(nvram->interface_priv), ENOMEM, strerror(ENOMEM));
 		return -ENOMEM;
@@ -207,21 +292,26 @@ static int legacy_commit(struct nvram* nvram, const struct libnvram_list* list)
 
 	/* Write buffer */
 	size_t pos = 0;
-	for (struct libnvram_list* it = libnvram_list_begin(list); it != libnvram_list_end(list); it = libnvram_list_next(it)) {
-		const struct libnvram_entry* entry = libnvram_list_deref(it);
+	for (size_t i = 0; i < table->rows; ++i) {
+		if (!nvram_table_live(table, i))
+			continue;
+		nvram_table_entry(table, i, &row);
 		/* legacy format only supports strings and all entries should be null-terminated */
 		int r = snprintf((char*) buf + pos, buf_size - pos, row_format, entry->key, entry->value);
-		if (r < 0) {
-			free(buf);
+		if (r < 0)
 			return -EINVAL;
-		}
 		pos += r;
 	}
 
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	int r = nvram->interface->write(nvram->interface_priv, buf, buf_size - 1);
-	free(buf);
-	if (r)
+	if (r) {
 		pr_err("%s: failed writing [%d]: %s\n", nvram->interface->section(nvram->interface_priv), -r, strerror(-r));
+	}
+	else {
+		nvram_stats_commit(nvram->interface->section(nvram->interface_priv), buf_size - 1, nvram_stats_elapsed_us(&start), 0);
+	}
 	return r;
 }
 
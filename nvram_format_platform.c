@@ -3,13 +3,14 @@
 #include <string.h>
 #include <stdio.h>
 #include <inttypes.h>
-#include <limits.h>
 #include <errno.h>
 #include <assert.h>
-#include <zlib.h>
 #include "log.h"
+#include "nvram_crc32.h"
 #include "nvram_format.h"
 #include "nvram_interface.h"
+#include "nvram_value.h"
+#include "nvram_stats.h"
 #include "libnvram/libnvram.h"
 
 #ifdef NVRAM_PLATFORM_VERSION
@@ -92,6 +93,9 @@ static_assert(sizeof(struct platform_header) == PLATFORM_HEADER_SIZE, "Platform
 struct nvram {
 	struct nvram_interface* interface;
 	struct nvram_priv* interface_priv;
+	struct nvram_arena* arena;
+	/* Reused by later commits */
+	struct nvram_arena_buf wbuf;
 };
 
 static void platform_close(struct nvram** nvram)
@@ -100,7 +104,6 @@ static void platform_close(struct nvram** nvram)
 		struct nvram *pnvram = *nvram;
 		if (pnvram->interface_priv)
 			pnvram->interface->destroy(&pnvram->interface_priv);
-		free(*nvram);
 		*nvram = NULL;
 	}
 }
@@ -189,8 +192,7 @@ static int parse_header(struct platform_header* header, const uint8_t* buf, size
 
 	/* header */
 	header->hdr_crc32 = letou32(buf + offsetof(struct platform_header, hdr_crc32));
-	const uint32_t crc32_init = crc32(0L, Z_NULL, 0);
-	const uint32_t crc32_calc = crc32(crc32_init, buf, offsetof(struct platform_header, hdr_crc32));
+	const uint32_t crc32_calc = nvram_crc32(0, buf, offsetof(struct platform_header, hdr_crc32));
 	if (header->hdr_crc32 != crc32_calc)
 		return -EINVAL;
 	header->hdr_magic = letou32(buf + offsetof(struct platform_header, hdr_magic));
@@ -222,13 +224,10 @@ static int parse_header(struct platform_header* header, const uint8_t* buf, size
 	return 0;
 }
 
-static int value_to_list(const struct platform_header* header, enum field_name name, const struct field* field, struct libnvram_list** list)
+static int value_to_table(const struct platform_header* header, enum field_name name, const struct field* field, struct nvram_table* table)
 {
-	/* Well enough to hold both x32 and x64 string representations */
-	const int buf_size = 64;
-	uint8_t buf[buf_size];
+	uint8_t buf[NVRAM_VALUE_MAX_SIZE];
 	struct libnvram_entry entry;
-	int r = 0;
 	union data data;
 
 	switch (name) {
@@ -297,22 +296,12 @@ static int value_to_list(const struct platform_header* header, enum field_name n
 
 	switch (field->type) {
 	case FIELD_TYPE_U32:
-		r = snprintf((char*) buf, buf_size, "0x%" PRIx32"", data.u32);
-		if (r >= buf_size) {
-			pr_err("failed converting u32 to string\n");
-			return -EINVAL;
-		}
 		entry.value = buf;
-		entry.value_len = r + 1;
+		entry.value_len = nvram_value_encode(NVRAM_VALUE_U32, data.u32, buf);
 		break;
 	case FIELD_TYPE_U64:
-		r = snprintf((char*) buf, buf_size, "0x%" PRIx64"", data.u64);
-		if (r >= buf_size) {
-			pr_err("failed converting u64 to string\n");
-			return -EINVAL;
-		}
 		entry.value = buf;
-		entry.value_len = r + 1;
+		entry.value_len = nvram_value_encode(NVRAM_VALUE_U64, data.u64, buf);
 		break;
 	case FIELD_TYPE_STRING:
 		entry.value = (uint8_t*) data.str;
@@ -320,42 +309,42 @@ static int value_to_list(const struct platform_header* header, enum field_name n
 		break;
 	}
 
-	if (libnvram_list_set(list, &entry) != 0) {
-		pr_err("Failed adding entry to list\n");
+	if (nvram_table_set(table, entry.key, entry.key_len, entry.value, entry.value_len) < 0) {
+		pr_err("Failed adding entry to table\n");
 		return -ENOMEM;
 	}
 
 	return 0;
 }
 
-static int header_to_list_version_iterator(const struct platform_header* header, const enum field_name* version_fields, size_t len, struct libnvram_list** list)
+static int header_to_table_version_iterator(const struct platform_header* header, const enum field_name* version_fields, size_t len, struct nvram_table* table)
 {
 	for (size_t i = 0; i < len; ++i) {
 		const enum field_name field_index = version_fields[i];
 		if (ARRAY_SIZE(fields) < field_index)
 			return -EINVAL;
 		const struct field* field = &fields[field_index];
-		int r = value_to_list(header, field_index, field, list);
+		int r = value_to_table(header, field_index, field, table);
 		if (r != 0)
 			return r;
 	}
 	return 0;
 }
 
-static int header_to_list(struct libnvram_list** list, const struct platform_header* header)
+static int header_to_table(struct nvram_table* table, const struct platform_header* header)
 {
 	int r = 0;
 
 	switch (header->hdr_version) {
 	/* Example of adding header version 1:
 	 * case 1:
-	 *     r = header_to_list_version_iterator(header, version_1_fields, ARRAY_SIZE(version_1_fields), list);
+	 *     r = header_to_table_version_iterator(header, version_1_fields, ARRAY_SIZE(version_1_fields), table);
 	 *     if (r != 0)
 	 *         return r;
 	 *     [[FALLTHROUGH]
 	 * */
 	case 0:
-		r = header_to_list_version_iterator(header, version_0_fields, ARRAY_SIZE(version_0_fields), list);
+		r = header_to_table_version_iterator(header, version_0_fields, ARRAY_SIZE(version_0_fields), table);
 		if (r != 0)
 			return r;
 		break;
@@ -367,44 +356,31 @@ static int header_to_list(struct libnvram_list** list, const struct platform_hea
 	return 0;
 }
 
-static_assert(sizeof(unsigned long int) >= sizeof(uint32_t), "unsigned long smaller than uint32_t, format conversion invalid");
-static_assert(sizeof(unsigned long long int) >= sizeof(uint64_t), "unsigned long long smaller than uint64_t, format conversion invalid");
+/* Values are typed as read from header, or strings as set by user */
 static int value_to_header(struct platform_header* header, enum field_name name, const struct field* field, const struct libnvram_entry* entry)
 {
-	/* Ensure value to parse is null terminated */
-	if (entry->value[entry->value_len - 1] != '\0') {
-		pr_err("field id [%d] with key \"%s\" not of type string\n", name, field->key);
-		return -EINVAL;
-	}
 	union data data;
+	uint64_t val = 0;
 	switch (field->type) {
 	case FIELD_TYPE_U32:
-		{
-			char* endptr = NULL;
-			const unsigned long int val = strtoul((char*) entry->value, &endptr, 0);
-			if ((val == 0 && endptr == NULL)
-				|| (val == ULONG_MAX && errno == ERANGE)
-				|| (val > UINT32_MAX)) {
-				pr_err("field id [%d] with key \"%s\" not of type u32\n", name, field->key);
-				return -EINVAL;
-			}
-			data.u32 = val;
+		if (nvram_value_get(NVRAM_VALUE_U32, entry->value, entry->value_len, &val)) {
+			pr_err("field id [%d] with key \"%s\" not of type u32\n", name, field->key);
+			return -EINVAL;
 		}
+		data.u32 = val;
 		break;
 	case FIELD_TYPE_U64:
-	{
-		char* endptr = NULL;
-		const unsigned long long int val = strtoull((char*) entry->value, &endptr, 0);
-		if ((val == 0 && endptr == NULL)
-			|| (val == ULLONG_MAX && errno == ERANGE)
-			|| (val > UINT64_MAX)) {
+		if (nvram_value_get(NVRAM_VALUE_U64, entry->value, entry->value_len, &val)) {
 			pr_err("field id [%d] with key \"%s\" not of type u64\n", name, field->key);
 			return -EINVAL;
 		}
 		data.u64 = val;
-	}
 		break;
 	case FIELD_TYPE_STRING:
+		if (nvram_value_type(entry->value, entry->value_len) != NVRAM_VALUE_STRING) {
+			pr_err("field id [%d] with key \"%s\" not of type string\n", name, field->key);
+			return -EINVAL;
+		}
 		data.str = (char*) entry->value;
 		break;
 	}
@@ -478,7 +454,7 @@ static int value_to_header(struct platform_header* header, enum field_name name,
 }
 
 /* return 1 if found, 0 if not found, < 0 for error */
-static int list_to_header_version_iterator(struct platform_header* header, const enum field_name* version_fields, size_t len, const struct libnvram_entry* entry)
+static int table_to_header_version_iterator(struct platform_header* header, const enum field_name* version_fields, size_t len, const struct libnvram_entry* entry)
 {
 	for (size_t i = 0; i < len; ++i) {
 		const enum field_name field_index = version_fields[i];
@@ -495,26 +471,30 @@ static int list_to_header_version_iterator(struct platform_header* header, const
 	return 0;
 }
 
-static int list_to_header(const struct libnvram_list* list, struct platform_header* header)
+static int table_to_header(const struct nvram_table* table, struct platform_header* header)
 {
 	header->hdr_magic = HEADER_MAGIC;
 	header->hdr_version = HEADER_VERSION;
 
 	int r = 0;
+	struct libnvram_entry row;
+	const struct libnvram_entry* entry = &row;
 
-	for (struct libnvram_list* it = libnvram_list_begin(list); it != libnvram_list_end(list); it = libnvram_list_next(it)) {
-		const struct libnvram_entry* entry = libnvram_list_deref(it);
+	for (size_t i = 0; i < table->rows; ++i) {
+		if (!nvram_table_live(table, i))
+			continue;
+		nvram_table_entry(table, i, &row);
 		switch (header->hdr_version) {
 			/* Example of adding header version 1:
 			 * case 1:
-			 *     r = list_to_header_version_iterator(header, version_1_fields, ARRAY_SIZE(version_1_fields), entry);
+			 *     r = table_to_header_version_iterator(header, version_1_fields, ARRAY_SIZE(version_1_fields), entry);
 			 *     if (r < 0)
 			 *         return r;
 			 *     [[FALLTHROUGH]]
 			 *      --- Allow r == 0 if key not found, version0 will return with error if key still not resolved.
 			 * */
 		case 0:
-			r = list_to_header_version_iterator(header, version_0_fields, ARRAY_SIZE(version_0_fields), entry);
+			r = table_to_header_version_iterator(header, version_0_fields, ARRAY_SIZE(version_0_fields), entry);
 			if (r < 0)
 				return r;
 			if (r == 0) {
@@ -573,8 +553,7 @@ static int serialize_header(const struct platform_header* header, uint8_t* buf,
 	u32tole(header->config4, buf + offsetof(struct platform_header, config4));
 	u32tole(header->total_size, buf + offsetof(struct platform_header, total_size));
 
-	const uint32_t crc32_init = crc32(0L, Z_NULL, 0);
-	const uint32_t crc32_calc = crc32(crc32_init, buf, offsetof(struct platform_header, hdr_crc32));
+	const uint32_t crc32_calc = nvram_crc32(0, buf, offsetof(struct platform_header, hdr_crc32));
 	u32tole(crc32_calc, buf + offsetof(struct platform_header, hdr_crc32));
 
 	pr_dbg("header content:\n");
@@ -596,7 +575,8 @@ static int serialize_header(const struct platform_header* header, uint8_t* buf,
 	return 0;
 }
 
-static int platform_init(struct nvram** nvram, struct nvram_interface* interface, struct libnvram_list** list, const char* section_a, const char* section_b)
+static int platform_init(struct nvram** nvram, struct nvram_interface* interface, struct nvram_table* table, const char* section_a, const char* section_b,
+						struct nvram_arena* arena)
 {
 	if (!section_a || strlen(section_a) < 1)
 		return -EINVAL;
@@ -604,18 +584,18 @@ static int platform_init(struct nvram** nvram, struct nvram_interface* interface
 		pr_err("platform interface supports single (A) section only\n");
 		return -EINVAL;
 	}
-	struct nvram *pnvram = malloc(sizeof(struct nvram));
+	struct nvram *pnvram = nvram_arena_zalloc(arena, sizeof(struct nvram));
 	if (!pnvram)
 		return -ENOMEM;
-	memset(pnvram, 0, sizeof(struct nvram));
 	pnvram->interface = interface;
+	pnvram->arena = arena;
 
 	int r = 0;
 	size_t size = 0;
 	uint8_t* buf = NULL;
 	struct platform_header header;
 
-	r = pnvram->interface->init(&pnvram->interface_priv, section_a);
+	r = pnvram->interface->init(&pnvram->interface_priv, section_a, arena);
 	if (r != 0) {
 		pr_err("%s: failed initializing [%d]: %s\n", section_a, -r, strerror(-r));
 		goto exit;
@@ -628,7 +608,7 @@ static int platform_init(struct nvram** nvram, struct nvram_interface* interface
 
 	/* Can't be valid if too small */
 	if (size >= PLATFORM_HEADER_SIZE) {
-		buf = malloc(PLATFORM_HEADER_SIZE);
+		buf = nvram_arena_alloc(arena, PLATFORM_HEADER_SIZE);
 		if (buf == NULL) {
 			r = -ENOMEM;
 			goto exit;
@@ -646,9 +626,9 @@ static int platform_init(struct nvram** nvram, struct nvram_interface* interface
 				goto exit;
 			}
 			pr_dbg("header valid\n");
-			r = header_to_list(list, &header);
+			r = header_to_table(table, &header);
 			if (r) {
-				pr_err("%s: Failed populating list from header [%d]: %s\n", section_a, -r, strerror(-r))
+				pr_err("%s: Failed populating table from header [%d]: %s\n", section_a, -r, strerror(-r))
 				goto exit;
 			}
 		}
@@ -664,25 +644,23 @@ static int platform_init(struct nvram** nvram, struct nvram_interface* interface
 	r = 0;
 
 exit:
-	if (buf != NULL)
-		free(buf);
 	if (r != 0)
 		platform_close(&pnvram);
 	return r;
 }
 
-static int platform_commit(struct nvram* nvram, const struct libnvram_list* list)
+static int platform_commit(struct nvram* nvram, const struct nvram_table* table)
 {
 	if (ALLOW_WRITE != 1)
 		return -ENOTSUP;
 
 	struct platform_header header;
 	memset(&header, 0, sizeof(header));
-	int r = list_to_header(list, &header);
+	int r = table_to_header(table, &header);
 	if (r != 0)
 		return r;
 
-	uint8_t* buf = malloc(PLATFORM_HEADER_SIZE);
+	uint8_t* buf = nvram_arena_buf_get(&nvram->wbuf, nvram->arena, PLATFORM_HEADER_SIZE);
 	if (buf == NULL)
 		return -ENOMEM;
 
@@ -692,17 +670,18 @@ static int platform_commit(struct nvram* nvram, const struct libnvram_list* list
 		goto exit;
 	}
 
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	r = nvram->interface->write(nvram->interface_priv, buf, PLATFORM_HEADER_SIZE);
 	if (r != 0) {
 		pr_err("%s: Failed writing header [%d]: %s\n",
 				nvram->interface->section(nvram->interface_priv), -r, strerror(-r));
 		goto exit;
 	}
+	nvram_stats_commit(nvram->interface->section(nvram->interface_priv), PLATFORM_HEADER_SIZE, nvram_stats_elapsed_us(&start), 0);
 
 	r = 0;
 exit:
-	if (buf != NULL)
-		free(buf);
 	return r;
 }
 
@@ -3,17 +3,35 @@
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 #include "log.h"
+#include "nvram_crc32.h"
 #include "nvram_format.h"
 #include "nvram_interface.h"
+#include "nvram_stats.h"
+#include "nvram_stream.h"
 #include "libnvram/libnvram.h"
 
 struct nvram {
 	struct nvram_interface* interface;
+	struct nvram_arena* arena;
 	struct libnvram_transaction trans;
 	struct nvram_priv* priv_a;
 	struct nvram_priv* priv_b;
+	/*
+	 * Section data as read. Unmodified table rows reference the active one
+	 * so it is kept, along with the rest of the arena, until the arena is
+	 * released after close.
+	 */
+	uint8_t* buf_a;
+	size_t size_a;
+	uint8_t* buf_b;
+	size_t size_b;
+	/* Bytes sections are read at a time, 0 if they are read whole */
+	size_t window;
+	/* Serialized data for commit, reused by later commits */
+	struct nvram_arena_buf wbuf;
 };
 
 static void v2_close(struct nvram** nvram)
@@ -24,7 +42,6 @@ static void v2_close(struct nvram** nvram)
 			pnvram->interface->destroy(&pnvram->priv_a);
 		if (pnvram->priv_b)
 			pnvram->interface->destroy(&pnvram->priv_b);
-		free(*nvram);
 		*nvram = NULL;
 	}
 }
@@ -42,21 +59,20 @@ static const char* nvram_active_str(enum libnvram_active active)
 }
 
 // return 1 for valid header, 0 for invalid, negative for error
-static int read_header(struct nvram_interface* interface, struct nvram_priv* priv, struct libnvram_header* header)
+static int read_header(struct nvram_interface* interface, struct nvram_priv* priv, struct libnvram_header* header, struct nvram_arena* arena)
 {
 	const uint32_t size = libnvram_header_len();
-	uint8_t* buf = malloc(size);
+	uint8_t* buf = nvram_arena_alloc(arena, size);
 	if (buf == NULL)
 		return -ENOMEM;
 
 	int r = interface->read(priv, buf, size);
 	if (r == 0)
 		r = libnvram_validate_header(buf, size, header) == 0;
-	free(buf);
 	return r;
 }
 
-static int read_section(struct nvram_interface* interface, struct nvram_priv* priv, uint8_t** data, size_t* len)
+static int read_section(struct nvram_interface* interface, struct nvram_priv* priv, uint8_t** data, size_t* len, struct nvram_arena* arena)
 {
 	size_t total_size = 0;
 	size_t data_size = 0;
@@ -71,11 +87,11 @@ static int read_section(struct nvram_interface* interface, struct nvram_priv* pr
 	if (total_size >= libnvram_header_len()) {
 		struct libnvram_header hdr;
 		memset(&hdr, 0, sizeof(hdr));
-		r = read_header(interface, priv, &hdr);
+		r = read_header(interface, priv, &hdr, arena);
 		switch (r) {
 		case 1: /* valid */
 			data_size = libnvram_header_len() + hdr.len;
-			buf = malloc(data_size);
+			buf = nvram_arena_alloc(arena, data_size);
 			if (buf == NULL) {
 				r = -ENOMEM;
 				pr_err("%s: failed allocating %zu byte read buffer\n", interface->section(priv), data_size);
@@ -100,21 +116,22 @@ static int read_section(struct nvram_interface* interface, struct nvram_priv* pr
 	return 0;
 
 error_exit:
-	if (buf) {
-		free(buf);
-	}
 	return r;
 }
 
-static int init_and_read(struct nvram_interface* interface, struct nvram_priv** priv, const char* section, enum libnvram_active name, uint8_t** buf, size_t* size)
+static int init_and_read(struct nvram_interface* interface, struct nvram_priv** priv, const char* section, enum libnvram_active name, uint8_t** buf, size_t* size,
+						size_t window, struct nvram_arena* arena)
 {
 	pr_dbg("%s: initializing: %s\n", nvram_active_str(name), section);
-	int r = interface->init(priv, section);
+	int r = interface->init(priv, section, arena);
 	if (r) {
 		pr_err("%s: failed init [%d]: %s\n", section, -r, strerror(-r));
 		return r;
 	}
-	r = read_section(interface, *priv, buf, size);
+	/* Streamed sections are read once loaded */
+	if (window > 0)
+		return 0;
+	r = read_section(interface, *priv, buf, size, arena);
 	if (r) {
 		return r;
 	}
@@ -123,39 +140,451 @@ static int init_and_read(struct nvram_interface* interface, struct nvram_priv**
 	return 0;
 }
 
-static int v2_init(struct nvram** nvram, struct nvram_interface* interface, struct libnvram_list** list, const char* section_a, const char* section_b)
+static uint32_t get_u32le(const uint8_t* buf)
+{
+	return (uint32_t) buf[0] | (uint32_t) buf[1] << 8 | (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 24;
+}
+
+static void put_u32le(uint8_t* buf, uint32_t val)
+{
+	buf[0] = val & 0xff;
+	buf[1] = (val >> 8) & 0xff;
+	buf[2] = (val >> 16) & 0xff;
+	buf[3] = (val >> 24) & 0xff;
+}
+
+/*
+ * Header as written by libnvram_serialize: u32 le counter, u8 type and
+ * padding, u32 le data length, u32 le data crc32 and u32 le crc32 of the
+ * header before it.
+ */
+#define HDR_USER 0
+#define HDR_TYPE 4
+#define HDR_LEN 8
+#define HDR_CRC32 12
+#define HDR_HDR_CRC32 16
+#define HDR_SIZE 20
+
+/*
+ * Write header of data serialized by nvram_table_serialize, hdr len and crc32
+ * set. libnvram has no call writing a header alone, so it is checked to be
+ * read back by libnvram_validate_header as written.
+ *
+ * @returns
+ *   0 for success
+ *   -ENOTSUP if libnvram uses another header layout
+ */
+static int put_header(uint8_t* buf, struct libnvram_header* hdr)
+{
+	if (libnvram_header_len() != HDR_SIZE)
+		return -ENOTSUP;
+	memset(buf, 0, HDR_SIZE);
+	put_u32le(buf + HDR_USER, hdr->user);
+	buf[HDR_TYPE] = hdr->type;
+	put_u32le(buf + HDR_LEN, hdr->len);
+	put_u32le(buf + HDR_CRC32, hdr->crc32);
+	hdr->hdr_crc32 = nvram_crc32(0, buf, HDR_HDR_CRC32);
+	put_u32le(buf + HDR_HDR_CRC32, hdr->hdr_crc32);
+
+	struct libnvram_header read;
+	memset(&read, 0, sizeof(read));
+	if (libnvram_validate_header(buf, HDR_SIZE, &read) || read.user != hdr->user || read.type != hdr->type
+			|| read.len != hdr->len || read.crc32 != hdr->crc32)
+		return -ENOTSUP;
+	return 0;
+}
+
+/* Entry of section data, offsets from start of data */
+struct section_entry {
+	uint32_t key_off;
+	uint32_t key_len;
+	uint32_t value_off;
+	uint32_t value_len;
+};
+
+/*
+ * Get entry at pos of verified section data and advance pos past it. Same
+ * layout as produced by libnvram_serialize for LIBNVRAM_TYPE_LIST:
+ * [key_len u32 le][value_len u32 le][key][value], repeated.
+ *
+ * Returns 1 for entry, 0 at end of data, negative errno for malformed data.
+ */
+static int next_entry(const uint8_t* data, const struct libnvram_header* hdr, uint32_t* pos, struct section_entry* entry)
+{
+	const uint32_t entry_hdr_len = 2 * sizeof(uint32_t);
+	if (hdr->type != LIBNVRAM_TYPE_LIST)
+		return -EINVAL;
+	if (*pos >= hdr->len)
+		return 0;
+	if (hdr->len - *pos < entry_hdr_len)
+		return -EINVAL;
+	entry->key_len = get_u32le(data + *pos);
+	entry->value_len = get_u32le(data + *pos + sizeof(uint32_t));
+	*pos += entry_hdr_len;
+	if ((uint64_t) entry->key_len + entry->value_len > hdr->len - *pos)
+		return -EINVAL;
+	entry->key_off = *pos;
+	entry->value_off = *pos + entry->key_len;
+	*pos += entry->key_len + entry->value_len;
+	return 1;
+}
+
+/* Add rows referencing entries of verified section data in place */
+static int borrow_section(struct nvram_table* table, const uint8_t* data, const struct libnvram_header* hdr)
+{
+	struct section_entry entry;
+	uint32_t pos = 0;
+	int r = 0;
+	while ((r = next_entry(data, hdr, &pos, &entry)) == 1) {
+		r = nvram_table_borrow(table, data, entry.key_off, entry.key_len, entry.value_off, entry.value_len);
+		if (r)
+			return r;
+	}
+	return r;
+}
+
+/* Get data and header of active section, returns 0 if none is active */
+static int active_section(const struct nvram* nvram, const uint8_t** data, const struct libnvram_header** hdr)
+{
+	if ((nvram->trans.active & LIBNVRAM_ACTIVE_A) == LIBNVRAM_ACTIVE_A) {
+		*data = nvram->buf_a + libnvram_header_len();
+		*hdr = &nvram->trans.section_a.hdr;
+		return 1;
+	}
+	if ((nvram->trans.active & LIBNVRAM_ACTIVE_B) == LIBNVRAM_ACTIVE_B) {
+		*data = nvram->buf_b + libnvram_header_len();
+		*hdr = &nvram->trans.section_b.hdr;
+		return 1;
+	}
+	return 0;
+}
+
+/* Sections loaded in windows */
+enum {
+	STREAM_A,
+	STREAM_B,
+	STREAM_SECTIONS,
+};
+
+struct stream_section {
+	struct nvram_priv* priv;
+	struct libnvram_header hdr;
+	/* Sections with valid header are assumed all verified until read */
+	enum libnvram_state state;
+	/* Data has been read through and state reflects its crc */
+	int verified;
+};
+
+/* Entries wanted while streaming section data */
+struct stream_visit {
+	/* Append entries unless NULL */
+	struct nvram_table* table;
+	/* Copy entry with key to found from arena unless NULL */
+	const uint8_t* key;
+	uint32_t key_len;
+	struct libnvram_entry* found;
+	int is_found;
+};
+
+static int stream_header(struct nvram_interface* interface, struct stream_section* section, struct nvram_arena* arena)
+{
+	section->state = LIBNVRAM_STATE_UNKNOWN;
+	if (!section->priv)
+		return 0;
+
+	size_t total_size = 0;
+	int r = interface->size(section->priv, &total_size);
+	if (r) {
+		pr_err("%s: failed checking size [%d]: %s\n", interface->section(section->priv), -r, strerror(-r));
+		return r;
+	}
+	if (total_size < libnvram_header_len())
+		return 0;
+	r = read_header(interface, section->priv, &section->hdr, arena);
+	if (r < 0) {
+		pr_err("%s: failed reading and validating header: [%d]: %s\n", interface->section(section->priv), -r, strerror(-r));
+		return r;
+	}
+	if (r == 1)
+		section->state = LIBNVRAM_STATE_ALL_VERIFIED;
+	return 0;
+}
+
+/*
+ * Set up trans from headers and states of sections not read whole. libnvram
+ * picks the active section from header-only copies, with counters and types
+ * of the sections and data crcs that verify as the section data did, so
+ * streamed and whole sections are chosen alike.
+ *
+ * @returns
+ *   0 for success
+ *   -ENOTSUP if libnvram uses another header layout
+ */
+static int stream_transaction(struct libnvram_transaction* trans, const struct stream_section* sections)
+{
+	uint8_t bufs[STREAM_SECTIONS][HDR_SIZE];
+	uint32_t lens[STREAM_SECTIONS];
+	for (int i = 0; i < STREAM_SECTIONS; ++i) {
+		lens[i] = 0;
+		if (sections[i].state == LIBNVRAM_STATE_UNKNOWN)
+			continue;
+		struct libnvram_header hdr = sections[i].hdr;
+		hdr.len = 0;
+		hdr.crc32 = nvram_crc32(0, bufs[i], 0);
+		/* Section data failed its crc, so does the copy */
+		if (sections[i].state != LIBNVRAM_STATE_ALL_VERIFIED)
+			hdr.crc32 = ~hdr.crc32;
+		const int r = put_header(bufs[i], &hdr);
+		if (r)
+			return r;
+		lens[i] = HDR_SIZE;
+	}
+
+	libnvram_init_transaction(trans, bufs[STREAM_A], lens[STREAM_A], bufs[STREAM_B], lens[STREAM_B]);
+	trans->section_a.state = sections[STREAM_A].state;
+	trans->section_a.hdr = sections[STREAM_A].hdr;
+	trans->section_b.state = sections[STREAM_B].state;
+	trans->section_b.hdr = sections[STREAM_B].hdr;
+	return 0;
+}
+
+/* Returns STREAM_A or STREAM_B if active in trans, else -1 */
+static int stream_active(const struct libnvram_transaction* trans)
+{
+	if ((trans->active & LIBNVRAM_ACTIVE_A) == LIBNVRAM_ACTIVE_A)
+		return STREAM_A;
+	if ((trans->active & LIBNVRAM_ACTIVE_B) == LIBNVRAM_ACTIVE_B)
+		return STREAM_B;
+	return -1;
+}
+
+/* Pass entry at start of stream to visit, only the entry has to fit the window */
+static int visit_entry(struct nvram* nvram, struct nvram_stream* stream, uint32_t key_len, uint32_t value_len, struct stream_visit* visit)
+{
+	const size_t len = (size_t) key_len + value_len;
+	int r = 0;
+	if (visit->table) {
+		r = nvram_stream_fill(stream, len);
+		if (r)
+			return r;
+		const uint8_t* data = nvram_stream_data(stream);
+		r = nvram_table_append(visit->table, data, key_len, data + key_len, value_len);
+		if (r)
+			return r;
+		nvram_stream_consume(stream, len);
+		return 0;
+	}
+	if (visit->key && !visit->is_found && key_len == visit->key_len) {
+		r = nvram_stream_fill(stream, key_len);
+		if (r)
+			return r;
+		if (memcmp(nvram_stream_data(stream), visit->key, key_len) == 0) {
+			r = nvram_stream_fill(stream, len);
+			if (r)
+				return r;
+			uint8_t* copy = nvram_arena_alloc(nvram->arena, len > 0 ? len : 1);
+			if (copy == NULL)
+				return -ENOMEM;
+			memcpy(copy, nvram_stream_data(stream), len);
+			visit->found->key = copy;
+			visit->found->key_len = key_len;
+			visit->found->value = copy + key_len;
+			visit->found->value_len = value_len;
+			visit->is_found = 1;
+		}
+	}
+	return nvram_stream_skip(stream, len);
+}
+
+/*
+ * Read data of section through in windows, verifying its crc and passing
+ * entries to visit if given. Entries are only parsed if visit wants them.
+ *
+ * Returns 1 if crc matches, 0 if not, negative errno for error, also for
+ * malformed data with matching crc.
+ */
+static int stream_section(struct nvram* nvram, const struct stream_section* section, struct stream_visit* visit)
+{
+	const uint32_t entry_hdr_len = 2 * sizeof(uint32_t);
+	const struct libnvram_header* hdr = &section->hdr;
+	const int parse = visit && (visit->table || visit->key);
+	int malformed = parse && hdr->type != LIBNVRAM_TYPE_LIST;
+	struct nvram_stream stream;
+	nvram_stream_init(&stream, nvram->interface, section->priv, libnvram_header_len(), hdr->len, nvram->window);
+
+	int r = 0;
+	uint32_t pos = 0;
+	while (parse && !malformed && pos < hdr->len) {
+		if (hdr->len - pos < entry_hdr_len) {
+			malformed = 1;
+			break;
+		}
+		r = nvram_stream_fill(&stream, entry_hdr_len);
+		if (r)
+			goto exit;
+		const uint8_t* data = nvram_stream_data(&stream);
+		const uint32_t key_len = get_u32le(data);
+		const uint32_t value_len = get_u32le(data + sizeof(uint32_t));
+		nvram_stream_consume(&stream, entry_hdr_len);
+		pos += entry_hdr_len;
+		if ((uint64_t) key_len + value_len > hdr->len - pos) {
+			malformed = 1;
+			break;
+		}
+		r = visit_entry(nvram, &stream, key_len, value_len, visit);
+		if (r)
+			goto exit;
+		pos += key_len + value_len;
+	}
+	r = nvram_stream_drain(&stream);
+	if (r)
+		goto exit;
+	if (stream.crc != hdr->crc32)
+		r = 0;
+	else
+		r = malformed ? -EINVAL : 1;
+
+exit:
+	if (r < 0 && r != -EINVAL) {
+		pr_err("%s: failed reading [%d]: %s\n", nvram->interface->section(section->priv), -r, strerror(-r));
+	}
+	pr_dbg("%s: streamed %" PRIu32 " b in windows of %zu b, %zu b at most\n", nvram->interface->section(section->priv), hdr->len, nvram->window,
+			stream.cap);
+	nvram_stream_destroy(&stream);
+	return r;
+}
+
+/*
+ * Load sections in windows. The active section, see stream_transaction, is read
+ * into table, the other one is only read to verify its crc. Should the
+ * active one fail its crc the table is emptied and the next active one read.
+ */
+static int stream_load(struct nvram* nvram, struct nvram_table* table)
+{
+	struct stream_section sections[STREAM_SECTIONS];
+	memset(sections, 0, sizeof(sections));
+	sections[STREAM_A].priv = nvram->priv_a;
+	sections[STREAM_B].priv = nvram->priv_b;
+	int r = 0;
+	for (int i = 0; i < STREAM_SECTIONS; ++i) {
+		r = stream_header(nvram->interface, &sections[i], nvram->arena);
+		if (r)
+			return r;
+	}
+
+	for (;;) {
+		r = stream_transaction(&nvram->trans, sections);
+		if (r)
+			return r;
+		const int active = stream_active(&nvram->trans);
+		if (active < 0)
+			break;
+		/* Verify the other first so the active one is read at most once */
+		struct stream_section* other = &sections[STREAM_B - active];
+		if (other->state == LIBNVRAM_STATE_ALL_VERIFIED && !other->verified) {
+			r = stream_section(nvram, other, NULL);
+			if (r < 0)
+				return r;
+			other->verified = 1;
+			if (r == 0)
+				other->state = LIBNVRAM_STATE_HEADER_VERIFIED;
+			continue;
+		}
+		struct stream_section* section = &sections[active];
+		struct stream_visit visit;
+		memset(&visit, 0, sizeof(visit));
+		visit.table = table;
+		r = stream_section(nvram, section, &visit);
+		if (r < 0)
+			return r;
+		section->verified = 1;
+		if (r == 1)
+			break;
+		section->state = LIBNVRAM_STATE_HEADER_VERIFIED;
+		if (table) {
+			nvram_table_destroy(table);
+			memset(table, 0, sizeof(*table));
+		}
+	}
+	return 0;
+}
+
+/* Stream active section for key, entry is copied to the arena */
+static int stream_lookup(struct nvram* nvram, const uint8_t* key, uint32_t key_len, struct libnvram_entry* entry)
 {
-	uint8_t *buf_a = NULL;
-	size_t size_a = 0;
-	uint8_t *buf_b = NULL;
-	size_t size_b = 0;
-	struct nvram *pnvram = (struct nvram*) malloc(sizeof(struct nvram));
+	struct stream_section section;
+	memset(&section, 0, sizeof(section));
+	const int active = stream_active(&nvram->trans);
+	if (active == STREAM_A) {
+		section.priv = nvram->priv_a;
+		section.hdr = nvram->trans.section_a.hdr;
+	}
+	else if (active == STREAM_B) {
+		section.priv = nvram->priv_b;
+		section.hdr = nvram->trans.section_b.hdr;
+	}
+	else {
+		return -ENOENT;
+	}
+
+	struct stream_visit visit;
+	memset(&visit, 0, sizeof(visit));
+	visit.key = key;
+	visit.key_len = key_len;
+	visit.found = entry;
+	int r = stream_section(nvram, &section, &visit);
+	if (r < 0)
+		return r;
+	/* Verified when loaded, changed since */
+	if (r == 0) {
+		pr_err("%s: data changed while reading\n", nvram->interface->section(section.priv));
+		return -EIO;
+	}
+	return visit.is_found ? 0 : -ENOENT;
+}
+
+static int v2_init(struct nvram** nvram, struct nvram_interface* interface, struct nvram_table* table, const char* section_a, const char* section_b,
+					struct nvram_arena* arena)
+{
+	struct nvram *pnvram = (struct nvram*) nvram_arena_zalloc(arena, sizeof(struct nvram));
 	if (!pnvram)
 		return -ENOMEM;
-	memset(pnvram, 0, sizeof(struct nvram));
 	pnvram->interface = interface;
+	pnvram->arena = arena;
+	/* Streamed sections are chosen by libnvram from headers put_header writes */
+	/* Streamed crcs are computed by nvram_crc32, written ones by libnvram */
+	pnvram->window = interface->read_at && libnvram_header_len() == HDR_SIZE && nvram_crc32_matches(libnvram_crc32) ? nvram_stream_window() : 0;
 
 	int r = 0;
 	if (section_a && strlen(section_a) > 0) {
-		r = init_and_read(pnvram->interface, &pnvram->priv_a, section_a, LIBNVRAM_ACTIVE_A, &buf_a, &size_a);
+		r = init_and_read(pnvram->interface, &pnvram->priv_a, section_a, LIBNVRAM_ACTIVE_A, &pnvram->buf_a, &pnvram->size_a, pnvram->window, arena);
 		if (r)
 			goto exit;
 	}
 	if (section_b && strlen(section_b) > 0) {
-		r = init_and_read(pnvram->interface, &pnvram->priv_b, section_b, LIBNVRAM_ACTIVE_B, &buf_b, &size_b);
+		r = init_and_read(pnvram->interface, &pnvram->priv_b, section_b, LIBNVRAM_ACTIVE_B, &pnvram->buf_b, &pnvram->size_b, pnvram->window, arena);
 		if (r)
 			goto exit;
 	}
 
-	libnvram_init_transaction(&pnvram->trans, buf_a, size_a, buf_b, size_b);
+	if (pnvram->window > 0) {
+		r = stream_load(pnvram, table);
+		if (r) {
+			pr_err("failed loading data [%d]: %s\n", -r, strerror(-r));
+			goto exit;
+		}
+	}
+	else {
+		libnvram_init_transaction(&pnvram->trans, pnvram->buf_a, pnvram->size_a, pnvram->buf_b, pnvram->size_b);
+	}
 	pr_dbg("A: %s\n", pnvram->trans.section_a.state == LIBNVRAM_STATE_ALL_VERIFIED ? "valid" : "invalid");
 	pr_dbg("B: %s\n", pnvram->trans.section_b.state == LIBNVRAM_STATE_ALL_VERIFIED ? "valid" : "invalid");
 	pr_dbg("%s: active\n", nvram_active_str(pnvram->trans.active));
 	r = 0;
-	if ((pnvram->trans.active & LIBNVRAM_ACTIVE_A) == LIBNVRAM_ACTIVE_A)
-		r = libnvram_deserialize(list, buf_a + libnvram_header_len(), size_a - libnvram_header_len(), &pnvram->trans.section_a.hdr);
-	else if ((pnvram->trans.active & LIBNVRAM_ACTIVE_B) == LIBNVRAM_ACTIVE_B)
-		r = libnvram_deserialize(list, buf_b + libnvram_header_len(), size_b - libnvram_header_len(), &pnvram->trans.section_b.hdr);
+	const uint8_t* data = NULL;
+	const struct libnvram_header* hdr = NULL;
+	if (table && pnvram->window == 0 && active_section(pnvram, &data, &hdr))
+		r = borrow_section(table, data, hdr);
 
 	if (r) {
 		pr_err("failed deserializing data [%d]: %s\n", -r, strerror(-r));
@@ -167,79 +596,224 @@ static int v2_init(struct nvram** nvram, struct nvram_interface* interface, stru
 exit:
 	if (r)
 		v2_close(&pnvram);
-	if (buf_a)
-		free(buf_a);
-	if (buf_b)
-		free(buf_b);
 
 	return r;
 }
 
-static int write_buf(struct nvram_interface* interface, struct nvram_priv* priv, const uint8_t* buf, uint32_t size)
+/* Scan active section in place, no table needed */
+static int v2_lookup(struct nvram* nvram, const uint8_t* key, uint32_t key_len, struct libnvram_entry* entry)
+{
+	if (nvram->window > 0)
+		return stream_lookup(nvram, key, key_len, entry);
+
+	const uint8_t* data = NULL;
+	const struct libnvram_header* hdr = NULL;
+	if (!active_section(nvram, &data, &hdr))
+		return -ENOENT;
+
+	struct section_entry it;
+	uint32_t pos = 0;
+	int r = 0;
+	while ((r = next_entry(data, hdr, &pos, &it)) == 1) {
+		if (it.key_len == key_len && memcmp(data + it.key_off, key, key_len) == 0) {
+			entry->key = (uint8_t*) data + it.key_off;
+			entry->key_len = it.key_len;
+			entry->value = (uint8_t*) data + it.value_off;
+			entry->value_len = it.value_len;
+			return 0;
+		}
+	}
+	return r < 0 ? r : -ENOENT;
+}
+
+/* counter is the transaction counter of the data, kept in the header user field */
+static int write_buf(struct nvram_interface* interface, struct nvram_priv* priv, const uint8_t* buf, uint32_t size, uint32_t counter)
 {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	pr_dbg("%s: write: %" PRIu32 " b\n", interface->section(priv), size);
 	int r = interface->write(priv, buf, size);
-	if (r)
+	if (r) {
 		pr_err("%s: failed writing %" PRIu32 " b [%d]: %s\n", interface->section(priv), size, -r, strerror(-r));
+	}
+	else {
+		const long us = nvram_stats_elapsed_us(&start);
+		pr_dbg("%s: write done in %ld us\n", interface->section(priv), us);
+		nvram_stats_commit(interface->section(priv), size, us, counter);
+	}
 
 	return r;
 }
 
-static int v2_commit(struct nvram* nvram, const struct libnvram_list* list)
+/* Serialize through a libnvram_list, for headers put_header can't write */
+static int serialize_list(struct nvram* nvram, const struct nvram_table* table, uint8_t** buf, uint32_t* size,
+		struct libnvram_header* hdr)
 {
-	uint8_t *buf = NULL;
-	int r = 0;
-	uint32_t size = libnvram_serialize_size(list, LIBNVRAM_TYPE_LIST);
-
-	buf = (uint8_t*) malloc(size);
-	if (!buf) {
-		pr_err("failed allocating %" PRIu32 " byte write buffer\n", size);
+	struct libnvram_list *list = NULL;
+	int r = nvram_table_to_list(table, &list);
+	if (r) {
+		pr_err("failed creating list from table [%d]: %s\n", -r, strerror(-r));
+		goto exit;
+	}
+	*size = libnvram_serialize_size(list, LIBNVRAM_TYPE_LIST);
+	*buf = (uint8_t*) nvram_arena_buf_get(&nvram->wbuf, nvram->arena, *size);
+	if (!*buf) {
+		pr_err("failed allocating %" PRIu32 " byte write buffer\n", *size);
 		r = -ENOMEM;
 		goto exit;
 	}
+	if (!libnvram_serialize(list, *buf, *size, hdr)) {
+		pr_err("failed serializing nvram data\n");
+		r = -EINVAL;
+	}
+
+exit:
+	if (list)
+		destroy_libnvram_list(&list);
+	return r;
+}
 
+/*
+ * Serialize table into the write buffer, entries directly and the header as
+ * libnvram would, see put_header.
+ */
+static int serialize(struct nvram* nvram, const struct nvram_table* table, uint8_t** buf, uint32_t* size,
+		struct libnvram_header* hdr)
+{
+	const uint32_t header_len = libnvram_header_len();
+	const uint64_t data_len = nvram_table_serialize_size(table);
+	if (data_len > UINT32_MAX - header_len) {
+		pr_err("%" PRIu64 " bytes of entries too large for section\n", data_len);
+		return -EFBIG;
+	}
+	*size = header_len + (uint32_t) data_len;
+	*buf = (uint8_t*) nvram_arena_buf_get(&nvram->wbuf, nvram->arena, *size);
+	if (!*buf) {
+		pr_err("failed allocating %" PRIu32 " byte write buffer\n", *size);
+		return -ENOMEM;
+	}
+	nvram_table_serialize(table, *buf + header_len);
+	hdr->len = (uint32_t) data_len;
+	hdr->crc32 = nvram_crc32(0, *buf + header_len, hdr->len);
+	int r = put_header(*buf, hdr);
+	if (r == -ENOTSUP) {
+		pr_dbg("header layout of libnvram unknown, serializing list\n");
+		r = serialize_list(nvram, table, buf, size, hdr);
+	}
+	return r;
+}
+
+static int v2_commit(struct nvram* nvram, const struct nvram_table* table)
+{
+	uint8_t *buf = NULL;
+	uint32_t size = 0;
 	struct libnvram_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
 	hdr.type = LIBNVRAM_TYPE_LIST;
 	enum libnvram_operation op = libnvram_next_transaction(&nvram->trans, &hdr);
-	uint32_t bytes = libnvram_serialize(list, buf, size, &hdr);
-	if (!bytes) {
-		pr_err("failed serializing nvram data\n");
-		goto exit;
-	}
+	int r = serialize(nvram, table, &buf, &size, &hdr);
+	if (r)
+		return r;
 
 	if (!nvram->priv_a || !nvram->priv_b) {
 		// Transactional write disabled
-		r = write_buf(nvram->interface, nvram->priv_a ? nvram->priv_a : nvram->priv_b, buf, size);
+		r = write_buf(nvram->interface, nvram->priv_a ? nvram->priv_a : nvram->priv_b, buf, size, hdr.user);
 	}
 	else {
 		const int is_write_a = (op & LIBNVRAM_OPERATION_WRITE_A) == LIBNVRAM_OPERATION_WRITE_A;
 		const int is_counter_reset = (op & LIBNVRAM_OPERATION_COUNTER_RESET) == LIBNVRAM_OPERATION_COUNTER_RESET;
 		// first write
-		r = write_buf(nvram->interface, is_write_a ? nvram->priv_a : nvram->priv_b, buf, size);
+		r = write_buf(nvram->interface, is_write_a ? nvram->priv_a : nvram->priv_b, buf, size, hdr.user);
 		if (!r && is_counter_reset) {
 			// second write, if requested
-			r = write_buf(nvram->interface, is_write_a ? nvram->priv_b : nvram->priv_a, buf, size);
+			r = write_buf(nvram->interface, is_write_a ? nvram->priv_b : nvram->priv_a, buf, size, hdr.user);
 		}
 	}
 	if (r)
-		goto exit;
+		return r;
 
 	libnvram_update_transaction(&nvram->trans, op, &hdr);
 
 	pr_dbg("%s: active\n", nvram_active_str(nvram->trans.active));
 
-	r = 0;
-exit:
-	if (buf) {
-		free(buf);
+	return 0;
+}
+
+static int v2_standby(struct nvram* nvram)
+{
+	/* Only A/B keeps a valid copy while the other section is erased */
+	if (!nvram->priv_a || !nvram->priv_b || !nvram->interface->erase)
+		return 0;
+
+	struct nvram_priv* priv = NULL;
+	if ((nvram->trans.active & LIBNVRAM_ACTIVE_A) == LIBNVRAM_ACTIVE_A)
+		priv = nvram->priv_b;
+	else if ((nvram->trans.active & LIBNVRAM_ACTIVE_B) == LIBNVRAM_ACTIVE_B)
+		priv = nvram->priv_a;
+	else
+		return 0;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int r = nvram->interface->erase(priv);
+	if (r) {
+		pr_err("%s: failed erasing standby section [%d]: %s\n", nvram->interface->section(priv), -r, strerror(-r));
+	}
+	else {
+		pr_dbg("%s: standby erased in %ld us\n", nvram->interface->section(priv), nvram_stats_elapsed_us(&start));
 	}
 	return r;
 }
 
+static int same_header(const struct libnvram_header* a, const struct libnvram_header* b)
+{
+	return a->user == b->user && a->type == b->type && a->len == b->len && a->crc32 == b->crc32 && a->hdr_crc32 == b->hdr_crc32;
+}
+
+/*
+ * Commits only write the section that isn't active, so an active section
+ * read with valid crc is a committed state. Reading headers again tells if a
+ * commit completed meanwhile. Without an active section, only sections too
+ * small to hold data are certain, others may have been read while written.
+ */
+static int v2_validate(struct nvram* nvram)
+{
+	struct nvram_priv* privs[] = {nvram->priv_a, nvram->priv_b};
+	const struct libnvram_section* sections[] = {&nvram->trans.section_a, &nvram->trans.section_b};
+	const int has_active = (nvram->trans.active & (LIBNVRAM_ACTIVE_A | LIBNVRAM_ACTIVE_B)) != 0;
+	for (size_t i = 0; i < sizeof(privs) / sizeof(privs[0]); ++i) {
+		if (!privs[i])
+			continue;
+		size_t size = 0;
+		int r = nvram->interface->size(privs[i], &size);
+		if (r)
+			return r;
+		struct libnvram_header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		int valid = 0;
+		if (size >= libnvram_header_len()) {
+			if (!has_active)
+				return -EAGAIN;
+			valid = read_header(nvram->interface, privs[i], &hdr, nvram->arena);
+			if (valid < 0)
+				return valid;
+		}
+		const int was_valid = sections[i]->state != LIBNVRAM_STATE_UNKNOWN;
+		if (valid != was_valid || (valid && !same_header(&hdr, &sections[i]->hdr))) {
+			pr_dbg("%s: changed while read\n", nvram->interface->section(privs[i]));
+			return -EAGAIN;
+		}
+	}
+	return 0;
+}
+
 /* Exposed by nvram_format.c */
 struct nvram_format nvram_v2_format =
 {
 	.init = v2_init,
 	.commit = v2_commit,
+	.lookup = v2_lookup,
+	.standby = v2_standby,
+	.validate = v2_validate,
 	.close = v2_close,
 };
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "nvram_arena.h"
+#include "nvram_format.h"
+#include "nvram_interface.h"
+#include "nvram_manifest.h"
+#include "nvram_stats.h"
+#include "nvram_table.h"
+
+#define xstr(a) str(a)
+#define str(a) #a
+
+#define NVRAM_ENV_DEBUG "NVRAM_DEBUG"
+#define DIR_MODE (S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH)
+
+/*
+ * nvram-image, writes the sections of many units from a manifest for
+ * flashing in production. Images are committed by the same formats nvram
+ * uses, through the file interface, one unit per worker at a time.
+ */
+
+struct image_format {
+	const char* name;
+	/* Keys are split into system and user sections, else one image named after format holds all */
+	int split;
+	/* Both A and B sections are written */
+	int ab;
+};
+
+static const struct image_format image_formats[] = {
+	{.name = "v2", .split = 1, .ab = 1},
+	{.name = "legacy", .split = 1, .ab = 0},
+	{.name = "platform", .split = 0, .ab = 0},
+};
+
+struct build {
+	const struct image_format* image_format;
+	struct nvram_format* format;
+	struct nvram_interface* interface;
+	const char* output;
+	/* NULL if none */
+	const struct nvram_manifest_unit* template;
+	const struct nvram_manifest* manifest;
+	/* Index of next unit to build, taken by workers */
+	size_t next;
+	/* First error, stops workers */
+	int error;
+};
+
+static void print_usage(void)
+{
+	printf("nvram-image, nvram images for provisioning, Data Respons Solutions AB\n");
+	printf("Version:   %s\n", xstr(SRC_VERSION));
+	printf("\n");
+
+	printf("Usage:   nvram-image [OPTION] MANIFEST\n");
+	printf("Example: nvram-image -t template -o images units.csv\n");
+	printf("\n");
+	printf("Writes the sections of each unit in MANIFEST to OUTPUT/UNIT:\n");
+	printf("  v2:        system_a system_b user_a user_b\n");
+	printf("  legacy:    system_a user_a\n");
+	printf("  platform:  platform\n");
+	printf("Keys prefixed \"%s\" go to system, others to user.\n", xstr(NVRAM_SYSTEM_PREFIX));
+	printf("\n");
+
+	printf("Options:\n");
+	printf("  -t, --template FILE  KEY=VALUE lines set for all units, MANIFEST takes precedence\n");
+	printf("  -o, --output DIR     directory for units, default current directory\n");
+	printf("  -f, --format FORMAT  v2, legacy or platform, default v2\n");
+	printf("  -j, --jobs N         units written in parallel, default online cpus\n");
+	printf("  -h, --help           show this help\n");
+	printf("\n");
+
+	printf("MANIFEST is CSV with a header row holding a unit column, or JSON if it\n");
+	printf("ends in .json, an array of objects with a unit member.\n");
+}
+
+/* Keys with the system prefix go to system, all do if there is no prefix */
+static int is_system_key(const char* key)
+{
+	const char* prefix = xstr(NVRAM_SYSTEM_PREFIX);
+	return strncmp(key, prefix, strlen(prefix)) == 0;
+}
+
+static int add_pairs(const struct build* build, const struct nvram_manifest_unit* unit,
+		struct nvram_table* system, struct nvram_table* user)
+{
+	for (size_t i = 0; i < unit->pairs_len; ++i) {
+		const struct nvram_manifest_pair* pair = &unit->pairs[i];
+		struct nvram_table* table = !build->image_format->split || is_system_key(pair->key) ? system : user;
+		const int r = nvram_table_set(table, (const uint8_t*) pair->key, strlen(pair->key) + 1,
+				(const uint8_t*) pair->value, strlen(pair->value) + 1);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+/* Commit table to dir/name, or dir/name_a and dir/name_b for sections */
+static int write_image(const struct build* build, const char* dir, const char* name, const struct nvram_table* table,
+		struct nvram_arena* arena)
+{
+	/* Room for separator, section suffix and terminator */
+	const size_t len = strlen(dir) + strlen(name) + 4;
+	char* path_a = nvram_arena_alloc(arena, len);
+	char* path_b = NULL;
+	if (!path_a)
+		return -ENOMEM;
+	snprintf(path_a, len, build->image_format->split ? "%s/%s_a" : "%s/%s", dir, name);
+	if (build->image_format->ab) {
+		path_b = nvram_arena_alloc(arena, len);
+		if (!path_b)
+			return -ENOMEM;
+		snprintf(path_b, len, "%s/%s_b", dir, name);
+	}
+
+	/* Formats continue the transaction of existing sections, start over */
+	const char* paths[] = {path_a, path_b};
+	for (size_t i = 0; i < sizeof(paths) / sizeof(*paths); ++i) {
+		if (paths[i] && unlink(paths[i]) && errno != ENOENT) {
+			const int r = -errno;
+			pr_err("failed removing %s [%d]: %s\n", paths[i], -r, strerror(-r));
+			return r;
+		}
+	}
+
+	struct nvram* nvram = NULL;
+	int r = build->format->init(&nvram, build->interface, NULL, path_a, path_b, arena);
+	if (r)
+		return r;
+	r = build->format->commit(nvram, table);
+	/* Second commit writes the other section, so both hold the data when flashed */
+	if (r == 0 && build->image_format->ab)
+		r = build->format->commit(nvram, table);
+	build->format->close(&nvram);
+	if (r)
+		pr_err("%s: failed writing image [%d]: %s\n", path_a, -r, strerror(-r));
+	return r;
+}
+
+static int build_unit(const struct build* build, const struct nvram_manifest_unit* unit)
+{
+	/* Memory for this unit, released when it is written */
+	struct nvram_arena arena;
+	memset(&arena, 0, sizeof(arena));
+	struct nvram_table system;
+	memset(&system, 0, sizeof(system));
+	struct nvram_table user;
+	memset(&user, 0, sizeof(user));
+	int r = 0;
+
+	const size_t len = strlen(build->output) + strlen(unit->name) + 2;
+	char* dir = nvram_arena_alloc(&arena, len);
+	if (!dir) {
+		r = -ENOMEM;
+		goto exit;
+	}
+	snprintf(dir, len, "%s/%s", build->output, unit->name);
+	if (mkdir(dir, DIR_MODE) && errno != EEXIST) {
+		r = -errno;
+		pr_err("failed creating %s [%d]: %s\n", dir, -r, strerror(-r));
+		goto exit;
+	}
+
+	/* Manifest values take precedence over template */
+	if (build->template)
+		r = add_pairs(build, build->template, &system, &user);
+	if (r == 0)
+		r = add_pairs(build, unit, &system, &user);
+	if (r) {
+		pr_err("%s: failed adding attributes [%d]: %s\n", unit->name, -r, strerror(-r));
+		goto exit;
+	}
+
+	if (build->image_format->split) {
+		r = write_image(build, dir, "system", &system, &arena);
+		if (r == 0)
+			r = write_image(build, dir, "user", &user, &arena);
+	}
+	else {
+		r = write_image(build, dir, build->image_format->name, &system, &arena);
+	}
+
+exit:
+	/* Images aren't commits on a device, and their paths go with the arena */
+	nvram_stats_discard();
+	nvram_table_destroy(&system);
+	nvram_table_destroy(&user);
+	nvram_arena_release(&arena);
+	return r;
+}
+
+static void set_error(struct build* build, int error)
+{
+	int expected = 0;
+	__atomic_compare_exchange_n(&build->error, &expected, error, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void* worker(void* ctx)
+{
+	struct build* build = ctx;
+	while (!__atomic_load_n(&build->error, __ATOMIC_RELAXED)) {
+		const size_t i = __atomic_fetch_add(&build->next, 1, __ATOMIC_RELAXED);
+		if (i >= build->manifest->units_len)
+			break;
+		const int r = build_unit(build, &build->manifest->units[i]);
+		if (r)
+			set_error(build, r);
+	}
+	return NULL;
+}
+
+static long online_cpus(void)
+{
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? cpus : 1;
+}
+
+/* Returns NULL if not found */
+static const struct image_format* find_image_format(const char* name)
+{
+	for (size_t i = 0; i < sizeof(image_formats) / sizeof(*image_formats); ++i) {
+		if (!strcmp(image_formats[i].name, name))
+			return &image_formats[i];
+	}
+	return NULL;
+}
+
+/* NOLINTNEXTLINE(readability-function-cognitive-complexity) */
+int main(int argc, char** argv)
+{
+	/* Memory for manifest and template, released in one go at exit */
+	struct nvram_arena arena;
+	memset(&arena, 0, sizeof(arena));
+	struct nvram_manifest manifest;
+	memset(&manifest, 0, sizeof(manifest));
+	struct nvram_manifest_unit template;
+	memset(&template, 0, sizeof(template));
+	const char* template_path = NULL;
+	const char* manifest_path = NULL;
+	const char* output = ".";
+	const char* format_name = "v2";
+	long jobs = online_cpus();
+	pthread_t* threads = NULL;
+	int r = 0;
+
+	const char* debug = getenv(NVRAM_ENV_DEBUG);
+	if (debug && strtol(debug, NULL, 10))
+		enable_debug();
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		if (!strcmp("-h", arg) || !strcmp("--help", arg)) {
+			print_usage();
+			goto exit;
+		}
+		else if (!strcmp("-t", arg) || !strcmp("--template", arg)
+				|| !strcmp("-o", arg) || !strcmp("--output", arg)
+				|| !strcmp("-f", arg) || !strcmp("--format", arg)
+				|| !strcmp("-j", arg) || !strcmp("--jobs", arg)) {
+			if (++i >= argc) {
+				fprintf(stderr, "Too few arguments for %s\n", arg);
+				r = -EINVAL;
+				goto exit;
+			}
+			if (arg[1] == 't' || !strcmp("--template", arg)) {
+				template_path = argv[i];
+			}
+			else if (arg[1] == 'o' || !strcmp("--output", arg)) {
+				output = argv[i];
+			}
+			else if (arg[1] == 'f' || !strcmp("--format", arg)) {
+				format_name = argv[i];
+			}
+			else {
+				char* end = NULL;
+				jobs = strtol(argv[i], &end, 10);
+				if (*argv[i] == '\0' || *end != '\0' || jobs < 1) {
+					fprintf(stderr, "invalid number of jobs: %s\n", argv[i]);
+					r = -EINVAL;
+					goto exit;
+				}
+			}
+		}
+		else if (arg[0] == '-' && arg[1] != '\0') {
+			fprintf(stderr, "unknown argument: %s\n", arg);
+			r = -EINVAL;
+			goto exit;
+		}
+		else if (manifest_path) {
+			fprintf(stderr, "only one manifest supported: %s\n", arg);
+			r = -EINVAL;
+			goto exit;
+		}
+		else {
+			manifest_path = arg;
+		}
+	}
+	if (!manifest_path) {
+		fprintf(stderr, "no manifest given, see --help\n");
+		r = -EINVAL;
+		goto exit;
+	}
+
+	const struct image_format* image_format = find_image_format(format_name);
+	struct nvram_format* format = nvram_get_format(format_name);
+	if (image_format == NULL || format == NULL) {
+		fprintf(stderr, "Unresolved format: %s\n", format_name);
+		r = -EINVAL;
+		goto exit;
+	}
+	struct nvram_interface* interface = nvram_get_interface("file");
+	if (interface == NULL) {
+		fprintf(stderr, "Unresolved interface: file\n");
+		r = -EINVAL;
+		goto exit;
+	}
+
+	if (template_path) {
+		r = nvram_manifest_read_template(template_path, &template, &arena);
+		if (r)
+			goto exit;
+	}
+	r = nvram_manifest_read(manifest_path, &manifest, &arena);
+	if (r)
+		goto exit;
+	if (mkdir(output, DIR_MODE) && errno != EEXIST) {
+		r = -errno;
+		pr_err("failed creating %s [%d]: %s\n", output, -r, strerror(-r));
+		goto exit;
+	}
+
+	struct build build;
+	memset(&build, 0, sizeof(build));
+	build.image_format = image_format;
+	build.format = format;
+	build.interface = interface;
+	build.output = output;
+	build.template = template_path ? &template : NULL;
+	build.manifest = &manifest;
+
+	if ((size_t) jobs > manifest.units_len)
+		jobs = (long) manifest.units_len;
+	threads = calloc(jobs > 0 ? jobs : 1, sizeof(*threads));
+	if (!threads) {
+		r = -ENOMEM;
+		goto exit;
+	}
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	long started = 0;
+	for (; started < jobs; ++started) {
+		const int err = pthread_create(&threads[started], NULL, worker, &build);
+		if (err) {
+			pr_err("failed starting worker [%d]: %s\n", err, strerror(err));
+			set_error(&build, -err);
+			break;
+		}
+	}
+	for (long i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	r = build.error;
+	pr_dbg("%zu units by %ld workers in %ld us\n", manifest.units_len, started, nvram_stats_elapsed_us(&start));
+
+exit:
+	free(threads);
+	nvram_manifest_destroy(&manifest);
+	pr_dbg("arena: %zu allocations, %zu bytes, %zu chunks\n",
+			arena.allocations, arena.bytes, arena.chunk_allocations);
+	nvram_arena_release(&arena);
+	return -r;
+}
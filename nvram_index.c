@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "nvram_index.h"
+
+static int keycmp(const uint8_t* key1, uint32_t key1_len, const uint8_t* key2, uint32_t key2_len)
+{
+	const uint32_t len = key1_len < key2_len ? key1_len : key2_len;
+	const int r = memcmp(key1, key2, len);
+	if (r != 0)
+		return r;
+	if (key1_len == key2_len)
+		return 0;
+	return key1_len < key2_len ? -1 : 1;
+}
+
+static int indexcmp(const void* a, const void* b)
+{
+	const struct nvram_index_key* key1 = a;
+	const struct nvram_index_key* key2 = b;
+	return keycmp(key1->key, key1->key_len, key2->key, key2->key_len);
+}
+
+int nvram_index_build(struct nvram_index* index, const struct nvram_table* table, struct nvram_arena* arena)
+{
+	index->keys = NULL;
+	index->len = 0;
+	if (table->live == 0)
+		return 0;
+
+	index->keys = nvram_arena_alloc(arena, table->live * sizeof(*index->keys));
+	if (index->keys == NULL)
+		return -ENOMEM;
+	for (size_t row = 0; row < table->rows; ++row) {
+		if (!nvram_table_live(table, row))
+			continue;
+		struct nvram_index_key* key = &index->keys[index->len++];
+		struct libnvram_entry entry;
+		nvram_table_entry(table, row, &entry);
+		key->key = entry.key;
+		key->key_len = entry.key_len;
+		key->row = row;
+	}
+
+	qsort(index->keys, index->len, sizeof(*index->keys), indexcmp);
+	return 0;
+}
+
+size_t nvram_index_lower_bound(const struct nvram_index* index, const uint8_t* key, uint32_t key_len)
+{
+	size_t low = 0;
+	size_t high = index->len;
+	while (low < high) {
+		const size_t mid = low + (high - low) / 2;
+		const struct nvram_index_key* it = &index->keys[mid];
+		if (keycmp(it->key, it->key_len, key, key_len) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+int nvram_index_has_prefix(const struct nvram_index* index, size_t pos, const uint8_t* prefix, uint32_t prefix_len)
+{
+	const struct nvram_index_key* it = &index->keys[pos];
+	return it->key_len >= prefix_len && memcmp(it->key, prefix, prefix_len) == 0;
+}
@@ -0,0 +1,54 @@
+#ifndef NVRAM_INDEX_H_
+#define NVRAM_INDEX_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "nvram_arena.h"
+#include "nvram_table.h"
+
+struct nvram_index_key {
+	const uint8_t* key;
+	uint32_t key_len;
+	/* row in table */
+	size_t row;
+};
+
+/*
+ * Sorted key index over the live rows of a table.
+ *
+ * Keys are ordered bytewise with a shorter key sorting first when it is a
+ * prefix of a longer one, which for null-terminated keys equals strcmp order.
+ * The index references memory owned by the table and is invalidated by any
+ * modification of it.
+ */
+struct nvram_index {
+	struct nvram_index_key* keys;
+	size_t len;
+};
+
+/*
+ * Build index from table
+ *
+ * @params
+ *   index: index to populate
+ *   table: table to index
+ *   arena: allocator for index memory
+ *
+ * @returns
+ *   0 for success
+ *   negative errno for error
+ */
+int nvram_index_build(struct nvram_index* index, const struct nvram_table* table, struct nvram_arena* arena);
+
+/*
+ * Find first position with key not ordered before given key
+ *
+ * @returns
+ *   position in index, index->len if all keys are ordered before key
+ */
+size_t nvram_index_lower_bound(const struct nvram_index* index, const uint8_t* key, uint32_t key_len);
+
+/* Returns 1 if key at position starts with prefix, else 0 */
+int nvram_index_has_prefix(const struct nvram_index* index, size_t pos, const uint8_t* prefix, uint32_t prefix_len);
+
+#endif // NVRAM_INDEX_H_
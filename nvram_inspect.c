@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "nvram_arena.h"
+#include "nvram_format.h"
+#include "nvram_interface.h"
+#include "nvram_scan.h"
+#include "nvram_stats.h"
+#include "nvram_table.h"
+#include "nvram_value.h"
+
+#define xstr(a) str(a)
+#define str(a) #a
+
+#define NVRAM_ENV_DEBUG "NVRAM_DEBUG"
+#define DEFAULT_ALIGN 4
+/* Dumps smaller than this per thread are not split further */
+#define MIN_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * nvram-inspect, lists v2 and platform sections found in raw dumps of flash
+ * or disks. The dump is mapped and split in chunks scanned by one thread
+ * each, sections found are decoded by the formats nvram uses.
+ */
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+/* Dump read by the dump interface */
+static const uint8_t* dump_buf;
+static size_t dump_size;
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Read only interface over the dump, section is the offset of the section */
+struct nvram_priv {
+	const char* section;
+	size_t offset;
+};
+
+static int dump_init(struct nvram_priv** priv, const char* section, struct nvram_arena* arena)
+{
+	char* end = NULL;
+	errno = 0;
+	const unsigned long long offset = strtoull(section, &end, 0);
+	if (errno || *section == '\0' || *end != '\0' || offset > dump_size)
+		return -EINVAL;
+	struct nvram_priv* pnvram = nvram_arena_zalloc(arena, sizeof(struct nvram_priv));
+	if (pnvram == NULL)
+		return -ENOMEM;
+	pnvram->section = section;
+	pnvram->offset = (size_t) offset;
+	*priv = pnvram;
+	return 0;
+}
+
+static void dump_destroy(struct nvram_priv** priv)
+{
+	*priv = NULL;
+}
+
+static int dump_size_of(const struct nvram_priv* priv, size_t* size)
+{
+	*size = dump_size - priv->offset;
+	return 0;
+}
+
+/* Offsets are from the section, as for the file interface */
+static int dump_read_at(struct nvram_priv* priv, uint8_t* buf, size_t size, size_t offset)
+{
+	const size_t available = dump_size - priv->offset;
+	if (offset > available || size > available - offset)
+		return -EIO;
+	memcpy(buf, dump_buf + priv->offset + offset, size);
+	return 0;
+}
+
+static int dump_read(struct nvram_priv* priv, uint8_t* buf, size_t size)
+{
+	return dump_read_at(priv, buf, size, 0);
+}
+
+static int dump_write(struct nvram_priv* priv, const uint8_t* buf, size_t size)
+{
+	(void) priv;
+	(void) buf;
+	(void) size;
+	return -EROFS;
+}
+
+static const char* dump_section(const struct nvram_priv* priv)
+{
+	return priv->section;
+}
+
+static struct nvram_interface dump_interface = {
+	.init = dump_init,
+	.destroy = dump_destroy,
+	.size = dump_size_of,
+	.read = dump_read,
+	.read_at = dump_read_at,
+	.write = dump_write,
+	.erase = NULL,
+	.section = dump_section,
+};
+
+static void print_usage(void)
+{
+	printf("nvram-inspect, nvram sections in raw dumps, Data Respons Solutions AB\n");
+	printf("Version:   %s\n", xstr(SRC_VERSION));
+	printf("\n");
+
+	printf("Usage:   nvram-inspect [OPTION] DUMP\n");
+	printf("Example: nvram-inspect --decode flash.bin\n");
+	printf("\n");
+	printf("Lists v2 and platform sections in DUMP as:\n");
+	printf("  OFFSET FORMAT size=SIZE [counter=COUNTER] data=valid|invalid\n");
+	printf("\n");
+
+	printf("Options:\n");
+	printf("  -d, --decode     print attributes of sections with valid data\n");
+	printf("  -a, --align N    check offsets that are multiples of N, default %d\n", DEFAULT_ALIGN);
+	printf("  -j, --jobs N     threads scanning, default online cpus\n");
+	printf("  -h, --help       show this help\n");
+}
+
+static long online_cpus(void)
+{
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? cpus : 1;
+}
+
+struct chunk {
+	pthread_t thread;
+	size_t begin;
+	size_t end;
+	size_t align;
+	struct nvram_scan_sections sections;
+	int error;
+};
+
+static void* worker(void* ctx)
+{
+	struct chunk* chunk = ctx;
+	chunk->error = nvram_scan(dump_buf, dump_size, chunk->begin, chunk->end, chunk->align, &chunk->sections);
+	return NULL;
+}
+
+static const char* type_name(enum nvram_scan_type type)
+{
+	return type == NVRAM_SCAN_PLATFORM ? "platform" : "v2";
+}
+
+static int decode(const struct nvram_scan_section* section)
+{
+	struct nvram_arena arena;
+	memset(&arena, 0, sizeof(arena));
+	struct nvram_table table;
+	memset(&table, 0, sizeof(table));
+	struct nvram* nvram = NULL;
+	char offset[32];
+	snprintf(offset, sizeof(offset), "0x%zx", section->offset);
+
+	const char* format_name = type_name(section->type);
+	struct nvram_format* format = nvram_get_format(format_name);
+	if (format == NULL) {
+		fprintf(stderr, "%s: format %s not compiled in, not decoded\n", offset, format_name);
+		return 0;
+	}
+	int r = format->init(&nvram, &dump_interface, &table, offset, NULL, &arena);
+	if (r) {
+		pr_err("%s: failed decoding [%d]: %s\n", offset, -r, strerror(-r));
+		goto exit;
+	}
+	for (size_t row = 0; row < table.rows; ++row) {
+		if (!nvram_table_live(&table, row))
+			continue;
+		struct libnvram_entry entry;
+		nvram_table_entry(&table, row, &entry);
+		printf("  ");
+		nvram_value_print(entry.key, entry.key_len);
+		printf("=");
+		nvram_value_print(entry.value, entry.value_len);
+		printf("\n");
+	}
+
+exit:
+	if (nvram)
+		format->close(&nvram);
+	nvram_table_destroy(&table);
+	nvram_arena_release(&arena);
+	return r;
+}
+
+static int print_section(const struct nvram_scan_section* section, int decode_data)
+{
+	printf("0x%08zx %s size=%zu", section->offset, type_name(section->type), section->size);
+	if (section->type == NVRAM_SCAN_V2)
+		printf(" counter=%" PRIu32, section->counter);
+	printf(" data=%s\n", section->data_valid ? "valid" : "invalid");
+	return decode_data && section->data_valid ? decode(section) : 0;
+}
+
+/* Map path read only, size 0 and NULL for empty dumps */
+static int map_dump(const char* path, const uint8_t** buf, size_t* size)
+{
+	int r = 0;
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		r = -errno;
+		pr_err("failed opening %s [%d]: %s\n", path, -r, strerror(-r));
+		return r;
+	}
+	/* Block devices report no size in st_size */
+	const off_t end = lseek(fd, 0, SEEK_END);
+	if (end < 0) {
+		r = -errno;
+		pr_err("failed checking size of %s [%d]: %s\n", path, -r, strerror(-r));
+		goto exit;
+	}
+	*size = (size_t) end;
+	*buf = NULL;
+	if (*size == 0)
+		goto exit;
+	void* map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		r = -errno;
+		pr_err("failed mapping %s [%d]: %s\n", path, -r, strerror(-r));
+		goto exit;
+	}
+	madvise(map, *size, MADV_SEQUENTIAL);
+	*buf = map;
+
+exit:
+	close(fd);
+	return r;
+}
+
+static int parse_number(const char* arg, const char* what, long* val)
+{
+	char* end = NULL;
+	*val = strtol(arg, &end, 0);
+	if (*arg == '\0' || *end != '\0' || *val < 1) {
+		fprintf(stderr, "invalid %s: %s\n", what, arg);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* NOLINTNEXTLINE(readability-function-cognitive-complexity) */
+int main(int argc, char** argv)
+{
+	const char* path = NULL;
+	int decode_data = 0;
+	long align = DEFAULT_ALIGN;
+	long jobs = online_cpus();
+	struct chunk* chunks = NULL;
+	long started = 0;
+	int r = 0;
+
+	const char* debug = getenv(NVRAM_ENV_DEBUG);
+	if (debug && strtol(debug, NULL, 10))
+		enable_debug();
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		if (!strcmp("-h", arg) || !strcmp("--help", arg)) {
+			print_usage();
+			goto exit;
+		}
+		else if (!strcmp("-d", arg) || !strcmp("--decode", arg)) {
+			decode_data = 1;
+		}
+		else if (!strcmp("-a", arg) || !strcmp("--align", arg)
+				|| !strcmp("-j", arg) || !strcmp("--jobs", arg)) {
+			if (++i >= argc) {
+				fprintf(stderr, "Too few arguments for %s\n", arg);
+				r = -EINVAL;
+				goto exit;
+			}
+			if (arg[1] == 'a' || !strcmp("--align", arg)) {
+				r = parse_number(argv[i], "alignment", &align);
+				if (!r && (align & (align - 1))) {
+					fprintf(stderr, "alignment not a power of two: %s\n", argv[i]);
+					r = -EINVAL;
+				}
+			}
+			else {
+				r = parse_number(argv[i], "number of jobs", &jobs);
+			}
+			if (r)
+				goto exit;
+		}
+		else if (arg[0] == '-' && arg[1] != '\0') {
+			fprintf(stderr, "unknown argument: %s\n", arg);
+			r = -EINVAL;
+			goto exit;
+		}
+		else if (path) {
+			fprintf(stderr, "only one dump supported: %s\n", arg);
+			r = -EINVAL;
+			goto exit;
+		}
+		else {
+			path = arg;
+		}
+	}
+	if (!path) {
+		fprintf(stderr, "no dump given, see --help\n");
+		r = -EINVAL;
+		goto exit;
+	}
+
+	r = map_dump(path, &dump_buf, &dump_size);
+	if (r || dump_size == 0)
+		goto exit;
+
+	const size_t max_jobs = (dump_size + MIN_CHUNK_SIZE - 1) / MIN_CHUNK_SIZE;
+	if ((size_t) jobs > max_jobs)
+		jobs = (long) max_jobs;
+	chunks = calloc(jobs, sizeof(*chunks));
+	if (!chunks) {
+		r = -ENOMEM;
+		goto exit;
+	}
+	const size_t chunk_size = dump_size / jobs;
+	for (long i = 0; i < jobs; ++i) {
+		chunks[i].begin = chunk_size * i;
+		chunks[i].end = i == jobs - 1 ? dump_size : chunk_size * (i + 1);
+		chunks[i].align = (size_t) align;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (; started < jobs; ++started) {
+		const int err = pthread_create(&chunks[started].thread, NULL, worker, &chunks[started]);
+		if (err) {
+			pr_err("failed starting worker [%d]: %s\n", err, strerror(err));
+			r = -err;
+			break;
+		}
+	}
+	for (long i = 0; i < started; ++i) {
+		pthread_join(chunks[i].thread, NULL);
+		if (!r)
+			r = chunks[i].error;
+	}
+	pr_dbg("%zu bytes by %ld threads in %ld us (%s)\n", dump_size, started, nvram_stats_elapsed_us(&start), nvram_scan_impl_name());
+	if (r) {
+		pr_err("failed scanning %s [%d]: %s\n", path, -r, strerror(-r));
+		goto exit;
+	}
+
+	/* Chunks are in order of offset, as are the sections of each */
+	for (long i = 0; i < started && !r; ++i) {
+		for (size_t j = 0; j < chunks[i].sections.len && !r; ++j)
+			r = print_section(&chunks[i].sections.sections[j], decode_data);
+	}
+
+exit:
+	for (long i = 0; i < started; ++i)
+		nvram_scan_destroy(&chunks[i].sections);
+	free(chunks);
+	if (dump_buf)
+		munmap((void*) dump_buf, dump_size);
+	return -r;
+}
@@ -1,6 +1,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
 #include "nvram_interface.h"
 
 #define xstr(a) str(a)
@@ -95,3 +97,39 @@ const char* nvram_get_interface_section(const char* interface_name, enum section
 	return NULL;
 }
 
+
+int nvram_pread_all(int fd, uint8_t* buf, size_t size, off_t offset)
+{
+	while (size > 0) {
+		ssize_t bytes = pread(fd, buf, size, offset);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (bytes == 0)
+			return -EIO;
+		buf += bytes;
+		size -= bytes;
+		offset += bytes;
+	}
+	return 0;
+}
+
+int nvram_pwrite_all(int fd, const uint8_t* buf, size_t size, off_t offset)
+{
+	while (size > 0) {
+		ssize_t bytes = pwrite(fd, buf, size, offset);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (bytes == 0)
+			return -EIO;
+		buf += bytes;
+		size -= bytes;
+		offset += bytes;
+	}
+	return 0;
+}
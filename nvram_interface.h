@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/types.h>
+#include "nvram_arena.h"
 
 /* Private data for usage by interface */
 struct nvram_priv;
@@ -15,15 +17,17 @@ struct nvram_interface {
 	 *   priv: private data
 	 *   section: String (i.e. path) for section A. The pointer must remain valid until
 	 *            nvram_interface_destroy is called.
+	 *   arena: allocator for private data. Must outlive destroy.
 	 *
 	 * @returns
 	 *   0 for success
 	 *   negative errno for error
 	 */
-	int (*init)(struct nvram_priv** priv, const char* section);
+	int (*init)(struct nvram_priv** priv, const char* section, struct nvram_arena* arena);
 
 	/*
-	 * Free allocated resources
+	 * Release resources held, such as open file descriptors. Memory is
+	 * returned with the arena.
 	 */
 	void (*destroy)(struct nvram_priv** priv);
 
@@ -54,6 +58,22 @@ struct nvram_interface {
 	 */
 	int (*read)(struct nvram_priv* priv, uint8_t* buf, size_t size);
 
+	/*
+	 * Read part of section at offset into buffer, for loading sections in
+	 * windows. Optional, NULL if sections can only be read whole.
+	 *
+	 * @params
+	 *   priv: private data
+	 *   buf: Read buffer
+	 *   size: Size of read buffer
+	 *   offset: Offset from start of section, as read by read
+	 *
+	 * @returns
+	 *   0 for success (All "size" bytes read)
+	 *   negative errno for error
+	 */
+	int (*read_at)(struct nvram_priv* priv, uint8_t* buf, size_t size, size_t offset);
+
 	/*
 	 * Write from buffer into nvram device
 	 *
@@ -69,6 +89,19 @@ struct nvram_interface {
 	 */
 	int (*write)(struct nvram_priv* priv, const uint8_t* buf, size_t size);
 
+	/*
+	 * Erase section ahead of a write, so the write only has to program.
+	 * Optional, NULL for devices that need no erase.
+	 *
+	 * @params
+	 *   priv: private data
+	 *
+	 * @returns
+	 *   0 for success
+	 *   negative errno for error
+	 */
+	int (*erase)(struct nvram_priv* priv);
+
 	/*
 	 * Get section string from interface
 	 *
@@ -82,6 +115,25 @@ struct nvram_interface {
 	const char* (*section)(const struct nvram_priv* priv);
 };
 
+/*
+ * Read exactly size bytes from fd at offset, retrying short reads
+ *
+ * @returns
+ *   0 for success
+ *   -EIO if end of file is reached before size bytes
+ *   negative errno for error
+ */
+int nvram_pread_all(int fd, uint8_t* buf, size_t size, off_t offset);
+
+/*
+ * Write exactly size bytes to fd at offset, retrying short writes
+ *
+ * @returns
+ *   0 for success
+ *   negative errno for error
+ */
+int nvram_pwrite_all(int fd, const uint8_t* buf, size_t size, off_t offset);
+
 /* Returns NULL if not found */
 struct nvram_interface* nvram_get_interface(const char* interface_name);
 
@@ -5,9 +5,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <errno.h>
-#include <ext2fs/ext2_fs.h>
-#include <e2p/e2p.h>
 #include "nvram_interface.h"
 
 struct efi_header {
@@ -18,15 +18,28 @@ static const struct efi_header EFI_HEADER = {0x7};
 
 struct nvram_priv {
 	char *path;
+	struct nvram_arena* arena;
+	/* -1 until the variable exists */
+	int fd;
+	struct nvram_arena_buf wbuf;
 };
 
-static int efi_init(struct nvram_priv** priv, const char* section)
+static int efi_init(struct nvram_priv** priv, const char* section, struct nvram_arena* arena)
 {
-	struct nvram_priv *pbuf = malloc(sizeof(struct nvram_priv));
+	struct nvram_priv *pbuf = nvram_arena_alloc(arena, sizeof(struct nvram_priv));
 	if (!pbuf) {
 		return -ENOMEM;
 	}
 	pbuf->path = (char*) section;
+	pbuf->arena = arena;
+	pbuf->wbuf.data = NULL;
+	pbuf->wbuf.cap = 0;
+
+	/* Variables are immutable, writes use a separate descriptor after clearing that */
+	pbuf->fd = open(pbuf->path, O_RDONLY);
+	if (pbuf->fd < 0 && errno != ENOENT) {
+		return -errno;
+	}
 
 	*priv = pbuf;
 
@@ -35,23 +48,22 @@ static int efi_init(struct nvram_priv** priv, const char* section)
 
 static void efi_destroy(struct nvram_priv** priv)
 {
-	if (*priv) {
-		free(*priv);
-		*priv = NULL;
+	if ((*priv)->fd >= 0) {
+		close((*priv)->fd);
 	}
+	*priv = NULL;
 }
 
 static int efi_size(const struct nvram_priv* priv, size_t* size)
 {
+	if (priv->fd < 0) {
+		*size = 0;
+		return 0;
+	}
+
 	struct stat sb;
-	if (stat(priv->path, &sb)) {
-		switch (errno) {
-		case ENOENT:
-			*size = 0;
-			return 0;
-		default:
-			return -errno;
-		}
+	if (fstat(priv->fd, &sb)) {
+		return -errno;
 	}
 
 	if (sb.st_size < (off_t) sizeof(EFI_HEADER)) {
@@ -62,59 +74,39 @@ static int efi_size(const struct nvram_priv* priv, size_t* size)
 	return 0;
 }
 
-static int efi_read(struct nvram_priv* priv, uint8_t* buf, size_t size)
+static int efi_read_at(struct nvram_priv* priv, uint8_t* buf, size_t size, size_t offset)
 {
 	if (!buf) {
 		return -EINVAL;
 	}
-
-	int r = 0;
-	int fd = open(priv->path, O_RDONLY);
-	if (fd < 0) {
-		return -errno;
-	}
-
-	uint8_t* pbuf = (uint8_t*) malloc(size + sizeof(EFI_HEADER));
-	if (!pbuf) {
-		return -ENOMEM;
+	if (priv->fd < 0) {
+		return -ENOENT;
 	}
 
-	ssize_t bytes = read(fd, pbuf, size + sizeof(EFI_HEADER));
-	if (bytes < 0) {
-		r = -errno;
-		goto exit;
-	}
-	else
-	if ((size_t) bytes != size + sizeof(EFI_HEADER)) {
-		r = -EIO;
-		goto exit;
-	}
-
-	memcpy(buf, pbuf + sizeof(EFI_HEADER), size);
-
-	r = 0;
+	return nvram_pread_all(priv->fd, buf, size, (off_t) (sizeof(EFI_HEADER) + offset));
+}
 
-exit:
-	free(pbuf);
-	close(fd);
-	return r;
+static int efi_read(struct nvram_priv* priv, uint8_t* buf, size_t size)
+{
+	return efi_read_at(priv, buf, size, 0);
 }
 
-static int set_immutable(const char* path, bool value)
+static int set_immutable(int fd, bool value)
 {
-	unsigned long flags = 0LU;
-	if (fgetflags(path, &flags) != 0) {
+	/* Kernel reads and writes an int despite the ioctl being declared with long */
+	int flags = 0;
+	if (ioctl(fd, FS_IOC_GETFLAGS, &flags) != 0) {
 		return -errno;
 	}
 
 	if (value) {
-		flags |= EXT2_IMMUTABLE_FL;
+		flags |= FS_IMMUTABLE_FL;
 	}
 	else {
-		flags &= ~EXT2_IMMUTABLE_FL;
+		flags &= ~FS_IMMUTABLE_FL;
 	}
 
-	if (fsetflags(path, flags) != 0) {
+	if (ioctl(fd, FS_IOC_SETFLAGS, &flags) != 0) {
 		return -errno;
 	}
 
@@ -130,9 +122,11 @@ static int efi_write(struct nvram_priv* priv, const uint8_t* buf, size_t size)
 	uint8_t* pbuf = NULL;
 	int r = 0;
 
-	r = set_immutable(priv->path, false);
-	if (r != 0 && r != -ENOENT) {
-		return r;
+	if (priv->fd >= 0) {
+		r = set_immutable(priv->fd, false);
+		if (r) {
+			return r;
+		}
 	}
 
 	int fd = open(priv->path, O_WRONLY | O_CREAT, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
@@ -141,7 +135,7 @@ static int efi_write(struct nvram_priv* priv, const uint8_t* buf, size_t size)
 		goto exit;
 	}
 
-	pbuf = (uint8_t*) malloc(size + sizeof(EFI_HEADER));
+	pbuf = (uint8_t*) nvram_arena_buf_get(&priv->wbuf, priv->arena, size + sizeof(EFI_HEADER));
 	if (!pbuf) {
 		r = -ENOMEM;
 		goto exit;
@@ -150,6 +144,7 @@ static int efi_write(struct nvram_priv* priv, const uint8_t* buf, size_t size)
 	memcpy(pbuf, &EFI_HEADER, sizeof(EFI_HEADER));
 	memcpy(pbuf + sizeof(EFI_HEADER), buf, size);
 
+	/* efivarfs takes the whole variable in a single write, no partial retries */
 	ssize_t bytes = write(fd, pbuf, size + sizeof(EFI_HEADER));
 	if (bytes < 0) {
 		r = -errno;
@@ -162,11 +157,23 @@ static int efi_write(struct nvram_priv* priv, const uint8_t* buf, size_t size)
 	}
 
 	r = 0;
+	/* Variable created by this write is read like one that existed on init */
+	if (priv->fd < 0) {
+		priv->fd = open(priv->path, O_RDONLY);
+		if (priv->fd < 0) {
+			r = -errno;
+		}
+	}
 
 exit:
-	set_immutable(priv->path, true);
-	free(pbuf);
-	close(fd);
+	if (fd >= 0) {
+		set_immutable(fd, true);
+		close(fd);
+	}
+	else
+	if (priv->fd >= 0) {
+		set_immutable(priv->fd, true);
+	}
 	return r;
 }
 
@@ -182,6 +189,7 @@ struct nvram_interface nvram_efi_interface =
 	.destroy = efi_destroy,
 	.size = efi_size,
 	.read = efi_read,
+	.read_at = efi_read_at,
 	.write = efi_write,
 	.section = efi_section,
 };
@@ -1,5 +1,9 @@
-#include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <libgen.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -9,21 +13,98 @@
 #include "log.h"
 #include "nvram_interface.h"
 
+#define xstr(a) str(a)
+#define str(a) #a
+
+#define NVRAM_ENV_FILE_PREALLOCATE "NVRAM_FILE_PREALLOCATE"
+#define NVRAM_ENV_FILE_ATOMIC "NVRAM_FILE_ATOMIC"
+
 struct nvram_priv {
 	char *path;
+	/* -1 until the file exists, read-only until the first write */
+	int fd;
+	int writable;
+	int is_regular;
+	/* Size regular files are allocated to and overwritten in place, 0 if disabled */
+	off_t preallocate;
+	/* Commits replace regular files by rename */
+	int atomic;
 };
 
-static int file_init(struct nvram_priv** priv, const char* section)
+static int atomic_enabled(void)
+{
+	const char* str = getenv(NVRAM_ENV_FILE_ATOMIC);
+	if (!str) {
+		str = xstr(NVRAM_FILE_ATOMIC);
+	}
+	return strtol(str, NULL, 10) != 0;
+}
+
+static off_t preallocate_size(void)
+{
+	const char* str = getenv(NVRAM_ENV_FILE_PREALLOCATE);
+	if (!str) {
+		str = xstr(NVRAM_FILE_PREALLOCATE);
+	}
+	char* endptr = NULL;
+	const long long size = strtoll(str, &endptr, 10);
+	if (*endptr != '\0' || size < 0) {
+		pr_err("invalid %s: %s\n", NVRAM_ENV_FILE_PREALLOCATE, str);
+		return 0;
+	}
+	return (off_t) size;
+}
+
+/*
+ * Open section read-only, or read-write creating it if missing when writable.
+ * Reads don't open read-write, closing that makes udev process a block device
+ * and it fails on write-protected ones.
+ */
+static int open_file(struct nvram_priv* priv, int writable)
+{
+	const int flags = writable ? O_RDWR | O_CREAT : O_RDONLY;
+	int fd = open(priv->path, flags, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) != 0) {
+		int r = -errno;
+		close(fd);
+		return r;
+	}
+	if (priv->fd >= 0) {
+		close(priv->fd);
+	}
+	priv->fd = fd;
+	priv->writable = writable;
+	priv->is_regular = S_ISREG(sb.st_mode);
+	return 0;
+}
+
+static int file_init(struct nvram_priv** priv, const char* section, struct nvram_arena* arena)
 {
 	if (!section || *priv) {
 		return -EINVAL;
 	}
 
-	struct nvram_priv *pbuf = malloc(sizeof(struct nvram_priv));
+	struct nvram_priv *pbuf = nvram_arena_alloc(arena, sizeof(struct nvram_priv));
 	if (!pbuf) {
 		return -ENOMEM;
 	}
 	pbuf->path = (char*) section;
+	pbuf->fd = -1;
+	pbuf->writable = 0;
+	pbuf->is_regular = 0;
+	pbuf->preallocate = preallocate_size();
+	pbuf->atomic = atomic_enabled();
+
+	/* Missing file is created on first write */
+	int r = open_file(pbuf, 0);
+	if (r && r != -ENOENT) {
+		return r;
+	}
 
 	*priv = pbuf;
 
@@ -32,21 +113,22 @@ static int file_init(struct nvram_priv** priv, const char* section)
 
 static void file_destroy(struct nvram_priv** priv)
 {
-	if (*priv) {
-		free(*priv);
-		*priv = NULL;
+	if ((*priv)->fd >= 0) {
+		close((*priv)->fd);
 	}
+	*priv = NULL;
 }
 
 static int file_size(const struct nvram_priv* priv, size_t* size)
 {
+	if (priv->fd < 0) {
+		*size = 0;
+		return 0;
+	}
+
 	/* Find out what type of file we're dealing with */
 	struct stat sb;
-	if (stat(priv->path, &sb) != 0) {
-		if (errno == ENOENT) {
-			*size = 0;
-			return 0;
-		}
+	if (fstat(priv->fd, &sb) != 0) {
 		return -errno;
 	}
 
@@ -56,15 +138,9 @@ static int file_size(const struct nvram_priv* priv, size_t* size)
 	}
 	else if (S_ISBLK(sb.st_mode)) {
 		pr_dbg("%s: blockdev\n", priv->path);
-		const int fd = open(priv->path, O_RDONLY);
-		if (fd < 0)
-			return -errno;
 		__u64 bytes = 0;
-		const int io_r = ioctl(fd, BLKGETSIZE64, &bytes);
-		const int io_errno = errno;
-		close(fd);
-		if (io_r != 0)
-			return -io_errno;
+		if (ioctl(priv->fd, BLKGETSIZE64, &bytes) != 0)
+			return -errno;
 		if (bytes > SIZE_MAX)
 			return -ENOMEM;
 		*size = bytes;
@@ -77,32 +153,138 @@ static int file_size(const struct nvram_priv* priv, size_t* size)
 	return 0;
 }
 
-static int file_read(struct nvram_priv* priv, uint8_t* buf, size_t size)
+static int file_read_at(struct nvram_priv* priv, uint8_t* buf, size_t size, size_t offset)
 {
 	if (!buf) {
 		return -EINVAL;
 	}
+	if (priv->fd < 0) {
+		return -ENOENT;
+	}
+
+	return nvram_pread_all(priv->fd, buf, size, (off_t) offset);
+}
+
+static int file_read(struct nvram_priv* priv, uint8_t* buf, size_t size)
+{
+	return file_read_at(priv, buf, size, 0);
+}
+
+/*
+ * Overwrite a section allocated to a fixed size on first use. Its blocks and
+ * size never change, so commits write no metadata that fdatasync() has to wait
+ * for. Data past the one written is left, formats storing their length, like
+ * v2, ignore it.
+ */
+static int write_in_place(struct nvram_priv* priv, const uint8_t* buf, size_t size)
+{
+	struct stat sb;
+	if (fstat(priv->fd, &sb) != 0) {
+		return -errno;
+	}
+	const off_t len = (off_t) size > priv->preallocate ? (off_t) size : priv->preallocate;
+	if (sb.st_size < len) {
+		pr_dbg("%s: preallocating %lld bytes\n", priv->path, (long long) len);
+		/* Returns error instead of setting errno */
+		int r = posix_fallocate(priv->fd, 0, len);
+		if (r) {
+			return -r;
+		}
+	}
+
+	int r = nvram_pwrite_all(priv->fd, buf, size, 0);
+	if (r) {
+		return r;
+	}
 
-	int fd = open(priv->path, O_RDONLY);
+	if (fdatasync(priv->fd) != 0) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int sync_dir(const char* path)
+{
+	char dir[PATH_MAX];
+	if (snprintf(dir, sizeof(dir), "%s", path) >= (int) sizeof(dir)) {
+		return -ENAMETOOLONG;
+	}
+	int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
 	if (fd < 0) {
 		return -errno;
 	}
+	int r = fsync(fd) ? -errno : 0;
+	close(fd);
+	return r;
+}
 
+/*
+ * Write a temporary file next to the section and rename it over the section,
+ * so a power cut leaves either the previous or the new data. For sections
+ * without a B copy to fall back to. The section path itself is replaced, a
+ * symlink is not followed.
+ */
+static int write_replace(struct nvram_priv* priv, const uint8_t* buf, size_t size)
+{
+	char tmp_path[PATH_MAX];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", priv->path) >= (int) sizeof(tmp_path)) {
+		return -ENAMETOOLONG;
+	}
+
+	mode_t mode = S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH;
+	struct stat sb;
+	if (priv->fd >= 0) {
+		if (fstat(priv->fd, &sb) != 0) {
+			return -errno;
+		}
+		mode = sb.st_mode & 07777;
+	}
+
+	int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, mode);
+	if (fd < 0) {
+		return -errno;
+	}
 	int r = 0;
-	ssize_t bytes = read(fd, buf, size);
-	if (bytes < 0) {
+	/* Keep owner of the replaced file, e.g. when written by root */
+	if (priv->fd >= 0) {
+		struct stat tmp_sb;
+		if (fstat(fd, &tmp_sb) != 0) {
+			r = -errno;
+		}
+		else if ((tmp_sb.st_uid != sb.st_uid || tmp_sb.st_gid != sb.st_gid)
+				&& fchown(fd, sb.st_uid, sb.st_gid) != 0) {
+			r = -errno;
+		}
+	}
+	/* Not subject to umask, unlike the mode passed to open(), and after fchown() which may clear setuid bits */
+	if (!r && fchmod(fd, mode) != 0) {
 		r = -errno;
-		goto exit;
 	}
-	else
-	if ((size_t) bytes != size) {
-		r = -EIO;
-		goto exit;
+	if (!r) {
+		r = nvram_pwrite_all(fd, buf, size, 0);
+	}
+	if (!r && fdatasync(fd) != 0) {
+		r = -errno;
+	}
+	if (!r && rename(tmp_path, priv->path) != 0) {
+		r = -errno;
+	}
+	if (r) {
+		close(fd);
+		unlink(tmp_path);
+		return r;
 	}
 
-exit:
-	close(fd);
-	return r;
+	/* Descriptor is of the replaced file from now on */
+	if (priv->fd >= 0) {
+		close(priv->fd);
+	}
+	priv->fd = fd;
+	priv->writable = 1;
+	priv->is_regular = 1;
+
+	return sync_dir(priv->path);
 }
 
 static int file_write(struct nvram_priv* priv, const uint8_t* buf, size_t size)
@@ -111,26 +293,39 @@ static int file_write(struct nvram_priv* priv, const uint8_t* buf, size_t size)
 		return -EINVAL;
 	}
 
-	int fd = open(priv->path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
-	if (fd < 0) {
-		return -errno;
+	if (priv->atomic && (priv->fd < 0 || priv->is_regular)) {
+		/* Sections we may not write aren't replaced either */
+		if (priv->fd >= 0 && !priv->writable) {
+			int r = open_file(priv, 1);
+			if (r) {
+				return r;
+			}
+		}
+		return write_replace(priv, buf, size);
 	}
 
-	int r = 0;
-	ssize_t bytes = write(fd, buf, size);
-	if (bytes < 0) {
-		r = -errno;
-		goto exit;
+	if (!priv->writable) {
+		int r = open_file(priv, 1);
+		if (r) {
+			return r;
+		}
 	}
-	else
-	if ((size_t) bytes != size) {
-		r = -EIO;
-		goto exit;
+
+	if (priv->preallocate > 0 && priv->is_regular) {
+		return write_in_place(priv, buf, size);
 	}
 
-exit:
-	close(fd);
-	return r;
+	int r = nvram_pwrite_all(priv->fd, buf, size, 0);
+	if (r) {
+		return r;
+	}
+
+	/* Drop stale data from a previously larger section */
+	if (priv->is_regular && ftruncate(priv->fd, size) != 0) {
+		return -errno;
+	}
+
+	return 0;
 }
 
 static const char* file_section(const struct nvram_priv* priv)
@@ -145,6 +340,7 @@ struct nvram_interface nvram_file_interface =
 	.destroy = file_destroy,
 	.size = file_size,
 	.read = file_read,
+	.read_at = file_read_at,
 	.write = file_write,
 	.section = file_section,
 };
@@ -1,17 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
-#include <string.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <sys/ioctl.h>
 #include <mtd/mtd-user.h>
-#include <libmtd.h>
 #include <errno.h>
 #include "nvram_interface.h"
 #include "log.h"
+#include "nvram_stats.h"
 
 #define xstr(a) str(a)
 #define str(a) #a
@@ -23,7 +25,11 @@ static char* DEFAULT_NVRAM_WP_GPIO = xstr(NVRAM_WP_GPIO);
 
 struct nvram_mtd {
 	char *path;
+	/* Read-only until the first write or erase */
+	int fd;
+	int writable;
 	long long size;
+	uint32_t erasesize;
 };
 
 struct nvram_priv {
@@ -32,69 +38,100 @@ struct nvram_priv {
 	char* gpio;
 };
 
-static int find_mtd(const char* label,  int* mtd_num, long long* mtd_size)
+#define MTD_SYSFS_DIR "/sys/class/mtd"
+
+/* Read first line of sysfs attribute without trailing newline */
+static int read_sysfs_attr(const char* dev, const char* attr, char* buf, size_t size)
 {
-	int r = 0;
-	libmtd_t mtd = NULL;
-	struct mtd_dev_info *mtd_dev = (struct mtd_dev_info*) malloc(sizeof(struct mtd_dev_info));
-	struct mtd_info *mtd_info = (struct mtd_info*) malloc(sizeof(struct mtd_info));
-	if (!mtd_dev || !mtd_info) {
-		r = -ENOMEM;
-		goto exit;
+	char path[PATH_MAX];
+	int r = snprintf(path, sizeof(path), MTD_SYSFS_DIR "/%s/%s", dev, attr);
+	if (r < 0 || (size_t) r >= sizeof(path)) {
+		return -EINVAL;
 	}
 
-	mtd = libmtd_open();
-	if (!mtd) {
-		r = -errno;
-		goto exit;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+	ssize_t bytes = read(fd, buf, size - 1);
+	r = bytes < 0 ? -errno : 0;
+	close(fd);
+	if (r) {
+		return r;
 	}
 
-	if (mtd_get_info(mtd, mtd_info)) {
-		r = -errno;
-		goto exit;
+	buf[bytes] = '\0';
+	char* newline = strchr(buf, '\n');
+	if (newline) {
+		*newline = '\0';
 	}
+	return 0;
+}
 
-	for (int i = mtd_info->lowest_mtd_num; i <= mtd_info->highest_mtd_num; i++) {
-		if (mtd_get_dev_info1(mtd, i, mtd_dev)) {
-			r = -errno;
-			goto exit;
-		}
+/* Returns 1 for sysfs entries named mtdN, excluding the mtdNro aliases */
+static int is_mtd_dev(const char* name, int* mtd_num)
+{
+	if (strncmp(name, "mtd", 3) != 0 || name[3] < '0' || name[3] > '9') {
+		return 0;
+	}
+	char* end = NULL;
+	long num = strtol(name + 3, &end, 10);
+	if (*end != '\0' || num > INT_MAX) {
+		return 0;
+	}
+	*mtd_num = (int) num;
+	return 1;
+}
 
-		if (!strcmp(mtd_dev->name, label)) {
-			*mtd_num = mtd_dev->mtd_num;
-			*mtd_size = mtd_dev->size;
-			break;
-		}
+static int find_mtd(const char* label, int* mtd_num)
+{
+	char name[256];
+	int r = -ENODEV;
+	DIR* dir = opendir(MTD_SYSFS_DIR);
+	if (!dir) {
+		return -errno;
+	}
 
-		if (i == mtd_info->highest_mtd_num) {
-			r = -ENODEV;
-			goto exit;
+	struct dirent* ent = NULL;
+	while ((ent = readdir(dir)) != NULL) {
+		int num = 0;
+		if (!is_mtd_dev(ent->d_name, &num)) {
+			continue;
+		}
+		if (read_sysfs_attr(ent->d_name, "name", name, sizeof(name))) {
+			continue;
+		}
+		if (!strcmp(name, label)) {
+			*mtd_num = num;
+			r = 0;
+			break;
 		}
 	}
 
-	r = 0;
+	closedir(dir);
+	return r;
+}
 
-exit:
-	if (mtd) {
-		libmtd_close(mtd);
-	}
-	if (mtd_dev) {
-		free(mtd_dev);
-	}
-	if (mtd_info) {
-		free(mtd_info);
+static int get_mtd_info(int fd, long long* mtd_size, uint32_t* erasesize)
+{
+	struct mtd_info_user info;
+	if (ioctl(fd, MEMGETINFO, &info) < 0) {
+		return -errno;
 	}
-	return r;
+	*mtd_size = info.size;
+	/* Treat devices without erase blocks as one block */
+	*erasesize = info.erasesize ? info.erasesize : info.size;
+	return 0;
 }
 
-static int init_nvram_mtd(struct nvram_mtd* nvram_mtd, const char* label)
+static int init_nvram_mtd(struct nvram_mtd* nvram_mtd, const char* label, struct nvram_arena* arena)
 {
 	const char *pathfmt = "/dev/mtd%d";
 	long long mtd_size = 0LL;
 	int mtd_num = 0;
 	int r = 0;
 
-	r = find_mtd(label, &mtd_num, &mtd_size);
+	r = find_mtd(label, &mtd_num);
 	if (r) {
 		return r;
 	}
@@ -106,35 +143,62 @@ static int init_nvram_mtd(struct nvram_mtd* nvram_mtd, const char* label)
 	}
 	int bufsize = r + 1;
 
-	nvram_mtd->path = (char*) malloc(bufsize);
+	nvram_mtd->path = (char*) nvram_arena_alloc(arena, bufsize);
 	if (!nvram_mtd->path) {
 		return -ENOMEM;
 	}
 	r = snprintf(nvram_mtd->path, bufsize, pathfmt, mtd_num);
 	if (r != bufsize - 1) {
-		free(nvram_mtd->path);
 		nvram_mtd->path = NULL;
 		return -EINVAL;
 	}
 
+	/* Opened read-write only to write, closing that makes udev process the device */
+	nvram_mtd->fd = open(nvram_mtd->path, O_RDONLY);
+	nvram_mtd->writable = 0;
+	if (nvram_mtd->fd < 0) {
+		return -errno;
+	}
+
+	r = get_mtd_info(nvram_mtd->fd, &mtd_size, &nvram_mtd->erasesize);
+	if (r) {
+		close(nvram_mtd->fd);
+		nvram_mtd->fd = -1;
+		return r;
+	}
+
 	nvram_mtd->size = mtd_size;
 	return 0;
 }
 
-static int nvram_mtd_init(struct nvram_priv** priv, const char* section)
+/* Reopen device read-write for the first write or erase */
+static int open_writable(struct nvram_mtd* nvram_mtd)
+{
+	if (nvram_mtd->writable) {
+		return 0;
+	}
+	int fd = open(nvram_mtd->path, O_RDWR);
+	if (fd < 0) {
+		return -errno;
+	}
+	close(nvram_mtd->fd);
+	nvram_mtd->fd = fd;
+	nvram_mtd->writable = 1;
+	return 0;
+}
+
+static int nvram_mtd_init(struct nvram_priv** priv, const char* section, struct nvram_arena* arena)
 {
 	int r = 0;
-	struct nvram_priv *pbuf = malloc(sizeof(struct nvram_priv));
+	struct nvram_priv *pbuf = nvram_arena_zalloc(arena, sizeof(struct nvram_priv));
 	if (!pbuf) {
 		return -ENOMEM;
 	}
-	memset(pbuf, 0, sizeof(struct nvram_priv));
 
 	pbuf->label = (char*) section;
 
-	r = init_nvram_mtd(&pbuf->mtd, section);
+	r = init_nvram_mtd(&pbuf->mtd, section, arena);
 	if (r) {
-		free(pbuf);
 		return r;
 	}
 
@@ -155,14 +219,8 @@ static int nvram_mtd_init(struct nvram_priv** priv, const char* section)
 
 static void nvram_mtd_destroy(struct nvram_priv** priv)
 {
-	struct nvram_priv *pdev = *priv;
-	if (pdev) {
-		if (pdev->mtd.path) {
-			free(pdev->mtd.path);
-		}
-		free(pdev);
-		*priv = NULL;
-	}
+	close((*priv)->mtd.fd);
+	*priv = NULL;
 }
 
 static int nvram_mtd_size(const struct nvram_priv* priv, size_t* size)
@@ -171,45 +229,25 @@ static int nvram_mtd_size(const struct nvram_priv* priv, size_t* size)
 	return 0;
 }
 
-static int nvram_mtd_read(struct nvram_priv* priv, uint8_t* buf, size_t size)
+static int nvram_mtd_read_at(struct nvram_priv* priv, uint8_t* buf, size_t size, size_t offset)
 {
 	if (!buf) {
 		return -EINVAL;
 	}
 
-	int r = 0;
-	int fd = open(priv->mtd.path, O_RDONLY);
-	if (fd < 0) {
-		return -errno;
-	}
-
-	ssize_t bytes = read(fd, buf, size);
-	if (bytes < 0) {
-		r = -errno;
-		goto exit;
-	}
-	else
-	if ((size_t) bytes != size) {
-		r = -EIO;
-		goto exit;
-	}
-
-	r = 0;
-
-exit:
-	close(fd);
-	return r;
+	return nvram_pread_all(priv->mtd.fd, buf, size, (off_t) offset);
 }
 
-static int erase_mtd(int fd, long long size)
+static int nvram_mtd_read(struct nvram_priv* priv, uint8_t* buf, size_t size)
 {
-	if (size > UINT32_MAX || size < 0) {
-		return -EINVAL;
-	}
+	return nvram_mtd_read_at(priv, buf, size, 0);
+}
 
+static int erase_mtd(int fd, uint32_t start, uint32_t length)
+{
 	struct erase_info_user erase_info;
-	erase_info.start = 0;
-	erase_info.length = size;
+	erase_info.start = start;
+	erase_info.length = length;
 	int r = ioctl(fd, MEMERASE, &erase_info);
 	if (r < 0) {
 		return -errno;
@@ -217,6 +255,52 @@ static int erase_mtd(int fd, long long size)
 	return 0;
 }
 
+/* Returns 1 if range reads as erased, 0 if not, negative errno for error */
+static int is_erased(int fd, uint32_t start, uint32_t length)
+{
+	uint8_t buf[4096];
+	while (length > 0) {
+		const uint32_t chunk = length < sizeof(buf) ? length : sizeof(buf);
+		int r = nvram_pread_all(fd, buf, chunk, start);
+		if (r) {
+			return r;
+		}
+		for (uint32_t i = 0; i < chunk; i++) {
+			if (buf[i] != 0xff) {
+				return 0;
+			}
+		}
+		start += chunk;
+		length -= chunk;
+	}
+	return 1;
+}
+
+/*
+ * Erase blocks in range that are not already erased. Reading a block is much
+ * cheaper than erasing it, and a block holding data is recognized as soon as
+ * its first programmed byte is read. Erased blocks are left from earlier
+ * commits past the data written, or from a standby erase.
+ */
+static int erase_dirty_blocks(const struct nvram_mtd* mtd, const char* section, uint32_t start, uint32_t end)
+{
+	for (uint32_t block = start; block < end; block += mtd->erasesize) {
+		int r = is_erased(mtd->fd, block, mtd->erasesize);
+		if (r < 0) {
+			return r;
+		}
+		if (r == 0) {
+			pr_dbg("%s: erasing stale block at 0x%" PRIx32 "\n", mtd->path, block);
+			r = erase_mtd(mtd->fd, block, mtd->erasesize);
+			if (r) {
+				return r;
+			}
+			nvram_stats_erase(section, 1);
+		}
+	}
+	return 0;
+}
+
 static int set_gpio(const char* path, bool value)
 {
 	pr_dbg("%s: %s: %d\n", __func__, path, value);
@@ -239,12 +323,20 @@ static int nvram_mtd_write(struct nvram_priv* priv, const uint8_t* buf, size_t s
 		return -EINVAL;
 	}
 
-	int r = 0;
-	int fd = open(priv->mtd.path, O_WRONLY);
-	if (fd < 0) {
-		return -errno;
+	if (priv->mtd.size > UINT32_MAX || priv->mtd.size < 0) {
+		return -EINVAL;
+	}
+	if (size > (size_t) priv->mtd.size) {
+		return -EFBIG;
 	}
+	/* Only blocks holding data must be erased before programming */
+	const uint64_t blocks = (size + priv->mtd.erasesize - 1) / priv->mtd.erasesize;
+	const uint32_t data_len = blocks * priv->mtd.erasesize;
 
+	int r = open_writable(&priv->mtd);
+	if (r) {
+		return r;
+	}
 	if (priv->gpio) {
 		r = set_gpio(priv->gpio, false);
 		if (r) {
@@ -252,32 +344,50 @@ static int nvram_mtd_write(struct nvram_priv* priv, const uint8_t* buf, size_t s
 		}
 	}
 
-	pr_dbg("%s: erasing\n", priv->mtd.path);
-	r = erase_mtd(fd, priv->mtd.size);
+	r = erase_dirty_blocks(&priv->mtd, priv->label, 0, data_len);
 	if (r) {
 		goto exit;
 	}
 
 	pr_dbg("%s: writing\n", priv->mtd.path);
-	ssize_t bytes = write(fd, buf, size);
-	if (bytes < 0) {
-		r = -errno;
-		goto exit;
-	}
-	else
-	if ((size_t) bytes != size) {
-		r = -EIO;
+	r = nvram_pwrite_all(priv->mtd.fd, buf, size, 0);
+	if (r) {
 		goto exit;
 	}
 
-	r = 0;
+	/* Data is complete, leave the rest of the device erased as before */
+	r = erase_dirty_blocks(&priv->mtd, priv->label, data_len, priv->mtd.size);
 
 exit:
 	if (priv->gpio) {
 		set_gpio(priv->gpio, true);
 	}
 
-	close(fd);
+	return r;
+}
+
+static int nvram_mtd_erase(struct nvram_priv* priv)
+{
+	if (priv->mtd.size > UINT32_MAX || priv->mtd.size < 0) {
+		return -EINVAL;
+	}
+
+	int r = open_writable(&priv->mtd);
+	if (r) {
+		return r;
+	}
+	if (priv->gpio) {
+		r = set_gpio(priv->gpio, false);
+		if (r) {
+			return r;
+		}
+	}
+
+	r = erase_dirty_blocks(&priv->mtd, priv->label, 0, priv->mtd.size);
+
+	if (priv->gpio) {
+		set_gpio(priv->gpio, true);
+	}
 	return r;
 }
 
@@ -293,6 +403,8 @@ struct nvram_interface nvram_mtd_interface =
 	.destroy = nvram_mtd_destroy,
 	.size = nvram_mtd_size,
 	.read = nvram_mtd_read,
+	.read_at = nvram_mtd_read_at,
 	.write = nvram_mtd_write,
+	.erase = nvram_mtd_erase,
 	.section = nvram_mtd_section,
 };
@@ -0,0 +1,663 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "log.h"
+#include "nvram_manifest.h"
+
+#define UNIT_KEY "unit"
+#define READ_CHUNK 4096
+
+struct parser {
+	const char* path;
+	const char* pos;
+	const char* end;
+	size_t line;
+};
+
+/* Pairs of the unit being parsed, copied to the arena once complete */
+struct pairs {
+	struct nvram_manifest_pair* pairs;
+	size_t len;
+	size_t cap;
+};
+
+static int parse_error(const char* path, size_t line, const char* msg)
+{
+	pr_err("%s:%zu: %s\n", path, line, msg);
+	return -EINVAL;
+}
+
+static int read_file(const char* path, char** data, size_t* len)
+{
+	FILE* fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	char* buf = NULL;
+	size_t cap = 0;
+	size_t size = 0;
+	int r = 0;
+	for (;;) {
+		if (size == cap) {
+			cap = cap ? cap * 2 : READ_CHUNK;
+			char* grown = realloc(buf, cap);
+			if (!grown) {
+				r = -ENOMEM;
+				break;
+			}
+			buf = grown;
+		}
+		const size_t n = fread(buf + size, 1, cap - size, fp);
+		size += n;
+		if (n == 0) {
+			if (ferror(fp))
+				r = -EIO;
+			break;
+		}
+	}
+	fclose(fp);
+
+	if (r) {
+		free(buf);
+		return r;
+	}
+	*data = buf;
+	*len = size;
+	return 0;
+}
+
+static char* copy_str(struct nvram_arena* arena, const char* str, size_t len)
+{
+	char* copy = nvram_arena_alloc(arena, len + 1);
+	if (copy) {
+		memcpy(copy, str, len);
+		copy[len] = '\0';
+	}
+	return copy;
+}
+
+static int pairs_add(struct pairs* pairs, const char* key, const char* value)
+{
+	if (pairs->len == pairs->cap) {
+		const size_t cap = pairs->cap ? pairs->cap * 2 : 16;
+		struct nvram_manifest_pair* grown = realloc(pairs->pairs, cap * sizeof(*grown));
+		if (!grown)
+			return -ENOMEM;
+		pairs->pairs = grown;
+		pairs->cap = cap;
+	}
+	pairs->pairs[pairs->len].key = key;
+	pairs->pairs[pairs->len].value = value;
+	pairs->len++;
+	return 0;
+}
+
+static int copy_pairs(const struct pairs* pairs, struct nvram_manifest_unit* unit, struct nvram_arena* arena)
+{
+	unit->pairs = NULL;
+	unit->pairs_len = pairs->len;
+	if (pairs->len == 0)
+		return 0;
+	struct nvram_manifest_pair* copy = nvram_arena_alloc(arena, pairs->len * sizeof(*copy));
+	if (!copy)
+		return -ENOMEM;
+	memcpy(copy, pairs->pairs, pairs->len * sizeof(*copy));
+	unit->pairs = copy;
+	return 0;
+}
+
+static int add_unit(struct nvram_manifest* manifest, const char* name, const struct pairs* pairs, struct nvram_arena* arena)
+{
+	if (manifest->units_len == manifest->units_cap) {
+		const size_t cap = manifest->units_cap ? manifest->units_cap * 2 : 64;
+		struct nvram_manifest_unit* grown = realloc(manifest->units, cap * sizeof(*grown));
+		if (!grown)
+			return -ENOMEM;
+		manifest->units = grown;
+		manifest->units_cap = cap;
+	}
+	struct nvram_manifest_unit* unit = &manifest->units[manifest->units_len];
+	unit->name = name;
+	const int r = copy_pairs(pairs, unit, arena);
+	if (r == 0)
+		manifest->units_len++;
+	return r;
+}
+
+/*
+ * Parse field at pos as of RFC 4180, quoted fields may hold separators,
+ * newlines and quotes doubled. end_of_record is set if it was the last field
+ * of its record.
+ */
+static int csv_field(struct parser* p, struct nvram_arena* arena, char** field, int* end_of_record)
+{
+	if (p->pos < p->end && *p->pos == '"') {
+		const char* start = ++p->pos;
+		size_t len = 0;
+		for (;;) {
+			if (p->pos >= p->end)
+				return parse_error(p->path, p->line, "unterminated quoted field");
+			if (*p->pos == '"') {
+				if (p->pos + 1 < p->end && p->pos[1] == '"') {
+					p->pos += 2;
+					len++;
+					continue;
+				}
+				break;
+			}
+			if (*p->pos == '\n')
+				p->line++;
+			p->pos++;
+			len++;
+		}
+		const char* raw_end = p->pos++;
+
+		char* out = nvram_arena_alloc(arena, len + 1);
+		if (!out)
+			return -ENOMEM;
+		len = 0;
+		for (const char* c = start; c < raw_end; ++c) {
+			out[len++] = *c;
+			if (*c == '"')
+				++c;
+		}
+		out[len] = '\0';
+		*field = out;
+	}
+	else {
+		const char* start = p->pos;
+		while (p->pos < p->end && *p->pos != ',' && *p->pos != '\n' && *p->pos != '\r')
+			p->pos++;
+		*field = copy_str(arena, start, p->pos - start);
+		if (!*field)
+			return -ENOMEM;
+	}
+
+	*end_of_record = 0;
+	if (p->pos < p->end && *p->pos == ',') {
+		p->pos++;
+		return 0;
+	}
+	if (p->pos < p->end && *p->pos == '\r')
+		p->pos++;
+	if (p->pos < p->end) {
+		if (*p->pos != '\n')
+			return parse_error(p->path, p->line, "unexpected character after field");
+		p->pos++;
+		p->line++;
+	}
+	*end_of_record = 1;
+	return 0;
+}
+
+static int is_blank_line(const struct parser* p)
+{
+	return *p->pos == '\n' || (*p->pos == '\r' && p->pos + 1 < p->end && p->pos[1] == '\n');
+}
+
+/* NOLINTNEXTLINE(readability-function-cognitive-complexity) */
+static int parse_csv(struct parser* p, struct nvram_manifest* manifest, struct nvram_arena* arena)
+{
+	char** columns = NULL;
+	size_t columns_len = 0;
+	size_t columns_cap = 0;
+	size_t unit_column = SIZE_MAX;
+	struct pairs pairs;
+	memset(&pairs, 0, sizeof(pairs));
+	int end_of_record = 0;
+	int r = 0;
+
+	if (p->pos == p->end) {
+		r = parse_error(p->path, p->line, "no header row");
+		goto exit;
+	}
+	do {
+		char* field = NULL;
+		r = csv_field(p, arena, &field, &end_of_record);
+		if (r)
+			goto exit;
+		if (columns_len == columns_cap) {
+			columns_cap = columns_cap ? columns_cap * 2 : 16;
+			char** grown = realloc(columns, columns_cap * sizeof(*grown));
+			if (!grown) {
+				r = -ENOMEM;
+				goto exit;
+			}
+			columns = grown;
+		}
+		columns[columns_len++] = field;
+	} while (!end_of_record);
+
+	for (size_t i = 0; i < columns_len; ++i) {
+		if (*columns[i] == '\0') {
+			r = parse_error(p->path, 1, "empty column name");
+			goto exit;
+		}
+		for (size_t j = 0; j < i; ++j) {
+			if (!strcmp(columns[i], columns[j])) {
+				pr_err("%s:1: column %s listed more than once\n", p->path, columns[i]);
+				r = -EINVAL;
+				goto exit;
+			}
+		}
+		if (!strcmp(columns[i], UNIT_KEY))
+			unit_column = i;
+	}
+	if (unit_column == SIZE_MAX) {
+		r = parse_error(p->path, 1, "no " UNIT_KEY " column");
+		goto exit;
+	}
+
+	while (p->pos < p->end) {
+		if (is_blank_line(p)) {
+			p->pos += *p->pos == '\r' ? 2 : 1;
+			p->line++;
+			continue;
+		}
+		const size_t line = p->line;
+		const char* name = NULL;
+		size_t fields = 0;
+		pairs.len = 0;
+		do {
+			char* field = NULL;
+			r = csv_field(p, arena, &field, &end_of_record);
+			if (r)
+				goto exit;
+			if (fields == columns_len) {
+				r = parse_error(p->path, line, "more fields than columns");
+				goto exit;
+			}
+			if (fields == unit_column)
+				name = field;
+			else if (*field != '\0')
+				r = pairs_add(&pairs, columns[fields], field);
+			if (r)
+				goto exit;
+			fields++;
+		} while (!end_of_record);
+
+		if (fields != columns_len) {
+			r = parse_error(p->path, line, "fewer fields than columns");
+			goto exit;
+		}
+		if (*name == '\0') {
+			r = parse_error(p->path, line, "empty " UNIT_KEY);
+			goto exit;
+		}
+		r = add_unit(manifest, name, &pairs, arena);
+		if (r)
+			goto exit;
+	}
+
+exit:
+	free(columns);
+	free(pairs.pairs);
+	return r;
+}
+
+static void skip_ws(struct parser* p)
+{
+	while (p->pos < p->end && (*p->pos == ' ' || *p->pos == '\t' || *p->pos == '\r' || *p->pos == '\n')) {
+		if (*p->pos == '\n')
+			p->line++;
+		p->pos++;
+	}
+}
+
+/* Skip whitespace and consume c, returns 1 if it was next */
+static int consume(struct parser* p, char c)
+{
+	skip_ws(p);
+	if (p->pos < p->end && *p->pos == c) {
+		p->pos++;
+		return 1;
+	}
+	return 0;
+}
+
+/* Returns 0 if str starts with 4 hex digits */
+static int parse_hex4(const char* str, uint32_t* val)
+{
+	*val = 0;
+	for (int i = 0; i < 4; ++i) {
+		const char c = str[i];
+		uint32_t digit = 0;
+		if (c >= '0' && c <= '9')
+			digit = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			digit = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			digit = c - 'A' + 10;
+		else
+			return -EINVAL;
+		*val = *val << 4 | digit;
+	}
+	return 0;
+}
+
+static size_t utf8_encode(uint32_t cp, char* out)
+{
+	if (cp < 0x80) {
+		out[0] = (char) cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		out[0] = (char) (0xc0 | cp >> 6);
+		out[1] = (char) (0x80 | (cp & 0x3f));
+		return 2;
+	}
+	if (cp < 0x10000) {
+		out[0] = (char) (0xe0 | cp >> 12);
+		out[1] = (char) (0x80 | ((cp >> 6) & 0x3f));
+		out[2] = (char) (0x80 | (cp & 0x3f));
+		return 3;
+	}
+	out[0] = (char) (0xf0 | cp >> 18);
+	out[1] = (char) (0x80 | ((cp >> 12) & 0x3f));
+	out[2] = (char) (0x80 | ((cp >> 6) & 0x3f));
+	out[3] = (char) (0x80 | (cp & 0x3f));
+	return 4;
+}
+
+/* Decode \u escape at c, pointing at the u, and advance c to its last digit */
+static int json_unicode(const struct parser* p, const char** c, const char* raw_end, char* out, size_t* len)
+{
+	uint32_t cp = 0;
+	if (raw_end - *c < 5 || parse_hex4(*c + 1, &cp))
+		return parse_error(p->path, p->line, "invalid \\u escape");
+	*c += 4;
+	if (cp >= 0xd800 && cp < 0xdc00) {
+		uint32_t low = 0;
+		if (raw_end - *c < 7 || (*c)[1] != '\\' || (*c)[2] != 'u' || parse_hex4(*c + 3, &low)
+				|| low < 0xdc00 || low >= 0xe000)
+			return parse_error(p->path, p->line, "invalid surrogate pair");
+		cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+		*c += 6;
+	}
+	else if (cp >= 0xdc00 && cp < 0xe000) {
+		return parse_error(p->path, p->line, "invalid surrogate pair");
+	}
+	/* Keys and values are null-terminated */
+	if (cp == 0)
+		return parse_error(p->path, p->line, "null character in string");
+	*len += utf8_encode(cp, out + *len);
+	return 0;
+}
+
+static int json_string(struct parser* p, struct nvram_arena* arena, char** str)
+{
+	if (!consume(p, '"'))
+		return parse_error(p->path, p->line, "expected string");
+	const char* start = p->pos;
+	while (p->pos < p->end && *p->pos != '"') {
+		if ((unsigned char) *p->pos < 0x20)
+			return parse_error(p->path, p->line, "control character in string");
+		if (*p->pos == '\\')
+			p->pos++;
+		p->pos++;
+	}
+	if (p->pos >= p->end)
+		return parse_error(p->path, p->line, "unterminated string");
+	const char* raw_end = p->pos++;
+
+	/* Escapes never decode to more bytes than they take */
+	char* out = nvram_arena_alloc(arena, raw_end - start + 1);
+	if (!out)
+		return -ENOMEM;
+	size_t len = 0;
+	for (const char* c = start; c < raw_end; ++c) {
+		if (*c != '\\') {
+			out[len++] = *c;
+			continue;
+		}
+		int r = 0;
+		switch (*++c) {
+		case '"':
+		case '\\':
+		case '/':
+			out[len++] = *c;
+			break;
+		case 'b':
+			out[len++] = '\b';
+			break;
+		case 'f':
+			out[len++] = '\f';
+			break;
+		case 'n':
+			out[len++] = '\n';
+			break;
+		case 'r':
+			out[len++] = '\r';
+			break;
+		case 't':
+			out[len++] = '\t';
+			break;
+		case 'u':
+			r = json_unicode(p, &c, raw_end, out, &len);
+			break;
+		default:
+			r = parse_error(p->path, p->line, "invalid escape");
+			break;
+		}
+		if (r)
+			return r;
+	}
+	out[len] = '\0';
+	*str = out;
+	return 0;
+}
+
+/* Numbers, true and false are kept as text, null sets str to NULL */
+static int json_scalar(struct parser* p, struct nvram_arena* arena, char** str)
+{
+	const char* start = p->pos;
+	while (p->pos < p->end && (isalnum((unsigned char) *p->pos) || *p->pos == '-' || *p->pos == '+' || *p->pos == '.'))
+		p->pos++;
+	const size_t len = p->pos - start;
+
+	if (len == strlen("null") && !memcmp(start, "null", len)) {
+		*str = NULL;
+		return 0;
+	}
+	const int is_bool = (len == strlen("true") && !memcmp(start, "true", len))
+			|| (len == strlen("false") && !memcmp(start, "false", len));
+	if (len == 0 || (!is_bool && !strchr("-0123456789", *start)))
+		return parse_error(p->path, p->line, "expected string, number, true, false or null");
+	*str = copy_str(arena, start, len);
+	return *str ? 0 : -ENOMEM;
+}
+
+static int json_unit(struct parser* p, struct pairs* pairs, struct nvram_manifest* manifest, struct nvram_arena* arena)
+{
+	skip_ws(p);
+	const size_t line = p->line;
+	if (!consume(p, '{'))
+		return parse_error(p->path, p->line, "expected object");
+
+	const char* name = NULL;
+	pairs->len = 0;
+	if (!consume(p, '}')) {
+		do {
+			char* key = NULL;
+			char* value = NULL;
+			int r = json_string(p, arena, &key);
+			if (r)
+				return r;
+			if (!consume(p, ':'))
+				return parse_error(p->path, p->line, "expected :");
+			skip_ws(p);
+			if (p->pos < p->end && *p->pos == '"')
+				r = json_string(p, arena, &value);
+			else
+				r = json_scalar(p, arena, &value);
+			if (r)
+				return r;
+			if (!strcmp(key, UNIT_KEY))
+				name = value;
+			else if (value)
+				r = pairs_add(pairs, key, value);
+			if (r)
+				return r;
+		} while (consume(p, ','));
+		if (!consume(p, '}'))
+			return parse_error(p->path, p->line, "expected , or }");
+	}
+
+	if (!name || *name == '\0')
+		return parse_error(p->path, line, "object without " UNIT_KEY);
+	return add_unit(manifest, name, pairs, arena);
+}
+
+static int parse_json(struct parser* p, struct nvram_manifest* manifest, struct nvram_arena* arena)
+{
+	struct pairs pairs;
+	memset(&pairs, 0, sizeof(pairs));
+	int r = 0;
+
+	if (!consume(p, '[')) {
+		r = parse_error(p->path, p->line, "expected array");
+		goto exit;
+	}
+	if (!consume(p, ']')) {
+		do {
+			r = json_unit(p, &pairs, manifest, arena);
+			if (r)
+				goto exit;
+		} while (consume(p, ','));
+		if (!consume(p, ']')) {
+			r = parse_error(p->path, p->line, "expected , or ]");
+			goto exit;
+		}
+	}
+	skip_ws(p);
+	if (p->pos != p->end)
+		r = parse_error(p->path, p->line, "data after array");
+
+exit:
+	free(pairs.pairs);
+	return r;
+}
+
+static int compare_names(const void* a, const void* b)
+{
+	return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+/* Units are written to directories named after them */
+static int check_names(const char* path, const struct nvram_manifest* manifest)
+{
+	for (size_t i = 0; i < manifest->units_len; ++i) {
+		const char* name = manifest->units[i].name;
+		if (strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+			pr_err("%s: " UNIT_KEY " %s not usable as directory name\n", path, name);
+			return -EINVAL;
+		}
+	}
+	if (manifest->units_len < 2)
+		return 0;
+
+	const char** names = malloc(manifest->units_len * sizeof(*names));
+	if (!names)
+		return -ENOMEM;
+	for (size_t i = 0; i < manifest->units_len; ++i)
+		names[i] = manifest->units[i].name;
+	qsort(names, manifest->units_len, sizeof(*names), compare_names);
+	int r = 0;
+	for (size_t i = 1; i < manifest->units_len; ++i) {
+		if (!strcmp(names[i - 1], names[i])) {
+			pr_err("%s: " UNIT_KEY " %s listed more than once\n", path, names[i]);
+			r = -EINVAL;
+			break;
+		}
+	}
+	free(names);
+	return r;
+}
+
+static int ends_with(const char* str, const char* suffix)
+{
+	const size_t len = strlen(str);
+	const size_t suffix_len = strlen(suffix);
+	return len >= suffix_len && !strcmp(str + len - suffix_len, suffix);
+}
+
+int nvram_manifest_read(const char* path, struct nvram_manifest* manifest, struct nvram_arena* arena)
+{
+	char* data = NULL;
+	size_t len = 0;
+	int r = read_file(path, &data, &len);
+	if (r) {
+		pr_err("failed reading %s [%d]: %s\n", path, -r, strerror(-r));
+		return r;
+	}
+
+	struct parser p = {.path = path, .pos = data, .end = data + len, .line = 1};
+	if (ends_with(path, ".json"))
+		r = parse_json(&p, manifest, arena);
+	else
+		r = parse_csv(&p, manifest, arena);
+	if (r == 0)
+		r = check_names(path, manifest);
+
+	free(data);
+	return r;
+}
+
+int nvram_manifest_read_template(const char* path, struct nvram_manifest_unit* unit, struct nvram_arena* arena)
+{
+	char* data = NULL;
+	size_t len = 0;
+	int r = read_file(path, &data, &len);
+	if (r) {
+		pr_err("failed reading %s [%d]: %s\n", path, -r, strerror(-r));
+		return r;
+	}
+
+	struct pairs pairs;
+	memset(&pairs, 0, sizeof(pairs));
+	struct parser p = {.path = path, .pos = data, .end = data + len, .line = 1};
+	while (p.pos < p.end) {
+		const char* eol = memchr(p.pos, '\n', p.end - p.pos);
+		if (!eol)
+			eol = p.end;
+		const char* line_end = eol;
+		if (line_end > p.pos && line_end[-1] == '\r')
+			line_end--;
+
+		if (line_end > p.pos && *p.pos != '#') {
+			const char* eq = memchr(p.pos, '=', line_end - p.pos);
+			if (!eq || eq == p.pos) {
+				r = parse_error(path, p.line, "expected KEY=VALUE");
+				goto exit;
+			}
+			const char* key = copy_str(arena, p.pos, eq - p.pos);
+			const char* value = copy_str(arena, eq + 1, line_end - eq - 1);
+			if (!key || !value) {
+				r = -ENOMEM;
+				goto exit;
+			}
+			r = pairs_add(&pairs, key, value);
+			if (r)
+				goto exit;
+		}
+		p.pos = eol < p.end ? eol + 1 : p.end;
+		p.line++;
+	}
+
+	unit->name = NULL;
+	r = copy_pairs(&pairs, unit, arena);
+
+exit:
+	free(pairs.pairs);
+	free(data);
+	return r;
+}
+
+void nvram_manifest_destroy(struct nvram_manifest* manifest)
+{
+	free(manifest->units);
+	memset(manifest, 0, sizeof(*manifest));
+}
@@ -0,0 +1,64 @@
+#ifndef NVRAM_MANIFEST_H_
+#define NVRAM_MANIFEST_H_
+
+#include <stddef.h>
+#include "nvram_arena.h"
+
+/*
+ * Attributes of units to provision, read by nvram-image.
+ *
+ * A manifest holds one unit per row. CSV manifests have a header row naming
+ * the columns, one of them "unit", and an empty field leaves the attribute of
+ * that column unset. JSON manifests are an array of objects with a "unit"
+ * member, numbers and booleans are kept as their text and null members are
+ * unset.
+ *
+ * Templates hold attributes set for all units as KEY=VALUE lines, empty lines
+ * and lines starting with # are skipped.
+ *
+ * Names, keys and values are strings allocated from the arena passed in.
+ */
+
+struct nvram_manifest_pair {
+	const char* key;
+	const char* value;
+};
+
+struct nvram_manifest_unit {
+	/* NULL for template */
+	const char* name;
+	const struct nvram_manifest_pair* pairs;
+	size_t pairs_len;
+};
+
+struct nvram_manifest {
+	struct nvram_manifest_unit* units;
+	size_t units_len;
+	size_t units_cap;
+};
+
+/*
+ * Read manifest at path, JSON if it ends in .json, otherwise CSV. Unit names
+ * are unique and can be used as file names.
+ *
+ * @returns
+ *   0 for success
+ *   -EINVAL for malformed manifest, with error printed
+ *   other negative errno for error
+ */
+int nvram_manifest_read(const char* path, struct nvram_manifest* manifest, struct nvram_arena* arena);
+
+/*
+ * Read template at path into unit
+ *
+ * @returns
+ *   0 for success
+ *   -EINVAL for malformed template, with error printed
+ *   other negative errno for error
+ */
+int nvram_manifest_read_template(const char* path, struct nvram_manifest_unit* unit, struct nvram_arena* arena);
+
+/* Free units, strings are returned with the arena */
+void nvram_manifest_destroy(struct nvram_manifest* manifest);
+
+#endif // NVRAM_MANIFEST_H_
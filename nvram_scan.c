@@ -0,0 +1,363 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "libnvram/libnvram.h"
+#include "log.h"
+#include "nvram_crc32.h"
+#include "nvram_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NVRAM_SCAN_X86 1
+#endif
+
+/* v2 header starts with the u32 transaction counter followed by the u8 type */
+#define V2_TYPE_OFFSET 4
+
+/* Layout of struct platform_header, see nvram_format_platform.c */
+#define PLATFORM_MAGIC 0x54414c50
+#define PLATFORM_HEADER_SIZE 1024
+#define PLATFORM_BLOB_OFFSET 72
+#define PLATFORM_BLOB_SIZE 76
+#define PLATFORM_BLOB_CRC32 84
+#define PLATFORM_TOTAL_SIZE 1016
+#define PLATFORM_HDR_CRC32 1020
+
+
+static uint32_t le32(const uint8_t* buf)
+{
+	return (uint32_t) buf[3] << 24 | (uint32_t) buf[2] << 16 | (uint32_t) buf[1] << 8 | buf[0];
+}
+
+static size_t align_up(size_t offset, size_t align)
+{
+	return (offset + align - 1) & ~(align - 1);
+}
+
+static int always_supported(void)
+{
+	return 1;
+}
+
+static int is_zero(const uint8_t* buf, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		if (buf[i])
+			return 0;
+	}
+	return 1;
+}
+
+static enum nvram_scan_type candidate_type(const uint8_t* buf, size_t size, size_t offset)
+{
+	int type = 0;
+	if (size - offset >= sizeof(uint32_t) && le32(buf + offset) == PLATFORM_MAGIC)
+		type |= NVRAM_SCAN_PLATFORM;
+	if (size - offset > V2_TYPE_OFFSET && buf[offset + V2_TYPE_OFFSET] == LIBNVRAM_TYPE_LIST) {
+		const size_t hdr_len = libnvram_header_len();
+		if (size - offset < hdr_len || !is_zero(buf + offset, hdr_len))
+			type |= NVRAM_SCAN_V2;
+	}
+	return (enum nvram_scan_type) type;
+}
+
+static int scan_generic(const uint8_t* buf, size_t size, size_t begin, size_t end, size_t align, nvram_scan_candidate candidate, void* ctx)
+{
+	for (size_t offset = align_up(begin, align); offset < end; offset += align) {
+		const enum nvram_scan_type type = candidate_type(buf, size, offset);
+		if (type) {
+			const int r = candidate(ctx, offset, type);
+			if (r)
+				return r;
+		}
+	}
+	return 0;
+}
+
+/* Bits of a block of width offsets, starting at a multiple of width, that are multiples of align */
+static uint32_t align_mask(size_t align, size_t width)
+{
+	uint32_t mask = 0;
+	for (size_t i = 0; i < width; i += align)
+		mask |= (uint32_t) 1 << i;
+	return mask;
+}
+
+static int candidates_in_block(size_t block, uint32_t platform, uint32_t v2, nvram_scan_candidate candidate, void* ctx)
+{
+	uint32_t any = platform | v2;
+	while (any) {
+		const uint32_t bit = any & -any;
+		any &= any - 1;
+		int type = 0;
+		if (platform & bit)
+			type |= NVRAM_SCAN_PLATFORM;
+		if (v2 & bit)
+			type |= NVRAM_SCAN_V2;
+		const int r = candidate(ctx, block + (size_t) __builtin_ctz(bit), (enum nvram_scan_type) type);
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+/*
+ * Sets bits of offsets in block p holding the platform magic and the v2 list
+ * type, and bits of zero bytes from p on
+ */
+typedef void (*block_masks)(const uint8_t* p, uint32_t* platform, uint32_t* v2, uint64_t* zero);
+
+/* Bits i of bits where bits i to i + len - 1 are all set, bits past the end count as unset */
+static uint64_t runs(uint64_t bits, size_t len)
+{
+	size_t have = 1;
+	while (have * 2 <= len) {
+		bits &= bits >> have;
+		have *= 2;
+	}
+	if (have < len)
+		bits &= bits >> (len - have);
+	return bits;
+}
+
+/*
+ * Scan full blocks of width offsets with masks reading read bytes, offsets
+ * before the first and after the last full block are left to scan_generic.
+ *
+ * Zero filled areas hold the list type at every offset, v2 candidates with
+ * an all zero header are dropped as by candidate_type.
+ */
+static int scan_blocks(const uint8_t* buf, size_t size, size_t begin, size_t end, size_t align, size_t width, size_t read,
+		block_masks masks, nvram_scan_candidate candidate, void* ctx)
+{
+	if (align > width || size < read)
+		return scan_generic(buf, size, begin, end, align, candidate, ctx);
+
+	size_t block = align_up(begin, width);
+	if (block > end)
+		block = end;
+	int r = scan_generic(buf, size, begin, block, align, candidate, ctx);
+	if (r)
+		return r;
+
+	const uint32_t aligned = align_mask(align, width);
+	const size_t hdr_len = libnvram_header_len();
+	const size_t last = size - read;
+	for (; block < end && block <= last; block += width) {
+		uint32_t platform = 0;
+		uint32_t v2 = 0;
+		uint64_t zero = 0;
+		masks(buf + block, &platform, &v2, &zero);
+		uint32_t mask = aligned;
+		if (end - block < width)
+			mask &= ((uint32_t) 1 << (end - block)) - 1;
+		platform &= mask;
+		v2 &= mask & ~(uint32_t) runs(zero, hdr_len);
+		if (platform | v2) {
+			r = candidates_in_block(block, platform, v2, candidate, ctx);
+			if (r)
+				return r;
+		}
+	}
+	return block < end ? scan_generic(buf, size, block, end, align, candidate, ctx) : 0;
+}
+
+#ifdef NVRAM_SCAN_X86
+#define MAGIC_BYTE(n) ((char) ((PLATFORM_MAGIC >> (8 * (n))) & 0xff))
+
+/* Bytes read by masks_sse2 and masks_avx2 */
+#define SSE2_READ 48
+#define AVX2_READ 64
+
+__attribute__((target("sse2")))
+static void masks_sse2(const uint8_t* p, uint32_t* platform, uint32_t* v2, uint64_t* zero)
+{
+	const __m128i b0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), _mm_set1_epi8(MAGIC_BYTE(0)));
+	const __m128i b1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 1)), _mm_set1_epi8(MAGIC_BYTE(1)));
+	const __m128i b2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 2)), _mm_set1_epi8(MAGIC_BYTE(2)));
+	const __m128i b3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 3)), _mm_set1_epi8(MAGIC_BYTE(3)));
+	const __m128i type = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + V2_TYPE_OFFSET)), _mm_set1_epi8(LIBNVRAM_TYPE_LIST));
+	*platform = (uint32_t) _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(b0, b1), _mm_and_si128(b2, b3)));
+	*v2 = (uint32_t) _mm_movemask_epi8(type);
+	const __m128i z = _mm_setzero_si128();
+	*zero = (uint64_t) (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), z))
+		| (uint64_t) (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 16)), z)) << 16
+		| (uint64_t) (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 32)), z)) << 32;
+}
+
+__attribute__((target("avx2")))
+static void masks_avx2(const uint8_t* p, uint32_t* platform, uint32_t* v2, uint64_t* zero)
+{
+	const __m256i b0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) p), _mm256_set1_epi8(MAGIC_BYTE(0)));
+	const __m256i b1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (p + 1)), _mm256_set1_epi8(MAGIC_BYTE(1)));
+	const __m256i b2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (p + 2)), _mm256_set1_epi8(MAGIC_BYTE(2)));
+	const __m256i b3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (p + 3)), _mm256_set1_epi8(MAGIC_BYTE(3)));
+	const __m256i type = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (p + V2_TYPE_OFFSET)), _mm256_set1_epi8(LIBNVRAM_TYPE_LIST));
+	*platform = (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(b0, b1), _mm256_and_si256(b2, b3)));
+	*v2 = (uint32_t) _mm256_movemask_epi8(type);
+	const __m256i z = _mm256_setzero_si256();
+	*zero = (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) p), z))
+		| (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (p + 32)), z)) << 32;
+}
+
+static int scan_sse2(const uint8_t* buf, size_t size, size_t begin, size_t end, size_t align, nvram_scan_candidate candidate, void* ctx)
+{
+	return scan_blocks(buf, size, begin, end, align, 16, SSE2_READ, masks_sse2, candidate, ctx);
+}
+
+static int scan_avx2(const uint8_t* buf, size_t size, size_t begin, size_t end, size_t align, nvram_scan_candidate candidate, void* ctx)
+{
+	return scan_blocks(buf, size, begin, end, align, 32, AVX2_READ, masks_avx2, candidate, ctx);
+}
+
+static int sse2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static int avx2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* Ordered by preference */
+static const struct nvram_scan_impl impls[] = {
+#ifdef NVRAM_SCAN_X86
+	{.name = "avx2", .supported = avx2_supported, .scan = scan_avx2},
+	{.name = "sse2", .supported = sse2_supported, .scan = scan_sse2},
+#endif
+	{.name = "generic", .supported = always_supported, .scan = scan_generic},
+	{.name = NULL},
+};
+
+const struct nvram_scan_impl* nvram_scan_impls(void)
+{
+	return impls;
+}
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static const struct nvram_scan_impl* scan_impl;
+
+static const struct nvram_scan_impl* resolve_impl(void)
+{
+	const struct nvram_scan_impl* impl = __atomic_load_n(&scan_impl, __ATOMIC_RELAXED);
+	if (impl == NULL) {
+		impl = &impls[0];
+		while (!impl->supported())
+			impl++;
+		pr_dbg("scan: %s\n", impl->name);
+		__atomic_store_n(&scan_impl, impl, __ATOMIC_RELAXED);
+	}
+	return impl;
+}
+
+const char* nvram_scan_impl_name(void)
+{
+	return resolve_impl()->name;
+}
+
+// return 1 for valid header, 0 for invalid
+static int check_v2(const uint8_t* buf, size_t size, size_t offset, struct nvram_scan_section* section)
+{
+	const uint32_t hdr_len = libnvram_header_len();
+	if (size - offset < hdr_len)
+		return 0;
+	const uint8_t* hdr_buf = buf + offset;
+	struct libnvram_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	if (libnvram_validate_header(hdr_buf, hdr_len, &hdr) || hdr.type != LIBNVRAM_TYPE_LIST)
+		return 0;
+	section->type = NVRAM_SCAN_V2;
+	section->size = (size_t) hdr_len + hdr.len;
+	section->counter = hdr.user;
+	if (section->size > size - offset)
+		section->data_valid = 0;
+	else if (nvram_crc32_matches(libnvram_crc32))
+		section->data_valid = nvram_crc32(0, hdr_buf + hdr_len, hdr.len) == hdr.crc32;
+	else
+		section->data_valid = libnvram_crc32(hdr_buf + hdr_len, hdr.len) == hdr.crc32;
+	return 1;
+}
+
+// return 1 for valid header, 0 for invalid
+static int check_platform(const uint8_t* buf, size_t size, size_t offset, struct nvram_scan_section* section)
+{
+	if (size - offset < PLATFORM_HEADER_SIZE)
+		return 0;
+	const uint8_t* hdr = buf + offset;
+	if (nvram_crc32(0, hdr, PLATFORM_HDR_CRC32) != le32(hdr + PLATFORM_HDR_CRC32))
+		return 0;
+	const uint32_t total_size = le32(hdr + PLATFORM_TOTAL_SIZE);
+	const size_t blob_offset = le32(hdr + PLATFORM_BLOB_OFFSET);
+	const size_t blob_size = le32(hdr + PLATFORM_BLOB_SIZE);
+	const size_t avail = size - offset;
+	section->type = NVRAM_SCAN_PLATFORM;
+	section->size = total_size > PLATFORM_HEADER_SIZE ? total_size : PLATFORM_HEADER_SIZE;
+	section->counter = 0;
+	section->data_valid = section->size <= avail;
+	if (section->data_valid && blob_size > 0) {
+		section->data_valid = blob_offset <= avail && blob_size <= avail - blob_offset
+			&& nvram_crc32(0, hdr + blob_offset, blob_size) == le32(hdr + PLATFORM_BLOB_CRC32);
+	}
+	return 1;
+}
+
+struct scan {
+	const uint8_t* buf;
+	size_t size;
+	struct nvram_scan_sections* sections;
+};
+
+static int add_section(struct nvram_scan_sections* sections, const struct nvram_scan_section* section)
+{
+	if (sections->len == sections->cap) {
+		const size_t cap = sections->cap ? sections->cap * 2 : 16;
+		struct nvram_scan_section* grown = realloc(sections->sections, cap * sizeof(*grown));
+		if (grown == NULL)
+			return -ENOMEM;
+		sections->sections = grown;
+		sections->cap = cap;
+	}
+	sections->sections[sections->len++] = *section;
+	return 0;
+}
+
+static int check_candidate(void* ctx, size_t offset, enum nvram_scan_type type)
+{
+	struct scan* scan = ctx;
+	struct nvram_scan_section section;
+	memset(&section, 0, sizeof(section));
+	section.offset = offset;
+	int r = 0;
+	if ((type & NVRAM_SCAN_PLATFORM) && check_platform(scan->buf, scan->size, offset, &section))
+		r = add_section(scan->sections, &section);
+	if (!r && (type & NVRAM_SCAN_V2) && check_v2(scan->buf, scan->size, offset, &section))
+		r = add_section(scan->sections, &section);
+	return r;
+}
+
+int nvram_scan(const uint8_t* buf, size_t size, size_t begin, size_t end, size_t align, struct nvram_scan_sections* sections)
+{
+	if (align == 0 || (align & (align - 1)))
+		return -EINVAL;
+	if (end > size)
+		end = size;
+	if (begin >= end)
+		return 0;
+
+	struct scan scan = {.buf = buf, .size = size, .sections = sections};
+	return resolve_impl()->scan(buf, size, begin, end, align, check_candidate, &scan);
+}
+
+void nvram_scan_destroy(struct nvram_scan_sections* sections)
+{
+	free(sections->sections);
+	sections->sections = NULL;
+	sections->len = 0;
+	sections->cap = 0;
+}
@@ -0,0 +1,77 @@
+#ifndef NVRAM_SCAN_H_
+#define NVRAM_SCAN_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Locate v2 and platform sections in raw dumps of flash or disks.
+ *
+ * Platform headers start with HEADER_MAGIC. v2 headers have no magic, offsets
+ * holding the list type at the type field are candidates unless the header is
+ * all zero, which fails its crc and would make every offset of zero filled
+ * areas a candidate. Candidates are found by the fastest implementation
+ * supported by the running cpu and kept only if their header crc matches.
+ */
+
+enum nvram_scan_type {
+	NVRAM_SCAN_V2 = 1 << 0,
+	NVRAM_SCAN_PLATFORM = 1 << 1,
+};
+
+struct nvram_scan_section {
+	size_t offset;
+	enum nvram_scan_type type;
+	/* Header and data, may extend past the end of the dump */
+	size_t size;
+	/* Transaction counter, v2 only */
+	uint32_t counter;
+	/* Data is within the dump and its crc matches */
+	int data_valid;
+};
+
+struct nvram_scan_sections {
+	struct nvram_scan_section* sections;
+	size_t len;
+	size_t cap;
+};
+
+/*
+ * Scan buf for sections starting in [begin, end) at multiples of align
+ *
+ * @params
+ *   buf: dump, sections starting before end are validated up to size
+ *   align: power of two
+ *   sections: found sections are appended, in order of offset
+ *
+ * @returns
+ *   0 for success
+ *   -EINVAL for invalid align
+ *   -ENOMEM for allocation failure
+ */
+int nvram_scan(const uint8_t* buf, size_t size, size_t begin, size_t end, size_t align, struct nvram_scan_sections* sections);
+
+/* Free sections */
+void nvram_scan_destroy(struct nvram_scan_sections* sections);
+
+/* Called for candidate offsets, type holds the types matching */
+typedef int (*nvram_scan_candidate)(void* ctx, size_t offset, enum nvram_scan_type type);
+
+struct nvram_scan_impl {
+	const char* name;
+	/* Returns 1 if usable on running cpu */
+	int (*supported)(void);
+	/*
+	 * Call candidate for offsets in [begin, end) at multiples of align,
+	 * stops at the first non-zero return, which is returned
+	 */
+	int (*scan)(const uint8_t* buf, size_t size, size_t begin, size_t end, size_t align, nvram_scan_candidate candidate, void* ctx);
+};
+
+/* Returns compiled in implementations, terminated by entry with name NULL */
+const struct nvram_scan_impl* nvram_scan_impls(void);
+
+/* Returns name of implementation used by nvram_scan */
+const char* nvram_scan_impl_name(void);
+
+#endif // NVRAM_SCAN_H_
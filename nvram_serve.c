@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "log.h"
+#include "nvram_serve.h"
+
+#define MAX_REQUEST_SIZE 65536
+/* Clients stalling mid-request must not block the server */
+#define CLIENT_TIMEOUT_S 5
+#define LISTEN_BACKLOG 16
+/* Clients need to be the server's user or in its group */
+#define SOCKET_MODE 0660
+
+enum request_flags {
+	REQUEST_SYSTEM_UNLOCKED = 1 << 0,
+};
+
+/*
+ * Sent by client with its stdout and stderr attached as SCM_RIGHTS, followed
+ * by len bytes of argc NUL-terminated arguments. Server replies with int32_t
+ * result.
+ */
+struct request_header {
+	uint32_t flags;
+	uint32_t argc;
+	uint32_t len;
+};
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int sig)
+{
+	(void) sig;
+	stop_requested = 1;
+}
+
+static int make_address(const char* path, struct sockaddr_un* addr)
+{
+	const size_t len = strlen(path);
+	if (len == 0 || len >= sizeof(addr->sun_path))
+		return -ENAMETOOLONG;
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path, len);
+	return 0;
+}
+
+static int recv_all(int sock, void* buf, size_t size)
+{
+	uint8_t* pbuf = buf;
+	while (size > 0) {
+		ssize_t bytes = recv(sock, pbuf, size, 0);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (bytes == 0)
+			return -EPIPE;
+		pbuf += bytes;
+		size -= bytes;
+	}
+	return 0;
+}
+
+static int send_all(int sock, const void* buf, size_t size)
+{
+	const uint8_t* pbuf = buf;
+	while (size > 0) {
+		ssize_t bytes = send(sock, pbuf, size, MSG_NOSIGNAL);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		pbuf += bytes;
+		size -= bytes;
+	}
+	return 0;
+}
+
+/* Receive header and the client stdout and stderr descriptors into fds */
+static int recv_header(int sock, struct request_header* hdr, int fds[2])
+{
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(*hdr) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t bytes = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (bytes < 0)
+		return -errno;
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+			&& cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int)))
+		memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+	if (fds[0] < 0 || fds[1] < 0 || (msg.msg_flags & MSG_CTRUNC) != 0)
+		return -EPROTO;
+
+	if ((size_t) bytes < sizeof(*hdr))
+		return recv_all(sock, (uint8_t*) hdr + bytes, sizeof(*hdr) - bytes);
+	return 0;
+}
+
+/* Run request with stdout and stderr temporarily replaced by the client's */
+static int run_redirected(const struct nvram_serve_ops* ops, void* ctx, const int fds[2], int argc, char** argv, int system_unlocked)
+{
+	fflush(stdout);
+	fflush(stderr);
+	const int saved_out = dup(STDOUT_FILENO);
+	const int saved_err = dup(STDERR_FILENO);
+	int r = 0;
+	if (saved_out < 0 || saved_err < 0) {
+		r = -errno;
+		goto exit;
+	}
+	if (dup2(fds[0], STDOUT_FILENO) < 0 || dup2(fds[1], STDERR_FILENO) < 0) {
+		r = -errno;
+		goto restore;
+	}
+
+	r = ops->request(ctx, argc, argv, system_unlocked);
+
+	fflush(stdout);
+	fflush(stderr);
+restore:
+	dup2(saved_out, STDOUT_FILENO);
+	dup2(saved_err, STDERR_FILENO);
+exit:
+	if (saved_out >= 0)
+		close(saved_out);
+	if (saved_err >= 0)
+		close(saved_err);
+	return r;
+}
+
+/*
+ * The unlock is only the client's word, it is trusted from root and the
+ * server's own user. Clients running directly write sections with their own
+ * permissions, through the server they write with the server's.
+ */
+static int peer_trusted(int sock, int* trusted)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return -errno;
+	*trusted = cred.uid == 0 || cred.uid == geteuid();
+	if (!*trusted)
+		pr_dbg("client uid %u not trusted with system unlock\n", (unsigned) cred.uid);
+	return 0;
+}
+
+static int handle_client(int sock, const struct nvram_serve_ops* ops, void* ctx)
+{
+	const struct timeval timeout = { .tv_sec = CLIENT_TIMEOUT_S, .tv_usec = 0 };
+	struct request_header hdr;
+	int fds[2] = {-1, -1};
+	char* args = NULL;
+	char** argv = NULL;
+	int trusted = 0;
+
+	int r = 0;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))
+			|| setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))) {
+		r = -errno;
+		goto exit;
+	}
+
+	r = peer_trusted(sock, &trusted);
+	if (r)
+		goto exit;
+	r = recv_header(sock, &hdr, fds);
+	if (r)
+		goto exit;
+	if (hdr.len > MAX_REQUEST_SIZE || hdr.argc > hdr.len) {
+		r = -E2BIG;
+		goto exit;
+	}
+
+	args = malloc(hdr.len + 1);
+	argv = calloc(hdr.argc + 1, sizeof(char*));
+	if (!args || !argv) {
+		r = -ENOMEM;
+		goto exit;
+	}
+	r = recv_all(sock, args, hdr.len);
+	if (r)
+		goto exit;
+	args[hdr.len] = '\0';
+
+	size_t pos = 0;
+	for (uint32_t i = 0; i < hdr.argc; ++i) {
+		if (pos >= hdr.len) {
+			r = -EPROTO;
+			goto exit;
+		}
+		argv[i] = args + pos;
+		pos += strlen(args + pos) + 1;
+	}
+
+	const int32_t result = run_redirected(ops, ctx, fds, (int) hdr.argc, argv,
+			trusted && (hdr.flags & REQUEST_SYSTEM_UNLOCKED) == REQUEST_SYSTEM_UNLOCKED);
+	r = send_all(sock, &result, sizeof(result));
+
+exit:
+	for (int i = 0; i < 2; ++i) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	free(argv);
+	free(args);
+	return r;
+}
+
+int nvram_serve_run(const char* path, const struct nvram_serve_ops* ops, void* ctx)
+{
+	struct sockaddr_un addr;
+	int r = make_address(path, &addr);
+	if (r)
+		return r;
+
+	sigset_t stop_signals;
+	sigset_t orig_mask;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGTERM);
+	sigaddset(&stop_signals, SIGINT);
+	/* Only delivered while waiting in ppoll, so a request is never interrupted */
+	sigprocmask(SIG_BLOCK, &stop_signals, &orig_mask);
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = request_stop;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	/* Clients may go away while output is written to them */
+	signal(SIGPIPE, SIG_IGN);
+
+	const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		r = -errno;
+		pr_err("failed creating socket [%d]: %s\n", -r, strerror(-r));
+		goto exit;
+	}
+	/* Left by a server that didn't shut down cleanly, no server can be running while we hold the locks */
+	if (unlink(path) && errno != ENOENT) {
+		r = -errno;
+		pr_err("failed removing stale socket: %s [%d]: %s\n", path, -r, strerror(-r));
+		goto exit;
+	}
+	/* Mode is set by bind, restricted through umask so it doesn't depend on the caller's */
+	const mode_t mask = umask(~SOCKET_MODE & 0777);
+	r = bind(sock, (struct sockaddr*) &addr, sizeof(addr)) ? -errno : 0;
+	umask(mask);
+	if (r == 0 && listen(sock, LISTEN_BACKLOG))
+		r = -errno;
+	if (r) {
+		pr_err("failed listening on socket: %s [%d]: %s\n", path, -r, strerror(-r));
+		goto exit;
+	}
+	pr_dbg("serving on: %s\n", path);
+
+	while (!stop_requested) {
+		const long timeout_ms = ops->next_timeout(ctx);
+		struct timespec timeout;
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		struct pollfd pfd = { .fd = sock, .events = POLLIN, .revents = 0 };
+
+		const int n = ppoll(&pfd, 1, timeout_ms < 0 ? NULL : &timeout, &orig_mask);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			r = -errno;
+			pr_err("failed waiting for requests [%d]: %s\n", -r, strerror(-r));
+			break;
+		}
+		if (n == 0) {
+			ops->timeout(ctx);
+			continue;
+		}
+
+		const int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (client < 0)
+			continue;
+		const int client_r = handle_client(client, ops, ctx);
+		if (client_r)
+			pr_err("failed handling request [%d]: %s\n", -client_r, strerror(-client_r));
+		close(client);
+	}
+	pr_dbg("stopped serving: %s\n", path);
+
+exit:
+	if (sock >= 0) {
+		close(sock);
+		unlink(path);
+	}
+	sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+	return r;
+}
+
+int nvram_serve_forward(const char* path, int argc, char** argv, int system_unlocked, int* result)
+{
+	struct sockaddr_un addr;
+	int r = make_address(path, &addr);
+	if (r)
+		return r;
+
+	size_t len = 0;
+	for (int i = 0; i < argc; ++i)
+		len += strlen(argv[i]) + 1;
+	if (len > MAX_REQUEST_SIZE)
+		return -E2BIG;
+
+	const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+	char* args = NULL;
+	if (connect(sock, (struct sockaddr*) &addr, sizeof(addr))) {
+		r = -errno;
+		goto exit;
+	}
+	pr_dbg("forwarding to: %s\n", path);
+
+	args = malloc(len ? len : 1);
+	if (!args) {
+		r = -ENOMEM;
+		goto exit;
+	}
+	size_t pos = 0;
+	for (int i = 0; i < argc; ++i) {
+		const size_t arg_len = strlen(argv[i]) + 1;
+		memcpy(args + pos, argv[i], arg_len);
+		pos += arg_len;
+	}
+
+	struct request_header hdr;
+	hdr.flags = system_unlocked ? REQUEST_SYSTEM_UNLOCKED : 0;
+	hdr.argc = argc;
+	hdr.len = len;
+	const int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	fflush(stdout);
+	fflush(stderr);
+	ssize_t bytes = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	if (bytes < 0) {
+		r = -errno;
+		goto exit;
+	}
+	if ((size_t) bytes < sizeof(hdr)) {
+		r = send_all(sock, (uint8_t*) &hdr + bytes, sizeof(hdr) - bytes);
+		if (r)
+			goto exit;
+	}
+	r = send_all(sock, args, len);
+	if (r)
+		goto exit;
+
+	int32_t reply = 0;
+	r = recv_all(sock, &reply, sizeof(reply));
+	if (r)
+		goto exit;
+	*result = reply;
+
+exit:
+	free(args);
+	close(sock);
+	return r;
+}
@@ -0,0 +1,63 @@
+#ifndef NVRAM_SERVE_H_
+#define NVRAM_SERVE_H_
+
+/*
+ * Unix socket transport between nvram invocations and a resident process.
+ *
+ * A client sends its arguments along with its stdout and stderr descriptors,
+ * the server runs the request with those as its own stdout and stderr and
+ * replies with the result.
+ *
+ * The socket is created with mode 0660, so only the server's user and group
+ * can connect. System unlock of clients other than root and the server's
+ * user is ignored.
+ */
+
+struct nvram_serve_ops {
+	/*
+	 * Handle request. Output on stdout and stderr goes to the client.
+	 *
+	 * @params
+	 *   ctx: server data
+	 *   argc, argv: client arguments, without program name
+	 *   system_unlocked: client had system writes unlocked and is trusted with it
+	 *
+	 * @returns
+	 *   0 for success
+	 *   negative errno for error
+	 */
+	int (*request)(void* ctx, int argc, char** argv, int system_unlocked);
+
+	/*
+	 * Get milliseconds until timeout should be called, -1 for none
+	 */
+	long (*next_timeout)(void* ctx);
+
+	/* Called when next_timeout has expired */
+	void (*timeout)(void* ctx);
+};
+
+/*
+ * Serve requests on socket at path until SIGTERM or SIGINT
+ *
+ * @returns
+ *   0 when stopped by signal
+ *   negative errno for error
+ */
+int nvram_serve_run(const char* path, const struct nvram_serve_ops* ops, void* ctx);
+
+/*
+ * Forward request to server at path
+ *
+ * @params
+ *   result: result of request on server
+ *
+ * @returns
+ *   0 if request was handled by server
+ *   -ENOENT or -ECONNREFUSED if no server is running
+ *   -EACCES or -EPERM if not allowed to connect to the server
+ *   negative errno for other errors
+ */
+int nvram_serve_forward(const char* path, int argc, char** argv, int system_unlocked, int* result);
+
+#endif // NVRAM_SERVE_H_
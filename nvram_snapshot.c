@@ -0,0 +1,526 @@
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "nvram_arena.h"
+#include "nvram_index.h"
+#include "nvram_snapshot.h"
+
+/* "NVSN" in little endian */
+#define SNAPSHOT_MAGIC 0x4e53564eU
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_SECTIONS 2
+#define SNAPSHOT_ALL (NVRAM_SNAPSHOT_SYSTEM | NVRAM_SNAPSHOT_USER)
+/* Times a reader retries when the snapshot changed while looking up */
+#define LOOKUP_TRIES 3
+#define ENTRY_HEADER_SIZE 8
+
+/*
+ * File layout, offsets are from start of file:
+ *
+ *   header
+ *   source: interface, format and sections, each null-terminated
+ *   per section: uint32_t offsets of entries sorted by key, then the entries
+ *   entry: [key_len u32][value_len u32][key][value]
+ *
+ * Numbers are in host byte order, the file is not meant to leave the host.
+ * Writers serialize on a flock of the file, each may hold the nvram lock of
+ * only the section it publishes.
+ */
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	/* Odd while invalid, accessed atomically */
+	uint32_t seq;
+	/* enum nvram_snapshot_section of sections matching nvram */
+	uint32_t sections;
+	/* Bytes used, the file may be larger from an earlier snapshot */
+	uint32_t size;
+	uint32_t source_len;
+	uint32_t index_off[SNAPSHOT_SECTIONS];
+	uint32_t count[SNAPSHOT_SECTIONS];
+};
+
+static uint32_t get_u32(const uint8_t* buf)
+{
+	uint32_t val = 0;
+	memcpy(&val, buf, sizeof(val));
+	return val;
+}
+
+static void put_u32(uint8_t* buf, uint32_t val)
+{
+	memcpy(buf, &val, sizeof(val));
+}
+
+static size_t align_u32(size_t off)
+{
+	return (off + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+}
+
+/* Returns size of source, written to buf if not NULL */
+static size_t source_str(const struct nvram_snapshot_source* source, char* buf)
+{
+	const char* fields[] = {source->interface, source->format, source->system_a, source->system_b,
+		source->user_a, source->user_b};
+	size_t len = 0;
+	for (size_t i = 0; i < sizeof(fields) / sizeof(*fields); ++i) {
+		const char* field = fields[i] ? fields[i] : "";
+		const size_t field_len = strlen(field) + 1;
+		if (buf)
+			memcpy(buf + len, field, field_len);
+		len += field_len;
+	}
+	return len;
+}
+
+static int keycmp(const uint8_t* key1, uint32_t key1_len, const uint8_t* key2, uint32_t key2_len)
+{
+	const uint32_t len = key1_len < key2_len ? key1_len : key2_len;
+	const int r = memcmp(key1, key2, len);
+	if (r != 0)
+		return r;
+	if (key1_len == key2_len)
+		return 0;
+	return key1_len < key2_len ? -1 : 1;
+}
+
+static void clear_table(struct nvram_table* table)
+{
+	nvram_table_destroy(table);
+	memset(table, 0, sizeof(*table));
+}
+
+/* Mark header invalid unless it already is, before changing anything else */
+static void begin_update(struct snapshot_header* hdr)
+{
+	if (hdr->magic != SNAPSHOT_MAGIC || hdr->version != SNAPSHOT_VERSION) {
+		__atomic_store_n(&hdr->seq, 1, __ATOMIC_RELAXED);
+		hdr->sections = 0;
+		hdr->magic = SNAPSHOT_MAGIC;
+		hdr->version = SNAPSHOT_VERSION;
+	}
+	else {
+		const uint32_t seq = __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED);
+		if ((seq & 1) == 0)
+			__atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELAXED);
+	}
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Make sequence even again after begin_update() */
+static void end_update(struct snapshot_header* hdr)
+{
+	__atomic_store_n(&hdr->seq, __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
+static int header_matches(const uint8_t* map, size_t size, const char* source, size_t source_len)
+{
+	const struct snapshot_header* hdr = (const struct snapshot_header*) map;
+	if (hdr->magic != SNAPSHOT_MAGIC || hdr->version != SNAPSHOT_VERSION || hdr->size > size)
+		return 0;
+	return hdr->source_len == source_len && sizeof(*hdr) + source_len <= size
+			&& memcmp(map + sizeof(*hdr), source, source_len) == 0;
+}
+
+/*
+ * Copy entries of section from a snapshot nobody is writing to table
+ *
+ * @returns
+ *   0 for success
+ *   -EAGAIN if section is inconsistent
+ *   other negative errno for error
+ */
+static int copy_section(const uint8_t* map, const struct snapshot_header* hdr, int section,
+		struct nvram_table* table)
+{
+	const uint64_t size = hdr->size;
+	const uint64_t index_off = hdr->index_off[section];
+	const uint64_t count = hdr->count[section];
+	if (index_off + count * sizeof(uint32_t) > size)
+		return -EAGAIN;
+	for (size_t i = 0; i < count; ++i) {
+		const uint64_t off = get_u32(map + index_off + i * sizeof(uint32_t));
+		if (off + ENTRY_HEADER_SIZE > size)
+			return -EAGAIN;
+		const uint32_t key_len = get_u32(map + off);
+		const uint32_t value_len = get_u32(map + off + sizeof(uint32_t));
+		if (off + ENTRY_HEADER_SIZE + (uint64_t) key_len + value_len > size)
+			return -EAGAIN;
+		const uint8_t* key = map + off + ENTRY_HEADER_SIZE;
+		const int r = nvram_table_append(table, key, key_len, key + key_len, value_len);
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+/*
+ * Copy sections without a table from the snapshot in fd to kept, if they
+ * match nvram there.
+ *
+ * @returns enum nvram_snapshot_section of sections copied
+ */
+static uint32_t keep_sections(int fd, size_t size, const char* source, size_t source_len,
+		const struct nvram_table* tables[SNAPSHOT_SECTIONS], struct nvram_table kept[SNAPSHOT_SECTIONS])
+{
+	if (size < sizeof(struct snapshot_header))
+		return 0;
+	const uint8_t* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return 0;
+
+	const struct snapshot_header* hdr = (const struct snapshot_header*) map;
+	uint32_t sections = 0;
+	/* Odd sequence is a writer that stopped halfway, nothing in it is kept */
+	if (header_matches(map, size, source, source_len) && (hdr->seq & 1) == 0) {
+		for (int s = 0; s < SNAPSHOT_SECTIONS; ++s) {
+			if (tables[s] != NULL || (hdr->sections & (1U << s)) == 0)
+				continue;
+			if (copy_section(map, hdr, s, &kept[s]) == 0)
+				sections |= 1U << s;
+			else
+				clear_table(&kept[s]);
+		}
+	}
+	munmap((void*) map, size);
+	return sections;
+}
+
+int nvram_snapshot_publish(const char* path, const struct nvram_snapshot_source* source,
+		const struct nvram_table* system, const struct nvram_table* user)
+{
+	const struct nvram_table* tables[SNAPSHOT_SECTIONS] = {system, user};
+	struct nvram_table kept[SNAPSHOT_SECTIONS];
+	memset(kept, 0, sizeof(kept));
+	struct nvram_index index[SNAPSHOT_SECTIONS];
+	struct nvram_arena arena;
+	memset(&arena, 0, sizeof(arena));
+	char* source_buf = NULL;
+	uint8_t* map = NULL;
+	size_t map_size = 0;
+	int fd = -1;
+	int r = 0;
+
+	const size_t source_len = source_str(source, NULL);
+	source_buf = malloc(source_len);
+	if (!source_buf) {
+		r = -ENOMEM;
+		goto exit;
+	}
+	source_str(source, source_buf);
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		r = -errno;
+		goto exit;
+	}
+	/* Section published by another writer is kept, it must not change meanwhile */
+	if (flock(fd, LOCK_EX) != 0) {
+		r = -errno;
+		goto exit;
+	}
+	struct stat sb;
+	if (fstat(fd, &sb) != 0) {
+		r = -errno;
+		goto exit;
+	}
+
+	uint32_t sections = system != NULL ? NVRAM_SNAPSHOT_SYSTEM : 0;
+	sections |= user != NULL ? NVRAM_SNAPSHOT_USER : 0;
+	if (sections != SNAPSHOT_ALL)
+		sections |= keep_sections(fd, sb.st_size, source_buf, source_len, tables, kept);
+
+	uint64_t size = sizeof(struct snapshot_header) + source_len;
+	for (int s = 0; s < SNAPSHOT_SECTIONS; ++s) {
+		if (tables[s] == NULL)
+			tables[s] = &kept[s];
+		r = nvram_index_build(&index[s], tables[s], &arena);
+		if (r)
+			goto exit;
+		size = align_u32(size) + index[s].len * sizeof(uint32_t);
+		for (size_t i = 0; i < index[s].len; ++i) {
+			struct libnvram_entry entry;
+			nvram_table_entry(tables[s], index[s].keys[i].row, &entry);
+			size += ENTRY_HEADER_SIZE + (uint64_t) entry.key_len + entry.value_len;
+		}
+	}
+
+	if (size > UINT32_MAX) {
+		/* Still invalidate what readers see */
+		size = sizeof(struct snapshot_header);
+		r = -EFBIG;
+	}
+	/* Never shrink, readers may have mapped all of it */
+	map_size = (uint64_t) sb.st_size > size ? (size_t) sb.st_size : (size_t) size;
+	if ((uint64_t) sb.st_size < size && ftruncate(fd, (off_t) size) != 0) {
+		r = -errno;
+		goto exit;
+	}
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		r = -errno;
+		goto exit;
+	}
+
+	struct snapshot_header* hdr = (struct snapshot_header*) map;
+	begin_update(hdr);
+	hdr->sections = 0;
+	if (r)
+		goto exit;
+
+	size_t off = sizeof(*hdr);
+	hdr->source_len = source_len;
+	memcpy(map + off, source_buf, source_len);
+	off += source_len;
+	for (int s = 0; s < SNAPSHOT_SECTIONS; ++s) {
+		off = align_u32(off);
+		hdr->index_off[s] = off;
+		hdr->count[s] = index[s].len;
+		size_t entry_off = off + index[s].len * sizeof(uint32_t);
+		for (size_t i = 0; i < index[s].len; ++i) {
+			struct libnvram_entry entry;
+			nvram_table_entry(tables[s], index[s].keys[i].row, &entry);
+			put_u32(map + off + i * sizeof(uint32_t), entry_off);
+			put_u32(map + entry_off, entry.key_len);
+			put_u32(map + entry_off + sizeof(uint32_t), entry.value_len);
+			entry_off += ENTRY_HEADER_SIZE;
+			memcpy(map + entry_off, entry.key, entry.key_len);
+			entry_off += entry.key_len;
+			memcpy(map + entry_off, entry.value, entry.value_len);
+			entry_off += entry.value_len;
+		}
+		off = entry_off;
+	}
+	hdr->size = off;
+	hdr->sections = sections;
+
+	end_update(hdr);
+	pr_dbg("%s: published %" PRIu32 " bytes, sections 0x%" PRIx32 "\n", path, hdr->size, sections);
+
+exit:
+	if (map)
+		munmap(map, map_size);
+	if (fd >= 0)
+		close(fd);
+	for (int s = 0; s < SNAPSHOT_SECTIONS; ++s)
+		nvram_table_destroy(&kept[s]);
+	nvram_arena_release(&arena);
+	free(source_buf);
+	return r;
+}
+
+int nvram_snapshot_invalidate(const char* path, int sections)
+{
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -errno;
+
+	int r = 0;
+	if (flock(fd, LOCK_EX) != 0) {
+		r = -errno;
+		goto exit;
+	}
+	struct stat sb;
+	if (fstat(fd, &sb) != 0) {
+		r = -errno;
+		goto exit;
+	}
+	/* Readers don't use a file this short */
+	if ((size_t) sb.st_size < sizeof(struct snapshot_header))
+		goto exit;
+
+	struct snapshot_header* hdr = mmap(NULL, sizeof(*hdr), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		r = -errno;
+		goto exit;
+	}
+	/* Other sections stay valid, unless a writer stopped halfway */
+	const int complete = hdr->magic == SNAPSHOT_MAGIC && hdr->version == SNAPSHOT_VERSION
+			&& (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) & 1) == 0;
+	begin_update(hdr);
+	hdr->sections &= ~(uint32_t) sections;
+	if (complete)
+		end_update(hdr);
+	munmap(hdr, sizeof(*hdr));
+
+exit:
+	close(fd);
+	return r;
+}
+
+int nvram_snapshot_sections(const char* path, const struct nvram_snapshot_source* source)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	struct stat sb;
+	const uint8_t* map = MAP_FAILED;
+	if (fstat(fd, &sb) == 0 && (size_t) sb.st_size >= sizeof(struct snapshot_header))
+		map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	int sections = 0;
+	const size_t source_len = source_str(source, NULL);
+	char* source_buf = malloc(source_len);
+	if (source_buf) {
+		source_str(source, source_buf);
+		const struct snapshot_header* hdr = (const struct snapshot_header*) map;
+		if (header_matches(map, sb.st_size, source_buf, source_len)
+				&& (__atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE) & 1) == 0)
+			sections = hdr->sections & SNAPSHOT_ALL;
+	}
+	free(source_buf);
+	munmap((void*) map, sb.st_size);
+	return sections;
+}
+
+/*
+ * Find key in section. Entries may change while searching, every offset is
+ * checked against the mapping before it is used.
+ *
+ * @returns
+ *   1 if found
+ *   0 if not found
+ *   -EAGAIN if section is inconsistent
+ */
+static int find_key(const uint8_t* map, size_t size, uint64_t index_off, uint64_t count,
+		const uint8_t* key, uint32_t key_len, struct libnvram_entry* entry)
+{
+	if (index_off + count * sizeof(uint32_t) > size)
+		return -EAGAIN;
+
+	size_t lo = 0;
+	size_t hi = count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const uint64_t off = get_u32(map + index_off + mid * sizeof(uint32_t));
+		if (off + ENTRY_HEADER_SIZE > size)
+			return -EAGAIN;
+		entry->key_len = get_u32(map + off);
+		entry->value_len = get_u32(map + off + sizeof(uint32_t));
+		if (off + ENTRY_HEADER_SIZE + (uint64_t) entry->key_len + entry->value_len > size)
+			return -EAGAIN;
+		entry->key = (uint8_t*) map + off + ENTRY_HEADER_SIZE;
+		entry->value = entry->key + entry->key_len;
+
+		const int cmp = keycmp(entry->key, entry->key_len, key, key_len);
+		if (cmp == 0)
+			return 1;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+static int lookup_keys(const uint8_t* map, size_t size, const char* source, size_t source_len,
+		const char* const* keys, size_t keys_len, struct nvram_table* tables[SNAPSHOT_SECTIONS])
+{
+	const struct snapshot_header* hdr = (const struct snapshot_header*) map;
+	if (!header_matches(map, size, source, source_len))
+		return -EAGAIN;
+	/* A key missing from one section may be in the other, both are needed */
+	if ((__atomic_load_n(&hdr->sections, __ATOMIC_RELAXED) & SNAPSHOT_ALL) != SNAPSHOT_ALL)
+		return -EAGAIN;
+
+	/*
+	 * Header may change under us, each field is read once. Offsets are
+	 * checked against size of our mapping, a writer may have grown the file
+	 * and raised hdr->size past it.
+	 */
+	uint64_t index_off[SNAPSHOT_SECTIONS];
+	uint64_t count[SNAPSHOT_SECTIONS];
+	for (int s = 0; s < SNAPSHOT_SECTIONS; ++s) {
+		index_off[s] = __atomic_load_n(&hdr->index_off[s], __ATOMIC_RELAXED);
+		count[s] = __atomic_load_n(&hdr->count[s], __ATOMIC_RELAXED);
+	}
+
+	for (size_t k = 0; k < keys_len; ++k) {
+		const uint32_t key_len = strlen(keys[k]) + 1;
+		for (int s = 0; s < SNAPSHOT_SECTIONS; ++s) {
+			struct libnvram_entry entry;
+			int r = find_key(map, size, index_off[s], count[s], (const uint8_t*) keys[k], key_len, &entry);
+			if (r < 0)
+				return r;
+			if (r == 0)
+				continue;
+			r = nvram_table_set(tables[s], entry.key, entry.key_len, entry.value, entry.value_len);
+			if (r < 0)
+				return r;
+		}
+	}
+	return 0;
+}
+
+int nvram_snapshot_lookup(const char* path, const struct nvram_snapshot_source* source,
+		const char* const* keys, size_t keys_len, struct nvram_table* system, struct nvram_table* user)
+{
+	struct nvram_table* tables[SNAPSHOT_SECTIONS] = {system, user};
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	int r = 0;
+	struct stat sb;
+	if (fstat(fd, &sb) != 0) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+	const size_t size = sb.st_size;
+	if (size < sizeof(struct snapshot_header)) {
+		close(fd);
+		return -EAGAIN;
+	}
+	const uint8_t* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	const size_t source_len = source_str(source, NULL);
+	char* source_buf = malloc(source_len);
+	if (!source_buf) {
+		r = -ENOMEM;
+		goto exit;
+	}
+	source_str(source, source_buf);
+
+	const struct snapshot_header* hdr = (const struct snapshot_header*) map;
+	r = -EAGAIN;
+	for (int i = 0; i < LOOKUP_TRIES; ++i) {
+		const uint32_t seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+		/* Writer is busy or never finished, nvram is read instead */
+		if (seq & 1)
+			break;
+
+		r = lookup_keys(map, size, source_buf, source_len, keys, keys_len, tables);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) == seq)
+			break;
+
+		pr_dbg("%s: changed while looking up, retrying\n", path);
+		clear_table(system);
+		clear_table(user);
+		r = -EAGAIN;
+	}
+
+exit:
+	if (r) {
+		clear_table(system);
+		clear_table(user);
+	}
+	free(source_buf);
+	munmap((void*) map, size);
+	return r;
+}
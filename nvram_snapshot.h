@@ -0,0 +1,86 @@
+#ifndef NVRAM_SNAPSHOT_H_
+#define NVRAM_SNAPSHOT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "nvram_table.h"
+
+/*
+ * Snapshot of system and user attributes in a shared memory file, typically
+ * on tmpfs, for looking up keys without taking the lock.
+ *
+ * Writers hold the nvram lock of the sections they publish and update the file
+ * in place. A sequence counter in its header is odd while it is updated, or
+ * after an update was never completed, and readers retry or fall back to
+ * reading nvram when it changes under them. Each section is marked valid on
+ * its own, so committing one section doesn't invalidate the other. The file
+ * only grows, so readers can't fault on a mapping of it.
+ *
+ * Each snapshot records the interface, format and sections it was taken from,
+ * readers configured differently don't use it.
+ */
+
+struct nvram_snapshot_source {
+	const char* interface;
+	const char* format;
+	const char* system_a;
+	const char* system_b;
+	const char* user_a;
+	const char* user_b;
+};
+
+/* Sections of a snapshot, combined as flags */
+enum nvram_snapshot_section {
+	NVRAM_SNAPSHOT_SYSTEM = 1 << 0,
+	NVRAM_SNAPSHOT_USER = 1 << 1,
+};
+
+/*
+ * Replace snapshot at path with tables, created if missing. A NULL table
+ * keeps the section as last published, valid only if it was.
+ *
+ * @returns
+ *   0 for success
+ *   negative errno for error, snapshot is left invalid
+ */
+int nvram_snapshot_publish(const char* path, const struct nvram_snapshot_source* source,
+		const struct nvram_table* system, const struct nvram_table* user);
+
+/*
+ * Mark sections of snapshot at path invalid until published again, done
+ * before nvram is written so no reader sees data older than nvram
+ *
+ * @params
+ *   sections: enum nvram_snapshot_section flags
+ *
+ * @returns
+ *   0 for success, also if there is no snapshot
+ *   negative errno for error
+ */
+int nvram_snapshot_invalidate(const char* path, int sections);
+
+/*
+ * Get sections valid in snapshot at path, as a hint for publishing the others
+ *
+ * @returns
+ *   enum nvram_snapshot_section flags, 0 if there is no snapshot of source
+ */
+int nvram_snapshot_sections(const char* path, const struct nvram_snapshot_source* source);
+
+/*
+ * Look up keys in snapshot, adding those found to the system and user tables
+ *
+ * @params
+ *   keys: null-terminated keys
+ *   system, user: empty tables
+ *
+ * @returns
+ *   0 for success, tables hold the keys found
+ *   -ENOENT if there is no snapshot
+ *   -EAGAIN if a section is invalid, snapshot is of another source or kept changing
+ *   other negative errno for error
+ */
+int nvram_snapshot_lookup(const char* path, const struct nvram_snapshot_source* source,
+		const char* const* keys, size_t keys_len, struct nvram_table* system, struct nvram_table* user);
+
+#endif // NVRAM_SNAPSHOT_H_
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "nvram_stats.h"
+
+/* Sections an invocation can touch: system and user, A and B */
+#define MAX_RECORDED 8
+#define MAX_LINE (PATH_MAX + 128)
+
+struct section_stats {
+	char* section;
+	uint64_t commits;
+	uint64_t bytes;
+	uint64_t erases;
+	uint64_t last_commit_us;
+	uint32_t counter;
+	/* last_commit_us and counter are replaced, not added, when merged */
+	int committed;
+};
+
+/* Per thread, so formats can commit from several threads */
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static _Thread_local struct section_stats recorded[MAX_RECORDED];
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static _Thread_local size_t recorded_len = 0;
+
+/* Returns NULL when all slots are taken */
+static struct section_stats* find_recorded(const char* section)
+{
+	for (size_t i = 0; i < recorded_len; ++i) {
+		if (!strcmp(recorded[i].section, section))
+			return &recorded[i];
+	}
+	if (recorded_len == MAX_RECORDED)
+		return NULL;
+	struct section_stats* stats = &recorded[recorded_len++];
+	memset(stats, 0, sizeof(*stats));
+	stats->section = (char*) section;
+	return stats;
+}
+
+long nvram_stats_elapsed_us(const struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000L;
+}
+
+void nvram_stats_commit(const char* section, size_t bytes, long us, uint32_t counter)
+{
+	struct section_stats* stats = find_recorded(section);
+	if (!stats)
+		return;
+	stats->commits++;
+	stats->bytes += bytes;
+	stats->last_commit_us = us > 0 ? us : 0;
+	stats->counter = counter;
+	stats->committed = 1;
+}
+
+void nvram_stats_erase(const char* section, uint32_t blocks)
+{
+	struct section_stats* stats = find_recorded(section);
+	if (stats)
+		stats->erases += blocks;
+}
+
+void nvram_stats_discard(void)
+{
+	recorded_len = 0;
+}
+
+static void free_stats(struct section_stats* stats, size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+		free(stats[i].section);
+	free(stats);
+}
+
+/* Load file, a missing file has no entries. Malformed lines are skipped. */
+static int load(const char* path, struct section_stats** stats, size_t* len)
+{
+	*stats = NULL;
+	*len = 0;
+	FILE* fp = fopen(path, "r");
+	if (!fp)
+		return errno == ENOENT ? 0 : -errno;
+
+	char line[MAX_LINE];
+	size_t cap = 0;
+	int r = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		struct section_stats entry;
+		memset(&entry, 0, sizeof(entry));
+		int pos = 0;
+		if (sscanf(line, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu32 " %n",
+					&entry.commits, &entry.bytes, &entry.erases, &entry.last_commit_us, &entry.counter, &pos) != 5
+				|| pos == 0)
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		if (line[pos] == '\0')
+			continue;
+
+		if (*len == cap) {
+			cap = cap ? cap * 2 : MAX_RECORDED;
+			struct section_stats* grown = realloc(*stats, cap * sizeof(**stats));
+			if (!grown) {
+				r = -ENOMEM;
+				break;
+			}
+			*stats = grown;
+		}
+		entry.section = strdup(line + pos);
+		if (!entry.section) {
+			r = -ENOMEM;
+			break;
+		}
+		(*stats)[(*len)++] = entry;
+	}
+	if (r == 0 && ferror(fp))
+		r = -EIO;
+	fclose(fp);
+
+	if (r) {
+		free_stats(*stats, *len);
+		*stats = NULL;
+		*len = 0;
+	}
+	return r;
+}
+
+static int store(const char* path, const struct section_stats* stats, size_t len)
+{
+	char tmp_path[PATH_MAX];
+	int r = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	if (r < 0 || (size_t) r >= sizeof(tmp_path))
+		return -ENAMETOOLONG;
+
+	FILE* fp = fopen(tmp_path, "w");
+	if (!fp)
+		return -errno;
+	for (size_t i = 0; i < len; ++i) {
+		fprintf(fp, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu32 " %s\n",
+				stats[i].commits, stats[i].bytes, stats[i].erases, stats[i].last_commit_us, stats[i].counter, stats[i].section);
+	}
+	r = ferror(fp) ? -EIO : 0;
+	if (fclose(fp) && r == 0)
+		r = -errno;
+	if (r == 0 && rename(tmp_path, path))
+		r = -errno;
+	if (r)
+		remove(tmp_path);
+	return r;
+}
+
+/*
+ * Lock PATH.lock, as the file is replaced by rename. Returns descriptor
+ * holding the lock or negative errno.
+ */
+static int lock_stats(const char* path)
+{
+	char lock_path[PATH_MAX];
+	const int n = snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+	if (n < 0 || (size_t) n >= sizeof(lock_path))
+		return -ENAMETOOLONG;
+	const int fd = open(lock_path, O_CREAT | O_WRONLY | O_CLOEXEC, S_IWUSR | S_IRUSR);
+	if (fd < 0)
+		return -errno;
+	if (flock(fd, LOCK_EX)) {
+		const int r = -errno;
+		close(fd);
+		return r;
+	}
+	return fd;
+}
+
+int nvram_stats_flush(const char* path)
+{
+	if (recorded_len == 0)
+		return 0;
+
+	struct section_stats* stats = NULL;
+	size_t len = 0;
+	const int fd_lock = lock_stats(path);
+	int r = fd_lock < 0 ? fd_lock : 0;
+	if (r)
+		goto exit;
+	r = load(path, &stats, &len);
+	if (r)
+		goto exit;
+
+	for (size_t i = 0; i < recorded_len; ++i) {
+		const struct section_stats* rec = &recorded[i];
+		struct section_stats* entry = NULL;
+		for (size_t j = 0; j < len; ++j) {
+			if (!strcmp(stats[j].section, rec->section)) {
+				entry = &stats[j];
+				break;
+			}
+		}
+		if (!entry) {
+			struct section_stats* grown = realloc(stats, (len + 1) * sizeof(*stats));
+			if (!grown) {
+				r = -ENOMEM;
+				goto exit;
+			}
+			stats = grown;
+			entry = &stats[len];
+			memset(entry, 0, sizeof(*entry));
+			entry->section = strdup(rec->section);
+			if (!entry->section) {
+				r = -ENOMEM;
+				goto exit;
+			}
+			len++;
+		}
+		entry->commits += rec->commits;
+		entry->bytes += rec->bytes;
+		entry->erases += rec->erases;
+		if (rec->committed) {
+			entry->last_commit_us = rec->last_commit_us;
+			entry->counter = rec->counter;
+		}
+	}
+
+	r = store(path, stats, len);
+	if (r == 0)
+		recorded_len = 0;
+
+exit:
+	if (fd_lock >= 0)
+		close(fd_lock);
+	free_stats(stats, len);
+	return r;
+}
+
+/* Print label value with backslash, double quote and newline escaped */
+static void print_label(const char* value)
+{
+	for (const char* c = value; *c != '\0'; ++c) {
+		if (*c == '\\' || *c == '"')
+			printf("\\%c", *c);
+		else if (*c == '\n')
+			printf("\\n");
+		else
+			putchar(*c);
+	}
+}
+
+static uint64_t get_commits(const struct section_stats* stats)
+{
+	return stats->commits;
+}
+
+static uint64_t get_bytes(const struct section_stats* stats)
+{
+	return stats->bytes;
+}
+
+static uint64_t get_erases(const struct section_stats* stats)
+{
+	return stats->erases;
+}
+
+static uint64_t get_last_commit_us(const struct section_stats* stats)
+{
+	return stats->last_commit_us;
+}
+
+static uint64_t get_counter(const struct section_stats* stats)
+{
+	return stats->counter;
+}
+
+
+struct metric {
+	const char* name;
+	/* counter or gauge */
+	const char* type;
+	const char* help;
+	uint64_t (*value)(const struct section_stats* stats);
+	/* value is in microseconds and printed as seconds */
+	int is_us;
+};
+
+static const struct metric metrics[] = {
+	{"nvram_commits", "counter", "Commits written to section.", get_commits, 0},
+	{"nvram_written_bytes", "counter", "Bytes written to section by commits.", get_bytes, 0},
+	{"nvram_erased_blocks", "counter", "Erase blocks erased in section.", get_erases, 0},
+	{"nvram_last_commit_seconds", "gauge", "Duration of last commit written to section.", get_last_commit_us, 1},
+	{"nvram_transaction_counter", "gauge", "Transaction counter of last commit written to section.", get_counter, 0},
+};
+
+static void print_openmetrics(const struct section_stats* stats, size_t len)
+{
+	const uint64_t us_per_s = 1000000;
+	for (size_t m = 0; m < sizeof(metrics) / sizeof(*metrics); ++m) {
+		const struct metric* metric = &metrics[m];
+		/* Counter samples take a _total suffix on the family name */
+		const char* suffix = strcmp(metric->type, "counter") == 0 ? "_total" : "";
+		printf("# TYPE %s %s\n", metric->name, metric->type);
+		printf("# HELP %s %s\n", metric->name, metric->help);
+		for (size_t i = 0; i < len; ++i) {
+			printf("%s%s{section=\"", metric->name, suffix);
+			print_label(stats[i].section);
+			const uint64_t value = metric->value(&stats[i]);
+			if (metric->is_us)
+				printf("\"} %" PRIu64 ".%06" PRIu64 "\n", value / us_per_s, value % us_per_s);
+			else
+				printf("\"} %" PRIu64 "\n", value);
+		}
+	}
+	printf("# EOF\n");
+}
+
+int nvram_stats_print(const char* path, enum nvram_stats_output output)
+{
+	struct section_stats* stats = NULL;
+	size_t len = 0;
+	int r = load(path, &stats, &len);
+	if (r) {
+		pr_err("failed reading stats: %s [%d]: %s\n", path, -r, strerror(-r));
+		return r;
+	}
+
+	switch (output) {
+	case NVRAM_STATS_TEXT:
+		for (size_t i = 0; i < len; ++i) {
+			printf("%s: commits=%" PRIu64 " written_bytes=%" PRIu64 " erased_blocks=%" PRIu64
+					" last_commit_us=%" PRIu64 " counter=%" PRIu32 "\n",
+					stats[i].section, stats[i].commits, stats[i].bytes, stats[i].erases,
+					stats[i].last_commit_us, stats[i].counter);
+		}
+		break;
+	case NVRAM_STATS_OPENMETRICS:
+		print_openmetrics(stats, len);
+		break;
+	}
+
+	free_stats(stats, len);
+	return 0;
+}
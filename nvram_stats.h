@@ -0,0 +1,68 @@
+#ifndef NVRAM_STATS_H_
+#define NVRAM_STATS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Write and erase counters per section.
+ *
+ * Formats and interfaces record what they do during an invocation, which is
+ * merged into a sidecar file by nvram_stats_flush(). The file holds one line
+ * per section:
+ *
+ *   COMMITS BYTES ERASES LAST_COMMIT_US COUNTER SECTION
+ *
+ * It is replaced by rename, so readers need no lock. Writers lock PATH.lock,
+ * as invocations committing different section sets hold different nvram
+ * locks. Stats are recorded per thread and flushed by the thread that
+ * recorded them.
+ */
+
+enum nvram_stats_output {
+	NVRAM_STATS_TEXT,
+	/* OpenMetrics text format, e.g. for node_exporter textfile collector */
+	NVRAM_STATS_OPENMETRICS,
+};
+
+/*
+ * Record commit of data to section
+ *
+ * @params
+ *   section: as returned by interface, must stay valid until flushed
+ *   bytes: bytes written
+ *   us: duration of write
+ *   counter: transaction counter written, 0 if format has none
+ */
+void nvram_stats_commit(const char* section, size_t bytes, long us, uint32_t counter);
+
+/* Microseconds since start, taken from CLOCK_MONOTONIC */
+long nvram_stats_elapsed_us(const struct timespec* start);
+
+/* Record erase of blocks in section */
+void nvram_stats_erase(const char* section, uint32_t blocks);
+
+/* Drop stats recorded by this thread, when sections won't stay valid until flushed */
+void nvram_stats_discard(void);
+
+/*
+ * Add recorded stats to file at path and reset them. Nothing is done if none
+ * are recorded.
+ *
+ * @returns
+ *   0 for success
+ *   negative errno for error
+ */
+int nvram_stats_flush(const char* path);
+
+/*
+ * Print stats of file at path to stdout
+ *
+ * @returns
+ *   0 for success, also if file doesn't exist
+ *   negative errno for error
+ */
+int nvram_stats_print(const char* path, enum nvram_stats_output output);
+
+#endif // NVRAM_STATS_H_
@@ -0,0 +1,132 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "log.h"
+#include "nvram_crc32.h"
+#include "nvram_stream.h"
+
+#define xstr(a) str(a)
+#define str(a) #a
+
+#define NVRAM_ENV_STREAM_WINDOW "NVRAM_STREAM_WINDOW"
+
+size_t nvram_stream_window(void)
+{
+	const char* str = getenv(NVRAM_ENV_STREAM_WINDOW);
+	if (!str) {
+		str = xstr(NVRAM_STREAM_WINDOW);
+	}
+	char* endptr = NULL;
+	const long long size = strtoll(str, &endptr, 10);
+	if (*endptr != '\0' || size < 0) {
+		pr_err("invalid %s: %s\n", NVRAM_ENV_STREAM_WINDOW, str);
+		return 0;
+	}
+	return (size_t) size;
+}
+
+void nvram_stream_init(struct nvram_stream* stream, struct nvram_interface* interface, struct nvram_priv* priv, size_t offset, size_t len,
+						size_t window)
+{
+	memset(stream, 0, sizeof(*stream));
+	stream->interface = interface;
+	stream->priv = priv;
+	stream->window = window > 0 ? window : 1;
+	stream->offset = offset;
+	stream->remaining = len;
+}
+
+void nvram_stream_destroy(struct nvram_stream* stream)
+{
+	free(stream->buf);
+	stream->buf = NULL;
+	stream->cap = 0;
+}
+
+/* Make room for n bytes from start, keeping unconsumed bytes */
+static int reserve(struct nvram_stream* stream, size_t n)
+{
+	const size_t avail = stream->end - stream->start;
+	if (stream->cap - stream->start >= n)
+		return 0;
+	if (avail > 0)
+		memmove(stream->buf, stream->buf + stream->start, avail);
+	stream->start = 0;
+	stream->end = avail;
+	if (stream->cap >= n)
+		return 0;
+
+	size_t cap = stream->cap > 0 ? stream->cap : stream->window;
+	while (cap < n)
+		cap = cap > SIZE_MAX / 2 ? n : cap * 2;
+	uint8_t* buf = realloc(stream->buf, cap);
+	if (buf == NULL)
+		return -ENOMEM;
+	stream->buf = buf;
+	stream->cap = cap;
+	return 0;
+}
+
+int nvram_stream_fill(struct nvram_stream* stream, size_t n)
+{
+	const size_t avail = stream->end - stream->start;
+	if (avail >= n)
+		return 0;
+	if (n - avail > stream->remaining)
+		return -ENODATA;
+	int r = reserve(stream, n);
+	if (r)
+		return r;
+
+	/* Read as much as fits, at least what is missing as room was made for n */
+	const size_t room = stream->cap - stream->end;
+	const size_t size = room < stream->remaining ? room : stream->remaining;
+	uint8_t* buf = stream->buf + stream->end;
+	r = stream->interface->read_at(stream->priv, buf, size, stream->offset);
+	if (r)
+		return r;
+	stream->crc = nvram_crc32(stream->crc, buf, size);
+	stream->end += size;
+	stream->offset += size;
+	stream->remaining -= size;
+	return 0;
+}
+
+uint8_t* nvram_stream_data(const struct nvram_stream* stream)
+{
+	return stream->buf + stream->start;
+}
+
+size_t nvram_stream_avail(const struct nvram_stream* stream)
+{
+	return stream->end - stream->start;
+}
+
+void nvram_stream_consume(struct nvram_stream* stream, size_t n)
+{
+	stream->start += n;
+}
+
+int nvram_stream_skip(struct nvram_stream* stream, size_t n)
+{
+	if (n > nvram_stream_avail(stream) + stream->remaining)
+		return -ENODATA;
+	while (n > 0) {
+		if (nvram_stream_avail(stream) == 0) {
+			int r = nvram_stream_fill(stream, 1);
+			if (r)
+				return r;
+		}
+		const size_t avail = nvram_stream_avail(stream);
+		const size_t consumed = n < avail ? n : avail;
+		nvram_stream_consume(stream, consumed);
+		n -= consumed;
+	}
+	return 0;
+}
+
+int nvram_stream_drain(struct nvram_stream* stream)
+{
+	return nvram_stream_skip(stream, nvram_stream_avail(stream) + stream->remaining);
+}
@@ -0,0 +1,87 @@
+#ifndef NVRAM_STREAM_H_
+#define NVRAM_STREAM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "nvram_interface.h"
+
+/*
+ * Read part of a section in windows through the interface read_at, so
+ * formats can load sections without holding them whole. The window grows
+ * when more contiguous bytes are needed than it holds, memory needed scales
+ * with the largest entry rather than the section. The crc of all bytes read
+ * is kept for verifying the data once read through.
+ */
+struct nvram_stream {
+	struct nvram_interface* interface;
+	struct nvram_priv* priv;
+	uint8_t* buf;
+	size_t cap;
+	/* Bytes read at a time unless more are needed */
+	size_t window;
+	/* Unconsumed bytes are buf[start, end) */
+	size_t start;
+	size_t end;
+	/* Section offset of next read and bytes left to read */
+	size_t offset;
+	size_t remaining;
+	/* nvram_crc32 of bytes read */
+	uint32_t crc;
+};
+
+/*
+ * Get window size configured by NVRAM_STREAM_WINDOW
+ *
+ * @returns
+ *   bytes read at a time
+ *   0 if sections are read whole
+ */
+size_t nvram_stream_window(void);
+
+/* Set up stream of len bytes at offset of section, nothing is read yet */
+void nvram_stream_init(struct nvram_stream* stream, struct nvram_interface* interface, struct nvram_priv* priv, size_t offset, size_t len,
+						size_t window);
+
+/* Free window */
+void nvram_stream_destroy(struct nvram_stream* stream);
+
+/*
+ * Make at least n unconsumed bytes available, reading a window or more
+ *
+ * @returns
+ *   0 for success
+ *   -ENODATA if fewer than n bytes are left, nothing is read
+ *   -ENOMEM for allocation failure
+ *   negative errno for read error
+ */
+int nvram_stream_fill(struct nvram_stream* stream, size_t n);
+
+/* Unconsumed bytes, valid until next fill */
+uint8_t* nvram_stream_data(const struct nvram_stream* stream);
+
+/* Number of unconsumed bytes */
+size_t nvram_stream_avail(const struct nvram_stream* stream);
+
+/* Consume n bytes, at most nvram_stream_avail */
+void nvram_stream_consume(struct nvram_stream* stream, size_t n);
+
+/*
+ * Consume n bytes, reading past them without keeping them
+ *
+ * @returns
+ *   0 for success
+ *   -ENODATA if fewer than n bytes are left
+ *   negative errno for read error
+ */
+int nvram_stream_skip(struct nvram_stream* stream, size_t n);
+
+/*
+ * Consume rest of the stream, completing its crc
+ *
+ * @returns
+ *   0 for success
+ *   negative errno for read error
+ */
+int nvram_stream_drain(struct nvram_stream* stream);
+
+#endif // NVRAM_STREAM_H_
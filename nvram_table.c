@@ -0,0 +1,388 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "nvram_table.h"
+
+#define INITIAL_ROWS 16
+#define INITIAL_BLOB 1024
+#define INITIAL_SLOTS 32
+
+void nvram_table_destroy(struct nvram_table* table)
+{
+	free(table->blob);
+	free(table->key_off);
+	free(table->key_len);
+	free(table->value_off);
+	free(table->value_len);
+	free(table->flags);
+	free(table->slots);
+	memset(table, 0, sizeof(*table));
+}
+
+static const uint8_t* key_ptr(const struct nvram_table* table, size_t row)
+{
+	const uint8_t* base = table->flags[row] & NVRAM_ROW_KEY_BORROWED ? table->borrowed : table->blob;
+	return base + table->key_off[row];
+}
+
+static const uint8_t* value_ptr(const struct nvram_table* table, size_t row)
+{
+	const uint8_t* base = table->flags[row] & NVRAM_ROW_VALUE_BORROWED ? table->borrowed : table->blob;
+	return base + table->value_off[row];
+}
+
+/* FNV-1a */
+static uint64_t hash_key(const uint8_t* key, uint32_t key_len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (uint32_t i = 0; i < key_len; ++i) {
+		hash ^= key[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+size_t nvram_table_find(const struct nvram_table* table, const uint8_t* key, uint32_t key_len)
+{
+	if (table->slots_cap == 0)
+		return NVRAM_TABLE_NPOS;
+	const size_t mask = table->slots_cap - 1;
+	for (size_t slot = hash_key(key, key_len) & mask; table->slots[slot] != 0; slot = (slot + 1) & mask) {
+		const size_t row = table->slots[slot] - 1;
+		if (table->key_len[row] == key_len
+				&& nvram_table_live(table, row)
+				&& memcmp(key_ptr(table, row), key, key_len) == 0)
+			return row;
+	}
+	return NVRAM_TABLE_NPOS;
+}
+
+static void insert_slot(size_t* slots, size_t cap, const struct nvram_table* table, size_t row)
+{
+	const size_t mask = cap - 1;
+	size_t slot = hash_key(key_ptr(table, row), table->key_len[row]) & mask;
+	while (slots[slot] != 0)
+		slot = (slot + 1) & mask;
+	slots[slot] = row + 1;
+}
+
+/* Allocate empty slots for rows, keeping load at most half. Returns NULL for failure. */
+static size_t* alloc_slots(size_t rows, size_t* cap)
+{
+	*cap = INITIAL_SLOTS;
+	while (*cap / 2 < rows)
+		*cap *= 2;
+	return calloc(*cap, sizeof(size_t));
+}
+
+/* Replace slots with slots of live rows */
+static void set_slots(struct nvram_table* table, size_t* slots, size_t cap)
+{
+	size_t len = 0;
+	for (size_t row = 0; row < table->rows; ++row) {
+		if (nvram_table_live(table, row)) {
+			insert_slot(slots, cap, table, row);
+			len++;
+		}
+	}
+	free(table->slots);
+	table->slots = slots;
+	table->slots_len = len;
+	table->slots_cap = cap;
+}
+
+/* Rebuild slots of live rows with room for at least rows */
+static int rehash(struct nvram_table* table, size_t rows)
+{
+	size_t cap = 0;
+	size_t* slots = alloc_slots(rows, &cap);
+	if (slots == NULL)
+		return -ENOMEM;
+	set_slots(table, slots, cap);
+	return 0;
+}
+
+/*
+ * Make sure a slot is free for the next row. Deleted rows take slots until
+ * rehashed, slots are only doubled if live rows take more than a quarter.
+ */
+static int reserve_slot(struct nvram_table* table)
+{
+	if (table->slots_len + 1 <= table->slots_cap / 2)
+		return 0;
+	return rehash(table, table->live < table->slots_cap / 4 ? table->slots_cap / 2 : table->slots_cap);
+}
+
+static int grow_array(void** array, size_t member_size, size_t count)
+{
+	void* new = realloc(*array, member_size * count);
+	if (new == NULL)
+		return -ENOMEM;
+	*array = new;
+	return 0;
+}
+
+static int reserve_rows(struct nvram_table* table, size_t rows)
+{
+	if (rows <= table->rows_cap)
+		return 0;
+	size_t cap = table->rows_cap ? table->rows_cap : INITIAL_ROWS;
+	while (cap < rows)
+		cap *= 2;
+	if (grow_array((void**) &table->key_off, sizeof(*table->key_off), cap)
+			|| grow_array((void**) &table->key_len, sizeof(*table->key_len), cap)
+			|| grow_array((void**) &table->value_off, sizeof(*table->value_off), cap)
+			|| grow_array((void**) &table->value_len, sizeof(*table->value_len), cap)
+			|| grow_array((void**) &table->flags, sizeof(*table->flags), cap))
+		return -ENOMEM;
+	table->rows_cap = cap;
+	return 0;
+}
+
+/* Returns offset of appended data in blob or negative errno */
+static int64_t append_blob(struct nvram_table* table, const uint8_t* data, uint32_t len)
+{
+	if (table->blob_len + len > UINT32_MAX)
+		return -EFBIG;
+	if (table->blob_len + len > table->blob_cap) {
+		size_t cap = table->blob_cap ? table->blob_cap : INITIAL_BLOB;
+		while (cap < table->blob_len + len)
+			cap *= 2;
+		if (grow_array((void**) &table->blob, 1, cap))
+			return -ENOMEM;
+		table->blob_cap = cap;
+	}
+	const int64_t offset = (int64_t) table->blob_len;
+	memcpy(table->blob + table->blob_len, data, len);
+	table->blob_len += len;
+	return offset;
+}
+
+int nvram_table_set(struct nvram_table* table, const uint8_t* key, uint32_t key_len, const uint8_t* value, uint32_t value_len)
+{
+	const size_t row = nvram_table_find(table, key, key_len);
+	if (row != NVRAM_TABLE_NPOS) {
+		if (table->value_len[row] == value_len
+				&& memcmp(value_ptr(table, row), value, value_len) == 0)
+			return 0;
+		const int64_t value_off = append_blob(table, value, value_len);
+		if (value_off < 0)
+			return (int) value_off;
+		table->value_off[row] = value_off;
+		table->value_len[row] = value_len;
+		table->flags[row] &= ~NVRAM_ROW_VALUE_BORROWED;
+		return 1;
+	}
+
+	int r = nvram_table_append(table, key, key_len, value, value_len);
+	return r ? r : 1;
+}
+
+int nvram_table_borrow(struct nvram_table* table, const uint8_t* buf, uint32_t key_off, uint32_t key_len, uint32_t value_off, uint32_t value_len)
+{
+	if (table->borrowed && table->borrowed != buf)
+		return -EINVAL;
+	int r = reserve_rows(table, table->rows + 1);
+	if (!r)
+		r = reserve_slot(table);
+	if (r)
+		return r;
+	table->borrowed = buf;
+	table->key_off[table->rows] = key_off;
+	table->key_len[table->rows] = key_len;
+	table->value_off[table->rows] = value_off;
+	table->value_len[table->rows] = value_len;
+	table->flags[table->rows] = NVRAM_ROW_KEY_BORROWED | NVRAM_ROW_VALUE_BORROWED;
+	insert_slot(table->slots, table->slots_cap, table, table->rows);
+	table->slots_len++;
+	table->rows++;
+	table->live++;
+	return 0;
+}
+
+int nvram_table_append(struct nvram_table* table, const uint8_t* key, uint32_t key_len, const uint8_t* value, uint32_t value_len)
+{
+	int r = reserve_rows(table, table->rows + 1);
+	if (!r)
+		r = reserve_slot(table);
+	if (r)
+		return r;
+	const int64_t key_off = append_blob(table, key, key_len);
+	if (key_off < 0)
+		return (int) key_off;
+	const int64_t value_off = append_blob(table, value, value_len);
+	if (value_off < 0)
+		return (int) value_off;
+	table->key_off[table->rows] = key_off;
+	table->key_len[table->rows] = key_len;
+	table->value_off[table->rows] = value_off;
+	table->value_len[table->rows] = value_len;
+	table->flags[table->rows] = 0;
+	insert_slot(table->slots, table->slots_cap, table, table->rows);
+	table->slots_len++;
+	table->rows++;
+	table->live++;
+	return 0;
+}
+
+/* Returns copy of size bytes of src, NULL if size is 0 or allocation failed */
+static void* dup_array(const void* src, size_t size)
+{
+	if (size == 0)
+		return NULL;
+	void* dst = malloc(size);
+	if (dst)
+		memcpy(dst, src, size);
+	return dst;
+}
+
+int nvram_table_copy(struct nvram_table* dst, const struct nvram_table* src)
+{
+	struct nvram_table copy = *src;
+	copy.blob = dup_array(src->blob, src->blob_cap);
+	copy.key_off = dup_array(src->key_off, src->rows_cap * sizeof(*src->key_off));
+	copy.key_len = dup_array(src->key_len, src->rows_cap * sizeof(*src->key_len));
+	copy.value_off = dup_array(src->value_off, src->rows_cap * sizeof(*src->value_off));
+	copy.value_len = dup_array(src->value_len, src->rows_cap * sizeof(*src->value_len));
+	copy.flags = dup_array(src->flags, src->rows_cap * sizeof(*src->flags));
+	copy.slots = dup_array(src->slots, src->slots_cap * sizeof(*src->slots));
+	if ((src->blob_cap && !copy.blob) || (src->slots_cap && !copy.slots) || (src->rows_cap
+			&& (!copy.key_off || !copy.key_len || !copy.value_off || !copy.value_len || !copy.flags))) {
+		nvram_table_destroy(&copy);
+		return -ENOMEM;
+	}
+	*dst = copy;
+	return 0;
+}
+
+int nvram_table_remove(struct nvram_table* table, const uint8_t* key, uint32_t key_len)
+{
+	const size_t row = nvram_table_find(table, key, key_len);
+	if (row == NVRAM_TABLE_NPOS)
+		return 0;
+	table->flags[row] |= NVRAM_ROW_DELETED;
+	table->live--;
+	return 1;
+}
+
+int nvram_table_compact(struct nvram_table* table)
+{
+	size_t used = 0;
+	for (size_t row = 0; row < table->rows; ++row) {
+		if (!nvram_table_live(table, row))
+			continue;
+		if ((table->flags[row] & NVRAM_ROW_KEY_BORROWED) == 0)
+			used += table->key_len[row];
+		if ((table->flags[row] & NVRAM_ROW_VALUE_BORROWED) == 0)
+			used += table->value_len[row];
+	}
+	if (used == table->blob_len && table->live == table->rows)
+		return 0;
+
+	size_t slots_cap = 0;
+	size_t* slots = alloc_slots(table->live, &slots_cap);
+	if (slots == NULL)
+		return -ENOMEM;
+	uint8_t* blob = NULL;
+	if (used > 0) {
+		blob = malloc(used);
+		if (blob == NULL) {
+			free(slots);
+			return -ENOMEM;
+		}
+	}
+
+	size_t pos = 0;
+	size_t out = 0;
+	for (size_t row = 0; row < table->rows; ++row) {
+		if (!nvram_table_live(table, row))
+			continue;
+		const uint8_t flags = table->flags[row];
+		uint32_t key_off = table->key_off[row];
+		uint32_t value_off = table->value_off[row];
+		if ((flags & NVRAM_ROW_KEY_BORROWED) == 0) {
+			memcpy(blob + pos, table->blob + key_off, table->key_len[row]);
+			key_off = pos;
+			pos += table->key_len[row];
+		}
+		if ((flags & NVRAM_ROW_VALUE_BORROWED) == 0) {
+			memcpy(blob + pos, table->blob + value_off, table->value_len[row]);
+			value_off = pos;
+			pos += table->value_len[row];
+		}
+		table->key_off[out] = key_off;
+		table->key_len[out] = table->key_len[row];
+		table->value_off[out] = value_off;
+		table->value_len[out] = table->value_len[row];
+		table->flags[out] = flags;
+		out++;
+	}
+
+	free(table->blob);
+	table->blob = blob;
+	table->blob_len = used;
+	table->blob_cap = used;
+	table->rows = out;
+	set_slots(table, slots, slots_cap);
+	return 0;
+}
+
+uint64_t nvram_table_serialize_size(const struct nvram_table* table)
+{
+	uint64_t size = 0;
+	for (size_t row = 0; row < table->rows; ++row) {
+		if (nvram_table_live(table, row))
+			size += 2 * sizeof(uint32_t) + (uint64_t) table->key_len[row] + table->value_len[row];
+	}
+	return size;
+}
+
+static uint8_t* put_u32le(uint8_t* buf, uint32_t val)
+{
+	buf[0] = val & 0xff;
+	buf[1] = (val >> 8) & 0xff;
+	buf[2] = (val >> 16) & 0xff;
+	buf[3] = (val >> 24) & 0xff;
+	return buf + sizeof(uint32_t);
+}
+
+void nvram_table_serialize(const struct nvram_table* table, uint8_t* data)
+{
+	struct libnvram_entry entry;
+	for (size_t row = 0; row < table->rows; ++row) {
+		if (!nvram_table_live(table, row))
+			continue;
+		nvram_table_entry(table, row, &entry);
+		data = put_u32le(data, entry.key_len);
+		data = put_u32le(data, entry.value_len);
+		memcpy(data, entry.key, entry.key_len);
+		data += entry.key_len;
+		memcpy(data, entry.value, entry.value_len);
+		data += entry.value_len;
+	}
+}
+
+int nvram_table_from_list(struct nvram_table* table, const struct libnvram_list* list)
+{
+	for (struct libnvram_list* it = libnvram_list_begin(list); it != libnvram_list_end(list); it = libnvram_list_next(it)) {
+		const struct libnvram_entry* entry = libnvram_list_deref(it);
+		int r = nvram_table_set(table, entry->key, entry->key_len, entry->value, entry->value_len);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+int nvram_table_to_list(const struct nvram_table* table, struct libnvram_list** list)
+{
+	struct libnvram_entry entry;
+	for (size_t row = 0; row < table->rows; ++row) {
+		if (!nvram_table_live(table, row))
+			continue;
+		nvram_table_entry(table, row, &entry);
+		int r = libnvram_list_set(list, &entry);
+		if (r)
+			return r;
+	}
+	return 0;
+}
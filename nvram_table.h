@@ -0,0 +1,178 @@
+#ifndef NVRAM_TABLE_H_
+#define NVRAM_TABLE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "libnvram/libnvram.h"
+
+#define NVRAM_TABLE_NPOS SIZE_MAX
+
+enum nvram_row_flags {
+	NVRAM_ROW_DELETED = 1 << 0,
+	/* Key or value offset refers to borrowed buffer instead of blob */
+	NVRAM_ROW_KEY_BORROWED = 1 << 1,
+	NVRAM_ROW_VALUE_BORROWED = 1 << 2,
+};
+
+/*
+ * Key-value store kept as structure of arrays.
+ *
+ * Keys and values of all rows are stored back to back in blob and referenced
+ * by offset and length per row. Deleted rows are tombstoned and skipped,
+ * overwritten values are appended to blob and the row is pointed to the new
+ * value, keeping row order stable. A zeroed struct is an empty table.
+ *
+ * Rows may also reference a caller owned buffer, see nvram_table_borrow.
+ * Only values written after that are copied into blob.
+ *
+ * Keys are hashed into slots by open addressing, so finding a row doesn't
+ * scan the table. Deleted rows keep their slot until compacted.
+ */
+struct nvram_table {
+	uint8_t* blob;
+	size_t blob_len;
+	size_t blob_cap;
+	/* Buffer referenced by borrowed rows, not owned by table */
+	const uint8_t* borrowed;
+
+	uint32_t* key_off;
+	uint32_t* key_len;
+	uint32_t* value_off;
+	uint32_t* value_len;
+	uint8_t* flags;
+	/* Number of rows including tombstones */
+	size_t rows;
+	size_t rows_cap;
+	/* Number of rows not deleted */
+	size_t live;
+
+	/* Row + 1 per slot, 0 for empty. slots_cap is 0 or a power of two. */
+	size_t* slots;
+	size_t slots_len;
+	size_t slots_cap;
+};
+
+/*
+ * Free allocated resources
+ */
+void nvram_table_destroy(struct nvram_table* table);
+
+/* Returns 1 if row is not deleted, else 0 */
+static inline int nvram_table_live(const struct nvram_table* table, size_t row)
+{
+	return (table->flags[row] & NVRAM_ROW_DELETED) == 0;
+}
+
+/*
+ * Get view of row. Pointers are valid until the table is modified.
+ */
+static inline void nvram_table_entry(const struct nvram_table* table, size_t row, struct libnvram_entry* entry)
+{
+	const uint8_t flags = table->flags[row];
+	const uint8_t* key_base = flags & NVRAM_ROW_KEY_BORROWED ? table->borrowed : table->blob;
+	const uint8_t* value_base = flags & NVRAM_ROW_VALUE_BORROWED ? table->borrowed : table->blob;
+	/* libnvram_entry is not const qualified, entries must be treated as read-only */
+	entry->key = (uint8_t*) key_base + table->key_off[row];
+	entry->key_len = table->key_len[row];
+	entry->value = (uint8_t*) value_base + table->value_off[row];
+	entry->value_len = table->value_len[row];
+}
+
+/*
+ * Find row with key
+ *
+ * @returns
+ *   row index
+ *   NVRAM_TABLE_NPOS if not found
+ */
+size_t nvram_table_find(const struct nvram_table* table, const uint8_t* key, uint32_t key_len);
+
+/*
+ * Add or update row with key. key and value must not point into the table.
+ *
+ * @returns
+ *   1 if added or value changed
+ *   0 if key already had the value
+ *   negative errno for error
+ */
+int nvram_table_set(struct nvram_table* table, const uint8_t* key, uint32_t key_len, const uint8_t* value, uint32_t value_len);
+
+/*
+ * Remove row with key
+ *
+ * @returns
+ *   1 if removed
+ *   0 if not found
+ */
+int nvram_table_remove(struct nvram_table* table, const uint8_t* key, uint32_t key_len);
+
+/*
+ * Append row referencing key and value in buf without copying. All borrowed
+ * rows must reference the same buf which must outlive the table. Key must not
+ * already exist in table.
+ *
+ * @returns
+ *   0 for success
+ *   negative errno for error
+ */
+int nvram_table_borrow(struct nvram_table* table, const uint8_t* buf, uint32_t key_off, uint32_t key_len, uint32_t value_off, uint32_t value_len);
+
+/*
+ * Append row copying key and value, without looking for the key first as
+ * nvram_table_set does. Key must not already exist in table.
+ *
+ * @returns
+ *   0 for success
+ *   negative errno for error
+ */
+int nvram_table_append(struct nvram_table* table, const uint8_t* key, uint32_t key_len, const uint8_t* value, uint32_t value_len);
+
+/*
+ * Copy src to dst, which is overwritten. Borrowed rows of the copy reference
+ * the same buffer.
+ *
+ * @returns
+ *   0 for success
+ *   negative errno for error, dst is left unchanged
+ */
+int nvram_table_copy(struct nvram_table* dst, const struct nvram_table* src);
+
+/*
+ * Drop deleted rows and overwritten values. Row indices change, borrowed
+ * rows keep referencing the borrowed buffer.
+ *
+ * @returns
+ *   0 for success
+ *   negative errno for error
+ */
+int nvram_table_compact(struct nvram_table* table);
+
+/* Get bytes of live rows serialized by nvram_table_serialize */
+uint64_t nvram_table_serialize_size(const struct nvram_table* table);
+
+/*
+ * Write live rows to data in the entry layout of libnvram_serialize for
+ * LIBNVRAM_TYPE_LIST, [key_len u32 le][value_len u32 le][key][value] per
+ * row, without header. data must hold nvram_table_serialize_size bytes.
+ */
+void nvram_table_serialize(const struct nvram_table* table, uint8_t* data);
+
+/*
+ * Append entries of list to table
+ *
+ * @returns
+ *   0 for success
+ *   negative errno for error
+ */
+int nvram_table_from_list(struct nvram_table* table, const struct libnvram_list* list);
+
+/*
+ * Create list from rows in table. List must be destroyed by caller.
+ *
+ * @returns
+ *   0 for success
+ *   negative errno for error
+ */
+int nvram_table_to_list(const struct nvram_table* table, struct libnvram_list** list);
+
+#endif // NVRAM_TABLE_H_
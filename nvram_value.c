@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <string.h>
+#include <errno.h>
+#include "nvram_value.h"
+
+static uint32_t type_width(enum nvram_value_type type)
+{
+	switch (type) {
+	case NVRAM_VALUE_BOOL:
+		return 1;
+	case NVRAM_VALUE_U32:
+		return 4;
+	case NVRAM_VALUE_U64:
+		return 8;
+	case NVRAM_VALUE_BINARY:
+	case NVRAM_VALUE_STRING:
+		break;
+	}
+	return 0;
+}
+
+static uint64_t type_max(enum nvram_value_type type)
+{
+	switch (type) {
+	case NVRAM_VALUE_BOOL:
+		return 1;
+	case NVRAM_VALUE_U32:
+		return UINT32_MAX;
+	case NVRAM_VALUE_U64:
+		return UINT64_MAX;
+	case NVRAM_VALUE_BINARY:
+	case NVRAM_VALUE_STRING:
+		break;
+	}
+	return 0;
+}
+
+enum nvram_value_type nvram_value_type(const uint8_t* value, uint32_t len)
+{
+	if (len == 0)
+		return NVRAM_VALUE_BINARY;
+	if (value[len - 1] == '\0')
+		return NVRAM_VALUE_STRING;
+
+	const enum nvram_value_type typed[] = {NVRAM_VALUE_BOOL, NVRAM_VALUE_U32, NVRAM_VALUE_U64};
+	for (size_t i = 0; i < sizeof(typed) / sizeof(*typed); ++i) {
+		const uint32_t width = type_width(typed[i]);
+		if (len == width + 1 && value[width] == width) {
+			if (typed[i] == NVRAM_VALUE_BOOL && value[0] > 1)
+				break;
+			return typed[i];
+		}
+	}
+	return NVRAM_VALUE_BINARY;
+}
+
+uint32_t nvram_value_encode(enum nvram_value_type type, uint64_t val, uint8_t* buf)
+{
+	const uint32_t width = type_width(type);
+	if (width == 0 || val > type_max(type))
+		return 0;
+
+	for (uint32_t i = 0; i < width; ++i)
+		buf[i] = (uint8_t) (val >> (8 * i));
+	buf[width] = (uint8_t) width;
+	return width + 1;
+}
+
+int nvram_value_get(enum nvram_value_type type, const uint8_t* value, uint32_t len, uint64_t* val)
+{
+	const enum nvram_value_type stored = nvram_value_type(value, len);
+	if (stored == NVRAM_VALUE_STRING)
+		return nvram_value_parse(type, (const char*) value, val);
+	if (stored != type)
+		return -EINVAL;
+
+	uint64_t decoded = 0;
+	for (uint32_t i = 0; i < type_width(type); ++i)
+		decoded |= (uint64_t) value[i] << (8 * i);
+	*val = decoded;
+	return 0;
+}
+
+int nvram_value_parse(enum nvram_value_type type, const char* str, uint64_t* val)
+{
+	if (type_width(type) == 0)
+		return -EINVAL;
+	if (type == NVRAM_VALUE_BOOL) {
+		if (!strcmp(str, "true")) {
+			*val = 1;
+			return 0;
+		}
+		if (!strcmp(str, "false")) {
+			*val = 0;
+			return 0;
+		}
+	}
+
+	int base = 10;
+	if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+		base = 16;
+		str += 2;
+	}
+	/* strtoull() would skip whitespace and negate a leading minus */
+	const unsigned char first = (unsigned char) str[0];
+	if (base == 16 ? !isxdigit(first) : !isdigit(first))
+		return -EINVAL;
+
+	char* endptr = NULL;
+	errno = 0;
+	const unsigned long long parsed = strtoull(str, &endptr, base);
+	if (errno == ERANGE || *endptr != '\0' || parsed > type_max(type))
+		return -EINVAL;
+	*val = parsed;
+	return 0;
+}
+
+void nvram_value_print(const uint8_t* value, uint32_t len)
+{
+	uint64_t val = 0;
+	const enum nvram_value_type type = nvram_value_type(value, len);
+	switch (type) {
+	case NVRAM_VALUE_STRING:
+		printf("%s", value);
+		break;
+	case NVRAM_VALUE_BOOL:
+		nvram_value_get(type, value, len, &val);
+		printf("%s", val ? "true" : "false");
+		break;
+	case NVRAM_VALUE_U32:
+	case NVRAM_VALUE_U64:
+		nvram_value_get(type, value, len, &val);
+		printf("0x%" PRIx64 "", val);
+		break;
+	case NVRAM_VALUE_BINARY:
+		printf("0x");
+		for (uint32_t i = 0; i < len; ++i)
+			printf("%02" PRIx8 "", value[i]);
+		break;
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef NVRAM_VALUE_H_
+#define NVRAM_VALUE_H_
+
+#include <stdint.h>
+
+/*
+ * Typed values stored in place of strings.
+ *
+ * A typed value is its fixed-width little endian representation followed by
+ * one byte holding that width. The trailing byte is never '\0', so typed
+ * values are told apart from null-terminated strings without a separate type
+ * field:
+ *
+ *   bool: [0 or 1][0x01]
+ *   u32:  [4 bytes LE][0x04]
+ *   u64:  [8 bytes LE][0x08]
+ */
+enum nvram_value_type {
+	NVRAM_VALUE_BINARY = 0,
+	NVRAM_VALUE_STRING,
+	NVRAM_VALUE_BOOL,
+	NVRAM_VALUE_U32,
+	NVRAM_VALUE_U64,
+};
+
+/* Size of the largest encoded typed value */
+#define NVRAM_VALUE_MAX_SIZE 9
+
+/* Returns type of stored value */
+enum nvram_value_type nvram_value_type(const uint8_t* value, uint32_t len);
+
+/*
+ * Encode typed value
+ *
+ * @params
+ *   type: NVRAM_VALUE_BOOL, NVRAM_VALUE_U32 or NVRAM_VALUE_U64
+ *   val: value, must fit type
+ *   buf: at least NVRAM_VALUE_MAX_SIZE bytes
+ *
+ * @returns
+ *   size of encoded value
+ *   0 for invalid type or value
+ */
+uint32_t nvram_value_encode(enum nvram_value_type type, uint64_t val, uint8_t* buf);
+
+/*
+ * Get value as number
+ *
+ * Typed values of matching type are decoded, strings are parsed as by
+ * nvram_value_parse().
+ *
+ * @returns
+ *   0 for success
+ *   -EINVAL if value is not of type
+ */
+int nvram_value_get(enum nvram_value_type type, const uint8_t* value, uint32_t len, uint64_t* val);
+
+/*
+ * Parse string as type. Numbers are decimal, or hexadecimal with 0x prefix,
+ * bool also takes true and false.
+ *
+ * @returns
+ *   0 for success
+ *   -EINVAL if string is not a valid value of type
+ */
+int nvram_value_parse(enum nvram_value_type type, const char* str, uint64_t* val);
+
+/*
+ * Print value to stdout, strings as is, typed values by type (u32 and u64 as
+ * hex) and anything else as hex
+ */
+void nvram_value_print(const uint8_t* value, uint32_t len);
+
+#endif // NVRAM_VALUE_H_
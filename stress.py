@@ -0,0 +1,186 @@
+#!/usr/bin/python3
+
+'''
+Concurrent readers and writers against file backed user sections.
+
+Every writer owns its own keys and remembers the last value it committed, so
+the final content is known despite the interleaving. Readers only check that
+what they see is a value some writer could have written. Lock timeouts are
+counted separately, any other failure fails the run.
+'''
+
+import argparse
+import errno
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+KEYS_PER_WRITER = 4
+
+def percentile(samples, pct):
+    if not samples:
+        return 0.0
+    ordered = sorted(samples)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * pct / 100))]
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.latency = {}
+        self.timeouts = 0
+        self.errors = []
+
+    def record(self, op, seconds):
+        with self.lock:
+            self.latency.setdefault(op, []).append(seconds)
+
+    def timeout(self):
+        with self.lock:
+            self.timeouts += 1
+
+    def error(self, msg):
+        with self.lock:
+            self.errors.append(msg)
+
+class Runner:
+    def __init__(self, nvram, env, stats):
+        self.nvram = nvram
+        self.env = env
+        self.stats = stats
+
+    # Returns CompletedProcess, or None after a lock timeout
+    def run(self, op, args, ok=(0,)):
+        start = time.monotonic()
+        r = subprocess.run([self.nvram] + args, capture_output=True, text=True, env=self.env)
+        elapsed = time.monotonic() - start
+        if r.returncode == errno.ETIMEDOUT:
+            self.stats.timeout()
+            return None
+        if r.returncode not in ok:
+            self.stats.error(f'{" ".join(args)}: exit {r.returncode}: {r.stderr.strip()}')
+            return None
+        self.stats.record(op, elapsed)
+        return r
+
+def writer_key(writer, index):
+    return f'stress_w{writer}_k{index}'
+
+def writer(runner, writer_id, deadline, committed):
+    rng = random.Random(writer_id)
+    counter = 0
+    while time.monotonic() < deadline:
+        key = writer_key(writer_id, rng.randrange(KEYS_PER_WRITER))
+        if rng.random() < 0.25:
+            if runner.run('del', ['--del', key]) is not None:
+                committed[key] = None
+        else:
+            counter += 1
+            value = f'{writer_id}:{counter}'
+            if runner.run('set', ['--set', key, value]) is not None:
+                committed[key] = value
+
+def reader(runner, reader_id, deadline, writers):
+    rng = random.Random(-1 - reader_id)
+    while time.monotonic() < deadline:
+        if rng.random() < 0.5:
+            w = rng.randrange(writers)
+            key = writer_key(w, rng.randrange(KEYS_PER_WRITER))
+            r = runner.run('get', ['--get', key], ok=(0, errno.ENOENT))
+            if r is not None and r.returncode == 0 and not r.stdout.startswith(f'{w}:'):
+                runner.stats.error(f'{key}: unexpected value: {r.stdout.strip()}')
+        else:
+            runner.run('list', ['--list'])
+
+def read_section(nvram, env, section_a, section_b):
+    env = dict(env, NVRAM_FILE_USER_A=section_a, NVRAM_FILE_USER_B=section_b)
+    r = subprocess.run([nvram, '--list'], capture_output=True, text=True, env=env, check=True)
+    return dict(line.split('=', 1) for line in r.stdout.splitlines())
+
+def counter_of(value):
+    return int(value.split(':')[1])
+
+def check_consistency(nvram, env, committed):
+    errors = []
+    expected = {k: v for k, v in committed.items() if v is not None}
+    actual = read_section(nvram, env, env['NVRAM_FILE_USER_A'], env['NVRAM_FILE_USER_B'])
+    if actual != expected:
+        missing = {k: v for k, v in expected.items() if actual.get(k) != v}
+        extra = {k: v for k, v in actual.items() if k not in expected}
+        errors.append(f'active state differs, expected but missing: {missing}, unexpected: {extra}')
+
+    # Each section on its own must hold a complete earlier or current state
+    sections = []
+    for name in ('NVRAM_FILE_USER_A', 'NVRAM_FILE_USER_B'):
+        if not os.path.isfile(env[name]):
+            continue
+        try:
+            sections.append(read_section(nvram, env, env[name], ''))
+        except subprocess.CalledProcessError as e:
+            errors.append(f'{env[name]}: unreadable: {e.stderr.strip()}')
+    if actual not in sections:
+        errors.append('neither section alone matches the active state')
+    for section in sections:
+        for key, value in section.items():
+            final = actual.get(key)
+            if final is not None and counter_of(value) > counter_of(final):
+                errors.append(f'{key}: stale section has newer value {value} than {final}')
+    return errors
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--nvram', default='./build/nvram', help='binary under test')
+    parser.add_argument('--readers', type=int, default=4)
+    parser.add_argument('--writers', type=int, default=4)
+    parser.add_argument('--duration', type=float, default=10.0, help='seconds')
+    parser.add_argument('--max-timeouts', type=int, default=-1, help='fail if exceeded, -1 for no limit')
+    args = parser.parse_args()
+
+    nvram = os.path.abspath(args.nvram)
+    stats = Stats()
+    with tempfile.TemporaryDirectory() as tmpdir:
+        env = {
+            'NVRAM_INTERFACE': 'file',
+            'NVRAM_FILE_SYSTEM_A': f'{tmpdir}/system_a',
+            'NVRAM_FILE_SYSTEM_B': f'{tmpdir}/system_b',
+            'NVRAM_FILE_USER_A': f'{tmpdir}/user_a',
+            'NVRAM_FILE_USER_B': f'{tmpdir}/user_b',
+        }
+        runner = Runner(nvram, env, stats)
+        committed = [dict() for _ in range(args.writers)]
+        deadline = time.monotonic() + args.duration
+        threads = [threading.Thread(target=writer, args=(runner, i, deadline, committed[i])) for i in range(args.writers)]
+        threads += [threading.Thread(target=reader, args=(runner, i, deadline, max(args.writers, 1))) for i in range(args.readers)]
+        start = time.monotonic()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        elapsed = time.monotonic() - start
+
+        merged = {}
+        for c in committed:
+            merged.update(c)
+        errors = stats.errors + check_consistency(nvram, env, merged)
+
+    total = sum(len(v) for v in stats.latency.values())
+    print(f'{args.writers} writers, {args.readers} readers, {elapsed:.1f} s')
+    print(f'{"op":<6} {"count":>8} {"ops/s":>8} {"p50 ms":>8} {"p99 ms":>8} {"max ms":>8}')
+    for op in sorted(stats.latency):
+        samples = stats.latency[op]
+        print(f'{op:<6} {len(samples):>8} {len(samples) / elapsed:>8.1f} '
+              f'{percentile(samples, 50) * 1000:>8.2f} {percentile(samples, 99) * 1000:>8.2f} {max(samples) * 1000:>8.2f}')
+    print(f'total: {total} ops, {total / elapsed:.1f} ops/s, lock timeouts: {stats.timeouts}')
+
+    for e in errors:
+        print(f'error: {e}', file=sys.stderr)
+    if args.max_timeouts >= 0 and stats.timeouts > args.max_timeouts:
+        print(f'error: {stats.timeouts} lock timeouts exceeds {args.max_timeouts}', file=sys.stderr)
+        return 1
+    return 1 if errors else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -4,6 +4,12 @@ import unittest
 import tempfile
 import os
 import subprocess
+import time
+import errno
+import fcntl
+import threading
+import pwd
+import shutil
 from subprocess import CalledProcessError
 
 def nvram(env, arglist, sys=False):
@@ -29,6 +35,9 @@ class test_user_base(unittest.TestCase):
                 'NVRAM_FILE_SYSTEM_B': f'{self.dir}/system_b',
                 'NVRAM_FILE_USER_A': f'{self.dir}/user_a',
                 'NVRAM_FILE_USER_B': f'{self.dir}/user_b',
+                'NVRAM_SNAPSHOT': f'{self.dir}/snapshot',
+                'NVRAM_VOLATILE_FILE': f'{self.dir}/run/volatile',
+                'NVRAM_STATS_FILE': f'{self.dir}/stats',
             }
         self.sys = False
     
@@ -56,6 +65,12 @@ class test_user_base(unittest.TestCase):
             args.extend(['--del', key])
         nvram(self.env, args, sys=self.sys)
 
+    # Held until the test ends, section is system, user or volatile
+    def hold_lock(self, section):
+        lock = open(f'/run/lock/nvram-{section}.lock', 'w')
+        fcntl.flock(lock, fcntl.LOCK_EX)
+        self.addCleanup(lock.close)
+
 class test_user_set_get(test_user_base):
     def test_set_get(self):
         key = 'key1'
@@ -79,6 +94,20 @@ class test_user_set_get(test_user_base):
         key = 'key1'
         with self.assertRaises(CalledProcessError):
             self.nvram_get(key)
+
+    # Enough keys to grow the table's hash several times, with deleted keys set again
+    def test_many_keys(self):
+        attributes = {f'key{i}': f'val{i}' for i in range(500)}
+        self.nvram_set(attributes.items())
+        self.nvram_delete([f'key{i}' for i in range(0, 500, 2)])
+        args = []
+        for i in range(0, 500, 4):
+            args.extend(['--del', f'key{i + 1}', '--set', f'key{i}', f'new{i}'])
+            attributes[f'key{i}'] = f'new{i}'
+            del attributes[f'key{i + 1}']
+            del attributes[f'key{i + 2}']
+        nvram(self.env, args)
+        self.assertEqual(self.nvram_list(), attributes)
             
     def test_overwrite(self):
         key = 'key1'
@@ -87,6 +116,27 @@ class test_user_set_get(test_user_base):
         self.nvram_set([(key, val1)])
         self.nvram_set([(key, val2)])
         self.assertEqual(val2, self.nvram_get(key))
+
+    def test_standby_erase(self):
+        self.env['NVRAM_STANDBY_ERASE'] = '1'
+        for i in range(3):
+            self.nvram_set([('key1', f'val{i}')])
+            self.assertEqual(f'val{i}', self.nvram_get('key1'))
+
+    # An erase outlasting the lock timeout, as on NOR, holds the standby lock
+    def test_standby_erase_back_to_back(self):
+        self.env['NVRAM_STANDBY_ERASE'] = '1'
+        self.nvram_set([('key1', 'val1')])
+        lock = open('/run/lock/nvram-user-standby.lock', 'w')
+        self.addCleanup(lock.close)
+        fcntl.flock(lock, fcntl.LOCK_EX)
+        threading.Timer(0.3, lock.close).start()
+        self.assertEqual('val1', self.nvram_get('key1'))
+        start = time.monotonic()
+        self.nvram_set([('key2', 'val2')])
+        self.nvram_set([('key3', 'val3')])
+        self.assertGreater(time.monotonic() - start, 0.2)
+        self.assertEqual(self.nvram_list(), {'key1': 'val1', 'key2': 'val2', 'key3': 'val3'})
         
     def test_with_prefix(self):
         key = 'SYS_key1'
@@ -94,6 +144,469 @@ class test_user_set_get(test_user_base):
         with self.assertRaises(CalledProcessError):
             self.nvram_set([(key, val)])
 
+    def test_typed(self):
+        values = [
+            ('u32', '0', '0', '0x0'),
+            ('u32', '4294967295', '4294967295', '0xffffffff'),
+            ('u32', '0x2a', '42', '0x2a'),
+            ('u64', '18446744073709551615', '18446744073709551615', '0xffffffffffffffff'),
+            ('bool', 'true', 'true', 'true'),
+            ('bool', '0', 'false', 'false'),
+            ]
+        for t, val, typed, listed in values:
+            nvram(self.env, [f'--set-{t}', 'key1', val], sys=self.sys)
+            self.assertEqual(typed, nvram(self.env, [f'--get-{t}', 'key1'], sys=self.sys).rstrip())
+            self.assertEqual(listed, self.nvram_get('key1'))
+            self.assertEqual({'key1': listed}, self.nvram_list())
+
+        values_err = [('u32', '4294967296'), ('u32', '-1'), ('u32', ' 1'), ('u64', '0x'), ('bool', '2')]
+        for t, val in values_err:
+            with self.assertRaises(CalledProcessError):
+                nvram(self.env, [f'--set-{t}', 'key1', val], sys=self.sys)
+
+    def test_exists(self):
+        self.nvram_set([('key1', 'val1')])
+        nvram(self.env, ['--exists', 'key1'], sys=self.sys)
+        with self.assertRaises(CalledProcessError) as e:
+            nvram(self.env, ['--exists', 'key2'], sys=self.sys)
+        self.assertEqual(2, e.exception.returncode)
+        with self.assertRaises(CalledProcessError):
+            nvram(self.env, ['--exists', 'key1', '--list'], sys=self.sys)
+
+    def test_typed_get(self):
+        self.nvram_set([('key1', '7'), ('key2', 'val2')])
+        nvram(self.env, ['--set-u64', 'key3', '7'], sys=self.sys)
+        self.assertEqual('7', nvram(self.env, ['--get-u32', 'key1'], sys=self.sys).rstrip())
+        with self.assertRaises(CalledProcessError):
+            nvram(self.env, ['--get-u32', 'key2'], sys=self.sys)
+        with self.assertRaises(CalledProcessError):
+            nvram(self.env, ['--get-u32', 'key3'], sys=self.sys)
+
+    def test_cas(self):
+        self.nvram_set([('key1', 'val1')])
+        nvram(self.env, ['--cas', 'key1', 'val1', 'val2'], sys=self.sys)
+        self.assertEqual('val2', self.nvram_get('key1'))
+        with self.assertRaises(CalledProcessError) as e:
+            nvram(self.env, ['--cas', 'key1', 'val1', 'val3'], sys=self.sys)
+        self.assertEqual(errno.ECANCELED, e.exception.returncode)
+        with self.assertRaises(CalledProcessError) as e:
+            nvram(self.env, ['--cas', 'key2', '', 'val3'], sys=self.sys)
+        self.assertEqual(errno.ECANCELED, e.exception.returncode)
+        self.assertEqual('val2', self.nvram_get('key1'))
+
+    def test_cas_empty(self):
+        self.nvram_set([('key1', '')])
+        nvram(self.env, ['--cas', 'key1', '', 'val1'], sys=self.sys)
+        self.assertEqual('val1', self.nvram_get('key1'))
+
+    def test_cas_absent(self):
+        nvram(self.env, ['--cas-absent', 'key1', 'val1'], sys=self.sys)
+        with self.assertRaises(CalledProcessError) as e:
+            nvram(self.env, ['--cas-absent', 'key1', 'val2'], sys=self.sys)
+        self.assertEqual(errno.ECANCELED, e.exception.returncode)
+        self.assertEqual('val1', self.nvram_get('key1'))
+
+    def test_cas_batch(self):
+        self.nvram_set([('key1', 'val1')])
+        with self.assertRaises(CalledProcessError):
+            nvram(self.env, ['--set', 'key2', 'val2', '--cas', 'key1', 'other', 'val3'], sys=self.sys)
+        self.assertEqual(self.nvram_list(), {'key1': 'val1'})
+        with self.assertRaises(CalledProcessError):
+            nvram(self.env, ['--cas', 'key1', 'val1', 'val3', '--get', 'key1'], sys=self.sys)
+
+    def test_cas_unchanged(self):
+        self.nvram_set([('key1', 'val1')])
+        written = [s for s in ('user_a', 'user_b') if os.path.isfile(f'{self.dir}/{s}')]
+        nvram(self.env, ['--cas', 'key1', 'val1', 'val1'], sys=self.sys)
+        self.assertEqual(written, [s for s in ('user_a', 'user_b') if os.path.isfile(f'{self.dir}/{s}')])
+
+    def test_incr(self):
+        self.assertEqual('1', nvram(self.env, ['--incr', 'count'], sys=self.sys).rstrip())
+        self.assertEqual('6', nvram(self.env, ['--incr', 'count', '5'], sys=self.sys).rstrip())
+        self.assertEqual('4', nvram(self.env, ['--decr', 'count', '2'], sys=self.sys).rstrip())
+        self.assertEqual('4', self.nvram_get('count'))
+        self.assertEqual('3\n1\n', nvram(self.env, ['--decr', 'count', '--incr', 'other'], sys=self.sys))
+        with self.assertRaises(CalledProcessError) as e:
+            nvram(self.env, ['--decr', 'count', '4', '--decr', 'count'], sys=self.sys)
+        self.assertEqual(errno.ERANGE, e.exception.returncode)
+        # Nothing committed, so nothing printed
+        self.assertEqual('', e.exception.stdout)
+        self.assertEqual('3', self.nvram_get('count'))
+
+    def test_incr_typed(self):
+        nvram(self.env, ['--set-u32', 'count', '0xfffffffe'], sys=self.sys)
+        self.assertEqual('4294967295', nvram(self.env, ['--incr', 'count'], sys=self.sys).rstrip())
+        self.assertEqual('4294967295', nvram(self.env, ['--get-u32', 'count'], sys=self.sys).rstrip())
+        with self.assertRaises(CalledProcessError) as e:
+            nvram(self.env, ['--incr', 'count'], sys=self.sys)
+        self.assertEqual(errno.ERANGE, e.exception.returncode)
+        nvram(self.env, ['--set-bool', 'flag', 'true'], sys=self.sys)
+        self.nvram_set([('name', 'val1')])
+        for key in ('flag', 'name'):
+            with self.assertRaises(CalledProcessError):
+                nvram(self.env, ['--incr', key], sys=self.sys)
+
+class test_stats(test_user_base):
+    def stats(self):
+        stdout = nvram(self.env, ['--stats'])
+        stats = {}
+        for line in stdout.splitlines():
+            section, fields = line.split(': ')
+            stats[section] = dict(field.split('=') for field in fields.split())
+        return stats
+
+    def test_empty(self):
+        self.assertEqual({}, self.stats())
+        nvram(self.env, ['--list'])
+        self.assertEqual({}, self.stats())
+
+    def test_commits(self):
+        for i in range(3):
+            self.nvram_set([(f'key{i}', f'val{i}')])
+        self.nvram_get('key1')
+        stats = self.stats()
+        user_a = stats[f'{self.dir}/user_a']
+        user_b = stats[f'{self.dir}/user_b']
+        # Commits alternate between sections, starting with A
+        self.assertEqual('2', user_a['commits'])
+        self.assertEqual('1', user_b['commits'])
+        self.assertEqual('3', user_a['counter'])
+        self.assertEqual('2', user_b['counter'])
+        self.assertEqual(str(os.path.getsize(f'{self.dir}/user_b')), user_b['written_bytes'])
+        self.assertEqual('0', user_a['erased_blocks'])
+
+    def test_openmetrics(self):
+        self.nvram_set([('key1', 'val1')])
+        stdout = nvram(self.env, ['--stats-openmetrics'])
+        lines = stdout.splitlines()
+        self.assertIn('# TYPE nvram_commits counter', lines)
+        self.assertIn(f'nvram_commits_total{{section="{self.dir}/user_a"}} 1', lines)
+        self.assertIn(f'nvram_transaction_counter{{section="{self.dir}/user_a"}} 1', lines)
+        self.assertEqual('# EOF', lines[-1])
+
+    def test_disabled(self):
+        self.env['NVRAM_STATS_FILE'] = ''
+        self.nvram_set([('key1', 'val1')])
+        self.assertFalse(os.path.exists(f'{self.dir}/stats'))
+        with self.assertRaises(CalledProcessError):
+            nvram(self.env, ['--stats'])
+
+    def test_combined(self):
+        with self.assertRaises(CalledProcessError):
+            nvram(self.env, ['--stats', '--list'])
+
+class test_preallocate(test_user_base):
+    def setUp(self):
+        super().setUp()
+        self.env['NVRAM_FILE_PREALLOCATE'] = '65536'
+
+    def test_fixed_size(self):
+        self.nvram_set([('key1', 'x' * 1000), ('key2', 'val2')])
+        self.nvram_set([('key3', 'val3')])
+        self.nvram_delete(['key1'])
+        self.assertEqual(os.path.getsize(f'{self.dir}/user_a'), 65536)
+        self.assertEqual(os.path.getsize(f'{self.dir}/user_b'), 65536)
+        self.assertEqual(self.nvram_list(), {'key2': 'val2', 'key3': 'val3'})
+
+    def test_larger_than_preallocated(self):
+        self.env['NVRAM_FILE_PREALLOCATE'] = '64'
+        self.nvram_set([('key1', 'x' * 1000)])
+        self.assertGreater(os.path.getsize(f'{self.dir}/user_a'), 1000)
+        self.nvram_set([('key1', 'val1')])
+        self.nvram_set([('key2', 'val2')])
+        self.assertEqual(self.nvram_list(), {'key1': 'val1', 'key2': 'val2'})
+
+class test_stream(test_user_base):
+    def setUp(self):
+        super().setUp()
+        self.env['NVRAM_STREAM_WINDOW'] = '16'
+        # Lookups have to read the sections
+        self.env['NVRAM_SNAPSHOT'] = ''
+
+    def corrupt_last_byte(self, section):
+        with open(f'{self.dir}/{section}', 'r+b') as f:
+            f.seek(-1, os.SEEK_END)
+            last = f.read(1)[0]
+            f.seek(-1, os.SEEK_END)
+            f.write(bytes([last ^ 0xff]))
+
+    def test_entries_larger_than_window(self):
+        pairs = {f'key{i}': str(i) * 100 for i in range(10)}
+        self.nvram_set(pairs.items())
+        self.nvram_set([('key0', 'x')])
+        pairs['key0'] = 'x'
+        self.assertEqual(self.nvram_list(), pairs)
+        self.assertEqual(self.nvram_get('key9'), '9' * 100)
+        with self.assertRaises(CalledProcessError):
+            self.nvram_get('missing')
+        self.env['NVRAM_STREAM_WINDOW'] = '0'
+        self.assertEqual(self.nvram_list(), pairs)
+
+    def test_corrupt_active(self):
+        self.nvram_set([('key1', 'x' * 100)])
+        self.nvram_set([('key1', 'y' * 100)])
+        self.corrupt_last_byte('user_b')
+        self.assertEqual(self.nvram_get('key1'), 'x' * 100)
+        self.assertEqual(self.nvram_list(), {'key1': 'x' * 100})
+        self.nvram_set([('key2', 'val2')])
+        self.assertEqual(self.nvram_list(), {'key1': 'x' * 100, 'key2': 'val2'})
+
+    # Both sections have counter 1 after a counter reset, the same one as for
+    # sections read whole has to be active
+    def test_equal_counters(self):
+        self.nvram_set([('key1', 'val1')])
+        os.rename(f'{self.dir}/user_a', f'{self.dir}/saved')
+        self.nvram_set([('key1', 'val2')])
+        self.assertFalse(os.path.exists(f'{self.dir}/user_b'))
+        os.rename(f'{self.dir}/saved', f'{self.dir}/user_b')
+        self.env['NVRAM_STREAM_WINDOW'] = '0'
+        whole = self.nvram_get('key1')
+        self.env['NVRAM_STREAM_WINDOW'] = '16'
+        self.assertEqual(self.nvram_get('key1'), whole)
+        self.nvram_set([('key2', 'val2')])
+        self.assertEqual(self.nvram_list(), {'key1': whole, 'key2': 'val2'})
+
+    def test_active_as_whole(self):
+        for i in range(3):
+            self.nvram_set([('key1', f'val{i}')])
+        for _ in range(2):
+            self.env['NVRAM_STREAM_WINDOW'] = '0'
+            whole = self.nvram_get('key1')
+            self.env['NVRAM_STREAM_WINDOW'] = '16'
+            self.assertEqual(self.nvram_get('key1'), whole)
+            os.rename(f'{self.dir}/user_a', f'{self.dir}/saved')
+            os.rename(f'{self.dir}/user_b', f'{self.dir}/user_a')
+            os.rename(f'{self.dir}/saved', f'{self.dir}/user_b')
+
+    def test_corrupt_both(self):
+        self.nvram_set([('key1', 'val1')])
+        self.nvram_set([('key1', 'val2')])
+        self.corrupt_last_byte('user_a')
+        self.corrupt_last_byte('user_b')
+        self.assertEqual(self.nvram_list(), {})
+
+class test_lockless(test_user_base):
+    def setUp(self):
+        super().setUp()
+        # Lookups have to read the sections
+        self.env['NVRAM_SNAPSHOT'] = ''
+
+    def test_read_while_locked(self):
+        self.nvram_set([('key1', 'val1'), ('key2', 'val2')])
+        self.nvram_set([('key2', 'val3')])
+        self.hold_lock('user')
+        self.assertEqual(self.nvram_get('key1'), 'val1')
+        self.assertEqual(self.nvram_list(), {'key1': 'val1', 'key2': 'val3'})
+        with self.assertRaises(CalledProcessError):
+            self.nvram_get('missing')
+        with self.assertRaises(CalledProcessError):
+            self.nvram_set([('key3', 'val3')])
+        self.env['NVRAM_LOCKLESS_READ'] = '0'
+        with self.assertRaises(CalledProcessError):
+            self.nvram_get('key1')
+
+    def test_invalid_takes_lock(self):
+        self.env['NVRAM_FILE_USER_B'] = ''
+        self.nvram_set([('key1', 'val1')])
+        with open(f'{self.dir}/user_a', 'r+b') as f:
+            f.seek(-1, os.SEEK_END)
+            f.write(b'x')
+        self.assertEqual(self.nvram_list(), {})
+        self.hold_lock('user')
+        with self.assertRaises(CalledProcessError):
+            self.nvram_list()
+
+class test_section_locks(test_user_base):
+    def setUp(self):
+        super().setUp()
+        self.env['NVRAM_SNAPSHOT'] = ''
+        self.env['NVRAM_LOCKLESS_READ'] = '0'
+
+    def test_user_while_system_locked(self):
+        self.hold_lock('system')
+        nvram(self.env, ['--user', '--set', 'key1', 'val1'])
+        self.assertEqual(nvram(self.env, ['--user', '--get', 'key1']).rstrip(), 'val1')
+        # Without --user the system section is read too
+        with self.assertRaises(CalledProcessError) as e:
+            self.nvram_get('key1')
+        self.assertEqual(e.exception.returncode, errno.ETIMEDOUT)
+
+    def test_system_while_user_locked(self):
+        self.hold_lock('user')
+        self.assertEqual(nvram(self.env, ['--sys', '--list']), '')
+        with self.assertRaises(CalledProcessError) as e:
+            self.nvram_list()
+        self.assertEqual(e.exception.returncode, errno.ETIMEDOUT)
+
+    def test_persistent_while_volatile_locked(self):
+        self.hold_lock('volatile')
+        nvram(self.env, ['--user', '--set', 'key1', 'val1'])
+        self.nvram_set([('key2', 'val2')])
+        with self.assertRaises(CalledProcessError) as e:
+            self.nvram_set([('VOL_key3', 'val3')])
+        self.assertEqual(e.exception.returncode, errno.ETIMEDOUT)
+        self.assertEqual(nvram(self.env, ['--user', '--list']), 'key1=val1\nkey2=val2\n')
+
+    def test_set_while_system_locked(self):
+        self.hold_lock('system')
+        self.nvram_set([('key1', 'val1')])
+        self.nvram_delete(['key1'])
+        self.assertEqual('1', nvram(self.env, ['--incr', 'key2']).rstrip())
+        self.assertEqual(nvram(self.env, ['--user', '--list']), 'key2=1\n')
+
+class test_snapshot(test_user_base):
+    def remove_sections(self):
+        for section in ('user_a', 'user_b'):
+            if os.path.exists(f'{self.dir}/{section}'):
+                os.remove(f'{self.dir}/{section}')
+
+    def test_get_from_snapshot(self):
+        self.nvram_set([('key1', 'val1')])
+        self.nvram_set([('key2', 'val2')])
+        self.assertTrue(os.path.isfile(f'{self.dir}/snapshot'))
+        self.remove_sections()
+        self.assertEqual('val1', self.nvram_get('key1'))
+        nvram(self.env, ['--exists', 'key2'])
+        with self.assertRaises(CalledProcessError):
+            nvram(self.env, ['--exists', 'key3'])
+
+    def test_updated_by_commit(self):
+        self.nvram_set([('key1', 'val1')])
+        self.nvram_set([('key1', 'val2')])
+        self.nvram_delete(['key1'])
+        self.nvram_set([('key2', 'val2')])
+        self.remove_sections()
+        with self.assertRaises(CalledProcessError):
+            self.nvram_get('key1')
+        self.assertEqual('val2', self.nvram_get('key2'))
+
+    def test_updated_by_single_section(self):
+        self.nvram_set([('key1', 'val1')])
+        nvram(self.env, ['--user', '--set', 'key2', 'val2'])
+        self.remove_sections()
+        self.assertEqual('val1', self.nvram_get('key1'))
+        self.assertEqual('val2', self.nvram_get('key2'))
+
+    def test_other_section_published(self):
+        nvram(self.env, ['--user', '--set', 'key1', 'val1'])
+        self.remove_sections()
+        self.assertEqual('val1', self.nvram_get('key1'))
+
+    def test_other_section_locked(self):
+        self.hold_lock('system')
+        nvram(self.env, ['--user', '--set', 'key1', 'val1'])
+        self.assertTrue(os.path.isfile(f'{self.dir}/snapshot'))
+        self.remove_sections()
+        with self.assertRaises(CalledProcessError):
+            self.nvram_get('key1')
+
+    def test_other_source(self):
+        self.nvram_set([('key1', 'val1')])
+        self.env['NVRAM_FILE_USER_A'] = f'{self.dir}/other_a'
+        self.env['NVRAM_FILE_USER_B'] = f'{self.dir}/other_b'
+        with self.assertRaises(CalledProcessError):
+            self.nvram_get('key1')
+
+    def test_disabled(self):
+        self.env['NVRAM_SNAPSHOT'] = ''
+        self.nvram_set([('key1', 'val1')])
+        self.assertFalse(os.path.exists(f'{self.dir}/snapshot'))
+        self.assertEqual('val1', self.nvram_get('key1'))
+
+class test_volatile(test_user_base):
+    def test_set_get(self):
+        self.nvram_set([('VOL_key1', 'val1'), ('key2', 'val2')])
+        self.assertEqual('val1', self.nvram_get('VOL_key1'))
+        self.assertEqual(self.nvram_list(), {'VOL_key1': 'val1', 'key2': 'val2'})
+        self.assertTrue(os.path.isfile(f'{self.dir}/run/volatile'))
+
+    def test_not_persisted(self):
+        self.nvram_set([('key1', 'val1')])
+        user = {s: open(f'{self.dir}/{s}', 'rb').read() for s in ('user_a', 'user_b') if os.path.exists(f'{self.dir}/{s}')}
+        self.nvram_set([('VOL_key1', 'val1')])
+        self.nvram_delete(['VOL_key1'])
+        self.nvram_set([('VOL_key2', 'val2')])
+        self.assertEqual(user, {s: open(f'{self.dir}/{s}', 'rb').read() for s in ('user_a', 'user_b') if os.path.exists(f'{self.dir}/{s}')})
+        os.remove(f'{self.dir}/run/volatile')
+        self.assertEqual(self.nvram_list(), {'key1': 'val1'})
+
+    def test_not_in_user(self):
+        self.nvram_set([('key1', 'val1')])
+        with self.assertRaises(CalledProcessError):
+            nvram(self.env, ['--user', '--set', 'VOL_key1', 'val1'])
+        with self.assertRaises(CalledProcessError):
+            nvram(self.env, ['--user', '--get', 'VOL_key1'])
+        self.nvram_set([('VOL_key1', 'val1')])
+        self.assertEqual(nvram(self.env, ['--user', '--list']), 'key1=val1\n')
+
+    def test_counter(self):
+        self.assertEqual('1', nvram(self.env, ['--incr', 'VOL_count']).rstrip())
+        self.assertEqual('3', nvram(self.env, ['--incr', 'VOL_count', '2']).rstrip())
+        self.assertFalse(os.path.exists(f'{self.dir}/user_a'))
+        self.assertFalse(os.path.exists(f'{self.dir}/user_b'))
+
+    def test_disabled(self):
+        self.env['NVRAM_VOLATILE_PREFIX'] = ''
+        self.nvram_set([('VOL_key1', 'val1')])
+        self.assertFalse(os.path.exists(f'{self.dir}/run/volatile'))
+        self.assertEqual(nvram(self.env, ['--user', '--list']), 'VOL_key1=val1\n')
+
+class test_inspect(test_user_base):
+    def nvram_inspect(self, arglist):
+        args = ['./build/nvram-inspect']
+        args.extend(arglist)
+        return subprocess.run(args, capture_output=True, text=True, check=True).stdout
+
+    def dump(self, sections, size=3 * 1024 * 1024):
+        data = bytearray(os.urandom(size))
+        data[size // 3:2 * size // 3] = bytes(size // 3)
+        for offset, section in sections:
+            content = open(f'{self.dir}/{section}', 'rb').read()
+            data[offset:offset + len(content)] = content
+        path = f'{self.dir}/dump'
+        with open(path, 'wb') as f:
+            f.write(data)
+        return path
+
+    def size(self, section):
+        return os.path.getsize(f'{self.dir}/{section}')
+
+    def test_find(self):
+        self.nvram_set([('key1', 'val1')])
+        self.nvram_set([('key2', 'val2')])
+        dump = self.dump([(0x1000, 'user_a'), (0x3000, 'user_b'), (0x100004, 'user_b')])
+        a, b = self.size('user_a'), self.size('user_b')
+        self.assertEqual(self.nvram_inspect([dump]),
+                f'0x00001000 v2 size={a} counter=1 data=valid\n'
+                f'0x00003000 v2 size={b} counter=2 data=valid\n'
+                f'0x00100004 v2 size={b} counter=2 data=valid\n')
+
+    def test_align(self):
+        self.nvram_set([('key1', 'val1')])
+        dump = self.dump([(0x1000, 'user_a'), (0x200001, 'user_a')])
+        a = self.size('user_a')
+        self.assertEqual(self.nvram_inspect([dump]), f'0x00001000 v2 size={a} counter=1 data=valid\n')
+        self.assertEqual(self.nvram_inspect(['-a', '1', '-j', '3', dump]),
+                f'0x00001000 v2 size={a} counter=1 data=valid\n'
+                f'0x00200001 v2 size={a} counter=1 data=valid\n')
+
+    def test_decode(self):
+        self.nvram_set([('key1', 'val1')])
+        nvram(self.env, ['--set-u32', 'key2', '7'])
+        dump = self.dump([(0x1000, 'user_b')])
+        self.assertEqual(self.nvram_inspect(['--decode', dump]),
+                f'0x00001000 v2 size={self.size("user_b")} counter=2 data=valid\n'
+                '  key1=val1\n'
+                '  key2=0x7\n')
+
+    def test_invalid_data(self):
+        self.nvram_set([('key1', 'val1')])
+        dump = self.dump([(0x1000, 'user_a')])
+        with open(dump, 'r+b') as f:
+            f.seek(0x1000 + self.size('user_a') - 1)
+            f.write(b'X')
+        self.assertEqual(self.nvram_inspect(['--decode', dump]), f'0x00001000 v2 size={self.size("user_a")} counter=1 data=invalid\n')
+
 class test_user_list(test_user_base):
     def test_list(self):
         attributes = {}
@@ -109,6 +622,27 @@ class test_user_list(test_user_base):
         d = self.nvram_list()
         self.assertEqual(0, len(d))
         
+class test_user_query(test_user_base):
+    def nvram_query(self, args):
+        stdout = nvram(self.env, args, sys=self.sys)
+        return [tuple(pair.split("=")) for pair in stdout.split()]
+
+    def test_prefix(self):
+        self.nvram_set([('NET_ip', 'a'), ('NET_mask', 'b'), ('NETWORK', 'c'), ('key1', 'd')])
+        self.assertEqual([('NET_ip', 'a'), ('NET_mask', 'b')], self.nvram_query(['--list-prefix', 'NET_']))
+        self.assertEqual([('NETWORK', 'c'), ('NET_ip', 'a'), ('NET_mask', 'b')], self.nvram_query(['--list-prefix', 'NET']))
+        self.assertEqual([], self.nvram_query(['--list-prefix', 'none']))
+
+    def test_range(self):
+        self.nvram_set([(f'key{i}', f'val{i}') for i in range(10)])
+        self.assertEqual([('key2', 'val2'), ('key3', 'val3'), ('key4', 'val4')],
+                         self.nvram_query(['--range', 'key2', 'key5']))
+        self.assertEqual([], self.nvram_query(['--range', 'key5', 'key2']))
+
+    def test_mix_get(self):
+        with self.assertRaises(CalledProcessError):
+            self.nvram_query(['--list-prefix', 'key', '--get', 'key1'])
+
 class test_user_delete(test_user_base):
     def test_delete(self):
         key = 'key1'
@@ -286,6 +820,50 @@ class test_mixed_list(test_mixed_base):
         d = self.nvram_list()
         self.assertEqual(d, attributes)
 
+class test_mixed_query(test_mixed_base):
+    def test_prefix(self):
+        self.sys = True
+        self.nvram_set([('SYS_NET_ip', 'a'), ('SYS_other', 'b')])
+        self.sys = False
+        self.nvram_set([('NET_ip', 'c')])
+        stdout = nvram(self.env, ['--list-prefix', 'SYS_NET_'])
+        self.assertEqual('SYS_NET_ip=a\n', stdout)
+        stdout = nvram(self.env, ['--user', '--list-prefix', 'SYS_'])
+        self.assertEqual('', stdout)
+        stdout = nvram(self.env, ['--range', 'A', 'z'])
+        self.assertEqual('SYS_NET_ip=a\nSYS_other=b\nNET_ip=c\n', stdout)
+
+class test_mixed_snapshot(test_mixed_base):
+    def test_sections_kept(self):
+        nvram(self.env, ['--sys', '--set', 'SYS_key1', 'val1'])
+        nvram(self.env, ['--user', '--set', 'key2', 'val2'])
+        nvram(self.env, ['--sys', '--set', 'SYS_key3', 'val3'])
+        for section in ('system_a', 'system_b', 'user_a', 'user_b'):
+            if os.path.exists(f'{self.dir}/{section}'):
+                os.remove(f'{self.dir}/{section}')
+        self.assertEqual('val1', self.nvram_get('SYS_key1'))
+        self.assertEqual('val2', self.nvram_get('key2'))
+        self.assertEqual('val3', self.nvram_get('SYS_key3'))
+
+class test_mixed_locks(test_mixed_base):
+    def setUp(self):
+        super().setUp()
+        self.env['NVRAM_SNAPSHOT'] = ''
+        self.env['NVRAM_LOCKLESS_READ'] = '0'
+
+    def test_system_get_while_user_locked(self):
+        nvram(self.env, ['--sys', '--set', 'SYS_key1', 'val1'])
+        self.hold_lock('user')
+        self.assertEqual(nvram(self.env, ['--sys', '--get', 'SYS_key1']).rstrip(), 'val1')
+        with self.assertRaises(CalledProcessError) as e:
+            self.nvram_set([('key2', 'val2')])
+        self.assertEqual(e.exception.returncode, errno.ETIMEDOUT)
+
+    def test_system_set_while_user_locked(self):
+        self.hold_lock('user')
+        nvram(self.env, ['--sys', '--set', 'SYS_key1', 'val1'])
+        self.assertEqual(nvram(self.env, ['--sys', '--list']), 'SYS_key1=val1\n')
+
 class test_mixed_delete(test_mixed_base):
     def tearDown(self):
         self.assertTrue(os.path.isfile(self.env['NVRAM_FILE_SYSTEM_A']))
@@ -330,6 +908,8 @@ class test_single_section(test_user_base):
                 'NVRAM_FILE_SYSTEM_B': f'{self.dir}/system_b',
                 'NVRAM_FILE_USER_A': '',
                 'NVRAM_FILE_USER_B': '',
+                'NVRAM_SNAPSHOT': f'{self.dir}/snapshot',
+                'NVRAM_VOLATILE_FILE': f'{self.dir}/run/volatile',
             }
         self.sys = False
         
@@ -368,6 +948,174 @@ class test_single_section(test_user_base):
         self.assertTrue(os.path.isfile(f'{self.dir}/user_b'))
         self.assertFalse(os.path.isfile(f'{self.dir}/user_a'))
 
+class test_serve(test_user_base):
+    def setUp(self):
+        super().setUp()
+        self.env['NVRAM_SOCKET'] = f'{self.dir}/nvram.sock'
+        self.env['NVRAM_FLUSH_DELAY_MS'] = '60000'
+        self.server = subprocess.Popen(['./build/nvram', '--serve'], env=self.env)
+        for _ in range(500):
+            if os.path.exists(self.env['NVRAM_SOCKET']):
+                break
+            time.sleep(0.01)
+        self.assertTrue(os.path.exists(self.env['NVRAM_SOCKET']))
+
+    def tearDown(self):
+        if self.server.poll() is None:
+            self.server.terminate()
+        self.server.wait()
+        super().tearDown()
+
+    def stop_server(self):
+        self.server.terminate()
+        self.assertEqual(0, self.server.wait())
+        self.assertFalse(os.path.exists(self.env['NVRAM_SOCKET']))
+
+    def test_coalesced_sync(self):
+        for i in range(10):
+            self.nvram_set([(f'key{i}', f'val{i}')])
+        self.assertEqual('val3', self.nvram_get('key3'))
+        self.assertEqual(10, len(self.nvram_list()))
+        self.assertFalse(os.path.isfile(f'{self.dir}/user_a'))
+        self.assertFalse(os.path.isfile(f'{self.dir}/user_b'))
+
+        nvram(self.env, ['--sync'])
+        written = [s for s in ('user_a', 'user_b') if os.path.isfile(f'{self.dir}/{s}')]
+        self.assertEqual(1, len(written))
+
+        self.stop_server()
+        self.assertEqual(self.nvram_list(), {f'key{i}': f'val{i}' for i in range(10)})
+
+    def test_flush_on_terminate(self):
+        self.nvram_set([('key1', 'val1')])
+        self.nvram_delete(['key1'])
+        self.nvram_set([('key2', 'val2')])
+        self.stop_server()
+        self.assertEqual(self.nvram_list(), {'key2': 'val2'})
+
+    def test_snapshot(self):
+        self.nvram_set([('key1', 'val1')])
+        nvram(self.env, ['--sync'])
+        self.stop_server()
+        for section in ('user_a', 'user_b'):
+            if os.path.exists(f'{self.dir}/{section}'):
+                os.remove(f'{self.dir}/{section}')
+        self.assertEqual('val1', self.nvram_get('key1'))
+
+    def test_cas_batch(self):
+        self.nvram_set([('key1', 'val1')])
+        nvram(self.env, ['--sync'])
+        with self.assertRaises(CalledProcessError):
+            nvram(self.env, ['--set', 'key2', 'val2', '--set', 'VOL_key3', 'val3', '--cas', 'key1', 'other', 'val4'])
+        self.assertEqual(self.nvram_list(), {'key1': 'val1'})
+        self.stop_server()
+        self.assertEqual(self.nvram_list(), {'key1': 'val1'})
+
+    def test_volatile(self):
+        self.nvram_set([('VOL_key1', 'val1')])
+        self.assertEqual('val1', self.nvram_get('VOL_key1'))
+        self.stop_server()
+        self.assertFalse(os.path.isfile(f'{self.dir}/user_a'))
+        self.assertFalse(os.path.isfile(f'{self.dir}/user_b'))
+        self.assertEqual(self.nvram_list(), {'VOL_key1': 'val1'})
+
+    def test_section_override(self):
+        with self.assertRaises(CalledProcessError):
+            nvram(self.env, ['--user_a', f'{self.dir}/other', '--list'])
+
+    def test_socket_mode(self):
+        self.assertEqual(0o660, os.stat(self.env['NVRAM_SOCKET']).st_mode & 0o777)
+
+    # Run a copy of nvram as nobody, which can execute it
+    def nvram_nobody(self, arglist, env):
+        nobody = pwd.getpwnam('nobody')
+        os.chmod(self.dir, 0o755)
+        shutil.copy('./build/nvram', f'{self.dir}/nvram')
+        return subprocess.run([f'{self.dir}/nvram'] + arglist, capture_output=True, text=True, env=env,
+                user=nobody.pw_uid, group=nobody.pw_gid, extra_groups=[])
+
+    def test_untrusted_unlock(self):
+        os.chown(self.env['NVRAM_SOCKET'], -1, pwd.getpwnam('nobody').pw_gid)
+        env = dict(self.env, NVRAM_SYSTEM_UNLOCK='16440')
+        r = self.nvram_nobody(['--sys', '--set', 'SYS_key1', 'val1'], env)
+        self.assertEqual(errno.EACCES, r.returncode)
+        self.assertIn('system write locked', r.stderr)
+        r = self.nvram_nobody(['--user', '--set', 'key1', 'val1'], env)
+        self.assertEqual(0, r.returncode)
+        self.assertEqual('val1', self.nvram_get('key1'))
+
+    # Change deferred by server isn't seen when reading the sections directly
+    def test_not_allowed_fails(self):
+        self.nvram_set([('key1', 'val1')])
+        r = self.nvram_nobody(['--list'], self.env)
+        self.assertIn(r.returncode, (errno.EACCES, errno.EPERM), r.stderr)
+        self.assertEqual('', r.stdout)
+
+class test_image(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.dir = self.tmpdir.name
+        self.out = f'{self.dir}/out'
+
+    def tearDown(self):
+        self.tmpdir.cleanup()
+
+    def write(self, name, content):
+        path = f'{self.dir}/{name}'
+        with open(path, 'w') as f:
+            f.write(content)
+        return path
+
+    def nvram_image(self, arglist):
+        args = ['./build/nvram-image', '-o', self.out]
+        args.extend(arglist)
+        subprocess.run(args, capture_output=True, text=True, check=True)
+
+    def unit_env(self, unit):
+        return {
+                'NVRAM_INTERFACE': 'file',
+                'NVRAM_FILE_SYSTEM_A': f'{self.out}/{unit}/system_a',
+                'NVRAM_FILE_SYSTEM_B': f'{self.out}/{unit}/system_b',
+                'NVRAM_FILE_USER_A': f'{self.out}/{unit}/user_a',
+                'NVRAM_FILE_USER_B': f'{self.out}/{unit}/user_b',
+                'NVRAM_SNAPSHOT': '',
+                'NVRAM_VOLATILE_FILE': '',
+                'NVRAM_STATS_FILE': '',
+            }
+
+    def unit_list(self, unit, sys=False):
+        stdout = nvram(self.unit_env(unit), ['--list'], sys=sys)
+        return dict(pair.split("=", 1) for pair in stdout.splitlines())
+
+    def test_csv_template(self):
+        template = self.write('template', '# defaults\nSYS_board=r1\nregion=eu\n\n')
+        manifest = self.write('units.csv', 'unit,SYS_serial,region\nsn1,1,\nsn2,2,"u,s"\n')
+        self.nvram_image(['-t', template, manifest])
+        self.assertEqual(self.unit_list('sn1'), {'SYS_board': 'r1', 'SYS_serial': '1', 'region': 'eu'})
+        self.assertEqual(self.unit_list('sn2'), {'SYS_board': 'r1', 'SYS_serial': '2', 'region': 'u,s'})
+        self.assertEqual(self.unit_list('sn2', sys=True), {'SYS_board': 'r1', 'SYS_serial': '2'})
+
+    def test_ab_valid(self):
+        manifest = self.write('units.csv', 'unit,SYS_serial,key1\nsn1,1,val1\n')
+        self.nvram_image([manifest])
+        for section in ('system_a', 'user_a'):
+            os.remove(f'{self.out}/sn1/{section}')
+        self.assertEqual(self.unit_list('sn1'), {'SYS_serial': '1', 'key1': 'val1'})
+
+    def test_json(self):
+        manifest = self.write('units.json', '[{"unit": "sn1", "key1": "caf\\u00e9", "count": 3, "unset": null}]')
+        self.nvram_image([manifest])
+        self.assertEqual(self.unit_list('sn1'), {'key1': 'café', 'count': '3'})
+
+    def test_invalid(self):
+        for name, content in (('dup.csv', 'unit,key1\nsn1,a\nsn1,b\n'),
+                              ('fields.csv', 'unit,key1\nsn1,a,b\n'),
+                              ('path.csv', 'unit,key1\n../sn1,a\n'),
+                              ('array.json', '[{"unit": "sn1", "key1": [1]}]')):
+            with self.assertRaises(CalledProcessError):
+                self.nvram_image([self.write(name, content)])
+        self.assertFalse(os.path.exists(f'{self.dir}/sn1'))
+
 class test_legacy_api(test_user_base):
     def nvram_legacy_set(self, pairs):
         args = []
@@ -423,6 +1171,8 @@ class test_legacy_format(unittest.TestCase):
                 'NVRAM_FILE_SYSTEM_B': '',
                 'NVRAM_FILE_USER_A': f'{self.dir}/user_a',
                 'NVRAM_FILE_USER_B': '',
+                'NVRAM_SNAPSHOT': f'{self.dir}/snapshot',
+                'NVRAM_VOLATILE_FILE': f'{self.dir}/run/volatile',
             }
         self.sys = False
     
@@ -460,6 +1210,28 @@ class test_legacy_format(unittest.TestCase):
         expects = f'{key1}={val1}\n'
         self.assertEqual(expects, self.read_user_a())
         
+    def test_write_atomic(self):
+        self.env['NVRAM_FILE_ATOMIC'] = '1'
+        self.nvram_set([('key1', 'val1')])
+        os.chmod(self.env['NVRAM_FILE_USER_A'], 0o600)
+        inode = os.stat(self.env['NVRAM_FILE_USER_A']).st_ino
+        self.nvram_set([('key2', 'val2')])
+        st = os.stat(self.env['NVRAM_FILE_USER_A'])
+        self.assertNotEqual(inode, st.st_ino)
+        self.assertEqual(0o600, st.st_mode & 0o777)
+        self.assertEqual('key1=val1\nkey2=val2\n', self.read_user_a())
+        self.assertFalse(os.path.exists(self.env['NVRAM_FILE_USER_A'] + '.tmp'))
+
+    def test_write_atomic_owner(self):
+        self.env['NVRAM_FILE_ATOMIC'] = '1'
+        self.nvram_set([('key1', 'val1')])
+        nobody = pwd.getpwnam('nobody')
+        os.chown(self.env['NVRAM_FILE_USER_A'], nobody.pw_uid, nobody.pw_gid)
+        self.nvram_set([('key2', 'val2')])
+        st = os.stat(self.env['NVRAM_FILE_USER_A'])
+        self.assertEqual((nobody.pw_uid, nobody.pw_gid), (st.st_uid, st.st_gid))
+        self.assertEqual('key1=val1\nkey2=val2\n', self.read_user_a())
+
     def test_del(self):
         key1 = 'key1'
         val1 = 'val1'
@@ -516,7 +1288,27 @@ class test_legacy_format(unittest.TestCase):
         self.write_user_a(f'key1=\n')
         with self.assertRaises(CalledProcessError):
             self.nvram_get('key1')
-            
+
+    def test_stream(self):
+        self.env['NVRAM_STREAM_WINDOW'] = '4'
+        self.env['NVRAM_SNAPSHOT'] = ''
+        long_value = 'x' * 100
+        self.write_user_a(f'  key1=val1\n\n\tkey2={long_value}\nkey3=val3')
+        self.assertEqual('val1', self.nvram_get('key1'))
+        self.assertEqual(long_value, self.nvram_get('key2'))
+        self.assertEqual('val3', self.nvram_get('key3'))
+        self.nvram_set([('key4', 'val4')])
+        self.assertEqual(f'key1=val1\nkey2={long_value}\nkey3=val3\nkey4=val4\n', self.read_user_a())
+        self.write_user_a(f'key1={long_value}\nkey2')
+        with self.assertRaises(CalledProcessError):
+            self.nvram_get('key1')
+
+    def test_typed(self):
+        with self.assertRaises(CalledProcessError):
+            nvram(self.env, ['--user', '--set-u32', 'key1', '1'], sys=self.sys)
+        self.write_user_a('key1=1\n')
+        self.assertEqual('1', nvram(self.env, ['--user', '--get-u32', 'key1'], sys=self.sys).rstrip())
+
 class test_platform_format(unittest.TestCase):
     def setUp(self):
         self.tmpdir = tempfile.TemporaryDirectory()
@@ -526,6 +1318,8 @@ class test_platform_format(unittest.TestCase):
                 'NVRAM_INTERFACE': 'file',
                 'NVRAM_FILE_USER_A': f'{self.dir}/user_a',
                 'NVRAM_FILE_USER_B': '',
+                'NVRAM_SNAPSHOT': f'{self.dir}/snapshot',
+                'NVRAM_VOLATILE_FILE': f'{self.dir}/run/volatile',
             }
         self.sys = False
 
@@ -606,7 +1400,16 @@ class test_platform_format(unittest.TestCase):
         for val in values_err:
             with self.assertRaises(CalledProcessError):
                 self.nvram_set([(key, val)])
-        
+
+    def test_field_typed(self):
+        nvram(self.env, ['--user', '--set-u32', 'config2', '0x10'], sys=self.sys)
+        nvram(self.env, ['--user', '--set-u64', 'ddrc_size', '0x100000000'], sys=self.sys)
+        self.assertEqual('16', nvram(self.env, ['--user', '--get-u32', 'config2'], sys=self.sys).rstrip())
+        self.assertEqual('4294967296', nvram(self.env, ['--user', '--get-u64', 'ddrc_size'], sys=self.sys).rstrip())
+        self.assertEqual('0x10', self.nvram_get('config2'))
+        with self.assertRaises(CalledProcessError):
+            nvram(self.env, ['--user', '--set-u64', 'config2', '1'], sys=self.sys)
+
 if __name__ == '__main__':
     unittest.main()
     
\ No newline at end of file